@@ -3,61 +3,109 @@
 extern page_fault_handler
 extern keyboard_handler
 extern generic_handler
-extern scheduler_tick
-extern pic_send_eoi
+extern timer_handler
+extern lapic_timer_handler
+extern smp_resched_interrupt
+extern fpu_trap_handler
+extern uart_handler
+extern smp_tlb_flush_interrupt
+extern ahci_handler
+extern ahci_vector
+extern irqstat_enter
+extern irqstat_exit
 
 global load_idt
 global page_fault_isr
 global keyboard_isr
 global generic_isr
 global timer_isr
+global lapic_timer_isr
+global resched_isr
+global spurious_isr
+global device_not_available_isr
+global uart_isr
+global tlb_flush_isr
+global ahci_isr
 
-page_fault_isr:
-    push rax
-    push rbx
-    push rcx
-    push rdx
-    push rsi
+;-----------------------------------------------------------------------------
+; @brief Saves the interrupted context in task_context_t layout.
+; r15 is pushed last, so afterwards RSP points at a task_context_t whose
+; rip..ss fields are the frame pushed by the CPU. Handlers that return
+; through these macros may switch tasks: the frame stays on the task's
+; stack and iretq resumes it once the task is switched back in.
+;-----------------------------------------------------------------------------
+%macro PUSH_CONTEXT 0
+    push qword 0            ; orig_rax: IRQs push no error code
     push rdi
-    push rbp
+    push rsi
+    push rdx
+    push rcx
+    push rax
     push r8
     push r9
     push r10
     push r11
+    push rbx
+    push rbp
     push r12
     push r13
     push r14
     push r15
+%endmacro
 
-    ; x86_64 pushes an error code onto the stack for Page Faults.
-    ; It is located at [rsp + 120] after our pushes.
-    mov rdi, [rsp + 120]
-    call page_fault_handler
-
+%macro POP_CONTEXT 0
     pop r15
     pop r14
     pop r13
     pop r12
+    pop rbp
+    pop rbx
     pop r11
     pop r10
     pop r9
     pop r8
-    pop rbp
-    pop rdi
-    pop rsi
-    pop rdx
-    pop rcx
-    pop rbx
     pop rax
-    add rsp, 8 ; Clean up the error code pushed by the CPU before returning
-    iretq
+    pop rcx
+    pop rdx
+    pop rsi
+    pop rdi
+    add rsp, 8              ; Drop orig_rax
+%endmacro
+
+; Stack space for the irq_frame_t kept below the saved context. 32 bytes,
+; plus 8 that keep the calls 16-byte aligned.
+IRQ_FRAME_SPACE equ 40
+
+; Vector numbers, matching irq.h and apic.h
+VEC_TIMER       equ 0x20
+VEC_KEYBOARD    equ 0x21
+VEC_COM1        equ 0x24
+VEC_TLB_FLUSH   equ 0xEE
+VEC_LAPIC_TIMER equ 0xEF
+VEC_RESCHED     equ 0xF0
+VEC_NM          equ 7
+IRQSTAT_OTHER   equ 256
 
 ;-----------------------------------------------------------------------------
-; @brief Keyboard Interrupt Service Routine.
-; Routes IRQ 1 (mapped to Vector 33 via I/O APIC).
+; @brief Calls handler %1 for vector %2 between irqstat_enter() and
+; irqstat_exit(). Follows PUSH_CONTEXT; the handler gets the saved
+; task_context_t in RDI.
 ;-----------------------------------------------------------------------------
-keyboard_isr:
+%macro TIMED_CALL 2
+    sub rsp, IRQ_FRAME_SPACE
+    mov rdi, rsp            ; irq_frame_t *frame
+    mov esi, %2
+    call irqstat_enter
+    lea rdi, [rsp + IRQ_FRAME_SPACE] ; task_context_t *regs
+    call %1
+    mov rdi, rsp
+    call irqstat_exit
+    add rsp, IRQ_FRAME_SPACE
+%endmacro
+
+page_fault_isr:
     push rax
+    push rbx
     push rcx
     push rdx
     push rsi
@@ -71,7 +119,15 @@ keyboard_isr:
     push r13
     push r14
     push r15
-    call keyboard_handler
+
+    ; x86_64 pushes an error code onto the stack for Page Faults.
+    ; It is located at [rsp + 120] after our pushes.
+    ; The handler runs on the IST stack and returns if it backed the page.
+    mov rdi, [rsp + 120]
+    sub rsp, 8              ; Align the stack for the call
+    call page_fault_handler
+    add rsp, 8
+
     pop r15
     pop r14
     pop r13
@@ -85,7 +141,29 @@ keyboard_isr:
     pop rsi
     pop rdx
     pop rcx
+    pop rbx
     pop rax
+    add rsp, 8 ; Clean up the error code pushed by the CPU before returning
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief Keyboard Interrupt Service Routine.
+; Routes IRQ 1 (mapped to Vector 33 via I/O APIC).
+;-----------------------------------------------------------------------------
+keyboard_isr:
+    PUSH_CONTEXT
+    TIMED_CALL keyboard_handler, VEC_KEYBOARD
+    POP_CONTEXT
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief COM1 Interrupt Service Routine.
+; Routes IRQ 4 (mapped to Vector 0x24), raised when the UART wants more output.
+;-----------------------------------------------------------------------------
+uart_isr:
+    PUSH_CONTEXT
+    TIMED_CALL uart_handler, VEC_COM1
+    POP_CONTEXT
     iretq
 
 ;-----------------------------------------------------------------------------
@@ -93,70 +171,66 @@ keyboard_isr:
 ; Routes IRQ 0 (mapped to Vector 0x20 via I/O APIC).
 ;-----------------------------------------------------------------------------
 timer_isr:
-    push rax
-    push rcx
-    push rdx
-    push rsi
-    push rdi
-    push rbp
-    push r8
-    push r9
-    push r10
-    push r11
-    push r12
-    push r13
-    push r14
-    push r15
-    call scheduler_tick
-    mov rdi, 0
-    call pic_send_eoi
-    pop r15
-    pop r14
-    pop r13
-    pop r12
-    pop r11
-    pop r10
-    pop r9
-    pop r8
-    pop rbp
-    pop rdi
-    pop rsi
-    pop rdx
-    pop rcx
-    pop rax
+    PUSH_CONTEXT
+    TIMED_CALL timer_handler, VEC_TIMER
+    POP_CONTEXT
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief Local APIC timer interrupt, raised at the programmed TSC deadline.
+;-----------------------------------------------------------------------------
+lapic_timer_isr:
+    PUSH_CONTEXT
+    TIMED_CALL lapic_timer_handler, VEC_LAPIC_TIMER
+    POP_CONTEXT
     iretq
 
 generic_isr:
-    push rax
-    push rcx
-    push rdx
-    push rsi
-    push rdi
-    push rbp
-    push r8
-    push r9
-    push r10
-    push r11
-    push r12
-    push r13
-    push r14
-    push r15
-    ; Call generic handler
-    call generic_handler
-    pop r15
-    pop r14
-    pop r13
-    pop r12
-    pop r11
-    pop r10
-    pop r9
-    pop r8
-    pop rbp
-    pop rdi
-    pop rsi
-    pop rdx
-    pop rcx
-    pop rax
+    PUSH_CONTEXT
+    TIMED_CALL generic_handler, IRQSTAT_OTHER
+    POP_CONTEXT
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief Reschedule IPI sent by another CPU after queueing work here.
+;-----------------------------------------------------------------------------
+resched_isr:
+    PUSH_CONTEXT
+    TIMED_CALL smp_resched_interrupt, VEC_RESCHED
+    POP_CONTEXT
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief TLB shootdown IPI sent by a CPU that removed kernel mappings.
+;-----------------------------------------------------------------------------
+tlb_flush_isr:
+    PUSH_CONTEXT
+    TIMED_CALL smp_tlb_flush_interrupt, VEC_TLB_FLUSH
+    POP_CONTEXT
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief AHCI controller MSI, on a vector from irq_alloc_vector().
+;-----------------------------------------------------------------------------
+ahci_isr:
+    PUSH_CONTEXT
+    TIMED_CALL ahci_handler, [ahci_vector]
+    POP_CONTEXT
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief #NM, raised by the first FPU/SSE instruction while CR0.TS is set.
+;-----------------------------------------------------------------------------
+device_not_available_isr:
+    PUSH_CONTEXT
+    TIMED_CALL fpu_trap_handler, VEC_NM
+    POP_CONTEXT
+    iretq
+
+;-----------------------------------------------------------------------------
+; @brief Local APIC spurious interrupt. Must not be acknowledged.
+;-----------------------------------------------------------------------------
+spurious_isr:
     iretq
 
 load_idt:
@@ -0,0 +1,100 @@
+;-----------------------------------------------------------------------------
+; @file trampoline.s
+; @brief Application processor startup code.
+;
+; smp_init() copies this blob to TRAMPOLINE_BASE in low memory and fills in
+; trampoline_params before sending the startup IPI. An AP starts here in
+; real mode at TRAMPOLINE_BASE, switches to long mode on the kernel page
+; tables and calls the entry point with its CPU index in RDI.
+;-----------------------------------------------------------------------------
+
+TRAMPOLINE_BASE equ 0x8000
+
+; Address of a label once the blob has been copied to TRAMPOLINE_BASE
+%define TRAMP(label) (TRAMPOLINE_BASE + (label) - trampoline_start)
+
+global trampoline_start
+global trampoline_end
+global trampoline_params
+
+section .rodata
+align 16
+
+[BITS 16]
+trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    lgdt [TRAMP(tramp_gdt_ptr)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp 0x08:TRAMP(tramp_protected)
+
+[BITS 32]
+tramp_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; PAE, the kernel page tables, EFER.LME, then paging
+    mov eax, cr4
+    or eax, 1 << 5
+    mov cr4, eax
+
+    mov eax, [TRAMP(tp_cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, 1 << 8
+    wrmsr
+
+    mov eax, cr0
+    or eax, 1 << 31
+    mov cr0, eax
+
+    jmp 0x18:TRAMP(tramp_long)
+
+[BITS 64]
+tramp_long:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [TRAMP(tp_stack)]
+    mov rdi, [TRAMP(tp_arg)]
+    mov rax, [TRAMP(tp_entry)]
+    call rax
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF       ; 0x08: 32-bit code
+    dq 0x00CF92000000FFFF       ; 0x10: data
+    dq 0x00AF9A000000FFFF       ; 0x18: 64-bit code
+tramp_gdt_ptr:
+    dw tramp_gdt_ptr - tramp_gdt - 1
+    dd TRAMP(tramp_gdt)
+
+align 8
+trampoline_params:
+tp_cr3:   dq 0                  ; Physical address of the PML4
+tp_stack: dq 0                  ; Top of the AP's boot stack
+tp_entry: dq 0                  ; void entry(uint64_t cpu)
+tp_arg:   dq 0                  ; CPU index
+trampoline_end:
@@ -0,0 +1,558 @@
+/**
+ * @file ahci.c
+ * @brief AHCI SATA host controller driver.
+ *
+ * Each port with a disk gets one page holding its command list, its
+ * received-FIS area and the table of command slot 0. A request from the
+ * block layer becomes one READ or WRITE DMA EXT command whose scatter
+ * list has an entry per buffer, so the controller moves a whole merged
+ * request, up to BLK_MAX_SEGMENTS pages, straight into the buffers with
+ * a single interrupt at the end. Without NCQ a SATA disk runs one command
+ * at a time, so one slot per port is all a port ever uses; the elevator
+ * in front of it keeps requests large and in disk order instead.
+ */
+
+#include <valen/ahci.h>
+#include <valen/block.h>
+#include <valen/pci.h>
+#include <valen/irq.h>
+#include <valen/idt.h>
+#include <valen/vmm.h>
+#include <valen/pmm.h>
+#include <valen/page.h>
+#include <valen/heap.h>
+#include <valen/string.h>
+#include <valen/spinlock.h>
+#include <valen/softirq.h>
+#include <valen/timer.h>
+#include <valen/klog.h>
+#include <valen/irqstat.h>
+#include <valen/cpu.h>
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define PCI_PROGIF_AHCI 0x01
+#define AHCI_ABAR 5
+#define AHCI_MMIO_SIZE 0x1100
+
+/* Generic host control registers */
+#define HBA_CAP 0x00
+#define HBA_GHC 0x04
+#define HBA_IS 0x08
+#define HBA_PI 0x0C
+
+#define CAP_S64A (1U << 31)
+#define GHC_AE (1U << 31)
+#define GHC_IE (1U << 1)
+
+/* Port registers, PORT_SIZE bytes apart from PORT_BASE */
+#define PORT_BASE 0x100
+#define PORT_SIZE 0x80
+#define PX_CLB 0x00
+#define PX_CLBU 0x04
+#define PX_FB 0x08
+#define PX_FBU 0x0C
+#define PX_IS 0x10
+#define PX_IE 0x14
+#define PX_CMD 0x18
+#define PX_TFD 0x20
+#define PX_SIG 0x24
+#define PX_SSTS 0x28
+#define PX_SERR 0x30
+#define PX_CI 0x38
+
+#define CMD_ST 0x0001
+#define CMD_FRE 0x0010
+#define CMD_FR 0x4000
+#define CMD_CR 0x8000
+
+#define IS_DHRS 0x00000001      /* Device to host register FIS: command done */
+#define IS_ERRORS 0x78000000    /* Task file, host bus data/fatal and interface errors */
+
+#define TFD_ERR 0x01
+#define TFD_DRQ 0x08
+#define TFD_BSY 0x80
+
+#define SSTS_DET_MASK 0x0F
+#define SSTS_DET_PRESENT 0x03
+#define SIG_ATA 0x00000101
+
+/* ATA commands */
+#define ATA_READ_DMA_EXT 0x25
+#define ATA_WRITE_DMA_EXT 0x35
+#define ATA_IDENTIFY 0xEC
+#define ATA_DEVICE_LBA 0x40
+
+#define FIS_TYPE_H2D 0x27
+#define FIS_H2D_COMMAND 0x80
+#define FIS_H2D_DWORDS 5
+
+#define CMD_HEADER_WRITE 0x0040
+
+#define IDENTIFY_MODEL 27       /* Words 27-46, two characters each, swapped */
+#define IDENTIFY_FEATURES 83
+#define IDENTIFY_LBA48 (1 << 10)
+#define IDENTIFY_SECTORS48 100  /* Words 100-103 */
+
+#define AHCI_TIMEOUT_MS 1000
+#define AHCI_POLL_TIMEOUT_MS 5000
+
+typedef struct ahci_cmd_header
+{
+    uint16_t flags;         /* FIS length in dwords, write bit */
+    uint16_t prdtl;         /* Scatter list entries */
+    volatile uint32_t prdbc;
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+typedef struct ahci_prd
+{
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;           /* Byte count minus one */
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct ahci_cmd_table
+{
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    ahci_prd_t prdt[BLK_MAX_SEGMENTS];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+/* Layout of a port's page; each part meets its alignment rule */
+#define PORT_CMD_LIST 0         /* 32 headers, 1KB aligned */
+#define PORT_FIS 1024           /* 256 bytes, 256 aligned */
+#define PORT_CMD_TABLE 1280     /* 128 aligned */
+
+typedef struct ahci_port
+{
+    block_device_t blk;
+    volatile uint32_t *regs;
+    ahci_cmd_header_t *cmd_list;
+    ahci_cmd_table_t *table;
+    spinlock_t lock;            /* Taken with interrupts off */
+    blk_request_t *active;      /* Request in slot 0 */
+    int index;
+    char name[8];
+    char model[41];
+} ahci_port_t;
+
+extern void ahci_isr();
+
+/* Vector of the controller's MSI, read by ahci_isr for irqstat */
+uint32_t ahci_vector = IRQSTAT_OTHER;
+
+static volatile uint32_t *hba;
+static ahci_port_t *ports[AHCI_MAX_PORTS];
+static int use_64bit;
+static int use_irq;
+
+static inline uint32_t hba_read(uint32_t reg)
+{
+    return hba[reg / 4];
+}
+
+static inline void hba_write(uint32_t reg, uint32_t value)
+{
+    hba[reg / 4] = value;
+}
+
+static inline uint32_t port_read(volatile uint32_t *regs, uint32_t reg)
+{
+    return regs[reg / 4];
+}
+
+static inline void port_write(volatile uint32_t *regs, uint32_t reg, uint32_t value)
+{
+    regs[reg / 4] = value;
+}
+
+/**
+ * @brief Spins until every bit of @p mask in port register @p reg is clear.
+ * @return 0, or -1 after @p ms milliseconds.
+ */
+static int port_wait_clear(volatile uint32_t *regs, uint32_t reg, uint32_t mask, uint64_t ms)
+{
+    uint64_t deadline = timer_now() + ms * NSEC_PER_MSEC;
+    while (port_read(regs, reg) & mask)
+    {
+        if (timer_now() > deadline)
+            return -1;
+        cpu_relax();
+    }
+    return 0;
+}
+
+static int engine_stop(volatile uint32_t *regs)
+{
+    port_write(regs, PX_CMD, port_read(regs, PX_CMD) & ~CMD_ST);
+    if (port_wait_clear(regs, PX_CMD, CMD_CR, AHCI_TIMEOUT_MS) < 0)
+        return -1;
+    port_write(regs, PX_CMD, port_read(regs, PX_CMD) & ~CMD_FRE);
+    return port_wait_clear(regs, PX_CMD, CMD_FR, AHCI_TIMEOUT_MS);
+}
+
+static int engine_start(volatile uint32_t *regs)
+{
+    if (port_wait_clear(regs, PX_TFD, TFD_BSY | TFD_DRQ, AHCI_TIMEOUT_MS) < 0)
+        return -1;
+    port_write(regs, PX_CMD, port_read(regs, PX_CMD) | CMD_FRE);
+    port_write(regs, PX_CMD, port_read(regs, PX_CMD) | CMD_ST);
+    return 0;
+}
+
+/**
+ * @brief Fills slot 0 with an ATA command. Scatter list entries are set by
+ * the caller.
+ */
+static void build_command(ahci_port_t *port, uint8_t command, uint64_t lba, uint16_t sectors,
+                          uint16_t prds, int write)
+{
+    uint8_t *fis = port->table->cfis;
+    memset(fis, 0, 20);
+    fis[0] = FIS_TYPE_H2D;
+    fis[1] = FIS_H2D_COMMAND;
+    fis[2] = command;
+    fis[4] = (uint8_t)lba;
+    fis[5] = (uint8_t)(lba >> 8);
+    fis[6] = (uint8_t)(lba >> 16);
+    fis[7] = ATA_DEVICE_LBA;
+    fis[8] = (uint8_t)(lba >> 24);
+    fis[9] = (uint8_t)(lba >> 32);
+    fis[10] = (uint8_t)(lba >> 40);
+    fis[12] = (uint8_t)sectors;
+    fis[13] = (uint8_t)(sectors >> 8);
+
+    ahci_cmd_header_t *header = &port->cmd_list[0];
+    header->flags = FIS_H2D_DWORDS | (write ? CMD_HEADER_WRITE : 0);
+    header->prdtl = prds;
+    header->prdbc = 0;
+}
+
+static void set_prd(ahci_prd_t *prd, uint64_t phys, uint32_t bytes)
+{
+    prd->dba = (uint32_t)phys;
+    prd->dbau = (uint32_t)(phys >> 32);
+    prd->reserved = 0;
+    prd->dbc = bytes - 1;
+}
+
+/**
+ * @brief Puts the next queued request in slot 0 if the port is idle.
+ * Called with the port lock held.
+ */
+static void port_start(ahci_port_t *port)
+{
+    while (!port->active)
+    {
+        blk_request_t *req = blk_fetch_request(&port->blk);
+        if (!req)
+            return;
+
+        int reachable = 1;
+        for (uint32_t i = 0; i < req->count; i++)
+        {
+            uint64_t phys = VIRT_TO_PHYS(req->bufs[i]->data);
+            if (!use_64bit && (phys >> 32))
+                reachable = 0;
+            set_prd(&port->table->prdt[i], phys, BLOCK_SIZE);
+        }
+        if (!reachable)
+        {
+            /* A 32-bit controller cannot reach these pages; fail the request */
+            blk_end_request(req, -1);
+            continue;
+        }
+
+        build_command(port, req->write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT,
+                      req->block * BLOCK_SECTORS, (uint16_t)(req->count * BLOCK_SECTORS),
+                      (uint16_t)req->count, req->write);
+        port->active = req;
+
+        /* The command must be in memory before the controller is told to fetch it */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        port_write(port->regs, PX_CI, 1);
+    }
+}
+
+/**
+ * @brief Clears a failed command out of the port so the next one can run.
+ * Called with the port lock held.
+ */
+static void port_recover(ahci_port_t *port)
+{
+    engine_stop(port->regs);
+    port_write(port->regs, PX_SERR, 0xFFFFFFFF);
+    port_write(port->regs, PX_IS, 0xFFFFFFFF);
+    if (engine_start(port->regs) < 0)
+        klog(KLOG_ERR, "ahci: %s does not come back after an error\n", port->name);
+}
+
+/**
+ * @brief Completes the active command if the port has finished it and
+ * starts the next queued request. Used by the interrupt handler and as
+ * the block device's kick.
+ */
+static void port_service(ahci_port_t *port)
+{
+    blk_request_t *done = 0;
+    int err = 0;
+
+    uint64_t flags = spinlock_acquire_irqsave(&port->lock);
+
+    uint32_t is = port_read(port->regs, PX_IS);
+    port_write(port->regs, PX_IS, is);
+
+    if (port->active && ((is & IS_ERRORS) || !(port_read(port->regs, PX_CI) & 1)))
+    {
+        done = port->active;
+        port->active = 0;
+        err = (is & IS_ERRORS) || (port_read(port->regs, PX_TFD) & TFD_ERR);
+        if (err)
+            port_recover(port);
+    }
+    port_start(port);
+
+    spinlock_release_irqrestore(&port->lock, flags);
+
+    if (done)
+    {
+        if (err)
+            klog(KLOG_ERR, "ahci: %s: I/O error at block %llu\n", port->name, done->block);
+        blk_end_request(done, err ? -1 : 0);
+    }
+}
+
+static void ahci_kick(block_device_t *dev)
+{
+    ahci_port_t *port = dev->driver;
+    port_service(port);
+
+    if (use_irq)
+        return;
+
+    /* No interrupt will come: run the queue to completion from here */
+    uint64_t deadline = timer_now() + AHCI_POLL_TIMEOUT_MS * NSEC_PER_MSEC;
+    while (port->active)
+    {
+        if ((port_read(port->regs, PX_CI) & 1) && !(port_read(port->regs, PX_IS) & IS_ERRORS))
+        {
+            if (timer_now() <= deadline)
+            {
+                cpu_relax();
+                continue;
+            }
+
+            /* Treat a command that never finishes as an error */
+            uint64_t flags = spinlock_acquire_irqsave(&port->lock);
+            blk_request_t *req = port->active;
+            port->active = 0;
+            port_recover(port);
+            spinlock_release_irqrestore(&port->lock, flags);
+
+            if (req)
+            {
+                klog(KLOG_ERR, "ahci: %s: timeout at block %llu\n", port->name, req->block);
+                blk_end_request(req, -1);
+            }
+        }
+        port_service(port);
+        deadline = timer_now() + AHCI_POLL_TIMEOUT_MS * NSEC_PER_MSEC;
+    }
+}
+
+void ahci_handler(void)
+{
+    irq_enter();
+
+    uint32_t pending = hba_read(HBA_IS);
+    for (int i = 0; i < AHCI_MAX_PORTS; i++)
+    {
+        if (!(pending & (1U << i)))
+            continue;
+        if (ports[i])
+            port_service(ports[i]);
+    }
+    /* Port status first, then the summary bits that reflect it */
+    hba_write(HBA_IS, pending);
+
+    irq_eoi(0);
+    irq_exit();
+}
+
+/**
+ * @brief Runs IDENTIFY DEVICE by polling, before interrupts are on.
+ * @return 0 and fills in the size and model, or -1 for no usable disk.
+ */
+static int port_identify(ahci_port_t *port)
+{
+    uint16_t *id = pmm_alloc_zeroed(0);
+    if (!id)
+        return -1;
+
+    set_prd(&port->table->prdt[0], VIRT_TO_PHYS(id), SECTOR_SIZE);
+    build_command(port, ATA_IDENTIFY, 0, 0, 1, 0);
+    port->table->cfis[7] = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    port_write(port->regs, PX_CI, 1);
+
+    int ret = -1;
+    uint64_t deadline = timer_now() + AHCI_TIMEOUT_MS * NSEC_PER_MSEC;
+    while ((port_read(port->regs, PX_CI) & 1) && !(port_read(port->regs, PX_IS) & IS_ERRORS))
+    {
+        if (timer_now() > deadline)
+            goto out;
+        cpu_relax();
+    }
+    if ((port_read(port->regs, PX_IS) & IS_ERRORS) || (port_read(port->regs, PX_TFD) & TFD_ERR))
+        goto out;
+
+    /* READ/WRITE DMA EXT need 48-bit addressing */
+    if (!(id[IDENTIFY_FEATURES] & IDENTIFY_LBA48))
+        goto out;
+
+    uint64_t sectors = 0;
+    for (int i = 3; i >= 0; i--)
+        sectors = (sectors << 16) | id[IDENTIFY_SECTORS48 + i];
+    port->blk.blocks = sectors / BLOCK_SECTORS;
+
+    for (int i = 0; i < 20; i++)
+    {
+        port->model[i * 2] = (char)(id[IDENTIFY_MODEL + i] >> 8);
+        port->model[i * 2 + 1] = (char)id[IDENTIFY_MODEL + i];
+    }
+    port->model[40] = '\0';
+    for (int i = 39; i >= 0 && port->model[i] == ' '; i--)
+        port->model[i] = '\0';
+
+    ret = port->blk.blocks ? 0 : -1;
+
+out:
+    port_write(port->regs, PX_IS, 0xFFFFFFFF);
+    pmm_free_page(id);
+    return ret;
+}
+
+/**
+ * @brief Points a port at its own memory, starts it and identifies the disk.
+ * @return The port, or 0 if nothing usable is attached.
+ */
+static ahci_port_t *port_setup(int index, int disk)
+{
+    volatile uint32_t *regs = (volatile uint32_t *)((uint8_t *)hba + PORT_BASE + index * PORT_SIZE);
+
+    if ((port_read(regs, PX_SSTS) & SSTS_DET_MASK) != SSTS_DET_PRESENT)
+        return 0;
+    if (port_read(regs, PX_SIG) != SIG_ATA)
+        return 0;   /* ATAPI, port multiplier or bridge */
+
+    ahci_port_t *port = malloc(sizeof(ahci_port_t));
+    uint8_t *page = pmm_alloc_zeroed(0);
+    if (!port || !page)
+        goto fail;
+
+    memset(port, 0, sizeof(ahci_port_t));
+    port->regs = regs;
+    port->index = index;
+    port->cmd_list = (ahci_cmd_header_t *)(page + PORT_CMD_LIST);
+    port->table = (ahci_cmd_table_t *)(page + PORT_CMD_TABLE);
+    spinlock_init_named(&port->lock, "ahci");
+
+    uint64_t phys = VIRT_TO_PHYS(page);
+    if (!use_64bit && (phys >> 32))
+        goto fail;
+
+    if (engine_stop(regs) < 0)
+        goto fail;
+
+    uint64_t table = phys + PORT_CMD_TABLE;
+    port->cmd_list[0].ctba = (uint32_t)table;
+    port->cmd_list[0].ctbau = (uint32_t)(table >> 32);
+    port_write(regs, PX_CLB, (uint32_t)(phys + PORT_CMD_LIST));
+    port_write(regs, PX_CLBU, (uint32_t)((phys + PORT_CMD_LIST) >> 32));
+    port_write(regs, PX_FB, (uint32_t)(phys + PORT_FIS));
+    port_write(regs, PX_FBU, (uint32_t)((phys + PORT_FIS) >> 32));
+    port_write(regs, PX_SERR, 0xFFFFFFFF);
+    port_write(regs, PX_IS, 0xFFFFFFFF);
+
+    if (engine_start(regs) < 0 || port_identify(port) < 0)
+    {
+        engine_stop(regs);
+        goto fail;
+    }
+
+    port->name[0] = 's';
+    port->name[1] = 'd';
+    port->name[2] = (char)('a' + disk);
+    port->name[3] = '\0';
+    port->blk.name = port->name;
+    port->blk.kick = ahci_kick;
+    port->blk.driver = port;
+    return port;
+
+fail:
+    if (page)
+        pmm_free_page(page);
+    free(port);
+    return 0;
+}
+
+void ahci_init(void)
+{
+    pci_dev_t dev;
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, PCI_PROGIF_AHCI, 0, &dev) < 0)
+        return;
+
+    uint64_t abar = pci_bar_address(&dev, AHCI_ABAR);
+    if (!abar)
+        return;
+
+    pci_write16(&dev, PCI_COMMAND, pci_read16(&dev, PCI_COMMAND) | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+    hba = vmm_map_mmio(abar, AHCI_MMIO_SIZE);
+    if (!hba)
+        return;
+
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_AE);
+    use_64bit = (hba_read(HBA_CAP) & CAP_S64A) != 0;
+
+    /* MSI needs the local APIC to acknowledge it */
+    int vector = irq_apic_mode() ? irq_alloc_vector() : -1;
+    if (vector >= 0)
+    {
+        ahci_vector = (uint32_t)vector;
+        irqstat_set_name(ahci_vector, "ahci");
+        idt_set_descriptor((uint8_t)vector, ahci_isr, 0x8E);
+        use_irq = pci_enable_msi(&dev, 0, (uint8_t)vector) == 0;
+    }
+
+    uint32_t implemented = hba_read(HBA_PI);
+    int disks = 0;
+    for (int i = 0; i < AHCI_MAX_PORTS && disks < 26; i++)
+    {
+        if (!(implemented & (1U << i)))
+            continue;
+
+        ahci_port_t *port = port_setup(i, disks);
+        if (!port)
+            continue;
+
+        ports[i] = port;
+        if (use_irq)
+            port_write(port->regs, PX_IE, IS_DHRS | IS_ERRORS);
+        blk_register(&port->blk);
+        disks++;
+
+        klog(KLOG_INFO, "ahci: %s: %s, %llu MB\n", port->name, port->model,
+             port->blk.blocks * BLOCK_SIZE / (1024 * 1024));
+    }
+
+    hba_write(HBA_IS, 0xFFFFFFFF);
+    if (use_irq)
+        hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_IE);
+
+    klog(KLOG_INFO, "ahci: %u disks, completions by %s\n", disks, use_irq ? "MSI" : "polling");
+}
@@ -7,13 +7,38 @@
 #include <valen/io.h>
 #include <valen/shell.h>
 #include <valen/pic.h>
+#include <valen/irq.h>
+#include <valen/wait.h>
+#include <valen/timer.h>
+#include <valen/stdio.h>
+#include <valen/softirq.h>
 
 extern int system_ready;
 
 volatile int key_pressed_flag;
-static char pending_key = 0;
 
-static int shift_pressed = 0;
+/*
+ * Single-producer/single-consumer ring of key events. Only the IRQ 1
+ * handler advances head and only the reader advances tail, so neither
+ * side needs a lock: each publishes its index with a release store after
+ * touching the slot, and reads the other's index with an acquire load.
+ * The indices run freely and are masked on use.
+ */
+static key_event_t key_ring[KEY_RING_SIZE];
+static uint32_t key_head;
+static uint32_t key_tail;
+static uint64_t key_dropped;
+
+/* Tasks sleeping until a key arrives */
+static wait_queue_t key_wait = WAIT_QUEUE_INIT;
+
+static void key_wake_readers(void *data);
+
+/* Wakes the readers after the IRQ handler has queued events */
+static tasklet_t key_tasklet = TASKLET_INIT(key_wake_readers, NULL);
+
+/* Modifier state as of the last scancode the IRQ handler saw */
+static uint8_t modifiers = 0;
 
 /* Standard US-QWERTY Scancode Mapping */
 static const char scancode_to_ascii[] = {
@@ -34,70 +59,151 @@ void keyboard_init(void)
         inb(0x60);
     
     /* Enable keyboard IRQ */
-    pic_irq_enable(IRQ_KEYBOARD);
+    irq_enable(IRQ_KEYBOARD);
 }
 
 void wait_for_keypress(void)
 {
     key_pressed_flag = 0;
-    while (!key_pressed_flag)
+    wait_event(key_wait, key_pressed_flag);
+}
+
+static int key_ring_empty(void)
+{
+    return __atomic_load_n(&key_head, __ATOMIC_ACQUIRE) == key_tail;
+}
+
+/**
+ * @brief Sleeps until the IRQ handler has queued an event for
+ * process_pending_key().
+ */
+void keyboard_wait_key(void)
+{
+    wait_event(key_wait, !key_ring_empty());
+}
+
+int keyboard_read_event(key_event_t *event)
+{
+    uint32_t tail = key_tail;
+    if (__atomic_load_n(&key_head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+
+    *event = key_ring[tail & (KEY_RING_SIZE - 1)];
+
+    /* Hands the slot back to the producer */
+    __atomic_store_n(&key_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+uint64_t keyboard_dropped(void)
+{
+    return __atomic_load_n(&key_dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Queues one event. Runs only in the IRQ handler, the sole producer.
+ */
+static void key_ring_push(uint8_t scancode)
+{
+    uint32_t head = key_head;
+    if (head - __atomic_load_n(&key_tail, __ATOMIC_ACQUIRE) == KEY_RING_SIZE)
     {
-        /* Keep interrupts enabled so the IRQ can set the flag */
-        asm volatile("hlt");
+        __atomic_fetch_add(&key_dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
+
+    key_event_t *event = &key_ring[head & (KEY_RING_SIZE - 1)];
+    event->timestamp = timer_now();
+    event->scancode = scancode;
+    event->modifiers = modifiers;
+
+    /* Publishes the filled slot to the reader */
+    __atomic_store_n(&key_head, head + 1, __ATOMIC_RELEASE);
 }
 
+static void track_modifiers(uint8_t scancode)
+{
+    switch (scancode)
+    {
+    case 0x2A: case 0x36: modifiers |= KEY_MOD_SHIFT; break;
+    case 0xAA: case 0xB6: modifiers &= ~KEY_MOD_SHIFT; break;
+    case 0x1D: modifiers |= KEY_MOD_CTRL; break;
+    case 0x9D: modifiers &= ~KEY_MOD_CTRL; break;
+    case 0x38: modifiers |= KEY_MOD_ALT; break;
+    case 0xB8: modifiers &= ~KEY_MOD_ALT; break;
+    }
+}
 
 /**
- * @brief Primary PS/2 IRQ1 Handler.
+ * @brief Primary PS/2 IRQ1 Handler. Only queues the raw scancodes;
+ * translation happens in the reader.
  */
 void keyboard_handler()
 {
-    uint8_t status = inb(0x64);
+    uint8_t status;
+
+    irq_enter();
 
-    if ((status & 0x01) && !(status & 0x20)) {
+    while (((status = inb(0x64)) & 0x01) && !(status & 0x20)) {
         uint8_t scancode = inb(0x60);
 
-        if (scancode == 0x2A || scancode == 0x36)
-            shift_pressed = 1;
-        else if (scancode == 0xAA || scancode == 0xB6)
-            shift_pressed = 0;
-        else if (!(scancode & 0x80)) {
+        track_modifiers(scancode);
+        if (!(scancode & 0x80))
             key_pressed_flag = 1;
-            if (system_ready) {
-                switch (scancode) {
-                case 0x0E:
-                    pending_key = '\b';
-                    break;
-                case 0x1C:
-                    pending_key = '\n';
-                    break;
-                case 0x4B:
-                    pending_key = -1;
-                    break;
-                case 0x4D:
-                    pending_key = -2;
-                    break;
-                default:
-                    /* Only process ASCII characters for valid scancodes */
-                    if (scancode < sizeof(scancode_to_ascii)) {
-                        char c = shift_pressed ? scancode_to_ascii_shift[scancode] : scancode_to_ascii[scancode];
-                        if (c && c != '\0') {
-                            pending_key = c;
-                        }
-                    }
-                    break;
-                }
-            }
-        }
+        if (system_ready)
+            key_ring_push(scancode);
+    }
+
+    irq_eoi(IRQ_KEYBOARD);
+
+    tasklet_schedule(&key_tasklet);
+    irq_exit();
+
+    /* A reader woken by the tasklet that outranks the interrupted task runs right away */
+    preempt_schedule_irq();
+}
+
+static void key_wake_readers(void *data)
+{
+    (void)data;
+    wake_up(&key_wait);
+}
+
+/**
+ * @brief Translates a key press to what shell_input() takes.
+ * @return The character, or 0 for releases and keys without one.
+ */
+static char key_translate(const key_event_t *event)
+{
+    uint8_t scancode = event->scancode;
+    if (scancode & 0x80)
+        return 0;
+
+    switch (scancode) {
+    case 0x0E:
+        return '\b';
+    case 0x1C:
+        return '\n';
+    case 0x4B:
+        return KEY_LEFT;
+    case 0x4D:
+        return KEY_RIGHT;
     }
 
-    pic_send_eoi(IRQ_KEYBOARD);
+    if (scancode >= sizeof(scancode_to_ascii))
+        return 0;
+    return (event->modifiers & KEY_MOD_SHIFT) ? scancode_to_ascii_shift[scancode] : scancode_to_ascii[scancode];
 }
 
+/**
+ * @brief Feeds every buffered key press to the shell.
+ */
 void process_pending_key(void) {
-    if (pending_key != 0) {
-        shell_input(pending_key);
-        pending_key = 0;
+    key_event_t event;
+
+    while (keyboard_read_event(&event)) {
+        char c = key_translate(&event);
+        if (c)
+            shell_input(c);
     }
 }
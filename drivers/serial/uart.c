@@ -0,0 +1,185 @@
+/**
+ * @file uart.c
+ * @brief 16550 UART driver for the COM1 serial console.
+ *
+ * Writers copy into a transmit ring and return. The transmit holding
+ * register empty (THRE) interrupt refills the 16-byte FIFO from the ring
+ * and is switched off again once the ring runs dry, so an idle UART
+ * raises no interrupts. The ring has its own lock, separate from the VGA
+ * console's.
+ */
+
+#include <valen/uart.h>
+#include <valen/io.h>
+#include <valen/pic.h>
+#include <valen/irq.h>
+#include <valen/idt.h>
+#include <valen/spinlock.h>
+#include <valen/softirq.h>
+#include <valen/cpu.h>
+#include <valen/irqstat.h>
+
+#define COM1_PORT 0x3F8
+
+/* Register offsets from the base port */
+#define UART_DATA 0     /* THR on write, RBR on read; divisor low with DLAB */
+#define UART_IER  1     /* Interrupt enable; divisor high with DLAB */
+#define UART_IIR  2     /* Interrupt identification on read */
+#define UART_FCR  2     /* FIFO control on write */
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define IER_THRE      0x02
+#define IIR_NO_INT    0x01
+#define IIR_ID_MASK   0x0E
+#define IIR_THRE      0x02
+#define IIR_FIFO_OK   0xC0  /* Both bits set once a 16550A's FIFOs are on */
+#define FCR_ENABLE    0xC7  /* Enable and clear both FIFOs, 14-byte RX trigger */
+#define LCR_DLAB      0x80
+#define LCR_8N1       0x03
+#define MCR_DTR_RTS_OUT2 0x0B  /* OUT2 gates the interrupt line */
+#define LSR_THRE      0x20
+
+#define UART_BAUD_DIVISOR 1 /* 115200 baud */
+#define UART_FIFO_SIZE 16
+
+extern void uart_isr();
+
+static char tx_ring[UART_TX_RING_SIZE];
+static uint32_t tx_head;    /* Next byte to queue */
+static uint32_t tx_tail;    /* Next byte to send */
+static int tx_active;       /* THRE interrupt enabled; it will drain the ring */
+static int fifo_size = 1;
+static int irq_ready;
+
+static spinlock_t uart_lock = SPINLOCK_INIT_NAMED("uart");
+
+static int tx_ready(void)
+{
+    return inb(COM1_PORT + UART_LSR) & LSR_THRE;
+}
+
+/**
+ * @brief Moves up to a FIFO's worth of bytes from the ring to the UART.
+ * The transmitter must be empty. Called with the lock held.
+ */
+static void tx_fill(void)
+{
+    for (int i = 0; i < fifo_size && tx_tail != tx_head; i++)
+    {
+        outb(COM1_PORT + UART_DATA, tx_ring[tx_tail & (UART_TX_RING_SIZE - 1)]);
+        tx_tail++;
+    }
+}
+
+/**
+ * @brief Waits for the transmitter to empty and refills it. Called with
+ * the lock held.
+ */
+static void tx_poll(void)
+{
+    while (!tx_ready())
+        cpu_relax();
+    tx_fill();
+}
+
+/**
+ * @brief Starts draining the ring if the interrupt is not already doing so.
+ * Called with the lock held.
+ */
+static void tx_start(void)
+{
+    if (tx_active || tx_tail == tx_head)
+        return;
+
+    if (tx_ready())
+        tx_fill();
+
+    /* Raised as soon as the FIFO empties, or straight away if it already has */
+    tx_active = 1;
+    outb(COM1_PORT + UART_IER, IER_THRE);
+}
+
+void uart_init(void)
+{
+    outb(COM1_PORT + UART_IER, 0x00);
+
+    outb(COM1_PORT + UART_LCR, LCR_DLAB);
+    outb(COM1_PORT + UART_DATA, UART_BAUD_DIVISOR & 0xFF);
+    outb(COM1_PORT + UART_IER, UART_BAUD_DIVISOR >> 8);
+    outb(COM1_PORT + UART_LCR, LCR_8N1);
+
+    outb(COM1_PORT + UART_FCR, FCR_ENABLE);
+    if ((inb(COM1_PORT + UART_IIR) & IIR_FIFO_OK) == IIR_FIFO_OK)
+        fifo_size = UART_FIFO_SIZE;
+
+    outb(COM1_PORT + UART_MCR, MCR_DTR_RTS_OUT2);
+
+    idt_set_descriptor(IRQ_VECTOR_BASE + IRQ_COM1, uart_isr, 0x8E);
+    irqstat_set_name(IRQ_VECTOR_BASE + IRQ_COM1, "com1");
+    irq_ready = 1;
+    irq_enable(IRQ_COM1);
+}
+
+void uart_write(const char *s, size_t len)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&uart_lock);
+
+    for (size_t i = 0; i < len; i++)
+    {
+        /* Full: make room by feeding the UART ourselves */
+        while (tx_head - tx_tail == UART_TX_RING_SIZE)
+            tx_poll();
+        tx_ring[tx_head & (UART_TX_RING_SIZE - 1)] = s[i];
+        tx_head++;
+    }
+
+    if (irq_ready)
+    {
+        tx_start();
+    }
+    else
+    {
+        while (tx_head != tx_tail)
+            tx_poll();
+    }
+
+    spinlock_release_irqrestore(&uart_lock, flags);
+}
+
+void uart_flush(void)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&uart_lock);
+    while (tx_head != tx_tail)
+        tx_poll();
+    spinlock_release_irqrestore(&uart_lock, flags);
+}
+
+void uart_handler(void)
+{
+    irq_enter();
+    spinlock_acquire(&uart_lock);
+
+    uint8_t iir;
+    while (!((iir = inb(COM1_PORT + UART_IIR)) & IIR_NO_INT))
+    {
+        if ((iir & IIR_ID_MASK) != IIR_THRE)
+        {
+            /* Nothing else is enabled; reading LSR clears a line status interrupt */
+            inb(COM1_PORT + UART_LSR);
+            continue;
+        }
+
+        tx_fill();
+        if (tx_tail == tx_head)
+        {
+            tx_active = 0;
+            outb(COM1_PORT + UART_IER, 0x00);
+        }
+    }
+
+    spinlock_release(&uart_lock);
+    irq_eoi(IRQ_COM1);
+    irq_exit();
+}
@@ -6,11 +6,14 @@
  * which provides timer interrupts for task scheduling and system timing.
  */
 
+#include <valen/pit.h>
 #include <valen/io.h>
 #include <valen/pic.h>
+#include <valen/irq.h>
 
 #define PIT_COMMAND_PORT 0x43
 #define PIT_DATA_PORT_0 0x40
+#define PIT_FREQUENCY 1193182
 
 /**
  * @brief Initialize the PIT with specified frequency
@@ -24,6 +27,37 @@ void pit_init(uint32_t frequency) {
     outb(PIT_DATA_PORT_0, divisor & 0xFF);        // Low byte
     outb(PIT_DATA_PORT_0, (divisor >> 8) & 0xFF);   // High byte
     
-    // Enable timer IRQ (IRQ 0) in PIC
-    pic_irq_enable(0);
+    // Enable timer IRQ (IRQ 0)
+    irq_enable(IRQ_TIMER);
+}
+
+/**
+ * @brief Switch channel 0 to one-shot mode and enable its IRQ
+ *
+ * Nothing fires until the first pit_oneshot().
+ */
+void pit_oneshot_init(void) {
+    // Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(PIT_COMMAND_PORT, 0x30);
+    irq_enable(IRQ_TIMER);
+}
+
+/**
+ * @brief Raise IRQ 0 once after @p ns nanoseconds
+ *
+ * Longer delays are cut to the 16-bit counter's range, about 55ms; the
+ * caller re-arms when the early interrupt finds nothing due.
+ */
+void pit_oneshot(uint64_t ns) {
+    // Clamp before scaling so a far deadline cannot overflow
+    uint64_t max_ns = (uint64_t)PIT_ONESHOT_MAX_COUNT * 1000000000ULL / PIT_FREQUENCY;
+    uint64_t count = ns >= max_ns ? PIT_ONESHOT_MAX_COUNT : ns * PIT_FREQUENCY / 1000000000ULL;
+
+    if (count == 0) {
+        count = 1;
+    }
+
+    // Loading a new count restarts the one-shot
+    outb(PIT_DATA_PORT_0, count & 0xFF);
+    outb(PIT_DATA_PORT_0, (count >> 8) & 0xFF);
 }
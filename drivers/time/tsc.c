@@ -0,0 +1,74 @@
+/**
+ * @file tsc.c
+ * @brief Time-Stamp Counter calibration and delays.
+ *
+ * PIT channel 2 is not wired to an interrupt, so it can time a fixed
+ * interval by polling while the TSC is read at both ends. The result gives
+ * microsecond delays before any timer interrupt is running, as needed for
+ * the INIT/SIPI sequence when starting other CPUs.
+ */
+
+#include <valen/tsc.h>
+#include <valen/io.h>
+#include <valen/cpu.h>
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL2_PORT 0x42
+#define PIT_COMMAND_PORT 0x43
+#define PIT_GATE_PORT 0x61
+
+#define PIT_GATE_CHANNEL2 0x01
+#define PIT_SPEAKER 0x02
+#define PIT_OUT_CHANNEL2 0x20
+
+#define CALIBRATE_MS 10
+
+static uint64_t ticks_per_ms = 0;
+
+/* 32.32 fixed-point factors between TSC cycles and nanoseconds */
+static uint64_t ns_per_cycle = 0;
+static uint64_t cycles_per_ns = 0;
+
+void tsc_init(void)
+{
+    uint16_t count = PIT_FREQUENCY / (1000 / CALIBRATE_MS);
+
+    /* Gate channel 2 on, keep the speaker off */
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~PIT_SPEAKER) | PIT_GATE_CHANNEL2);
+
+    /* Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count) */
+    outb(PIT_COMMAND_PORT, 0xB0);
+    outb(PIT_CHANNEL2_PORT, count & 0xFF);
+    outb(PIT_CHANNEL2_PORT, count >> 8);
+
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT_CHANNEL2))
+        cpu_relax();
+    uint64_t end = rdtsc();
+
+    ticks_per_ms = (end - start) / CALIBRATE_MS;
+    ns_per_cycle = (1000000ULL << 32) / ticks_per_ms;
+    cycles_per_ns = (ticks_per_ms << 32) / 1000000ULL;
+}
+
+uint64_t tsc_khz(void)
+{
+    return ticks_per_ms;
+}
+
+void tsc_delay_us(uint64_t us)
+{
+    uint64_t end = rdtsc() + (us * ticks_per_ms) / 1000 + 1;
+    while (rdtsc() < end)
+        cpu_relax();
+}
+
+uint64_t tsc_to_ns(uint64_t cycles)
+{
+    return (uint64_t)(((unsigned __int128)cycles * ns_per_cycle) >> 32);
+}
+
+uint64_t tsc_from_ns(uint64_t ns)
+{
+    return (uint64_t)(((unsigned __int128)ns * cycles_per_ns) >> 32);
+}
@@ -0,0 +1,92 @@
+/**
+ * @file acpi.h
+ * @brief ACPI table discovery and MADT parsing.
+ */
+
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <valen/percpu.h>
+
+#define ACPI_MAX_IOAPICS 8
+#define ACPI_MAX_OVERRIDES 16
+
+/** @brief MADT interrupt override flags (MPS INTI flags). */
+#define ACPI_MADT_POLARITY_MASK 0x3
+#define ACPI_MADT_POLARITY_LOW 0x3
+#define ACPI_MADT_TRIGGER_MASK 0xC
+#define ACPI_MADT_TRIGGER_LEVEL 0xC
+
+/**
+ * @brief Common header of every ACPI system description table.
+ */
+typedef struct acpi_sdt_header
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+typedef struct acpi_ioapic
+{
+    uint8_t id;
+    uint32_t phys;
+    uint32_t gsi_base;
+} acpi_ioapic_t;
+
+/**
+ * @brief An ISA IRQ that is wired to a different global system interrupt.
+ */
+typedef struct acpi_override
+{
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} acpi_override_t;
+
+/**
+ * @brief Interrupt topology reported by the MADT.
+ */
+typedef struct acpi_madt_info
+{
+    uint64_t lapic_phys;
+    uint32_t cpu_count;
+    uint8_t cpu_apic_ids[MAX_CPUS];
+    uint32_t ioapic_count;
+    acpi_ioapic_t ioapics[ACPI_MAX_IOAPICS];
+    uint32_t override_count;
+    acpi_override_t overrides[ACPI_MAX_OVERRIDES];
+} acpi_madt_info_t;
+
+/**
+ * @brief Records the RSDP handed over by the bootloader.
+ * The structure is copied, so the multiboot information may be reused afterwards.
+ */
+void acpi_set_rsdp(const void *rsdp);
+
+/**
+ * @brief Locates the MADT and parses it. Requires the PMM and the direct map.
+ * Falls back to scanning the BIOS area when no RSDP was recorded.
+ * @return 0 on success, -1 if no usable MADT was found.
+ */
+int acpi_init(void);
+
+/**
+ * @brief Returns the parsed MADT, or NULL if acpi_init() failed.
+ */
+const acpi_madt_info_t *acpi_get_madt(void);
+
+/**
+ * @brief Finds an ACPI table by its four-character signature.
+ * @return The mapped table, or NULL.
+ */
+acpi_sdt_header_t *acpi_find_table(const char *signature);
+
+#endif
@@ -0,0 +1,25 @@
+/**
+ * @file ahci.h
+ * @brief AHCI SATA host controller driver.
+ */
+
+#ifndef AHCI_H
+#define AHCI_H
+
+/** @brief Ports one controller can implement. */
+#define AHCI_MAX_PORTS 32
+
+/**
+ * @brief Finds the first AHCI controller on the PCI bus and registers a
+ * block device (sda, sdb, ...) for every SATA disk attached to it.
+ * Completions arrive by MSI when the I/O APIC is in use; otherwise each
+ * submitter polls for its own request. Requires irq_init() and timer_init().
+ */
+void ahci_init(void);
+
+/**
+ * @brief Controller interrupt handler, called by ahci_isr.
+ */
+void ahci_handler(void);
+
+#endif
@@ -0,0 +1,78 @@
+/**
+ * @file apic.h
+ * @brief Local APIC driver.
+ */
+
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+/** @brief Vector the local APIC delivers spurious interrupts on. */
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+/** @brief Inter-processor interrupt asking a CPU to run its scheduler. */
+#define RESCHED_VECTOR 0xF0
+
+/** @brief Vector of the local APIC timer. */
+#define LAPIC_TIMER_VECTOR 0xEF
+
+/** @brief Inter-processor interrupt asking a CPU to flush its TLB. */
+#define TLB_FLUSH_VECTOR 0xEE
+
+/** @brief ICR delivery modes and flags. */
+#define LAPIC_ICR_INIT 0x00000500
+#define LAPIC_ICR_STARTUP 0x00000600
+#define LAPIC_ICR_ASSERT 0x00004000
+#define LAPIC_ICR_LEVEL 0x00008000
+#define LAPIC_ICR_PENDING 0x00001000
+
+/**
+ * @brief Maps the local APIC registers at @p phys and enables the BSP's APIC.
+ */
+void lapic_init(uint64_t phys);
+
+/**
+ * @brief Enables the local APIC of the calling CPU. lapic_init() must have run.
+ */
+void lapic_enable(void);
+
+/**
+ * @brief Returns non-zero once lapic_init() has mapped the registers.
+ */
+int lapic_available(void);
+
+/**
+ * @brief APIC ID of the calling CPU.
+ */
+uint32_t lapic_id(void);
+
+/**
+ * @brief Signals end of interrupt to the local APIC.
+ */
+void lapic_eoi(void);
+
+/**
+ * @brief Sends an IPI and waits until the APIC has accepted it.
+ * @param apic_id Destination APIC ID.
+ * @param icr     Vector, delivery mode and flags for the low ICR word.
+ */
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+
+/**
+ * @brief Returns non-zero if the calling CPU's APIC timer has TSC-deadline mode.
+ */
+int lapic_tsc_deadline_supported(void);
+
+/**
+ * @brief Puts the calling CPU's APIC timer in TSC-deadline mode, disarmed.
+ */
+void lapic_timer_init(void);
+
+/**
+ * @brief Fires LAPIC_TIMER_VECTOR once the TSC reaches @p tsc.
+ * A deadline already passed fires at once; 0 disarms the timer.
+ */
+void lapic_timer_set_deadline(uint64_t tsc);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef VALEN_BENCH_H
+#define VALEN_BENCH_H
+
+#include <stdint.h>
+
+/*
+ * In-kernel micro-benchmarks. Each suite times an operation with the TSC
+ * and prints one line per measurement to the console and to COM1, so a
+ * headless QEMU run can be scraped from its serial output:
+ *
+ *   BENCH <suite>.<name> min=<n> median=<n> p99=<n> avg=<n> n=<ops> fail=<n> cycles
+ */
+
+// Serializing TSC read: earlier instructions finish before the count is taken
+static inline uint64_t bench_tsc(void) {
+    uint32_t lo, hi;
+    asm volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Run one suite by name, or every suite for "all".
+// Returns 0 on success, -1 for an unknown suite.
+int bench_run(const char *suite);
+
+// Register the bench shell command
+void bench_init(void);
+
+// Print a line to the console and the serial port
+void bench_print(const char *line);
+
+// Sort samples[0..count) and print their min, median, p99 and mean,
+// along with the number of attempts that failed and took no sample
+void bench_report(const char *name, uint64_t *samples, uint32_t count, uint32_t failures);
+
+// Print a "BENCH <name> skipped (<why>)" line
+void bench_skip(const char *name, const char *why);
+
+// Suites
+void bench_sched(void);
+void bench_mm(void);
+
+#endif // VALEN_BENCH_H
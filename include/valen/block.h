@@ -0,0 +1,148 @@
+#ifndef VALEN_BLOCK_H
+#define VALEN_BLOCK_H
+
+#include <stdint.h>
+#include <valen/spinlock.h>
+#include <valen/wait.h>
+
+/*
+ * Block devices and the buffer cache on top of them.
+ *
+ * Everything above the driver works in 4KB blocks, one page each. The
+ * cache hands out buffers; a buffer that needs I/O is marked B_BUSY and
+ * passed to blk_submit(), which merges it into a queued request for the
+ * neighbouring block when it can and otherwise queues a new request
+ * sorted by block. Drivers take requests with blk_fetch_request(), which
+ * serves them in one sweep across the disk (C-LOOK), and report them done
+ * with blk_end_request(), which is safe from interrupt handlers.
+ */
+
+#define BLOCK_SIZE 4096
+#define SECTOR_SIZE 512
+#define BLOCK_SECTORS (BLOCK_SIZE / SECTOR_SIZE)
+
+// Blocks one request may carry, and requests queued per device
+#define BLK_MAX_SEGMENTS 32
+#define BLK_QUEUE_DEPTH 64
+
+// Buffer state bits
+#define B_UPTODATE 0x1  // data holds the block's contents
+#define B_DIRTY 0x2     // data is newer than the disk
+#define B_BUSY 0x4      // I/O in flight; data must not be touched
+#define B_ERROR 0x8     // The last I/O failed
+
+struct block_device;
+
+typedef struct buffer {
+    struct block_device *dev;
+    uint64_t block;
+    uint8_t *data;              // BLOCK_SIZE bytes, page-aligned
+    volatile uint32_t flags;    // B_*; changed atomically
+    uint32_t refcount;          // Under the cache lock
+    struct buffer *hash_next;
+    struct buffer *lru_next;    // Most recently used first
+    struct buffer *lru_prev;
+    struct buffer *sync_next;   // Batch being written by bcache_sync()
+} buffer_t;
+
+typedef struct blk_request {
+    struct block_device *dev;
+    uint64_t block;             // First block; bufs[i] holds block + i
+    uint32_t count;
+    int write;
+    buffer_t *bufs[BLK_MAX_SEGMENTS];
+    struct blk_request *next;
+} blk_request_t;
+
+typedef struct blk_stats {
+    uint64_t reads;             // Requests sent to the driver
+    uint64_t writes;
+    uint64_t blocks;            // Blocks those requests moved
+    uint64_t merges;            // Buffers folded into a queued request
+    uint64_t errors;
+} blk_stats_t;
+
+typedef struct block_device {
+    const char *name;
+    uint64_t blocks;            // Capacity
+    // Start the next request unless the device is busy. Called with no
+    // block layer lock held, from task and interrupt context.
+    void (*kick)(struct block_device *dev);
+    void *driver;
+
+    spinlock_t lock;            // Taken with interrupts off
+    blk_request_t *queue;       // Sorted by block
+    blk_request_t *free;
+    uint64_t head;              // Block after the last fetched request
+    int plugged;                // blk_fetch_request() holds requests back
+    blk_request_t pool[BLK_QUEUE_DEPTH];
+    wait_queue_t wait;          // Waiters for a free request or a buffer
+    blk_stats_t stats;
+    struct block_device *next;
+} block_device_t;
+
+// Set up the fields of dev the block layer owns and list it. The driver
+// fills name, blocks, kick and driver first.
+void blk_register(block_device_t *dev);
+
+// Registered device called name, or NULL
+block_device_t *blk_get(const char *name);
+
+// First registered device; follow ->next for the rest
+block_device_t *blk_devices(void);
+
+// Queue I/O for buf, which the caller has marked B_BUSY. Sleeps while
+// the device's queue is full, so task context only.
+void blk_submit(buffer_t *buf, int write);
+
+// Hold back requests on dev while a batch is queued, so that it is merged
+// and sorted before the driver sees any of it. A queue that fills up
+// starts anyway. Calls nest.
+void blk_plug(block_device_t *dev);
+void blk_unplug(block_device_t *dev);
+
+// Next request for the driver to run, or NULL. Safe from interrupts.
+blk_request_t *blk_fetch_request(block_device_t *dev);
+
+// Finish req: its buffers leave B_BUSY, with B_ERROR if err is non-zero,
+// and their waiters wake. Safe from interrupt handlers.
+void blk_end_request(blk_request_t *req, int err);
+
+// Sleep until buf has no I/O in flight. Returns -1 if it failed.
+int blk_wait_buffer(buffer_t *buf);
+
+// Fixed-size cache of block buffers, least recently used reused first.
+// Writes stay in the cache until bcache_sync(), which kflushd runs every
+// BCACHE_FLUSH_MS, or until their buffer is reused.
+#define BCACHE_BUFFERS 256
+#define BCACHE_FLUSH_MS 5000
+
+typedef struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;        // Dirty blocks written to disk
+    uint32_t buffers;
+    uint32_t dirty;
+} bcache_stats_t;
+
+// Allocate the buffers and start kflushd; needs the heap and tasking
+void bcache_init(void);
+
+// Buffer holding block of dev, read from disk on a miss, with a
+// reference held. NULL if the read failed or every buffer is in use.
+// Task context only.
+buffer_t *bcache_read(block_device_t *dev, uint64_t block);
+
+// Drop a reference from bcache_read()
+void bcache_release(buffer_t *buf);
+
+// Note that the caller changed buf->data; it is written back later
+void bcache_mark_dirty(buffer_t *buf);
+
+// Write every dirty buffer back and wait for the writes. Returns -1 if
+// any failed; those buffers stay dirty.
+int bcache_sync(void);
+
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif // VALEN_BLOCK_H
@@ -0,0 +1,112 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+/** @brief RFLAGS.IF - maskable interrupts enabled. */
+#define RFLAGS_IF (1ULL << 9)
+
+/**
+ * @brief Disables interrupts on this CPU and returns the previous RFLAGS.
+ * Pair with irq_restore() so nested sections keep the outer state.
+ */
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+    asm volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/**
+ * @brief Re-enables interrupts if they were enabled when irq_save() ran.
+ */
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & RFLAGS_IF)
+        asm volatile("sti" : : : "memory");
+}
+
+/**
+ * @brief Reads the Time-Stamp Counter.
+ */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * @brief Executes CPUID for @p leaf / @p subleaf.
+ */
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+/**
+ * @brief Reads a Model Specific Register.
+ */
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * @brief Writes a Model Specific Register.
+ */
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/**
+ * @brief Reads and writes the CR0 and CR4 control registers.
+ */
+static inline uint64_t read_cr0(void)
+{
+    uint64_t value;
+    asm volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint64_t value)
+{
+    asm volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+    uint64_t value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint64_t value)
+{
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+/**
+ * @brief Index of the lowest set bit. @p value must not be zero.
+ */
+static inline int bsf64(uint64_t value)
+{
+    uint64_t index;
+    asm("bsfq %1, %0" : "=r"(index) : "rm"(value) : "cc");
+    return (int)index;
+}
+
+/**
+ * @brief Hint to the CPU that we are in a spin-wait loop.
+ */
+static inline void cpu_relax(void)
+{
+    asm volatile("pause" : : : "memory");
+}
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * @file fpu.h
+ * @brief Lazy FPU/SSE state switching.
+ *
+ * The kernel is built without SSE, so interrupt handlers and ordinary code
+ * never touch the FPU. Task code may still use x87, MMX or SSE, e.g. in a
+ * function marked __attribute__((target("sse2"))). Its registers are then
+ * saved and restored across context switches. Interrupt handlers must not
+ * use them.
+ */
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+struct task;
+
+/**
+ * @brief Register image saved by fxsave.
+ */
+typedef struct fpu_state
+{
+    uint8_t fxsave[512];
+} __attribute__((aligned(16))) fpu_state_t;
+
+/**
+ * @brief Enables SSE on the BSP and records the initial register image.
+ * Requires slab_init().
+ */
+void fpu_init(void);
+
+/**
+ * @brief Enables SSE on an AP, with CR0.TS set.
+ */
+void fpu_init_cpu(void);
+
+/**
+ * @brief Saves @p prev's registers if it used them, and sets CR0.TS unless
+ * this CPU still holds @p next's registers. Called by the scheduler with
+ * interrupts disabled, right before switch_to().
+ */
+void fpu_switch(struct task *prev, struct task *next);
+
+/**
+ * @brief Releases the saved state of a task that is being freed.
+ */
+void fpu_release(struct task *task);
+
+/**
+ * @brief #NM handler: gives the current task its registers.
+ */
+void fpu_trap_handler(void);
+
+#endif
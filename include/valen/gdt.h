@@ -19,6 +19,30 @@ struct gdt_ptr
     uint64_t base;
 } __attribute__((packed));
 
+// 64-bit Task State Segment; only the interrupt stack table is used
+struct tss
+{
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+// First TSS descriptor; each CPU's takes two GDT entries from here on
+#define GDT_TSS 3
+
+// IST slot of the page fault handler, so faults on a task's stack run
+// on a stack that is known to be mapped
+#define IST_PAGE_FAULT 1
+
+// Size of each CPU's page fault stack
+#define IST_STACK_SIZE 8192
+
 void gdt_init();
+void gdt_load();
+void tss_init(uint32_t cpu);
 
 #endif
\ No newline at end of file
@@ -3,8 +3,28 @@
 #include <stdint.h>
 #include <stddef.h>
 
+/**
+ * @brief Heap usage and fragmentation counters.
+ */
+typedef struct heap_stats
+{
+    uint64_t live_allocs;    /* Outstanding allocations */
+    uint64_t large_allocs;   /* Outstanding allocations served with whole pages */
+    uint64_t bytes_in_use;   /* Bytes of allocated blocks, tags included */
+    uint64_t bytes_reserved; /* Bytes of arenas plus large allocations */
+    uint64_t arenas;         /* Arenas the heap has grown to */
+    uint64_t free_blocks;    /* Blocks on the free lists */
+    uint64_t free_bytes;     /* Bytes on the free lists */
+    uint64_t largest_free;   /* Largest free block */
+    uint64_t mallocs;        /* malloc() calls */
+    uint64_t frees;          /* Successful free() calls */
+    uint64_t failures;       /* malloc() calls that returned NULL */
+    uint64_t search_steps;   /* Free blocks inspected by all malloc() calls */
+} heap_stats_t;
+
 void heap_init();
 void *malloc(uint64_t size);
 void free(void *ptr);
+void heap_get_stats(heap_stats_t *stats);
 
 #endif
\ No newline at end of file
@@ -22,6 +22,8 @@ struct idt_ptr
 } __attribute__((packed));
 
 void idt_init();
+void idt_load();
 void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags);
+void idt_set_ist(uint8_t vector, uint8_t ist);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+/**
+ * @file ioapic.h
+ * @brief I/O APIC driver.
+ */
+
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include <stdint.h>
+
+/** @brief Redirection entry flags. */
+#define IOAPIC_ACTIVE_LOW 0x00002000
+#define IOAPIC_LEVEL 0x00008000
+#define IOAPIC_MASKED 0x00010000
+
+/**
+ * @brief Maps every I/O APIC listed in the MADT and masks all their inputs.
+ * Requires acpi_init().
+ * @return The number of I/O APICs found.
+ */
+int ioapic_init(void);
+
+/**
+ * @brief Routes global system interrupt @p gsi to @p vector on one CPU.
+ * @param gsi     Global system interrupt number.
+ * @param vector  IDT vector to deliver.
+ * @param apic_id Local APIC ID of the destination CPU.
+ * @param flags   IOAPIC_ACTIVE_LOW, IOAPIC_LEVEL and IOAPIC_MASKED.
+ * @return 0 on success, -1 if no I/O APIC serves @p gsi.
+ */
+int ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint32_t flags);
+
+/**
+ * @brief Masks or unmasks @p gsi, keeping the rest of its routing.
+ */
+void ioapic_set_masked(uint32_t gsi, int masked);
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * @file irq.h
+ * @brief Device interrupt routing over the 8259 PIC or the I/O APIC.
+ */
+
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+
+/** @brief ISA IRQ n (IRQ_* in pic.h) is delivered on vector IRQ_VECTOR_BASE + n. */
+#define IRQ_VECTOR_BASE 0x20
+#define IRQ_ISA_COUNT 16
+
+/** @brief Vectors handed out by irq_alloc_vector(), e.g. for MSI. */
+#define IRQ_DYNAMIC_FIRST 0x30
+#define IRQ_DYNAMIC_LAST 0xDF
+
+/**
+ * @brief Moves ISA interrupts from the 8259 PIC to the I/O APIC and masks the PIC.
+ * Lines enabled before the switch stay enabled. Without a local APIC or an
+ * I/O APIC in the MADT the PIC stays in charge. Requires smp_init().
+ */
+void irq_init(void);
+
+/**
+ * @brief Returns non-zero once interrupts are routed through the I/O APIC.
+ */
+int irq_apic_mode(void);
+
+/**
+ * @brief Unmasks ISA IRQ @p irq.
+ */
+void irq_enable(uint8_t irq);
+
+/**
+ * @brief Masks ISA IRQ @p irq.
+ */
+void irq_disable(uint8_t irq);
+
+/**
+ * @brief Signals end of interrupt for @p irq. Through the I/O APIC this is
+ * a single local APIC write and @p irq is not needed.
+ */
+void irq_eoi(uint8_t irq);
+
+/**
+ * @brief Delivers ISA IRQ @p irq to @p cpu from now on.
+ * @return 0 on success, -1 without an I/O APIC or if @p cpu is not online.
+ */
+int irq_set_affinity(uint8_t irq, uint32_t cpu);
+
+/**
+ * @brief CPU that ISA IRQ @p irq is delivered to.
+ */
+uint32_t irq_get_affinity(uint8_t irq);
+
+/**
+ * @brief Reserves an unused vector between IRQ_DYNAMIC_FIRST and IRQ_DYNAMIC_LAST.
+ * The caller installs its handler with idt_set_descriptor().
+ * @return The vector, or -1 if none is left.
+ */
+int irq_alloc_vector(void);
+
+/**
+ * @brief Composes the MSI address and data that deliver @p vector to @p cpu,
+ * edge-triggered with fixed delivery. Acknowledge the interrupt with irq_eoi().
+ */
+void irq_msi_message(uint32_t cpu, uint8_t vector, uint64_t *address, uint32_t *data);
+
+#endif
@@ -0,0 +1,103 @@
+/**
+ * @file irqstat.h
+ * @brief Per-CPU interrupt counts and handler duration histograms.
+ */
+
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include <stdint.h>
+
+/** @brief Slots: one per IDT vector, then one shared by the generic stub. */
+#define IRQSTAT_OTHER 256
+#define IRQSTAT_VECTORS 257
+
+/**
+ * @brief Duration buckets in TSC cycles. Bucket 0 is below
+ * 2^IRQSTAT_FIRST_SHIFT, each next bucket doubles the bound and the last
+ * one holds everything longer.
+ */
+#define IRQSTAT_BUCKETS 10
+#define IRQSTAT_FIRST_SHIFT 9
+
+/**
+ * @brief One interrupt being handled. The ISR stub keeps it on the stack
+ * below the saved context; nested interrupts link to the one they
+ * interrupted.
+ */
+typedef struct irq_frame
+{
+    uint64_t start;             /* TSC at entry */
+    uint64_t excluded;          /* Cycles spent in softirqs on the way out */
+    struct irq_frame *prev;
+    uint32_t vector;
+    uint32_t closed;            /* Already accounted */
+} irq_frame_t;
+
+/** @brief Counters for one vector or softirq on one CPU. */
+typedef struct irq_stat
+{
+    uint64_t count;
+    uint64_t cycles;            /* Total handler time */
+    uint64_t max;
+    uint32_t hist[IRQSTAT_BUCKETS];
+} irq_stat_t;
+
+/**
+ * @brief Registers the irqstat shell command.
+ */
+void irqstat_init(void);
+
+/**
+ * @brief Called by an ISR stub before its handler. Interrupts are off.
+ */
+void irqstat_enter(irq_frame_t *frame, uint32_t vector);
+
+/**
+ * @brief Called by an ISR stub after its handler. Accounts the interrupt
+ * unless irqstat_close() already did.
+ */
+void irqstat_exit(irq_frame_t *frame);
+
+/**
+ * @brief Accounts the outermost interrupt now, before it switches tasks,
+ * so the time another task runs is not charged to the handler.
+ */
+void irqstat_close(void);
+
+/**
+ * @brief Leaves @p cycles of softirq work out of the current interrupt's time.
+ */
+void irqstat_exclude(uint64_t cycles);
+
+/**
+ * @brief Records one run of softirq @p nr.
+ */
+void irqstat_softirq(int nr, uint64_t cycles);
+
+/**
+ * @brief Names vector @p vector for irqstat output. @p name must stay valid.
+ */
+void irqstat_set_name(uint32_t vector, const char *name);
+
+/**
+ * @brief Name given to @p vector, or 0.
+ */
+const char *irqstat_name(uint32_t vector);
+
+/**
+ * @brief Copies the counters of @p vector on @p cpu.
+ */
+void irqstat_get(uint32_t cpu, uint32_t vector, irq_stat_t *stat);
+
+/**
+ * @brief Copies the counters of softirq @p nr on @p cpu.
+ */
+void irqstat_get_softirq(uint32_t cpu, int nr, irq_stat_t *stat);
+
+/**
+ * @brief Clears every counter on every CPU.
+ */
+void irqstat_reset(void);
+
+#endif
@@ -5,4 +5,10 @@
 
 void kmain(unsigned long magic, unsigned long addr);
 
+/** @brief Command line the bootloader passed, or "" if there was none. */
+const char *kernel_cmdline(void);
+
+/** @brief Returns non-zero if @p option is a word of the command line. */
+int kernel_cmdline_has(const char *option);
+
 #endif
@@ -3,9 +3,40 @@
 
 #include <stdint.h>
 
+/* Modifier bits of a key event */
+#define KEY_MOD_SHIFT 0x01
+#define KEY_MOD_CTRL  0x02
+#define KEY_MOD_ALT   0x04
+
+/* Events buffered between the IRQ handler and the reader; a power of two */
+#define KEY_RING_SIZE 256
+
+/**
+ * @brief One scancode byte as the IRQ handler received it.
+ */
+typedef struct key_event
+{
+    uint64_t timestamp;     /* timer_now() when the byte arrived */
+    uint8_t scancode;       /* Raw set 1 scancode, release bit included */
+    uint8_t modifiers;      /* KEY_MOD_* held at that moment */
+} key_event_t;
+
 void keyboard_init(void);
 void keyboard_handler(void);
 void process_pending_key(void);
 void wait_for_keypress(void);
+void keyboard_wait_key(void);
+
+/**
+ * @brief Takes the oldest buffered event without sleeping. There may be
+ * only one reader at a time.
+ * @return 1 if @p event was filled in, 0 if no event is buffered.
+ */
+int keyboard_read_event(key_event_t *event);
+
+/**
+ * @brief Events discarded because the ring was full.
+ */
+uint64_t keyboard_dropped(void);
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef VALEN_KLOG_H
+#define VALEN_KLOG_H
+
+#include <stdint.h>
+
+/*
+ * Kernel log. klog() stores a binary record (timestamp, CPU, level, the
+ * format string and its raw arguments) in a ring of the calling CPU and
+ * returns; nothing is formatted and no lock is taken. A background task,
+ * klogd, formats the records later and writes them to the console sinks:
+ * the serial port gets everything, the screen only warnings and errors.
+ * The rings keep the most recent history for dmesg and for panics.
+ *
+ * The format must be a string literal: only its address is stored. It
+ * takes %d %i %u %x %X %o %b %p %s %c and %%, with l and ll length
+ * modifiers. Strings are copied into the record, cut at 63 characters.
+ * Safe from any context, including interrupt handlers, with any lock held
+ * but the timer wheel's.
+ */
+
+enum {
+    KLOG_ERR,
+    KLOG_WARN,
+    KLOG_INFO,
+    KLOG_DEBUG
+};
+
+// Log bytes kept per CPU; a power of two
+#define KLOG_RING_SIZE 16384
+
+void klog(int level, const char *fmt, ...);
+
+// Start klogd, which drains what was logged so far; needs softirq_init()
+void klog_init(void);
+
+// Print every record still in the rings, oldest first, to the screen
+void klog_dmesg(void);
+
+// Print the last @p count records to the screen and the serial port
+// without sleeping or waiting for klogd. For panics.
+void klog_dump(int count);
+
+#endif // VALEN_KLOG_H
@@ -0,0 +1,34 @@
+#ifndef VALEN_KSYMS_H
+#define VALEN_KSYMS_H
+
+#include <stdint.h>
+
+/*
+ * Kernel symbol table. The Makefile links the kernel once, lists its
+ * text symbols with nm and links again with the sorted table added
+ * (scripts/ksyms.sh). Only .rodata grows in the second link, so every
+ * function keeps the address the table records. A kernel built without
+ * that step has an empty table, and lookups fail.
+ */
+
+typedef struct ksym {
+    uint64_t addr;
+    const char *name;
+} ksym_t;
+
+// Number of symbols in the table, 0 if there is none
+uint64_t ksym_count(void);
+
+// Index of the function containing addr, or -1
+int64_t ksym_index(uint64_t addr);
+
+// Entry at a ksym_index() result
+const ksym_t *ksym_get(uint64_t index);
+
+// Name of the function containing addr and the offset into it, or NULL
+const char *ksym_lookup(uint64_t addr, uint64_t *offset);
+
+// Non-zero if addr lies in kernel text
+int ksym_is_text(uint64_t addr);
+
+#endif // VALEN_KSYMS_H
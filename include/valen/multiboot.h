@@ -5,7 +5,10 @@
 
 #define MULTIBOOT2_BOOTLOADER_MAGIC 0x36d76289
 #define MULTIBOOT_TAG_TYPE_END 0
+#define MULTIBOOT_TAG_TYPE_CMDLINE 1
 #define MULTIBOOT_TAG_TYPE_MMAP 6
+#define MULTIBOOT_TAG_TYPE_ACPI_OLD 14
+#define MULTIBOOT_TAG_TYPE_ACPI_NEW 15
 #define MULTIBOOT_MEMORY_AVAILABLE 1
 #define MULTIBOOT_MEMORY_RESERVED 2
 #define MULTIBOOT_MEMORY_ACPI_RECLAIM 3
@@ -35,4 +38,20 @@ struct multiboot_tag_mmap
     struct multiboot_mmap_entry entries[];
 } __attribute__((packed));
 
+/** @brief NUL-terminated string, such as the kernel command line. */
+struct multiboot_tag_string
+{
+    uint32_t type;
+    uint32_t size;
+    char string[];
+} __attribute__((packed));
+
+/** @brief Copy of the ACPI RSDP (revision 1 for ACPI_OLD, 2+ for ACPI_NEW). */
+struct multiboot_tag_acpi
+{
+    uint32_t type;
+    uint32_t size;
+    uint8_t rsdp[];
+} __attribute__((packed));
+
 #endif
@@ -0,0 +1,44 @@
+/**
+ * @file page.h
+ * @brief Page size and kernel address space layout.
+ *
+ * The kernel image is linked at KERNEL_VIRT_OFFSET, where boot.s maps the
+ * first 1GB of physical memory. All RAM reported by the bootloader is mapped
+ * again at DIRECT_MAP_OFFSET once paging_direct_map_end() has run.
+ */
+
+#ifndef PAGE_H
+#define PAGE_H
+
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+
+/** @brief Base of the kernel image and of the 1GB boot window. Must match boot.s and linker.ld. */
+#define KERNEL_VIRT_OFFSET 0xFFFFFFFF80000000ULL
+
+/** @brief Base of the direct map of all physical RAM (PML4 slot 256). */
+#define DIRECT_MAP_OFFSET 0xFFFF800000000000ULL
+
+/** @brief Physical address -> boot window. Only valid for the first 1GB. */
+#define KERNEL_PHYS_TO_VIRT(p) ((void *)((uint64_t)(p) + KERNEL_VIRT_OFFSET))
+
+/** @brief Physical address -> direct map. */
+#define PHYS_TO_VIRT(p) ((void *)((uint64_t)(p) + DIRECT_MAP_OFFSET))
+
+/** @brief Extracts the frame address from a page table entry. */
+#define ENTRY_TO_PHYS(entry) ((uint64_t)(entry) & 0x000FFFFFFFFFF000ULL)
+
+/**
+ * @brief Converts a kernel image or direct map address to physical.
+ */
+static inline uint64_t virt_to_phys(uint64_t virt)
+{
+    if (virt >= KERNEL_VIRT_OFFSET)
+        return virt - KERNEL_VIRT_OFFSET;
+    return virt - DIRECT_MAP_OFFSET;
+}
+
+#define VIRT_TO_PHYS(v) virt_to_phys((uint64_t)(v))
+
+#endif
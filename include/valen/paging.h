@@ -9,10 +9,47 @@
 #define PAGE_PWT (1ULL << 3) // Page Write-Through
 #define PAGE_PCD (1ULL << 4)  // Page-level Cache Disable
 #define PAGE_HUGE (1ULL << 7) /* PS bit for 2MB/1GB pages */
+#define PAGE_GLOBAL (1ULL << 8) // Kept in the TLB across CR3 switches
+
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
+/** @brief Batched operations touching more pages than this reload CR3 instead of using invlpg. */
+#define PAGING_FLUSH_THRESHOLD 32
+
+/**
+ * @brief A set of page tables. The lower half is private; the upper half
+ * is the kernel's, shared by every space.
+ */
+typedef struct addr_space
+{
+    uint64_t *pml4;
+    uint64_t kernel_gen;  // Kernel PML4 generation the upper half was copied at
+    uint16_t pcid;        // TLB tag, or 0 to flush on every switch
+} addr_space_t;
 
 void paging_init();
-void paging_map(uint64_t virt, uint64_t phys, uint64_t flags);
-void paging_map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
-void paging_map_page(uint64_t virt, uint64_t phys, uint64_t flags);
+void paging_init_cpu(void);
+int paging_map(uint64_t virt, uint64_t phys, uint64_t flags);
+int paging_map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+int paging_map_pages(uint64_t virt, const uint64_t *phys, uint64_t count, uint64_t flags);
+int paging_map_large(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+int paging_has_1g_pages(void);
+uint64_t paging_unmap(uint64_t virt);
+void paging_unmap_pages(uint64_t virt, uint64_t count, uint64_t *phys);
+int paging_prepare(uint64_t virt, uint64_t count);
+int paging_fill(uint64_t virt, uint64_t phys, uint64_t flags);
+void paging_flush_tlb(void);
+
+addr_space_t *paging_space_create(void);
+void paging_space_destroy(addr_space_t *space);
+int paging_space_map(addr_space_t *space, uint64_t virt, uint64_t phys, uint64_t flags);
+uint64_t paging_space_unmap(addr_space_t *space, uint64_t virt);
+void paging_switch(addr_space_t *space);
+int paging_sync_fault(uint64_t virt);
+
+void paging_direct_map_begin(uint64_t early_phys);
+void paging_direct_map_add(uint64_t phys, uint64_t len);
+uint64_t paging_direct_map_end(void);
 
 #endif
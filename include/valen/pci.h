@@ -0,0 +1,68 @@
+/**
+ * @file pci.h
+ * @brief PCI configuration space access through the legacy 0xCF8/0xCFC ports.
+ */
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+/** @brief Configuration space registers. */
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_CAP_PTR 0x34
+
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004
+#define PCI_COMMAND_INTX_OFF 0x0400
+#define PCI_STATUS_CAP_LIST 0x0010
+
+#define PCI_CAP_MSI 0x05
+
+/** @brief Bus, device and function of one PCI function. */
+typedef struct pci_dev
+{
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor;
+    uint16_t device;
+} pci_dev_t;
+
+uint32_t pci_read32(const pci_dev_t *dev, uint8_t offset);
+uint16_t pci_read16(const pci_dev_t *dev, uint8_t offset);
+uint8_t pci_read8(const pci_dev_t *dev, uint8_t offset);
+void pci_write32(const pci_dev_t *dev, uint8_t offset, uint32_t value);
+void pci_write16(const pci_dev_t *dev, uint8_t offset, uint16_t value);
+
+/**
+ * @brief Finds the @p index-th function whose class, subclass and
+ * programming interface match, scanning every bus.
+ * @return 0 and fills @p dev if found, -1 otherwise.
+ */
+int pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, int index, pci_dev_t *dev);
+
+/**
+ * @brief Physical address of memory BAR @p bar, 64-bit BARs included.
+ * @return The address, or 0 if the BAR is unused or an I/O BAR.
+ */
+uint64_t pci_bar_address(const pci_dev_t *dev, int bar);
+
+/**
+ * @brief Offset of capability @p id in configuration space, or 0 if absent.
+ */
+uint8_t pci_find_capability(const pci_dev_t *dev, uint8_t id);
+
+/**
+ * @brief Points the function's single MSI message at @p vector on @p cpu,
+ * enables it and turns the legacy INTx line off.
+ * @return 0 on success, -1 if the function has no MSI capability.
+ */
+int pci_enable_msi(const pci_dev_t *dev, uint32_t cpu, uint8_t vector);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Upper bound on the number of CPUs the kernel keeps state for.
+ * Follows the Kconfig CPU_CORES option when the build passes it in.
+ */
+#ifdef CONFIG_CPU_CORES
+#define MAX_CPUS CONFIG_CPU_CORES
+#else
+#define MAX_CPUS 8
+#endif
+
+struct task;
+struct task_context;
+struct irq_frame;
+
+/**
+ * @brief State private to one CPU, reached through the GS base.
+ * @c self and @c id sit at fixed offsets for the accessors below.
+ */
+typedef struct cpu_local
+{
+    struct cpu_local *self; /* Offset 0 */
+    uint32_t id;            /* Offset 8 */
+    uint32_t preempt_count; /* Preemption is disabled while non-zero */
+    uint32_t apic_id;
+    struct task *current;
+    struct task *idle;
+    struct task *dead;      /* Exited task to free once we are off its stack */
+    struct task *migrate;   /* Switched-out task that may no longer run here */
+    volatile uint8_t need_schedule;
+    volatile uint8_t online;
+    volatile uint8_t tick_pending; /* BSP passed on a scheduler tick (PIT fallback) */
+    struct task_context *irq_regs; /* Interrupted registers inside the timer handler */
+    struct task *fpu_owner; /* Task whose FPU/SSE state is in this CPU's registers */
+    volatile uint8_t rcu_idle; /* Halted in the idle loop; outside every grace period */
+    volatile uint32_t softirq_pending; /* Bit n set while softirq n is raised */
+    uint32_t irq_count;     /* Hardware interrupt handlers being run */
+    uint8_t in_softirq;     /* Running softirq handlers */
+    struct task *ksoftirqd; /* Runs softirqs that keep being raised */
+    volatile uint64_t tlb_gen; /* Last TLB shootdown this CPU has flushed for */
+    struct addr_space *active_space; /* Page tables loaded in CR3 */
+    struct irq_frame *irq_frame; /* Innermost interrupt being timed by irqstat */
+} cpu_local_t;
+
+extern cpu_local_t cpu_locals[MAX_CPUS];
+
+/**
+ * @brief Points the GS base of the calling CPU at cpu_locals[@p cpu].
+ * Must run after the GDT is loaded, since reloading GS clears the base.
+ */
+void percpu_init(uint32_t cpu);
+
+/**
+ * @brief Per-CPU block of the CPU executing this code.
+ */
+static inline cpu_local_t *this_cpu(void)
+{
+    cpu_local_t *cpu;
+    asm volatile("movq %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+/**
+ * @brief Index of the CPU executing this code.
+ */
+static inline uint32_t this_cpu_id(void)
+{
+    uint32_t id;
+    asm volatile("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
+
+/**
+ * @brief Task running on this CPU. A single GS-relative load, so the result
+ * stays right even if the caller is preempted and moved to another CPU.
+ */
+static inline struct task *this_cpu_current(void)
+{
+    struct task *task;
+    asm volatile("movq %%gs:%c1, %0" : "=r"(task) : "i"(offsetof(cpu_local_t, current)));
+    return task;
+}
+
+/**
+ * @brief Keeps the calling task on this CPU until preempt_enable().
+ * A single GS-relative instruction, so it cannot be split by an interrupt.
+ */
+static inline void preempt_disable(void)
+{
+    asm volatile("incl %%gs:%c0" : : "i"(offsetof(cpu_local_t, preempt_count)) : "memory");
+}
+
+/**
+ * @brief Re-allows preemption. A pending reschedule is taken on the next tick.
+ */
+static inline void preempt_enable(void)
+{
+    asm volatile("decl %%gs:%c0" : : "i"(offsetof(cpu_local_t, preempt_count)) : "memory");
+}
+
+/**
+ * @brief Nesting depth of preempt_disable() on this CPU.
+ */
+static inline uint32_t preempt_count(void)
+{
+    uint32_t count;
+    asm volatile("movl %%gs:%c1, %0" : "=r"(count) : "i"(offsetof(cpu_local_t, preempt_count)));
+    return count;
+}
+
+#endif
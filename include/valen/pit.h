@@ -9,4 +9,17 @@
  */
 void pit_init(uint32_t frequency);
 
+/** @brief Largest count a one-shot can be loaded with. */
+#define PIT_ONESHOT_MAX_COUNT 0xFFFF
+
+/**
+ * @brief Switch channel 0 to one-shot mode and enable IRQ 0
+ */
+void pit_oneshot_init(void);
+
+/**
+ * @brief Raise IRQ 0 once after @p ns nanoseconds, at most about 55ms ahead
+ */
+void pit_oneshot(uint64_t ns);
+
 #endif
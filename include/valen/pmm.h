@@ -3,15 +3,47 @@
 
 #include <stdint.h>
 
+/** @brief Largest buddy order: blocks of up to 2^10 frames (4MB). */
+#define PMM_MAX_ORDER 10
+
+/**
+ * @brief Aggregated per-CPU page cache counters.
+ */
+typedef struct pmm_pcp_stats
+{
+    uint64_t cached_pages; /* Free pages currently held in magazines */
+    uint64_t refills;      /* Batches pulled from the buddy lists */
+    uint64_t drains;       /* Batches returned to the buddy lists */
+} pmm_pcp_stats_t;
+
+/**
+ * @brief Counters of the pre-zeroed page pool.
+ */
+typedef struct pmm_zero_stats
+{
+    uint64_t pooled_pages; /* Zeroed pages ready to hand out */
+    uint64_t hits;         /* Allocations served from the pool */
+    uint64_t misses;       /* Allocations that had to clear a block themselves */
+} pmm_zero_stats_t;
+
 void pmm_init(uintptr_t start, uint64_t size);
+void pmm_free_region(uintptr_t base, uint64_t len);
 void pmm_mark_free(uintptr_t addr);
 void pmm_mark_used(uintptr_t addr);
 void *pmm_alloc_page();
 void *pmm_alloc_pages(uint64_t count);
+void *pmm_alloc_block(uint64_t order);
 void pmm_free_page(void *addr);
+void pmm_free_page_cold(void *addr);
+void pmm_free_pages(void *addr, uint64_t count);
+void *pmm_alloc_zeroed(uint64_t order);
+int pmm_zero_refill(void);
 
 uint64_t pmm_get_total_kb();
 uint64_t pmm_get_used_kb();
 uint64_t pmm_get_free_kb();
+uint64_t pmm_get_free_blocks(int order);
+void pmm_get_pcp_stats(pmm_pcp_stats_t *stats);
+void pmm_get_zero_stats(pmm_zero_stats_t *stats);
 
 #endif
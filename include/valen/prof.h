@@ -0,0 +1,53 @@
+#ifndef VALEN_PROF_H
+#define VALEN_PROF_H
+
+#include <stdint.h>
+
+struct task_context;
+
+/*
+ * Sampling profiler. While it runs, every CPU arms a timer PROF_HZ times
+ * a second, and the clock event interrupt that fires for it records the
+ * interrupted RIP, the running task's PID and the return addresses found
+ * by following the saved frame pointers. Samples go into a ring of the
+ * CPU's own, so taking one costs no lock. When the rings fill up,
+ * further samples are counted as dropped.
+ *
+ * With PIT one-shots all timers run on the BSP, so only the BSP is
+ * sampled.
+ */
+
+#define PROF_HZ 1000
+#define PROF_RING_SIZE 4096     // Samples kept per CPU
+#define PROF_DEPTH 6            // Return addresses kept per sample
+
+typedef struct prof_sample {
+    uint64_t rip;
+    uint32_t pid;
+    uint32_t depth;             // Valid entries in stack, innermost first
+    uint64_t stack[PROF_DEPTH];
+} prof_sample_t;
+
+// Register the prof shell command
+void prof_init(void);
+
+// Clear the rings and start sampling. Returns -1 if the rings cannot be
+// allocated.
+int prof_start(void);
+
+void prof_stop(void);
+
+int prof_running(void);
+
+// Called from the clock event interrupt with the interrupted registers;
+// samples only when this CPU's profiler timer is due
+void prof_tick(struct task_context *regs);
+
+// Print the functions that took the most samples, and the tasks
+void prof_dump(void);
+
+// Write every sample to the serial port as a folded stack,
+// "task-pid;outer;...;inner 1", ready for flamegraph tools
+void prof_stream(void);
+
+#endif // VALEN_PROF_H
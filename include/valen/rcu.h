@@ -0,0 +1,56 @@
+#ifndef VALEN_RCU_H
+#define VALEN_RCU_H
+
+#include <stddef.h>
+#include <valen/percpu.h>
+
+/*
+ * Read-copy-update for read-mostly data. Readers run between
+ * rcu_read_lock() and rcu_read_unlock() without taking any lock, so they
+ * never block writers. A writer unlinks an object under its own lock and
+ * hands it to call_rcu(), which runs the callback only after every CPU
+ * has passed a quiescent state, so no reader can still hold a pointer.
+ *
+ * The quiescent states are those of a non-preemptible kernel: a pass
+ * through schedule() with preemption enabled, and the idle loop. Read-side
+ * sections therefore disable preemption, must not sleep, and must not be
+ * used in interrupt handlers.
+ */
+
+// Deferred work; embed in the object to free
+typedef struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+} rcu_head_t;
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+static inline void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+// Publish p so that readers who load it also see its initialized contents
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Load a pointer published with rcu_assign_pointer()
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+// Run func(head) once every reader that might see the object is done.
+// Callbacks run with preemption enabled but no locks held, possibly from
+// schedule() or the idle loop, and must not sleep.
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head));
+
+// Sleep until a full grace period has passed
+void synchronize_rcu(void);
+
+// Quiescent state hooks for the scheduler
+void rcu_note_qs(void);
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+
+#endif // VALEN_RCU_H
@@ -3,8 +3,47 @@
 
 #include <stdint.h>
 
+/* Buckets of the command hash table; a power of two */
+#define SHELL_HASH_BUCKETS 64
+
+/**
+ * @brief A shell command. The owner keeps it in static storage and hands
+ * it to shell_register(); the shell only links it.
+ */
+typedef struct shell_command
+{
+    const char *name;
+    void (*func)(const char *arg);  /* arg is the rest of the line, or "" */
+    const char *help;
+    struct shell_command *hash_next;
+    struct shell_command *list_next; /* Registration order, for help */
+} shell_command_t;
+
+/**
+ * @brief Registers the shell's own commands. Subsystems register theirs
+ * from their init functions afterwards.
+ */
+void shell_commands_init(void);
+
+/**
+ * @brief Adds @p cmd to the command table. May be called at any time.
+ * @return 0 on success, -1 if a command of that name exists.
+ */
+int shell_register(shell_command_t *cmd);
+
 void shell_init(void);
+
+/**
+ * @brief Applies one key to the input line. The screen is updated by the
+ * next shell_flush(), so a burst of keys is drawn once.
+ */
 void shell_input(signed char c);
+
+/**
+ * @brief Draws what changed on the input line since the last flush.
+ */
+void shell_flush(void);
+
 void process_command(char *cmd);
 void shell_task_main(void);
 
@@ -0,0 +1,68 @@
+/**
+ * @file slab.h
+ * @brief Slab allocator for fixed-size kernel objects.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct kmem_cache kmem_cache_t;
+
+/**
+ * @brief Per-cache usage counters.
+ */
+typedef struct kmem_cache_stats
+{
+    char name[16];
+    uint64_t object_size;
+    uint64_t slab_bytes;
+    uint64_t objects_per_slab;
+    uint64_t slabs;
+    uint64_t active;  /* Objects allocated */
+    uint64_t total;   /* Objects the current slabs can hold */
+    uint64_t allocs;  /* kmem_cache_alloc() calls that succeeded */
+    uint64_t grows;   /* Slabs created over the cache's lifetime */
+} kmem_cache_stats_t;
+
+/**
+ * @brief Initializes the slab allocator. Requires the PMM.
+ */
+void slab_init(void);
+
+/**
+ * @brief Creates a cache of objects of @p size bytes.
+ * @param name  Short name used in statistics (truncated to 15 characters).
+ * @param size  Object size in bytes.
+ * @param align Object alignment (0 selects 8 bytes).
+ * @param ctor  Optional constructor, run once per object when a slab is
+ *              created. Objects must be returned in constructed state.
+ * @return The cache, or NULL if out of memory.
+ */
+kmem_cache_t *kmem_cache_create(const char *name, uint64_t size, uint64_t align, void (*ctor)(void *));
+
+/**
+ * @brief Destroys an empty cache and returns its slabs to the PMM.
+ * @return 0 on success, -1 if objects are still allocated.
+ */
+int kmem_cache_destroy(kmem_cache_t *cache);
+
+/**
+ * @brief Allocates one object from @p cache in O(1).
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/**
+ * @brief Returns an object to the cache it was allocated from in O(1).
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/**
+ * @brief Copies the counters of up to @p max caches into @p out.
+ * @return The number of entries written.
+ */
+int kmem_cache_get_stats(kmem_cache_stats_t *out, int max);
+
+#endif
@@ -0,0 +1,41 @@
+/**
+ * @file smp.h
+ * @brief Multiprocessor bring-up.
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+/**
+ * @brief Starts every application processor listed in the ACPI MADT.
+ * Requires the PMM, the VMM, the scheduler and tsc_init(). Without a MADT
+ * the system keeps running on the bootstrap processor alone.
+ */
+void smp_init(void);
+
+/**
+ * @brief Number of CPUs that have finished starting, including the BSP.
+ */
+uint32_t smp_cpu_count(void);
+
+/**
+ * @brief Asks @p cpu to run its scheduler, waking it from the idle loop.
+ */
+void smp_send_resched(uint32_t cpu);
+
+/**
+ * @brief Runs a scheduler tick on @p cpu. Used when the PIT drives every
+ * timer from the BSP, so the other CPUs still charge time slices.
+ */
+void smp_send_tick(uint32_t cpu);
+
+/**
+ * @brief Flushes the TLB of every online CPU and waits until they have.
+ * Call after removing kernel mappings and before reusing their frames or
+ * addresses. Safe with interrupts disabled.
+ */
+void smp_flush_tlb(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef VALEN_SOFTIRQ_H
+#define VALEN_SOFTIRQ_H
+
+#include <stdint.h>
+#include <valen/percpu.h>
+
+/*
+ * Deferred interrupt work. A top half acknowledges its device, queues
+ * what it read and raises a softirq; the work then runs on the way out
+ * of the interrupt, on the same CPU, with interrupts enabled. Softirqs
+ * raised while they run are picked up in the same pass, so a burst of
+ * interrupts is handled in one batch. Work that keeps coming back is
+ * handed to the CPU's ksoftirqd task so that it cannot starve tasks.
+ *
+ * Softirq handlers neither sleep nor nest, and run with preemption
+ * disabled. They may take only locks that are safe in interrupt
+ * handlers, which are all taken with interrupts disabled elsewhere, and
+ * like interrupt handlers must not enter RCU read-side sections.
+ */
+
+enum {
+    SOFTIRQ_TIMER,      // Expires the timer wheel
+    SOFTIRQ_TASKLET,    // Runs the scheduled tasklets
+    NR_SOFTIRQS
+};
+
+// One-off deferred function. Scheduling a tasklet that is already
+// pending does nothing; a tasklet never runs on two CPUs at once.
+typedef struct tasklet {
+    struct tasklet *next;
+    volatile uint32_t state;
+    void (*func)(void *data);
+    void *data;
+} tasklet_t;
+
+#define TASKLET_INIT(fn, arg) { NULL, 0, (fn), (arg) }
+
+// Marks the start of a hardware interrupt handler
+static inline void irq_enter(void) {
+    this_cpu()->irq_count++;
+}
+
+// Marks its end, after the EOI; runs pending softirqs unless this
+// interrupt came in on top of other interrupt work
+void irq_exit(void);
+
+// Non-zero in interrupt handlers and softirqs
+static inline int in_interrupt(void) {
+    cpu_local_t *cpu = this_cpu();
+    return cpu->irq_count || cpu->in_softirq;
+}
+
+// Start a ksoftirqd task on every online CPU; call after smp_init()
+void softirq_init(void);
+
+void open_softirq(int nr, void (*action)(void));
+
+// Short name of softirq nr, for statistics
+const char *softirq_name(int nr);
+
+// Mark a softirq pending on this CPU. From task context it runs in the
+// CPU's ksoftirqd, so do not call it holding a runqueue lock.
+void raise_softirq(int nr);
+
+void tasklet_init(tasklet_t *t, void (*func)(void *data), void *data);
+
+// Run t once soon on this CPU. Safe from interrupt handlers.
+void tasklet_schedule(tasklet_t *t);
+
+#endif // VALEN_SOFTIRQ_H
@@ -2,16 +2,71 @@
 #define SPINLOCK_H
 
 #include <stdint.h>
+#include <stddef.h>
 
-typedef struct {
-    volatile uint32_t lock;
+#ifdef CONFIG_LOCK_STAT
+// Contention counters of one lock, updated by each acquirer while it
+// holds the lock
+typedef struct lock_stat {
+    uint64_t acquisitions;
+    uint64_t contended;     // Acquisitions that had to wait
+    uint64_t spin_cycles;   // TSC cycles spent waiting, in total
+    uint64_t max_spin;      // Longest single wait
+    void *holder;           // Call site of the latest acquirer
+} lock_stat_t;
+#endif
+
+/*
+ * Ticket lock: an acquirer takes the next ticket and waits until owner
+ * reaches it, so the lock is handed out in arrival order. Both halves
+ * share one word so that a try-lock can compare and swap it whole.
+ */
+typedef struct spinlock {
+    union {
+        volatile uint32_t lock;
+        struct {
+            volatile uint16_t owner;    // Ticket being served
+            volatile uint16_t next;     // Ticket the next acquirer takes
+        } tickets;
+    };
+#ifdef CONFIG_LOCK_STAT
+    const char *name;           // Only named locks are listed by lockstat
+    struct spinlock *stat_next;
+    uint32_t stat_listed;
+    lock_stat_t stat;
+#endif
 } spinlock_t;
 
-#define SPINLOCK_INIT { .lock = 0 }
+#ifdef CONFIG_LOCK_STAT
+#define SPINLOCK_INIT_NAMED(n) { .lock = 0, .name = (n) }
+#else
+#define SPINLOCK_INIT_NAMED(n) { .lock = 0 }
+#endif
+#define SPINLOCK_INIT SPINLOCK_INIT_NAMED(NULL)
 
 void spinlock_init(spinlock_t *lock);
+void spinlock_init_named(spinlock_t *lock, const char *name);
 void spinlock_acquire(spinlock_t *lock);
 void spinlock_release(spinlock_t *lock);
 uint8_t spinlock_try_acquire(spinlock_t *lock);
 
-#endif
\ No newline at end of file
+// Disable interrupts on this CPU for as long as the lock is held. Any lock
+// that an interrupt handler takes must be taken this way everywhere else,
+// or the handler can spin forever on a lock its own CPU holds.
+uint64_t spinlock_acquire_irqsave(spinlock_t *lock);
+void spinlock_release_irqrestore(spinlock_t *lock, uint64_t flags);
+
+#ifdef CONFIG_LOCK_STAT
+// Visit every named lock that has been taken at least once. Locks are
+// never unlisted, so only name locks that live forever.
+void lockstat_for_each(void (*fn)(spinlock_t *lock, void *arg), void *arg);
+
+// Zero the counters of every listed lock
+void lockstat_reset(void);
+#endif
+
+// Register the lockstat shell command, which reports that statistics are
+// off when the kernel is built without LOCK_STAT
+void lockstat_init(void);
+
+#endif
@@ -5,6 +5,8 @@
 
 void *memset(void *ptr, int value, uint64_t num);
 void *memcpy(void *dest, const void *src, uint64_t num);
+void *memmove(void *dest, const void *src, uint64_t num);
+int memcmp(const void *ptr1, const void *ptr2, uint64_t num);
 int strlen(const char *str);
 int strcmp(const char *str1, const char *str2);
 int strncmp(const char *str1, const char *str2, uint64_t n);
@@ -12,4 +14,7 @@ char *strchr(const char *str, int c);
 char *strcpy(char *dest, const char *src);
 char *strncpy(char *dest, const char *src, uint64_t n);
 
+/* Picks the string routines for this CPU from CPUID; call once at boot */
+void string_init(void);
+
 #endif
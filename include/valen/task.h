@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <valen/rcu.h>
 
 // Process ID type
 typedef int pid_t;
@@ -23,6 +24,24 @@ typedef enum {
 #define TASK_UNINTERRUPTIBLE_FLAG 0x00000004
 #define TASK_ZOMBIE_FLAG    0x00000008
 
+// PIDs are 1 to PID_MAX - 1; 0 belongs to the idle tasks. A PID is
+// handed out again only once its previous task has been freed.
+#define PID_MAX 32768
+
+// Affinity mask allowing every CPU
+#define TASK_CPUS_ALL (~0ULL)
+
+// Priority levels: 0-99 are real-time, 100-139 map nice -20..19.
+// A lower value runs first.
+#define MAX_RT_PRIO 100
+#define MAX_PRIO 140
+#define DEFAULT_PRIO 120
+#define NICE_TO_PRIO(nice) (DEFAULT_PRIO + (nice))
+
+struct prio_array;
+struct fpu_state;
+struct addr_space;
+
 // Process context structure
 typedef struct task_context {
     uint64_t r15;
@@ -60,17 +79,37 @@ typedef struct task {
     int static_prio;
     int normal_prio;
     unsigned int rt_priority;
+    int cpu;        // Run queue the task belongs to
+    uint64_t cpus_allowed;  // Affinity mask, bit n set if CPU n may run the task
+    unsigned int time_slice;    // Timer ticks left before the task is preempted
+    struct prio_array *array;   // Priority array the task is queued on, or NULL
     
     // Task context
     task_context_t context;
     
+    // FPU/SSE state, allocated on first use (see fpu.h)
+    struct fpu_state *fpu_state;
+    int fpu_cpu;    // CPU whose registers last held that state, or -1
+    
     // Stack information
     void *stack;
     unsigned long stack_size;
+
+    // Own page tables, freed with the task; NULL runs in the kernel space
+    struct addr_space *mm;
     
-    // Linked list for runqueue
+    // Links in the FIFO of the task's priority level
     struct task *next;
     struct task *prev;
+
+    // Links in the list of all tasks, read under RCU
+    struct task *tasks_next;
+    struct task *tasks_prev;
+    rcu_head_t rcu;     // Frees the task once readers are done
+
+    // Chain of the task's PID hash bucket, read under RCU
+    struct task *pid_next;
+    struct task **pid_pprev;    // Link that points at this task
     
     // Task function
     void (*task_func)(void);
@@ -81,13 +120,16 @@ typedef struct task {
     
     // Flags
     unsigned int flags;
-} task_t;
 
-// Global current task
-extern task_t *current_task;
+    // Set by kill_task(); the task exits itself at its next safe point
+    volatile int kill_pending;
+    // Wait queue entries and timers linked from the task's own stack
+    int stack_links;
+} task_t;
 
 // Core task management functions
 task_t *task_create(void (*func)(void), const char *name);
+task_t *task_create_on(void (*func)(void), const char *name, uint64_t cpus_allowed);
 void task_exit(long exit_code);
 void schedule(void);
 void context_switch(task_t *prev, task_t *next);
@@ -97,7 +139,13 @@ extern void switch_to(task_context_t *prev, task_context_t *next);
 
 // Scheduler functions
 void scheduler_init(void);
+void scheduler_init_cpu(void);
+void cpu_idle(void) __attribute__((noreturn));
 void scheduler_tick(void);
+void preempt_schedule_irq(void);
+int task_wake(task_t *task);
+void task_sleep(uint64_t ms);
+void task_usleep(uint64_t us);
 void add_task_to_runqueue(task_t *task);
 void remove_task_from_runqueue(task_t *task);
 
@@ -107,5 +155,11 @@ pid_t get_current_pid(void);
 void yield(void);
 task_t *find_task_by_pid(pid_t pid);
 int kill_task(pid_t pid);
+int task_kill_pending(void);
+void task_check_kill(void);
+int task_set_affinity(task_t *task, uint64_t mask);
+int task_set_nice(task_t *task, int nice);
+int task_set_rt_priority(task_t *task, unsigned int rt_priority);
+void task_for_each(void (*fn)(task_t *task, void *arg), void *arg);
 
 #endif // VALEN_TASK_H
@@ -0,0 +1,79 @@
+/**
+ * @file timer.h
+ * @brief Kernel timers driven by one-shot clock event interrupts.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/** @brief Rate of the scheduler tick while a CPU has a task to run. */
+#define TIMER_HZ 50
+
+/** @brief Time units, in nanoseconds. */
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+/**
+ * @brief A one-shot timer. Embed it in the owning object or keep it on the
+ * stack while it is pending; the wheel only links it.
+ */
+typedef struct timer
+{
+    uint64_t expires;           /* timer_now() value at which the callback runs */
+    void (*func)(void *data);   /* Runs in softirq context */
+    void *data;
+    struct timer *next;
+    struct timer *prev;
+    int pending;
+    uint32_t cpu;               /* Wheel the timer is queued on */
+    uint32_t slot;              /* Level and slot within that wheel */
+} timer_t;
+
+/**
+ * @brief Picks the clock event device: the LAPIC timer in TSC-deadline mode
+ * if the CPU has it, otherwise PIT one-shots. Requires tsc_init() and, for
+ * the LAPIC timer, smp_init(). Each CPU sets up its LAPIC timer the first
+ * time it arms a deadline.
+ */
+void timer_init(void);
+
+/**
+ * @brief Returns non-zero if every CPU has its own clock event device, so
+ * a timer's callback runs on the CPU that armed it. Otherwise all timers
+ * run on the BSP.
+ */
+int timer_is_percpu(void);
+
+/**
+ * @brief Prepares a timer. Must be called before the first timer_add().
+ */
+void timer_setup(timer_t *timer, void (*func)(void *data), void *data);
+
+/**
+ * @brief Arms @p timer to fire once timer_now() reaches @p expires,
+ * re-arming it if pending. A deadline that has already passed fires at once.
+ */
+void timer_add(timer_t *timer, uint64_t expires);
+
+/**
+ * @brief Disarms a timer and waits for its callback if it is running.
+ * Must not be called from the timer's own callback.
+ * @return 1 if it was pending, 0 if it had already fired or was never armed.
+ */
+int timer_cancel(timer_t *timer);
+
+/**
+ * @brief Called from the clock event interrupt. Raises SOFTIRQ_TIMER, which
+ * runs the timers that are due and programs the next deadline.
+ */
+void timer_interrupt(void);
+
+/**
+ * @brief Nanoseconds since boot, read from the TSC.
+ */
+uint64_t timer_now(void);
+
+#endif
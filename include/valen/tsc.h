@@ -0,0 +1,32 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <stdint.h>
+
+/**
+ * @brief Measures the TSC frequency against PIT channel 2.
+ * Must run before the TSC is used for delays; it busy-waits for about 10ms.
+ */
+void tsc_init(void);
+
+/**
+ * @brief TSC ticks per millisecond, or 0 before tsc_init().
+ */
+uint64_t tsc_khz(void);
+
+/**
+ * @brief Busy-waits for at least @p us microseconds.
+ */
+void tsc_delay_us(uint64_t us);
+
+/**
+ * @brief Converts TSC cycles to nanoseconds. Returns 0 before tsc_init().
+ */
+uint64_t tsc_to_ns(uint64_t cycles);
+
+/**
+ * @brief Converts nanoseconds to TSC cycles. Returns 0 before tsc_init().
+ */
+uint64_t tsc_from_ns(uint64_t ns);
+
+#endif
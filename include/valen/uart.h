@@ -0,0 +1,40 @@
+/**
+ * @file uart.h
+ * @brief 16550 UART driver for the COM1 serial console.
+ */
+
+#ifndef UART_H
+#define UART_H
+
+#include <stddef.h>
+
+/** @brief Bytes of output buffered for the transmit interrupt; a power of two. */
+#define UART_TX_RING_SIZE 4096
+
+/**
+ * @brief Programs COM1 for 115200 8N1 with FIFOs enabled and installs its
+ * interrupt handler. Requires idt_init(). Output written before this is
+ * sent by polling.
+ */
+void uart_init(void);
+
+/**
+ * @brief Queues @p len bytes for transmission and returns. The THRE
+ * interrupt moves them to the FIFO. When the ring is full, or interrupts
+ * are not set up yet, the caller waits for the UART instead, so no output
+ * is dropped.
+ */
+void uart_write(const char *s, size_t len);
+
+/**
+ * @brief Sends everything queued by polling, without the interrupt. For
+ * panics, where interrupts may never come again.
+ */
+void uart_flush(void);
+
+/**
+ * @brief COM1 interrupt handler, called by uart_isr.
+ */
+void uart_handler(void);
+
+#endif
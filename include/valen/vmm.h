@@ -17,6 +17,16 @@
 #define PAGE_PCD (1ULL << 4)  /* Page-level Cache Disable (Required for MMIO) */
 #define PAGE_HUGE (1ULL << 7) /* PS bit for 2MB/1GB pages */
 
+/**
+ * @brief Demand paging counters.
+ */
+typedef struct vmm_fault_stats
+{
+    uint64_t faults;         /* Pages backed on first touch */
+    uint64_t misses;         /* Faults that had to allocate from the PMM */
+    uint64_t reserved_pages; /* Pages in vmm_reserve() ranges, backed or not */
+} vmm_fault_stats_t;
+
 /**
  * @brief Initializes the VMM and sets up initial kernel paging.
  */
@@ -27,13 +37,16 @@ void vmm_init();
  * @param virt The destination virtual address.
  * @param phys The source physical address.
  * @param flags Architectural flags (PRESENT | WRITE | PCD etc).
+ * @return 0 on success, -1 if a page table could not be allocated.
  */
-void vmm_map(uintptr_t virt, uintptr_t phys, uint64_t flags);
+int vmm_map(uintptr_t virt, uintptr_t phys, uint64_t flags);
 
 /**
  * @brief Maps a contiguous range of memory.
+ * @return 0 on success, or -1 if a page table could not be allocated, in
+ *         which case none of the range is left mapped.
  */
-void vmm_map_range(uintptr_t virt, uintptr_t phys, uint64_t size, uint64_t flags);
+int vmm_map_range(uintptr_t virt, uintptr_t phys, uint64_t size, uint64_t flags);
 
 /**
  * @brief Translates virtual pointers to physical addresses for hardware/DMA.
@@ -45,4 +58,57 @@ uintptr_t vmm_get_phys(uintptr_t virtual_addr);
  */
 void *vmm_alloc(uint64_t pages, uint64_t flags);
 
+/**
+ * @brief Unmaps memory returned by vmm_alloc() and frees its frames.
+ * @param addr  Start of the allocation.
+ * @param pages The page count passed to vmm_alloc().
+ */
+void vmm_free(void *addr, uint64_t pages);
+
+/**
+ * @brief Reserves kernel virtual memory that is backed on first touch,
+ * between two unmapped guard pages. Reads as zero. Free with vmm_free().
+ * Faults take frames only from a small per-CPU reserve, see vmm.c.
+ */
+void *vmm_reserve(uint64_t pages);
+
+/**
+ * @brief Backs @p pages of a vmm_reserve() range at @p addr right away.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int vmm_populate(void *addr, uint64_t pages);
+
+/** @brief Zeroed frames each CPU keeps for the page fault handler. */
+#define VMM_FAULT_RESERVE_PAGES 8
+
+/**
+ * @brief Tops up this CPU's reserve of frames for the page fault handler.
+ * Called on every task switch. Must not be called from interrupt context.
+ */
+void vmm_fault_refill(void);
+
+/** @brief vmm_handle_fault(): demand-backed page, but no frame left to back it. */
+#define VMM_FAULT_NO_RESERVE (-2)
+
+/**
+ * @brief Called by the page fault handler. Takes no lock.
+ * @return 0 if the page was backed and the access can be retried,
+ * VMM_FAULT_NO_RESERVE if this CPU's reserve is empty, -1 otherwise.
+ */
+int vmm_handle_fault(uintptr_t addr, uint64_t error_code);
+
+/**
+ * @brief Non-zero if @p addr is a guard page next to a vmm_reserve() range.
+ */
+int vmm_is_guard_page(uintptr_t addr);
+
+void vmm_get_fault_stats(vmm_fault_stats_t *stats);
+
+/**
+ * @brief Maps MMIO registers uncached into the kernel window.
+ * Such mappings are permanent and must not be passed to vmm_free().
+ * @return The virtual address corresponding to @p phys, or NULL.
+ */
+void *vmm_map_mmio(uintptr_t phys, uint64_t size);
+
 #endif
\ No newline at end of file
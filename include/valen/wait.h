@@ -0,0 +1,58 @@
+#ifndef VALEN_WAIT_H
+#define VALEN_WAIT_H
+
+#include <stddef.h>
+#include <valen/spinlock.h>
+#include <valen/task.h>
+
+// A task waiting on a queue; lives on the waiter's stack
+typedef struct wait_queue_entry {
+    task_t *task;
+    struct wait_queue_entry *next;
+    struct wait_queue_entry *prev;
+} wait_queue_entry_t;
+
+// List of tasks sleeping until some condition becomes true
+typedef struct wait_queue {
+    spinlock_t lock;
+    wait_queue_entry_t *head;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL }
+
+void wait_queue_init(wait_queue_t *wq);
+
+// Queue the current task on wq and mark it sleeping; schedule() then
+// takes it off its runqueue unless a wake_up() came in between
+void prepare_to_wait(wait_queue_t *wq, wait_queue_entry_t *entry);
+
+// Mark the current task running again and leave wq
+void finish_wait(wait_queue_t *wq, wait_queue_entry_t *entry);
+
+// Wake every task waiting on wq. Safe to call from interrupt handlers.
+void wake_up(wait_queue_t *wq);
+
+/*
+ * Sleep until condition is true. The condition is re-checked after the
+ * task is queued and marked sleeping, so a wake_up() that races with the
+ * check is never lost. A task that kill_task() has marked leaves the
+ * queue and exits here instead of returning.
+ */
+#define wait_event(wq, condition)                   \
+    do {                                            \
+        if (condition)                              \
+            break;                                  \
+        wait_queue_entry_t __wait = { 0 };          \
+        for (;;) {                                  \
+            prepare_to_wait(&(wq), &__wait);        \
+            if (condition)                          \
+                break;                              \
+            if (task_kill_pending())                \
+                break;                              \
+            schedule();                             \
+        }                                           \
+        finish_wait(&(wq), &__wait);                \
+        task_check_kill();                          \
+    } while (0)
+
+#endif // VALEN_WAIT_H
@@ -0,0 +1,158 @@
+#include <valen/bench.h>
+#include <valen/stdio.h>
+#include <valen/string.h>
+#include <valen/tsc.h>
+#include <valen/smp.h>
+#include <valen/shell.h>
+
+#define LINE_MAX 128
+
+typedef struct bench_suite {
+    const char *name;
+    void (*run)(void);
+} bench_suite_t;
+
+static const bench_suite_t suites[] = {
+    { "sched", bench_sched },
+    { "mm", bench_mm },
+    { NULL, NULL }
+};
+
+// Line building; there is no snprintf, and printf() does not reach COM1
+static char *append_str(char *p, char *end, const char *s) {
+    while (*s && p < end) *p++ = *s++;
+    return p;
+}
+
+static char *append_uint(char *p, char *end, uint64_t n) {
+    char digits[20];
+    int len = 0;
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (len && p < end) *p++ = digits[--len];
+    return p;
+}
+
+void bench_print(const char *line) {
+    puts(line);
+    serial_write((char *)line);
+}
+
+// Shell sort: no recursion on a kernel stack, and fast enough for the
+// few thousand samples a measurement takes
+static void sort_samples(uint64_t *v, uint32_t count) {
+    for (uint32_t gap = count / 2; gap; gap /= 2) {
+        for (uint32_t i = gap; i < count; i++) {
+            uint64_t x = v[i];
+            uint32_t j = i;
+            for (; j >= gap && v[j - gap] > x; j -= gap) {
+                v[j] = v[j - gap];
+            }
+            v[j] = x;
+        }
+    }
+}
+
+void bench_report(const char *name, uint64_t *samples, uint32_t count, uint32_t failures) {
+    if (!count) {
+        bench_skip(name, failures ? "every attempt failed" : "no samples");
+        return;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        total += samples[i];
+    }
+    sort_samples(samples, count);
+
+    char line[LINE_MAX];
+    char *p = line, *end = line + LINE_MAX - 2;
+    p = append_str(p, end, "BENCH ");
+    p = append_str(p, end, name);
+    p = append_str(p, end, " min=");
+    p = append_uint(p, end, samples[0]);
+    p = append_str(p, end, " median=");
+    p = append_uint(p, end, samples[count / 2]);
+    p = append_str(p, end, " p99=");
+    p = append_uint(p, end, samples[(uint64_t)count * 99 / 100]);
+    p = append_str(p, end, " avg=");
+    p = append_uint(p, end, total / count);
+    p = append_str(p, end, " n=");
+    p = append_uint(p, end, count);
+    p = append_str(p, end, " fail=");
+    p = append_uint(p, end, failures);
+    p = append_str(p, end, " cycles");
+    *p++ = '\n';
+    *p = '\0';
+    bench_print(line);
+}
+
+void bench_skip(const char *name, const char *why) {
+    char line[LINE_MAX];
+    char *p = line, *end = line + LINE_MAX - 2;
+    p = append_str(p, end, "BENCH ");
+    p = append_str(p, end, name);
+    p = append_str(p, end, " skipped (");
+    p = append_str(p, end, why);
+    p = append_str(p, end, ")");
+    *p++ = '\n';
+    *p = '\0';
+    bench_print(line);
+}
+
+static void run_suite(const bench_suite_t *suite) {
+    char line[LINE_MAX];
+    char *p = line, *end = line + LINE_MAX - 2;
+    p = append_str(p, end, "BENCH begin ");
+    p = append_str(p, end, suite->name);
+    p = append_str(p, end, " cpus=");
+    p = append_uint(p, end, smp_cpu_count());
+    p = append_str(p, end, " tsc_khz=");
+    p = append_uint(p, end, tsc_khz());
+    *p++ = '\n';
+    *p = '\0';
+    bench_print(line);
+
+    suite->run();
+
+    p = append_str(line, end, "BENCH end ");
+    p = append_str(p, end, suite->name);
+    *p++ = '\n';
+    *p = '\0';
+    bench_print(line);
+}
+
+/**
+ * @brief Run the suite called @p suite, or all of them for "all"
+ */
+int bench_run(const char *suite) {
+    int all = strcmp(suite, "all") == 0;
+    int found = 0;
+
+    for (const bench_suite_t *s = suites; s->name; s++) {
+        if (all || strcmp(suite, s->name) == 0) {
+            run_suite(s);
+            found = 1;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+static void cmd_bench(const char *arg) {
+    const char *suite = strlen(arg) ? arg : "all";
+
+    if (bench_run(suite) < 0) {
+        printf("Error: Unknown benchmark suite '%s'.\n", suite);
+        puts("Usage: bench [sched|mm|all]\n");
+    }
+}
+
+static shell_command_t bench_command = {
+    "bench", cmd_bench, "Run benchmarks (usage: bench [sched|mm|all])"
+};
+
+void bench_init(void) {
+    shell_register(&bench_command);
+}
@@ -0,0 +1,345 @@
+#include <valen/bench.h>
+#include <valen/pmm.h>
+#include <valen/vmm.h>
+#include <valen/heap.h>
+#include <valen/string.h>
+
+/*
+ * Allocator benchmarks. Sizes and free orders come from a fixed-seed
+ * xorshift generator, so every run issues the same sequence of requests
+ * and results stay comparable between builds.
+ */
+#define PAGE_SAMPLES 4096
+#define BLOCK_SAMPLES 1024
+#define FRAG_PAGES 2048
+#define VMM_SAMPLES 512
+#define CHURN_SLOTS 512
+#define CHURN_OPS 8192
+#define FRAG_BLOCKS 2048
+#define STRING_SAMPLES 1024
+
+static uint64_t rng_state;
+
+// Blocks held across a fragmented measurement; too big for a task stack
+static void *batch[BLOCK_SAMPLES / 4];
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint64_t rng_range(uint64_t lo, uint64_t hi) {
+    return lo + rng_next() % (hi - lo + 1);
+}
+
+// Heap request sizes: mostly small objects, some buffers, a few large
+// allocations that take the whole-page path
+static uint64_t mixed_size(void) {
+    uint64_t pick = rng_next() % 100;
+    if (pick < 70) return rng_range(16, 128);
+    if (pick < 95) return rng_range(256, 2048);
+    return rng_range(4096, 32768);
+}
+
+// Samples and pointers for one measurement
+typedef struct bench_buf {
+    uint64_t *alloc;
+    uint64_t *free;
+    void **ptrs;
+    uint64_t *sizes;
+    uint32_t allocs, frees, failures;
+} bench_buf_t;
+
+static int buf_get(bench_buf_t *buf, uint32_t count, const char *name) {
+    buf->alloc = malloc(count * sizeof(uint64_t));
+    buf->free = malloc(count * sizeof(uint64_t));
+    buf->ptrs = malloc(count * sizeof(void *));
+    buf->sizes = malloc(count * sizeof(uint64_t));
+    buf->allocs = buf->frees = buf->failures = 0;
+
+    if (!buf->alloc || !buf->free || !buf->ptrs || !buf->sizes) {
+        free(buf->alloc);
+        free(buf->free);
+        free(buf->ptrs);
+        free(buf->sizes);
+        bench_skip(name, "out of memory");
+        return -1;
+    }
+    return 0;
+}
+
+static void buf_put(bench_buf_t *buf) {
+    free(buf->sizes);
+    free(buf->ptrs);
+    free(buf->free);
+    free(buf->alloc);
+}
+
+// Single pages, freed in the order they were allocated
+static void bench_pmm_page(void) {
+    bench_buf_t buf;
+    if (buf_get(&buf, PAGE_SAMPLES, "mm.pmm_alloc_page") < 0) return;
+
+    uint32_t got = 0;
+    for (uint32_t i = 0; i < PAGE_SAMPLES; i++) {
+        uint64_t start = bench_tsc();
+        void *page = pmm_alloc_page();
+        uint64_t end = bench_tsc();
+        if (!page) {
+            buf.failures++;
+            continue;
+        }
+        buf.alloc[buf.allocs++] = end - start;
+        buf.ptrs[got++] = page;
+    }
+
+    for (uint32_t i = 0; i < got; i++) {
+        uint64_t start = bench_tsc();
+        pmm_free_page(buf.ptrs[i]);
+        buf.free[buf.frees++] = bench_tsc() - start;
+    }
+
+    bench_report("mm.pmm_alloc_page", buf.alloc, buf.allocs, buf.failures);
+    bench_report("mm.pmm_free_page", buf.free, buf.frees, 0);
+    buf_put(&buf);
+}
+
+// Runs of 1 to 64 pages, freed in random order
+static void bench_pmm_pages(void) {
+    bench_buf_t buf;
+    if (buf_get(&buf, BLOCK_SAMPLES, "mm.pmm_alloc_pages") < 0) return;
+
+    uint32_t got = 0;
+    for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+        uint64_t count = 1ULL << rng_range(0, 6);
+        uint64_t start = bench_tsc();
+        void *pages = pmm_alloc_pages(count);
+        uint64_t end = bench_tsc();
+        if (!pages) {
+            buf.failures++;
+            continue;
+        }
+        buf.alloc[buf.allocs++] = end - start;
+        buf.ptrs[got] = pages;
+        buf.sizes[got++] = count;
+    }
+
+    while (got) {
+        uint32_t i = rng_next() % got;
+        uint64_t start = bench_tsc();
+        pmm_free_pages(buf.ptrs[i], buf.sizes[i]);
+        buf.free[buf.frees++] = bench_tsc() - start;
+
+        got--;
+        buf.ptrs[i] = buf.ptrs[got];
+        buf.sizes[i] = buf.sizes[got];
+    }
+
+    bench_report("mm.pmm_alloc_pages", buf.alloc, buf.allocs, buf.failures);
+    bench_report("mm.pmm_free_pages", buf.free, buf.frees, 0);
+    buf_put(&buf);
+}
+
+// Eight-page runs while every other frame of a large stretch is held, so
+// the freed holes are all too small to serve them
+static void bench_pmm_fragmented(void) {
+    bench_buf_t buf;
+    if (buf_get(&buf, FRAG_PAGES, "mm.pmm_alloc_pages.fragmented") < 0) return;
+
+    uint32_t held = 0;
+    for (uint32_t i = 0; i < FRAG_PAGES; i++) {
+        void *page = pmm_alloc_page();
+        if (page) buf.ptrs[held++] = page;
+    }
+    for (uint32_t i = 0; i < held; i += 2) {
+        pmm_free_page(buf.ptrs[i]);
+    }
+
+    uint32_t got = 0;
+    for (uint32_t i = 0; i < sizeof(batch) / sizeof(batch[0]); i++) {
+        uint64_t start = bench_tsc();
+        void *pages = pmm_alloc_pages(8);
+        uint64_t end = bench_tsc();
+        if (!pages) {
+            buf.failures++;
+            continue;
+        }
+        buf.alloc[buf.allocs++] = end - start;
+        batch[got++] = pages;
+    }
+
+    for (uint32_t i = 0; i < got; i++) {
+        pmm_free_pages(batch[i], 8);
+    }
+    for (uint32_t i = 1; i < held; i += 2) {
+        pmm_free_page(buf.ptrs[i]);
+    }
+
+    bench_report("mm.pmm_alloc_pages.fragmented", buf.alloc, buf.allocs, buf.failures);
+    buf_put(&buf);
+}
+
+// Mapped ranges of 1 to 16 pages, freed newest first
+static void bench_vmm(void) {
+    bench_buf_t buf;
+    if (buf_get(&buf, VMM_SAMPLES, "mm.vmm_alloc") < 0) return;
+
+    uint32_t got = 0;
+    for (uint32_t i = 0; i < VMM_SAMPLES; i++) {
+        uint64_t pages = 1ULL << rng_range(0, 4);
+        uint64_t start = bench_tsc();
+        void *addr = vmm_alloc(pages, PAGE_PRESENT | PAGE_WRITE);
+        uint64_t end = bench_tsc();
+        if (!addr) {
+            buf.failures++;
+            continue;
+        }
+        buf.alloc[buf.allocs++] = end - start;
+        buf.ptrs[got] = addr;
+        buf.sizes[got++] = pages;
+    }
+
+    while (got--) {
+        uint64_t start = bench_tsc();
+        vmm_free(buf.ptrs[got], buf.sizes[got]);
+        buf.free[buf.frees++] = bench_tsc() - start;
+    }
+
+    bench_report("mm.vmm_alloc", buf.alloc, buf.allocs, buf.failures);
+    bench_report("mm.vmm_free", buf.free, buf.frees, 0);
+    buf_put(&buf);
+}
+
+// Random churn over a fixed set of slots: each step frees a live block or
+// allocates one of a mixed size, so free space ends up scattered
+static void bench_heap_mixed(void) {
+    bench_buf_t buf;
+    if (buf_get(&buf, CHURN_OPS, "mm.malloc.mixed") < 0) return;
+
+    void **slots = buf.ptrs;
+    for (uint32_t i = 0; i < CHURN_SLOTS; i++) {
+        slots[i] = NULL;
+    }
+
+    for (uint32_t op = 0; op < CHURN_OPS; op++) {
+        uint32_t slot = rng_next() % CHURN_SLOTS;
+
+        if (slots[slot]) {
+            uint64_t start = bench_tsc();
+            free(slots[slot]);
+            buf.free[buf.frees++] = bench_tsc() - start;
+            slots[slot] = NULL;
+            continue;
+        }
+
+        uint64_t size = mixed_size();
+        uint64_t start = bench_tsc();
+        slots[slot] = malloc(size);
+        uint64_t end = bench_tsc();
+        if (!slots[slot]) {
+            buf.failures++;
+            continue;
+        }
+        buf.alloc[buf.allocs++] = end - start;
+    }
+
+    for (uint32_t i = 0; i < CHURN_SLOTS; i++) {
+        free(slots[i]);
+    }
+
+    bench_report("mm.malloc.mixed", buf.alloc, buf.allocs, buf.failures);
+    bench_report("mm.free.mixed", buf.free, buf.frees, 0);
+    buf_put(&buf);
+}
+
+// Requests that fit none of the many small holes left by freeing every
+// other small block, so each one searches past all of them
+static void bench_heap_fragmented(void) {
+    bench_buf_t buf;
+    if (buf_get(&buf, FRAG_BLOCKS, "mm.malloc.fragmented") < 0) return;
+
+    uint32_t held = 0;
+    for (uint32_t i = 0; i < FRAG_BLOCKS; i++) {
+        void *block = malloc(64);
+        if (block) buf.ptrs[held++] = block;
+    }
+    for (uint32_t i = 0; i < held; i += 2) {
+        free(buf.ptrs[i]);
+    }
+
+    uint32_t got = 0;
+    for (uint32_t i = 0; i < sizeof(batch) / sizeof(batch[0]); i++) {
+        uint64_t start = bench_tsc();
+        void *block = malloc(256);
+        uint64_t end = bench_tsc();
+        if (!block) {
+            buf.failures++;
+            continue;
+        }
+        buf.alloc[buf.allocs++] = end - start;
+        batch[got++] = block;
+    }
+
+    for (uint32_t i = 0; i < got; i++) {
+        free(batch[i]);
+    }
+    for (uint32_t i = 1; i < held; i += 2) {
+        free(buf.ptrs[i]);
+    }
+
+    bench_report("mm.malloc.fragmented", buf.alloc, buf.allocs, buf.failures);
+    buf_put(&buf);
+}
+
+// memset() and memcpy() on a page and on a small object, both cache-hot
+static void bench_string(void) {
+    static const struct { const char *set, *copy; uint64_t size; } sizes[] = {
+        { "mm.memset.4096", "mm.memcpy.4096", 4096 },
+        { "mm.memset.64", "mm.memcpy.64", 64 },
+    };
+
+    uint64_t *samples = malloc(STRING_SAMPLES * sizeof(uint64_t));
+    uint8_t *src = malloc(4096);
+    uint8_t *dst = malloc(4096);
+    if (!samples || !src || !dst) {
+        free(samples);
+        free(src);
+        free(dst);
+        bench_skip("mm.memset", "out of memory");
+        return;
+    }
+
+    for (uint32_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        for (uint32_t i = 0; i < STRING_SAMPLES; i++) {
+            uint64_t start = bench_tsc();
+            memset(dst, (int)i, sizes[n].size);
+            samples[i] = bench_tsc() - start;
+        }
+        bench_report(sizes[n].set, samples, STRING_SAMPLES, 0);
+
+        for (uint32_t i = 0; i < STRING_SAMPLES; i++) {
+            uint64_t start = bench_tsc();
+            memcpy(dst, src, sizes[n].size);
+            samples[i] = bench_tsc() - start;
+        }
+        bench_report(sizes[n].copy, samples, STRING_SAMPLES, 0);
+    }
+
+    free(dst);
+    free(src);
+    free(samples);
+}
+
+void bench_mm(void) {
+    rng_state = 0x9E3779B97F4A7C15ULL;
+
+    bench_pmm_page();
+    bench_pmm_pages();
+    bench_pmm_fragmented();
+    bench_vmm();
+    bench_heap_mixed();
+    bench_heap_fragmented();
+    bench_string();
+}
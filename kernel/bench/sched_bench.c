@@ -0,0 +1,308 @@
+#include <valen/bench.h>
+#include <valen/task.h>
+#include <valen/wait.h>
+#include <valen/heap.h>
+#include <valen/percpu.h>
+#include <valen/cpu.h>
+#include <valen/rcu.h>
+
+/*
+ * Scheduler benchmarks. The benchmark task pins itself to the CPU it
+ * starts on and, while it measures schedule() and task creation, runs as
+ * a real-time task so that the tasks it queues behind itself never get to
+ * run and disturb the measurement.
+ */
+#define SWITCH_SAMPLES 10000
+#define SCHED_SAMPLES 10000
+#define SPAWN_BATCH 32
+#define SPAWN_ROUNDS 16
+#define WAKE_SAMPLES 1000
+#define PEER_STACK_SIZE 4096
+#define BENCH_RT_PRIO 50
+
+static const struct {
+    int runnable;
+    const char *name;
+} schedule_runs[] = {
+    { 1, "sched.schedule.n1" },
+    { 8, "sched.schedule.n8" },
+    { 64, "sched.schedule.n64" },
+};
+
+// switch_to() round trip: a bare context, not a task, that bounces
+// straight back to the benchmark
+static task_context_t bench_ctx, peer_ctx;
+
+static void switch_peer(void) {
+    for (;;) {
+        switch_to(&peer_ctx, &bench_ctx);
+    }
+}
+
+static void bench_switch_to(void) {
+    uint64_t *samples = malloc(SWITCH_SAMPLES * sizeof(uint64_t));
+    uint8_t *stack = malloc(PEER_STACK_SIZE);
+    if (!samples || !stack) {
+        bench_skip("sched.switch_to", "out of memory");
+        free(samples);
+        free(stack);
+        return;
+    }
+
+    // Same layout task_create() builds: six callee-saved registers, then
+    // the return address and a fake one above it
+    uint64_t *top = (uint64_t *)(((uint64_t)stack + PEER_STACK_SIZE) & ~0xFULL);
+    *--top = 0;
+    *--top = (uint64_t)switch_peer;
+    for (int i = 0; i < 6; i++) {
+        *--top = 0;
+    }
+    peer_ctx.rsp = (uint64_t)top;
+
+    // The peer is no task, so nothing may schedule while it runs
+    uint64_t flags = irq_save();
+    switch_to(&bench_ctx, &peer_ctx);  // Warm up and park the peer in its loop
+    for (int i = 0; i < SWITCH_SAMPLES; i++) {
+        uint64_t start = bench_tsc();
+        switch_to(&bench_ctx, &peer_ctx);
+        samples[i] = bench_tsc() - start;
+    }
+    irq_restore(flags);
+
+    bench_report("sched.switch_to", samples, SWITCH_SAMPLES, 0);
+    free(stack);
+    free(samples);
+}
+
+static void bench_spinner(void) {
+    for (;;) {
+        yield();
+    }
+}
+
+static int spawn_spinners(task_t **tasks, int count, uint64_t mask) {
+    for (int i = 0; i < count; i++) {
+        tasks[i] = task_create_on(bench_spinner, "bench-spin", mask);
+        if (!tasks[i]) {
+            return i;
+        }
+        task_set_nice(tasks[i], 19);
+    }
+    return count;
+}
+
+// A killed task only exits once it next runs, which the benchmark's
+// real-time priority holds off; sleep until every one of them has
+static void wait_for_exit(const pid_t *pids, int count) {
+    for (int i = 0; i < count; i++) {
+        for (;;) {
+            rcu_read_lock();
+            int alive = find_task_by_pid(pids[i]) != NULL;
+            rcu_read_unlock();
+            if (!alive) break;
+            task_sleep(1);
+        }
+    }
+}
+
+static void reap_spinners(task_t **tasks, int count) {
+    pid_t pids[64];
+    for (int i = 0; i < count; i++) {
+        pids[i] = tasks[i]->pid;
+        kill_task(pids[i]);
+    }
+    wait_for_exit(pids, count);
+}
+
+// Cost of a schedule() that picks the benchmark again, with N runnable
+// tasks queued behind it
+static void bench_schedule(uint64_t mask) {
+    uint64_t *samples = malloc(SCHED_SAMPLES * sizeof(uint64_t));
+    task_t **tasks = malloc(64 * sizeof(task_t *));
+    if (!samples || !tasks) {
+        bench_skip("sched.schedule", "out of memory");
+        free(samples);
+        free(tasks);
+        return;
+    }
+
+    for (unsigned int r = 0; r < sizeof(schedule_runs) / sizeof(schedule_runs[0]); r++) {
+        int want = schedule_runs[r].runnable;
+        int made = spawn_spinners(tasks, want, mask);
+        if (made < want) {
+            reap_spinners(tasks, made);
+            bench_skip(schedule_runs[r].name, "task_create failed");
+            continue;
+        }
+
+        for (int i = 0; i < SCHED_SAMPLES; i++) {
+            uint64_t start = bench_tsc();
+            schedule();
+            samples[i] = bench_tsc() - start;
+        }
+
+        reap_spinners(tasks, made);
+        bench_report(schedule_runs[r].name, samples, SCHED_SAMPLES, 0);
+    }
+
+    free(tasks);
+    free(samples);
+}
+
+// task_create() and kill_task() throughput, timed per call in batches
+// so the runqueue never grows past SPAWN_BATCH extra tasks
+static void bench_spawn(uint64_t mask) {
+    uint32_t total = SPAWN_BATCH * SPAWN_ROUNDS;
+    uint64_t *create = malloc(total * sizeof(uint64_t));
+    uint64_t *kill = malloc(total * sizeof(uint64_t));
+    if (!create || !kill) {
+        bench_skip("sched.task_create", "out of memory");
+        free(create);
+        free(kill);
+        return;
+    }
+
+    task_t *tasks[SPAWN_BATCH];
+    pid_t pids[SPAWN_BATCH];
+    uint32_t created = 0, killed = 0;
+
+    for (int r = 0; r < SPAWN_ROUNDS; r++) {
+        int made = 0;
+        for (; made < SPAWN_BATCH; made++) {
+            uint64_t start = bench_tsc();
+            tasks[made] = task_create_on(bench_spinner, "bench-spin", mask);
+            uint64_t end = bench_tsc();
+            if (!tasks[made]) {
+                break;
+            }
+            create[created++] = end - start;
+        }
+
+        for (int i = 0; i < made; i++) {
+            pids[i] = tasks[i]->pid;
+            uint64_t start = bench_tsc();
+            kill_task(pids[i]);
+            kill[killed++] = bench_tsc() - start;
+        }
+        wait_for_exit(pids, made);
+
+        if (made < SPAWN_BATCH) {
+            break;
+        }
+    }
+
+    bench_report("sched.task_create", create, created, created < total);
+    bench_report("sched.kill_task", kill, killed, 0);
+    free(kill);
+    free(create);
+}
+
+// Wakeup-to-run latency: from wake_up() to the first instruction the
+// woken task runs after its wait_event()
+static wait_queue_t wake_wait = WAIT_QUEUE_INIT;
+static volatile uint64_t wake_seq, seen_seq, woke_tsc;
+static volatile int wake_stop, wake_done;
+
+static void bench_sleeper(void) {
+    for (;;) {
+        wait_event(wake_wait, wake_seq != seen_seq);
+        woke_tsc = bench_tsc();
+        if (wake_stop) {
+            break;
+        }
+        seen_seq = wake_seq;
+    }
+    wake_done = 1;
+}
+
+// Let the sleeper run: on our CPU it needs us to switch away, elsewhere
+// we just wait for it
+static void wake_wait_step(int local) {
+    if (local) {
+        schedule();
+    } else {
+        cpu_relax();
+    }
+}
+
+static void bench_wakeup(const char *name, int cpu, int local) {
+    uint64_t *samples = malloc(WAKE_SAMPLES * sizeof(uint64_t));
+    if (!samples) {
+        bench_skip(name, "out of memory");
+        return;
+    }
+
+    wake_seq = seen_seq = 0;
+    wake_stop = wake_done = 0;
+
+    task_t *sleeper = task_create_on(bench_sleeper, "bench-wake", 1ULL << cpu);
+    if (!sleeper) {
+        bench_skip(name, "task_create failed");
+        free(samples);
+        return;
+    }
+    task_set_nice(sleeper, -20);
+
+    for (int i = 0; i < WAKE_SAMPLES; i++) {
+        // Only time wakeups of a task that is fully asleep, off its runqueue
+        while (sleeper->state != TASK_INTERRUPTIBLE || sleeper->array) {
+            wake_wait_step(local);
+        }
+
+        uint64_t start = bench_tsc();
+        wake_seq++;
+        wake_up(&wake_wait);
+        yield();  // The sleeper outranks us, so a local wakeup switches here
+
+        while (seen_seq != wake_seq) {
+            wake_wait_step(local);
+        }
+        // TSCs of different CPUs may be slightly apart
+        samples[i] = woke_tsc > start ? woke_tsc - start : 0;
+    }
+
+    wake_stop = 1;
+    wake_seq++;
+    wake_up(&wake_wait);
+    while (!wake_done) {
+        wake_wait_step(local);
+    }
+
+    bench_report(name, samples, WAKE_SAMPLES, 0);
+    free(samples);
+}
+
+void bench_sched(void) {
+    task_t *self = this_cpu_current();
+    uint64_t saved_mask = self->cpus_allowed;
+
+    // Pin to the CPU we are on; yield() completes a pending move
+    int cpu = this_cpu_id();
+    uint64_t mask = 1ULL << cpu;
+    task_set_affinity(self, mask);
+    yield();
+
+    bench_switch_to();
+
+    task_set_rt_priority(self, BENCH_RT_PRIO);
+    bench_schedule(mask);
+    bench_spawn(mask);
+    task_set_rt_priority(self, 0);
+
+    bench_wakeup("sched.wakeup_local", cpu, 1);
+
+    int remote = -1;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (i != cpu && cpu_locals[i].online) {
+            remote = i;
+            break;
+        }
+    }
+    if (remote < 0) {
+        bench_skip("sched.wakeup_remote", "one CPU");
+    } else {
+        bench_wakeup("sched.wakeup_remote", remote, 0);
+    }
+
+    task_set_affinity(self, saved_mask);
+}
@@ -0,0 +1,309 @@
+#include <valen/block.h>
+#include <valen/pmm.h>
+#include <valen/klog.h>
+#include <valen/task.h>
+#include <valen/stdio.h>
+#include <valen/shell.h>
+
+/*
+ * Every buffer is on the LRU list and, once it has held a block, on one
+ * hash chain. A lookup that hits moves the buffer to the front of the
+ * LRU; a miss reuses the rearmost buffer nobody holds, writing it back
+ * first if it is dirty. Dirty data otherwise stays in memory until
+ * kflushd's periodic bcache_sync(), which queues every dirty buffer at
+ * once so the elevator can merge neighbours into large writes.
+ *
+ * The cache lock is only taken from tasks and never held across I/O.
+ * Buffer flags also change from the completion path, so they are always
+ * updated atomically. A buffer written while its writeback is in flight
+ * is simply marked dirty again and goes out with the next sync.
+ */
+
+#define BCACHE_HASH 128
+
+static buffer_t buffers[BCACHE_BUFFERS];
+static buffer_t *hash[BCACHE_HASH];
+static buffer_t lru;                // Sentinel: lru.lru_next is the most recent
+static spinlock_t bcache_lock = SPINLOCK_INIT_NAMED("bcache");
+static uint32_t buffer_count;
+static uint64_t hits, misses, writebacks;
+
+static uint32_t hash_of(block_device_t *dev, uint64_t block) {
+    uint64_t key = block ^ ((uint64_t)dev >> 6);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) % BCACHE_HASH;
+}
+
+static buffer_t *lookup(block_device_t *dev, uint64_t block) {
+    for (buffer_t *buf = hash[hash_of(dev, block)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->block == block)
+            return buf;
+    }
+    return NULL;
+}
+
+static void unhash(buffer_t *buf) {
+    if (!buf->dev)
+        return;
+    buffer_t **link = &hash[hash_of(buf->dev, buf->block)];
+    while (*link != buf)
+        link = &(*link)->hash_next;
+    *link = buf->hash_next;
+}
+
+static void lru_remove(buffer_t *buf) {
+    buf->lru_prev->lru_next = buf->lru_next;
+    buf->lru_next->lru_prev = buf->lru_prev;
+}
+
+static void lru_push(buffer_t *buf) {
+    buf->lru_next = lru.lru_next;
+    buf->lru_prev = &lru;
+    lru.lru_next->lru_prev = buf;
+    lru.lru_next = buf;
+}
+
+static void lru_touch(buffer_t *buf) {
+    lru_remove(buf);
+    lru_push(buf);
+}
+
+static void set_flags(buffer_t *buf, uint32_t bits) {
+    __atomic_fetch_or(&buf->flags, bits, __ATOMIC_SEQ_CST);
+}
+
+static void clear_flags(buffer_t *buf, uint32_t bits) {
+    __atomic_fetch_and(&buf->flags, ~bits, __ATOMIC_SEQ_CST);
+}
+
+// Rearmost buffer that nobody holds and no I/O uses
+static buffer_t *find_victim(void) {
+    for (buffer_t *buf = lru.lru_prev; buf != &lru; buf = buf->lru_prev) {
+        if (buf->refcount == 0 && !(buf->flags & B_BUSY))
+            return buf;
+    }
+    return NULL;
+}
+
+// Write one buffer the caller has pinned and marked busy, then unpin it
+static int write_back(buffer_t *buf) {
+    blk_submit(buf, 1);
+    int err = blk_wait_buffer(buf);
+
+    spinlock_acquire(&bcache_lock);
+    if (err)
+        set_flags(buf, B_DIRTY);
+    else
+        writebacks++;
+    buf->refcount--;
+    spinlock_release(&bcache_lock);
+    return err;
+}
+
+buffer_t *bcache_read(block_device_t *dev, uint64_t block) {
+    if (block >= dev->blocks)
+        return NULL;
+
+    for (;;) {
+        spinlock_acquire(&bcache_lock);
+
+        buffer_t *buf = lookup(dev, block);
+        if (buf) {
+            buf->refcount++;
+            lru_touch(buf);
+            hits++;
+
+            // A hit on a block whose last read failed tries again
+            int reread = !(buf->flags & (B_UPTODATE | B_BUSY));
+            if (reread)
+                set_flags(buf, B_BUSY);
+            spinlock_release(&bcache_lock);
+
+            if (reread)
+                blk_submit(buf, 0);
+            if (blk_wait_buffer(buf) < 0 || !(buf->flags & B_UPTODATE)) {
+                bcache_release(buf);
+                return NULL;
+            }
+            return buf;
+        }
+
+        buf = find_victim();
+        if (!buf) {
+            spinlock_release(&bcache_lock);
+            return NULL;
+        }
+
+        if (buf->flags & B_DIRTY) {
+            // Write the old block out, then look again: someone may have
+            // read our block meanwhile, or taken this buffer back
+            buf->refcount++;
+            clear_flags(buf, B_DIRTY);
+            set_flags(buf, B_BUSY);
+            spinlock_release(&bcache_lock);
+
+            if (write_back(buf) < 0)
+                return NULL;
+            continue;
+        }
+
+        unhash(buf);
+        buf->dev = dev;
+        buf->block = block;
+        buf->flags = B_BUSY;
+        buf->refcount = 1;
+        uint32_t h = hash_of(dev, block);
+        buf->hash_next = hash[h];
+        hash[h] = buf;
+        lru_touch(buf);
+        misses++;
+        spinlock_release(&bcache_lock);
+
+        blk_submit(buf, 0);
+        if (blk_wait_buffer(buf) < 0) {
+            bcache_release(buf);
+            return NULL;
+        }
+        return buf;
+    }
+}
+
+void bcache_release(buffer_t *buf) {
+    spinlock_acquire(&bcache_lock);
+    buf->refcount--;
+    spinlock_release(&bcache_lock);
+}
+
+void bcache_mark_dirty(buffer_t *buf) {
+    set_flags(buf, B_DIRTY | B_UPTODATE);
+}
+
+int bcache_sync(void) {
+    buffer_t *batch = NULL;
+    uint32_t count = 0;
+
+    spinlock_acquire(&bcache_lock);
+    for (uint32_t i = 0; i < buffer_count; i++) {
+        buffer_t *buf = &buffers[i];
+        if ((buf->flags & (B_DIRTY | B_BUSY)) != B_DIRTY)
+            continue;
+        buf->refcount++;
+        clear_flags(buf, B_DIRTY);
+        set_flags(buf, B_BUSY);
+        buf->sync_next = batch;
+        batch = buf;
+        count++;
+    }
+    spinlock_release(&bcache_lock);
+
+    if (!batch)
+        return 0;
+
+    // Queue the whole batch before any of it starts, so it goes out
+    // sorted and merged
+    for (block_device_t *dev = blk_devices(); dev; dev = dev->next)
+        blk_plug(dev);
+    for (buffer_t *buf = batch; buf; buf = buf->sync_next)
+        blk_submit(buf, 1);
+    for (block_device_t *dev = blk_devices(); dev; dev = dev->next)
+        blk_unplug(dev);
+
+    int failed = 0;
+    for (buffer_t *buf = batch; buf; buf = buf->sync_next) {
+        if (blk_wait_buffer(buf) < 0) {
+            set_flags(buf, B_DIRTY);
+            failed++;
+        }
+    }
+
+    spinlock_acquire(&bcache_lock);
+    for (buffer_t *buf = batch; buf; buf = buf->sync_next)
+        buf->refcount--;
+    writebacks += count - failed;
+    spinlock_release(&bcache_lock);
+
+    if (failed) {
+        klog(KLOG_ERR, "bcache: %u of %u blocks failed to write back\n", failed, count);
+        return -1;
+    }
+    return 0;
+}
+
+void bcache_get_stats(bcache_stats_t *stats) {
+    spinlock_acquire(&bcache_lock);
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->writebacks = writebacks;
+    stats->buffers = buffer_count;
+    stats->dirty = 0;
+    for (uint32_t i = 0; i < buffer_count; i++) {
+        if (buffers[i].flags & B_DIRTY)
+            stats->dirty++;
+    }
+    spinlock_release(&bcache_lock);
+}
+
+static void kflushd_main(void) {
+    while (1) {
+        task_sleep(BCACHE_FLUSH_MS);
+        bcache_sync();
+    }
+}
+
+static void cmd_lsblk(const char *arg) {
+    (void)arg; // Unused parameter
+    block_device_t *dev = blk_devices();
+    if (!dev) {
+        puts("No block devices.\n");
+        return;
+    }
+
+    puts("\n--- Block Devices ---\n");
+    for (; dev; dev = dev->next) {
+        printf("  %s: %llu MB, %llu reads, %llu writes, %llu blocks moved, %llu merged, %llu errors\n",
+               dev->name, dev->blocks * BLOCK_SIZE / (1024 * 1024), dev->stats.reads,
+               dev->stats.writes, dev->stats.blocks, dev->stats.merges, dev->stats.errors);
+    }
+
+    bcache_stats_t cache;
+    bcache_get_stats(&cache);
+    printf("  Buffer cache: %u buffers, %u dirty, %llu hits, %llu misses, %llu written back\n",
+           cache.buffers, cache.dirty, cache.hits, cache.misses, cache.writebacks);
+    puts("---------------------\n");
+}
+
+static void cmd_sync(const char *arg) {
+    (void)arg; // Unused parameter
+    if (bcache_sync() < 0)
+        puts("sync: some blocks could not be written.\n");
+}
+
+static shell_command_t block_commands[] = {
+    {"lsblk", cmd_lsblk, "List block devices and buffer cache statistics"},
+    {"sync", cmd_sync, "Write dirty cached blocks back to disk"},
+};
+
+void bcache_init(void) {
+    shell_register(&block_commands[0]);
+    shell_register(&block_commands[1]);
+
+    lru.lru_next = lru.lru_prev = &lru;
+
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        uint8_t *data = pmm_alloc_page();
+        if (!data)
+            break;
+        buffers[i].data = data;
+        lru_push(&buffers[i]);
+        buffer_count++;
+    }
+
+    if (!blk_devices())
+        return;
+
+    task_t *task = task_create(kflushd_main, "kflushd");
+    if (!task) {
+        klog(KLOG_ERR, "bcache: cannot start kflushd\n");
+        return;
+    }
+    task_set_nice(task, 10);
+}
@@ -0,0 +1,201 @@
+#include <valen/block.h>
+#include <valen/string.h>
+
+/*
+ * Each device keeps its pending requests in one list sorted by first
+ * block. A new buffer is first offered to the queued requests: if it
+ * extends one of them at either end in the same direction, it joins that
+ * request, and a request that grows into its successor absorbs it. Only
+ * queued requests merge; once a driver has fetched a request it is off
+ * the list and never changes again.
+ *
+ * Requests come from a fixed per-device pool, so submitting never
+ * allocates and a full queue simply makes the submitter wait. The device
+ * lock is taken with interrupts off because drivers fetch and complete
+ * requests from their interrupt handlers.
+ */
+
+static block_device_t *devices;
+static spinlock_t devices_lock = SPINLOCK_INIT_NAMED("blkdevs");
+
+void blk_register(block_device_t *dev) {
+    spinlock_init_named(&dev->lock, "blkdev");
+    wait_queue_init(&dev->wait);
+    dev->queue = NULL;
+    dev->free = NULL;
+    dev->head = 0;
+    dev->plugged = 0;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    for (int i = 0; i < BLK_QUEUE_DEPTH; i++) {
+        dev->pool[i].dev = dev;
+        dev->pool[i].next = dev->free;
+        dev->free = &dev->pool[i];
+    }
+
+    spinlock_acquire(&devices_lock);
+    block_device_t **link = &devices;
+    while (*link)
+        link = &(*link)->next;
+    dev->next = NULL;
+    *link = dev;
+    spinlock_release(&devices_lock);
+}
+
+block_device_t *blk_get(const char *name) {
+    for (block_device_t *dev = devices; dev; dev = dev->next) {
+        if (strcmp(dev->name, name) == 0)
+            return dev;
+    }
+    return NULL;
+}
+
+block_device_t *blk_devices(void) {
+    return devices;
+}
+
+// Fold buf into a queued request next to it. Called with the lock held.
+static int try_merge(block_device_t *dev, buffer_t *buf, int write) {
+    for (blk_request_t *req = dev->queue; req; req = req->next) {
+        if (req->write != write || req->count >= BLK_MAX_SEGMENTS)
+            continue;
+
+        if (req->block + req->count == buf->block) {
+            req->bufs[req->count++] = buf;
+
+            // The gap to the next request may now be closed
+            blk_request_t *next = req->next;
+            if (next && next->write == write && req->block + req->count == next->block &&
+                req->count + next->count <= BLK_MAX_SEGMENTS) {
+                memcpy(&req->bufs[req->count], next->bufs, next->count * sizeof(buffer_t *));
+                req->count += next->count;
+                req->next = next->next;
+                next->next = dev->free;
+                dev->free = next;
+            }
+            return 1;
+        }
+
+        if (buf->block + 1 == req->block) {
+            memmove(&req->bufs[1], &req->bufs[0], req->count * sizeof(buffer_t *));
+            req->bufs[0] = buf;
+            req->block--;
+            req->count++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void blk_submit(buffer_t *buf, int write) {
+    block_device_t *dev = buf->dev;
+    uint64_t flags;
+
+    for (;;) {
+        flags = spinlock_acquire_irqsave(&dev->lock);
+        if (try_merge(dev, buf, write)) {
+            dev->stats.merges++;
+            break;
+        }
+        if (dev->free) {
+            blk_request_t *req = dev->free;
+            dev->free = req->next;
+            req->block = buf->block;
+            req->count = 1;
+            req->write = write;
+            req->bufs[0] = buf;
+
+            blk_request_t **link = &dev->queue;
+            while (*link && (*link)->block < buf->block)
+                link = &(*link)->next;
+            req->next = *link;
+            *link = req;
+            break;
+        }
+        spinlock_release_irqrestore(&dev->lock, flags);
+
+        // A full queue overrides a plug, or a large batch could never drain
+        dev->kick(dev);
+        wait_event(dev->wait, dev->free != NULL);
+    }
+
+    int plugged = dev->plugged;
+    spinlock_release_irqrestore(&dev->lock, flags);
+
+    if (!plugged)
+        dev->kick(dev);
+}
+
+void blk_plug(block_device_t *dev) {
+    uint64_t flags = spinlock_acquire_irqsave(&dev->lock);
+    dev->plugged++;
+    spinlock_release_irqrestore(&dev->lock, flags);
+}
+
+void blk_unplug(block_device_t *dev) {
+    uint64_t flags = spinlock_acquire_irqsave(&dev->lock);
+    int plugged = --dev->plugged;
+    spinlock_release_irqrestore(&dev->lock, flags);
+
+    if (!plugged)
+        dev->kick(dev);
+}
+
+blk_request_t *blk_fetch_request(block_device_t *dev) {
+    uint64_t flags = spinlock_acquire_irqsave(&dev->lock);
+    if (!dev->queue || (dev->plugged && dev->free)) {
+        spinlock_release_irqrestore(&dev->lock, flags);
+        return NULL;
+    }
+
+    // Carry on upwards from the last request; wrap to the lowest block
+    // once nothing is left above it
+    blk_request_t **link = &dev->queue;
+    while (*link && (*link)->block < dev->head)
+        link = &(*link)->next;
+    if (!*link)
+        link = &dev->queue;
+
+    blk_request_t *req = *link;
+    *link = req->next;
+    req->next = NULL;
+    dev->head = req->block + req->count;
+
+    if (req->write)
+        dev->stats.writes++;
+    else
+        dev->stats.reads++;
+    dev->stats.blocks += req->count;
+
+    spinlock_release_irqrestore(&dev->lock, flags);
+    return req;
+}
+
+void blk_end_request(blk_request_t *req, int err) {
+    block_device_t *dev = req->dev;
+
+    for (uint32_t i = 0; i < req->count; i++) {
+        buffer_t *buf = req->bufs[i];
+        if (err) {
+            __atomic_fetch_or(&buf->flags, B_ERROR, __ATOMIC_SEQ_CST);
+        } else {
+            __atomic_fetch_and(&buf->flags, ~B_ERROR, __ATOMIC_SEQ_CST);
+            __atomic_fetch_or(&buf->flags, B_UPTODATE, __ATOMIC_SEQ_CST);
+        }
+        // Last: a waiter that sees B_BUSY clear may use the buffer at once
+        __atomic_fetch_and(&buf->flags, ~B_BUSY, __ATOMIC_SEQ_CST);
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&dev->lock);
+    if (err)
+        dev->stats.errors++;
+    req->next = dev->free;
+    dev->free = req;
+    spinlock_release_irqrestore(&dev->lock, flags);
+
+    wake_up(&dev->wait);
+}
+
+int blk_wait_buffer(buffer_t *buf) {
+    wait_event(buf->dev->wait, !(buf->flags & B_BUSY));
+    return (buf->flags & B_ERROR) ? -1 : 0;
+}
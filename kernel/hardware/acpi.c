@@ -0,0 +1,221 @@
+/**
+ * @file acpi.c
+ * @brief ACPI table discovery and MADT parsing.
+ *
+ * The RSDP comes from the multiboot ACPI tags or, failing that, from a scan
+ * of the EBDA and the BIOS ROM area. Tables live in firmware-reserved memory
+ * that is not part of the direct map, so each table is mapped into the
+ * direct map on first access.
+ */
+
+#include <valen/acpi.h>
+#include <valen/page.h>
+#include <valen/paging.h>
+#include <valen/vmm.h>
+#include <valen/string.h>
+
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_OVERRIDE 2
+#define MADT_LAPIC_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED 0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+typedef struct acpi_rsdp
+{
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    /* Revision 2 and later */
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct acpi_madt
+{
+    acpi_sdt_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed)) acpi_madt_t;
+
+static acpi_rsdp_t rsdp_copy;
+static int rsdp_valid = 0;
+
+static acpi_madt_info_t madt_info;
+static int madt_valid = 0;
+
+static int sig_equal(const char *a, const char *b, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (a[i] != b[i])
+            return 0;
+    }
+    return 1;
+}
+
+static uint8_t checksum(const void *data, uint64_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint8_t sum = 0;
+    for (uint64_t i = 0; i < len; i++)
+        sum += bytes[i];
+    return sum;
+}
+
+/**
+ * @brief Makes [phys, phys + len) reachable through the direct map.
+ * @return The direct-map address of @p phys, or NULL if a page table could
+ *         not be allocated.
+ */
+static void *acpi_map(uint64_t phys, uint64_t len)
+{
+    uint64_t page = phys & ~(uint64_t)(PAGE_SIZE - 1);
+    for (; page < phys + len; page += PAGE_SIZE)
+    {
+        uintptr_t virt = (uintptr_t)PHYS_TO_VIRT(page);
+        if (vmm_get_phys(virt) != page && paging_map(virt, page, PAGE_PRESENT | PAGE_WRITE) != 0)
+            return NULL;
+    }
+    return PHYS_TO_VIRT(phys);
+}
+
+/**
+ * @brief Maps a whole table: the header first, then the length it reports.
+ */
+static acpi_sdt_header_t *map_table(uint64_t phys)
+{
+    acpi_sdt_header_t *header = (acpi_sdt_header_t *)acpi_map(phys, sizeof(acpi_sdt_header_t));
+    if (!header || !acpi_map(phys, header->length))
+        return NULL;
+
+    if (checksum(header, header->length) != 0)
+        return NULL;
+    return header;
+}
+
+void acpi_set_rsdp(const void *rsdp)
+{
+    const acpi_rsdp_t *src = (const acpi_rsdp_t *)rsdp;
+    uint64_t len = (src->revision >= 2) ? sizeof(acpi_rsdp_t) : 20;
+
+    memset(&rsdp_copy, 0, sizeof(rsdp_copy));
+    memcpy(&rsdp_copy, src, len);
+    rsdp_valid = sig_equal(rsdp_copy.signature, "RSD PTR ", 8) && checksum(&rsdp_copy, 20) == 0;
+}
+
+/**
+ * @brief Searches [start, end) of the first megabyte for the RSDP signature.
+ */
+static int scan_rsdp(uint64_t start, uint64_t end)
+{
+    for (uint64_t addr = start; addr + 20 <= end; addr += 16)
+    {
+        const char *p = (const char *)KERNEL_PHYS_TO_VIRT(addr);
+        if (sig_equal(p, "RSD PTR ", 8) && checksum(p, 20) == 0)
+        {
+            acpi_set_rsdp(p);
+            return rsdp_valid;
+        }
+    }
+    return 0;
+}
+
+acpi_sdt_header_t *acpi_find_table(const char *signature)
+{
+    if (!rsdp_valid)
+        return NULL;
+
+    /* Prefer the XSDT with 64-bit entries */
+    int wide = rsdp_copy.revision >= 2 && rsdp_copy.xsdt_address;
+    acpi_sdt_header_t *root = map_table(wide ? rsdp_copy.xsdt_address : rsdp_copy.rsdt_address);
+    if (!root)
+        return NULL;
+
+    uint64_t entries = (root->length - sizeof(acpi_sdt_header_t)) / (wide ? 8 : 4);
+    uint8_t *table = (uint8_t *)root + sizeof(acpi_sdt_header_t);
+
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        uint64_t phys = wide ? ((uint64_t *)table)[i] : ((uint32_t *)table)[i];
+        acpi_sdt_header_t *header = map_table(phys);
+        if (header && sig_equal(header->signature, signature, 4))
+            return header;
+    }
+    return NULL;
+}
+
+static void parse_madt(acpi_madt_t *madt)
+{
+    memset(&madt_info, 0, sizeof(madt_info));
+    madt_info.lapic_phys = madt->lapic_address;
+
+    uint8_t *entry = madt->entries;
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+
+    while (entry + 2 <= end && entry[1] >= 2)
+    {
+        switch (entry[0])
+        {
+        case MADT_LAPIC:
+        {
+            uint32_t flags = *(uint32_t *)(entry + 4);
+            if ((flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) && madt_info.cpu_count < MAX_CPUS)
+                madt_info.cpu_apic_ids[madt_info.cpu_count++] = entry[3];
+            break;
+        }
+        case MADT_IOAPIC:
+            if (madt_info.ioapic_count < ACPI_MAX_IOAPICS)
+            {
+                acpi_ioapic_t *io = &madt_info.ioapics[madt_info.ioapic_count++];
+                io->id = entry[2];
+                io->phys = *(uint32_t *)(entry + 4);
+                io->gsi_base = *(uint32_t *)(entry + 8);
+            }
+            break;
+        case MADT_OVERRIDE:
+            if (madt_info.override_count < ACPI_MAX_OVERRIDES)
+            {
+                acpi_override_t *ovr = &madt_info.overrides[madt_info.override_count++];
+                ovr->source = entry[3];
+                ovr->gsi = *(uint32_t *)(entry + 4);
+                ovr->flags = *(uint16_t *)(entry + 8);
+            }
+            break;
+        case MADT_LAPIC_OVERRIDE:
+            madt_info.lapic_phys = *(uint64_t *)(entry + 4);
+            break;
+        }
+        entry += entry[1];
+    }
+}
+
+int acpi_init(void)
+{
+    if (!rsdp_valid)
+    {
+        /* The EBDA segment is stored at 0x40E in the BIOS data area */
+        uint64_t ebda = (uint64_t)(*(uint16_t *)KERNEL_PHYS_TO_VIRT(0x40E)) << 4;
+        if (!(ebda && scan_rsdp(ebda, ebda + 1024)) && !scan_rsdp(0xE0000, 0x100000))
+            return -1;
+    }
+
+    acpi_madt_t *madt = (acpi_madt_t *)acpi_find_table("APIC");
+    if (!madt)
+        return -1;
+
+    parse_madt(madt);
+    madt_valid = 1;
+    return 0;
+}
+
+const acpi_madt_info_t *acpi_get_madt(void)
+{
+    return madt_valid ? &madt_info : NULL;
+}
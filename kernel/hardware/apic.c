@@ -0,0 +1,111 @@
+/**
+ * @file apic.c
+ * @brief Local APIC driver (xAPIC, memory-mapped).
+ *
+ * Every CPU sees its own local APIC at the same physical address, so one
+ * mapping serves all of them.
+ */
+
+#include <valen/apic.h>
+#include <valen/vmm.h>
+#include <valen/cpu.h>
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE (1ULL << 11)
+#define IA32_TSC_DEADLINE_MSR 0x6E0
+
+#define CPUID_1_ECX_TSC_DEADLINE (1U << 24)
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_TPR 0x80
+#define LAPIC_REG_EOI 0xB0
+#define LAPIC_REG_SVR 0xF0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
+
+static volatile uint32_t *lapic = 0;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+}
+
+void lapic_init(uint64_t phys)
+{
+    if (!phys)
+        phys = rdmsr(IA32_APIC_BASE_MSR) & ~0xFFFULL;
+
+    lapic = (volatile uint32_t *)vmm_map_mmio(phys, 0x1000);
+    if (lapic)
+        lapic_enable();
+}
+
+void lapic_enable(void)
+{
+    wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_ENABLE);
+
+    /* Accept all priorities and software-enable the APIC */
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+int lapic_available(void)
+{
+    return lapic != 0;
+}
+
+uint32_t lapic_id(void)
+{
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void)
+{
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr)
+{
+    /* An interrupt handler sending its own IPI must not split the two writes */
+    uint64_t flags = irq_save();
+
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, icr);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+        cpu_relax();
+
+    irq_restore(flags);
+}
+
+int lapic_tsc_deadline_supported(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    if (!lapic)
+        return 0;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
+}
+
+void lapic_timer_init(void)
+{
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+
+    /* The mode switch must land before the first deadline is written */
+    asm volatile("mfence" : : : "memory");
+    wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+}
+
+void lapic_timer_set_deadline(uint64_t tsc)
+{
+    wrmsr(IA32_TSC_DEADLINE_MSR, tsc);
+}
@@ -0,0 +1,115 @@
+/**
+ * @file fpu.c
+ * @brief Lazy FPU/SSE state switching.
+ *
+ * Every task starts out with CR0.TS set, so its first FPU or SSE
+ * instruction raises #NM. The handler clears TS, loads the task's saved
+ * registers (a clean image on first use) and makes the task the owner of
+ * this CPU's registers. A task that never uses them takes no trap and
+ * costs nothing on a switch.
+ *
+ * An owner that ran with TS clear is saved with fxsave when it is switched
+ * out. This keeps its saved state current, so it can resume on any CPU.
+ * If it comes back to a CPU whose registers still hold its state, TS stays
+ * clear and it takes no trap.
+ */
+
+#include <valen/fpu.h>
+#include <valen/task.h>
+#include <valen/percpu.h>
+#include <valen/slab.h>
+#include <valen/string.h>
+#include <valen/stdio.h>
+#include <valen/cpu.h>
+
+#define CR0_MP (1ULL << 1)
+#define CR0_EM (1ULL << 2)
+#define CR0_TS (1ULL << 3)
+#define CR0_NE (1ULL << 5)
+
+#define CR4_OSFXSR (1ULL << 9)
+#define CR4_OSXMMEXCPT (1ULL << 10)
+
+/** @brief MXCSR after reset: round to nearest, all SIMD exceptions masked. */
+#define MXCSR_DEFAULT 0x1F80
+
+static kmem_cache_t *fpu_cache = 0;
+static fpu_state_t initial_state;
+
+static inline void fxsave(fpu_state_t *state)
+{
+    asm volatile("fxsave64 %0" : "=m"(*state));
+}
+
+static inline void fxrstor(fpu_state_t *state)
+{
+    asm volatile("fxrstor64 %0" : : "m"(*state));
+}
+
+void fpu_init_cpu(void)
+{
+    write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+}
+
+void fpu_init(void)
+{
+    fpu_init_cpu();
+    fpu_cache = kmem_cache_create("fpu_state", sizeof(fpu_state_t), 16, NULL);
+
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    asm volatile("clts; fninit; ldmxcsr %0" : : "m"(mxcsr));
+    fxsave(&initial_state);
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+void fpu_switch(task_t *prev, task_t *next)
+{
+    cpu_local_t *cpu = this_cpu();
+    uint64_t cr0 = read_cr0();
+
+    /* TS is only ever cleared for the owner of the registers */
+    if (!(cr0 & CR0_TS))
+        fxsave(prev->fpu_state);
+
+    uint64_t want = cr0 | CR0_TS;
+    if (cpu->fpu_owner == next && next->fpu_cpu == (int)cpu->id)
+        want &= ~CR0_TS;
+
+    /* Writing CR0 serializes, so skip it when TS does not change */
+    if (want != cr0)
+        write_cr0(want);
+}
+
+void fpu_release(task_t *task)
+{
+    if (task->fpu_state)
+        kmem_cache_free(fpu_cache, task->fpu_state);
+    task->fpu_state = NULL;
+}
+
+void fpu_trap_handler(void)
+{
+    cpu_local_t *cpu = this_cpu();
+    task_t *task = cpu->current;
+
+    asm volatile("clts");
+    if (cpu->fpu_owner == task && task->fpu_cpu == (int)cpu->id)
+        return;
+
+    if (!task->fpu_state)
+    {
+        task->fpu_state = kmem_cache_alloc(fpu_cache);
+        if (!task->fpu_state)
+        {
+            printf("FPU: no memory for the state of task %d\n", task->pid);
+            for (;;)
+                asm volatile("cli; hlt");
+        }
+        memcpy(task->fpu_state, &initial_state, sizeof(fpu_state_t));
+    }
+
+    fxrstor(task->fpu_state);
+    cpu->fpu_owner = task;
+    task->fpu_cpu = cpu->id;
+}
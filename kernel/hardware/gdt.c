@@ -1,8 +1,12 @@
 #include <valen/gdt.h>
+#include <valen/percpu.h>
 
-struct gdt_entry gdt[3];
+struct gdt_entry gdt[GDT_TSS + 2 * MAX_CPUS];
 struct gdt_ptr gp;
 
+static struct tss tss[MAX_CPUS];
+static uint8_t ist_stacks[MAX_CPUS][IST_STACK_SIZE] __attribute__((aligned(16)));
+
 extern void gdt_flush(uint64_t gdt_ptr);
 
 void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
@@ -20,7 +24,7 @@ void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_
 
 void gdt_init()
 {
-    gp.limit = (sizeof(struct gdt_entry) * 3) - 1;
+    gp.limit = sizeof(gdt) - 1;
     gp.base = (uint64_t)&gdt;
 
     // Entry 0: Null Descriptor
@@ -36,4 +40,34 @@ void gdt_init()
     gdt_set_gate(2, 0, 0, 0x92, 0x00);
 
     gdt_flush((uint64_t)&gp);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Loads the already initialized GDT on the calling CPU (used by APs).
+ */
+void gdt_load()
+{
+    gdt_flush((uint64_t)&gp);
+}
+
+/**
+ * @brief Installs and loads the TSS of @p cpu, which gives it its own page
+ * fault stack. Called once on every CPU after its GDT is loaded.
+ */
+void tss_init(uint32_t cpu)
+{
+    struct tss *t = &tss[cpu];
+    t->ist[IST_PAGE_FAULT - 1] = (uint64_t)&ist_stacks[cpu][IST_STACK_SIZE];
+    t->iomap_base = sizeof(struct tss); // No I/O permission bitmap
+
+    // A system descriptor is 16 bytes: the usual 8, then bits 32-63 of the base
+    // Access: 0x89 (10001001b) -> Present, Ring 0, Available 64-bit TSS
+    int num = GDT_TSS + 2 * cpu;
+    uint64_t base = (uint64_t)t;
+    gdt_set_gate(num, (uint32_t)base, sizeof(struct tss) - 1, 0x89, 0x00);
+    uint32_t *high = (uint32_t *)&gdt[num + 1];
+    high[0] = (uint32_t)(base >> 32);
+    high[1] = 0;
+
+    asm volatile("ltr %0" : : "r"((uint16_t)(num * sizeof(struct gdt_entry))));
+}
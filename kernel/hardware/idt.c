@@ -9,7 +9,16 @@
 
 #include <valen/idt.h>
 #include <valen/pic.h>
+#include <valen/irq.h>
 #include <valen/keyboard.h>
+#include <valen/apic.h>
+#include <valen/task.h>
+#include <valen/percpu.h>
+#include <valen/timer.h>
+#include <valen/softirq.h>
+#include <valen/gdt.h>
+#include <valen/irqstat.h>
+#include <valen/prof.h>
 
 /* --- Global IDT Structures --- */
 
@@ -24,8 +33,12 @@ struct idt_ptr idtp;
 extern void page_fault_isr();
 extern void keyboard_isr();
 extern void generic_isr();
-extern void scheduler_tick();
 extern void timer_isr();
+extern void lapic_timer_isr();
+extern void resched_isr();
+extern void spurious_isr();
+extern void device_not_available_isr();
+extern void tlb_flush_isr();
 extern void load_idt(struct idt_ptr *ptr);
 
 /* --- Generic Handler --- */
@@ -33,7 +46,47 @@ extern void load_idt(struct idt_ptr *ptr);
 void generic_handler(void)
 {
     /* Generic interrupt handler - just send EOI and return */
-    pic_send_eoi(0);
+    irq_eoi(0);
+}
+
+/**
+ * @brief PIT IRQ handler, called by timer_isr with the interrupted context.
+ * The timers themselves run in SOFTIRQ_TIMER on the way out. The EOI goes
+ * out first so that the next deadline can fire meanwhile or while another
+ * task runs.
+ */
+void timer_handler(task_context_t *regs)
+{
+    cpu_local_t *cpu = this_cpu();
+
+    irq_enter();
+    cpu->irq_regs = regs;
+    prof_tick(regs);
+    timer_interrupt();
+    irq_eoi(IRQ_TIMER);
+    cpu->irq_regs = NULL;
+    irq_exit();
+
+    preempt_schedule_irq();
+}
+
+/**
+ * @brief Local APIC timer handler, called by lapic_timer_isr. Same as
+ * timer_handler() but acknowledged at the local APIC.
+ */
+void lapic_timer_handler(task_context_t *regs)
+{
+    cpu_local_t *cpu = this_cpu();
+
+    irq_enter();
+    cpu->irq_regs = regs;
+    prof_tick(regs);
+    timer_interrupt();
+    lapic_eoi();
+    cpu->irq_regs = NULL;
+    irq_exit();
+
+    preempt_schedule_irq();
 }
 
 /**
@@ -48,13 +101,22 @@ void idt_set_descriptor(uint8_t vector, void *isr, uint8_t flags)
 
     idt[vector].isr_low = addr & 0xFFFF;
     idt[vector].kernel_cs = 0x08; /* Kernel Code Segment Offset */
-    idt[vector].ist = 0;          /* Interrupt Stack Table (not used) */
+    idt[vector].ist = 0;          /* Current stack; see idt_set_ist() */
     idt[vector].attributes = flags;
     idt[vector].isr_mid = (addr >> 16) & 0xFFFF;
     idt[vector].isr_high = (addr >> 32) & 0xFFFFFFFF;
     idt[vector].reserved = 0;
 }
 
+/**
+ * @brief Makes the CPU switch to stack @p ist of its TSS before running the
+ * handler of @p vector.
+ */
+void idt_set_ist(uint8_t vector, uint8_t ist)
+{
+    idt[vector].ist = ist;
+}
+
 /**
  * @brief Initializes the IDT and prepares the CPU for interrupt handling.
  * This function performs the following steps:
@@ -78,6 +140,11 @@ void idt_init()
     /* 3. Register CPU Exceptions (Vectors 0-31) */
     /* Vector 14: Page Fault - Critical for Virtual Memory Management */
     idt_set_descriptor(14, page_fault_isr, 0x8E);
+    /* Faults on an unbacked stack page cannot push their frame on that stack */
+    idt_set_ist(14, IST_PAGE_FAULT);
+
+    /* Vector 7: Device Not Available - lazy FPU/SSE switching */
+    idt_set_descriptor(7, device_not_available_isr, 0x8E);
 
     /* 4. Register Hardware IRQs */
     /* IRQ 1: Keyboard - Vector 0x21 (0x20 + 1) */
@@ -86,9 +153,32 @@ void idt_init()
     /* IRQ 0: Timer - Vector 0x20 (0x20 + 0) */
     idt_set_descriptor(32, timer_isr, 0x8E);
 
+    /* Local APIC vectors: timer, reschedule IPI and spurious interrupts */
+    idt_set_descriptor(LAPIC_TIMER_VECTOR, lapic_timer_isr, 0x8E);
+    idt_set_descriptor(RESCHED_VECTOR, resched_isr, 0x8E);
+    idt_set_descriptor(TLB_FLUSH_VECTOR, tlb_flush_isr, 0x8E);
+    idt_set_descriptor(LAPIC_SPURIOUS_VECTOR, spurious_isr, 0x8E);
+
+    /* Names for irqstat; the stubs above are timed */
+    irqstat_set_name(7, "fpu-trap");
+    irqstat_set_name(IRQ_VECTOR_BASE + IRQ_TIMER, "pit");
+    irqstat_set_name(IRQ_VECTOR_BASE + IRQ_KEYBOARD, "keyboard");
+    irqstat_set_name(LAPIC_TIMER_VECTOR, "lapic-timer");
+    irqstat_set_name(RESCHED_VECTOR, "resched");
+    irqstat_set_name(TLB_FLUSH_VECTOR, "tlb-flush");
+    irqstat_set_name(IRQSTAT_OTHER, "other");
+
     /* 5. Configure IDT Pointer and load into CPU register */
     idtp.limit = (sizeof(struct idt_entry) * 256) - 1;
     idtp.base = (uint64_t)&idt;
 
     load_idt(&idtp);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Loads the already initialized IDT on the calling CPU (used by APs).
+ */
+void idt_load()
+{
+    load_idt(&idtp);
+}
@@ -0,0 +1,115 @@
+/**
+ * @file ioapic.c
+ * @brief I/O APIC driver.
+ *
+ * Each I/O APIC is reached through an index register and a data window,
+ * so every register access is a pair of MMIO writes under one lock. Its
+ * redirection table maps a range of global system interrupts, starting
+ * at the GSI base from the MADT, to a vector on a chosen local APIC.
+ */
+
+#include <valen/ioapic.h>
+#include <valen/acpi.h>
+#include <valen/vmm.h>
+#include <valen/spinlock.h>
+#include <valen/cpu.h>
+
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WIN 0x10
+
+#define IOAPIC_REG_VER 0x01
+#define IOAPIC_REG_REDTBL 0x10
+
+typedef struct ioapic
+{
+    volatile uint32_t *mmio;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+} ioapic_t;
+
+static ioapic_t ioapics[ACPI_MAX_IOAPICS];
+static int ioapic_count = 0;
+static spinlock_t ioapic_lock = SPINLOCK_INIT_NAMED("ioapic");
+
+static uint32_t ioapic_read(ioapic_t *io, uint32_t reg)
+{
+    io->mmio[IOAPIC_REGSEL / 4] = reg;
+    return io->mmio[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(ioapic_t *io, uint32_t reg, uint32_t value)
+{
+    io->mmio[IOAPIC_REGSEL / 4] = reg;
+    io->mmio[IOAPIC_WIN / 4] = value;
+}
+
+static ioapic_t *ioapic_for_gsi(uint32_t gsi)
+{
+    for (int i = 0; i < ioapic_count; i++)
+    {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].gsi_count)
+            return &ioapics[i];
+    }
+    return 0;
+}
+
+int ioapic_init(void)
+{
+    const acpi_madt_info_t *madt = acpi_get_madt();
+    if (!madt)
+        return 0;
+
+    for (uint32_t i = 0; i < madt->ioapic_count; i++)
+    {
+        ioapic_t *io = &ioapics[ioapic_count];
+
+        io->mmio = (volatile uint32_t *)vmm_map_mmio(madt->ioapics[i].phys, 0x1000);
+        if (!io->mmio)
+            continue;
+
+        io->gsi_base = madt->ioapics[i].gsi_base;
+        io->gsi_count = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+
+        for (uint32_t pin = 0; pin < io->gsi_count; pin++)
+        {
+            ioapic_write(io, IOAPIC_REG_REDTBL + pin * 2, IOAPIC_MASKED);
+            ioapic_write(io, IOAPIC_REG_REDTBL + pin * 2 + 1, 0);
+        }
+        ioapic_count++;
+    }
+
+    return ioapic_count;
+}
+
+int ioapic_route(uint32_t gsi, uint8_t vector, uint32_t apic_id, uint32_t flags)
+{
+    ioapic_t *io = ioapic_for_gsi(gsi);
+    if (!io)
+        return -1;
+
+    uint32_t pin = gsi - io->gsi_base;
+    uint64_t irq_flags = spinlock_acquire_irqsave(&ioapic_lock);
+
+    /* Mask while the destination changes so no half-written entry fires */
+    ioapic_write(io, IOAPIC_REG_REDTBL + pin * 2, IOAPIC_MASKED);
+    ioapic_write(io, IOAPIC_REG_REDTBL + pin * 2 + 1, apic_id << 24);
+    ioapic_write(io, IOAPIC_REG_REDTBL + pin * 2, vector | flags);
+
+    spinlock_release_irqrestore(&ioapic_lock, irq_flags);
+    return 0;
+}
+
+void ioapic_set_masked(uint32_t gsi, int masked)
+{
+    ioapic_t *io = ioapic_for_gsi(gsi);
+    if (!io)
+        return;
+
+    uint32_t reg = IOAPIC_REG_REDTBL + (gsi - io->gsi_base) * 2;
+    uint64_t irq_flags = spinlock_acquire_irqsave(&ioapic_lock);
+
+    uint32_t low = ioapic_read(io, reg);
+    ioapic_write(io, reg, masked ? low | IOAPIC_MASKED : low & ~IOAPIC_MASKED);
+
+    spinlock_release_irqrestore(&ioapic_lock, irq_flags);
+}
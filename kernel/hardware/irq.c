@@ -0,0 +1,179 @@
+/**
+ * @file irq.c
+ * @brief Device interrupt routing.
+ *
+ * ISA IRQ n always arrives on vector IRQ_VECTOR_BASE + n, so the IDT stays
+ * the same whichever controller delivers it. The 8259 PICs are used until
+ * irq_init() finds an I/O APIC. From then on every line goes through the
+ * I/O APIC to a chosen CPU, the PICs are masked, and an EOI is a single
+ * MMIO write to the local APIC instead of port I/O. The MADT interrupt
+ * source overrides give the GSI, polarity and trigger mode of each line.
+ */
+
+#include <valen/irq.h>
+#include <valen/ioapic.h>
+#include <valen/apic.h>
+#include <valen/acpi.h>
+#include <valen/pic.h>
+#include <valen/percpu.h>
+#include <valen/spinlock.h>
+#include <valen/cpu.h>
+
+#define MSI_ADDRESS_BASE 0xFEE00000ULL
+
+static int apic_mode = 0;
+static uint16_t enabled_irqs = 0;
+static uint8_t irq_cpus[IRQ_ISA_COUNT];
+static uint64_t used_vectors[4];
+static spinlock_t irq_lock = SPINLOCK_INIT_NAMED("irq");
+
+/**
+ * @brief Looks up the GSI and redirection flags of an ISA IRQ.
+ * ISA lines are edge-triggered and active high unless overridden.
+ */
+static uint32_t isa_gsi(uint8_t irq, uint32_t *flags)
+{
+    const acpi_madt_info_t *madt = acpi_get_madt();
+
+    *flags = 0;
+    for (uint32_t i = 0; madt && i < madt->override_count; i++)
+    {
+        const acpi_override_t *ovr = &madt->overrides[i];
+        if (ovr->source != irq)
+            continue;
+
+        if ((ovr->flags & ACPI_MADT_POLARITY_MASK) == ACPI_MADT_POLARITY_LOW)
+            *flags |= IOAPIC_ACTIVE_LOW;
+        if ((ovr->flags & ACPI_MADT_TRIGGER_MASK) == ACPI_MADT_TRIGGER_LEVEL)
+            *flags |= IOAPIC_LEVEL;
+        return ovr->gsi;
+    }
+    return irq;
+}
+
+/**
+ * @brief Writes the redirection entry of @p irq. irq_lock must be held.
+ */
+static void irq_route(uint8_t irq)
+{
+    uint32_t flags;
+    uint32_t gsi = isa_gsi(irq, &flags);
+
+    if (!(enabled_irqs & (1 << irq)))
+        flags |= IOAPIC_MASKED;
+    ioapic_route(gsi, IRQ_VECTOR_BASE + irq, cpu_locals[irq_cpus[irq]].apic_id, flags);
+}
+
+void irq_init(void)
+{
+    if (!lapic_available() || ioapic_init() == 0)
+        return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+
+    for (uint8_t irq = 0; irq < IRQ_ISA_COUNT; irq++)
+    {
+        if (irq != IRQ_CASCADE)
+            irq_route(irq);
+    }
+
+    /* The PICs stay remapped above the exception vectors, so a spurious
+       interrupt they still raise cannot pose as an exception */
+    pic_irq_mask_all();
+    apic_mode = 1;
+
+    spinlock_release_irqrestore(&irq_lock, flags);
+}
+
+int irq_apic_mode(void)
+{
+    return apic_mode;
+}
+
+static void irq_set_enabled(uint8_t irq, int enabled)
+{
+    if (irq >= IRQ_ISA_COUNT)
+        return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+
+    if (enabled)
+        enabled_irqs |= 1 << irq;
+    else
+        enabled_irqs &= ~(1 << irq);
+
+    if (apic_mode)
+    {
+        uint32_t gsi_flags;
+        ioapic_set_masked(isa_gsi(irq, &gsi_flags), !enabled);
+    }
+    else if (enabled)
+        pic_irq_enable(irq);
+    else
+        pic_irq_disable(irq);
+
+    spinlock_release_irqrestore(&irq_lock, flags);
+}
+
+void irq_enable(uint8_t irq)
+{
+    irq_set_enabled(irq, 1);
+}
+
+void irq_disable(uint8_t irq)
+{
+    irq_set_enabled(irq, 0);
+}
+
+void irq_eoi(uint8_t irq)
+{
+    if (apic_mode)
+        lapic_eoi();
+    else
+        pic_send_eoi(irq);
+}
+
+int irq_set_affinity(uint8_t irq, uint32_t cpu)
+{
+    if (!apic_mode || irq >= IRQ_ISA_COUNT || irq == IRQ_CASCADE || cpu >= MAX_CPUS || !cpu_locals[cpu].online)
+        return -1;
+
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+
+    irq_cpus[irq] = cpu;
+    irq_route(irq);
+
+    spinlock_release_irqrestore(&irq_lock, flags);
+    return 0;
+}
+
+uint32_t irq_get_affinity(uint8_t irq)
+{
+    return irq < IRQ_ISA_COUNT ? irq_cpus[irq] : 0;
+}
+
+int irq_alloc_vector(void)
+{
+    int vector = -1;
+    uint64_t flags = spinlock_acquire_irqsave(&irq_lock);
+
+    for (int v = IRQ_DYNAMIC_FIRST; v <= IRQ_DYNAMIC_LAST; v++)
+    {
+        if (!(used_vectors[v / 64] & (1ULL << (v % 64))))
+        {
+            used_vectors[v / 64] |= 1ULL << (v % 64);
+            vector = v;
+            break;
+        }
+    }
+
+    spinlock_release_irqrestore(&irq_lock, flags);
+    return vector;
+}
+
+void irq_msi_message(uint32_t cpu, uint8_t vector, uint64_t *address, uint32_t *data)
+{
+    /* Physical destination mode, no redirection hint */
+    *address = MSI_ADDRESS_BASE | ((uint64_t)cpu_locals[cpu].apic_id << 12);
+    *data = vector;
+}
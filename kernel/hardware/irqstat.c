@@ -0,0 +1,238 @@
+/**
+ * @file irqstat.c
+ * @brief Per-CPU interrupt counts and handler duration histograms.
+ *
+ * Instrumented ISR stubs bracket their handler with irqstat_enter() and
+ * irqstat_exit(), which read the TSC and update counters of the CPU the
+ * interrupt ran on. Each CPU only writes its own counters, with
+ * interrupts off, so there are no locks or atomics; readers may see a
+ * sample half recorded, which is fine for statistics.
+ *
+ * A handler's time runs from the stub's entry to its exit, minus any
+ * softirq work done by irq_exit(), which is accounted per softirq
+ * instead. A handler that ends by switching tasks is accounted just
+ * before the switch.
+ */
+
+#include <valen/irqstat.h>
+#include <valen/percpu.h>
+#include <valen/softirq.h>
+#include <valen/string.h>
+#include <valen/cpu.h>
+#include <valen/stdio.h>
+#include <valen/shell.h>
+
+static irq_stat_t vector_stats[MAX_CPUS][IRQSTAT_VECTORS] __attribute__((aligned(64)));
+static irq_stat_t softirq_stats[MAX_CPUS][NR_SOFTIRQS] __attribute__((aligned(64)));
+static const char *vector_names[IRQSTAT_VECTORS];
+
+static void record(irq_stat_t *stat, uint64_t cycles)
+{
+    stat->count++;
+    stat->cycles += cycles;
+    if (cycles > stat->max)
+        stat->max = cycles;
+
+    int bucket = 0;
+    if (cycles >> IRQSTAT_FIRST_SHIFT)
+        bucket = 63 - __builtin_clzll(cycles) - IRQSTAT_FIRST_SHIFT + 1;
+    if (bucket >= IRQSTAT_BUCKETS)
+        bucket = IRQSTAT_BUCKETS - 1;
+    stat->hist[bucket]++;
+}
+
+static void close_frame(cpu_local_t *cpu, irq_frame_t *frame)
+{
+    uint64_t cycles = rdtsc() - frame->start;
+    cycles = cycles > frame->excluded ? cycles - frame->excluded : 0;
+
+    record(&vector_stats[cpu->id][frame->vector], cycles);
+    frame->closed = 1;
+    cpu->irq_frame = frame->prev;
+}
+
+void irqstat_enter(irq_frame_t *frame, uint32_t vector)
+{
+    cpu_local_t *cpu = this_cpu();
+
+    frame->excluded = 0;
+    frame->vector = vector;
+    frame->closed = 0;
+    frame->prev = cpu->irq_frame;
+    cpu->irq_frame = frame;
+    frame->start = rdtsc();
+}
+
+void irqstat_exit(irq_frame_t *frame)
+{
+    if (!frame->closed)
+        close_frame(this_cpu(), frame);
+}
+
+void irqstat_close(void)
+{
+    cpu_local_t *cpu = this_cpu();
+    if (cpu->irq_frame)
+        close_frame(cpu, cpu->irq_frame);
+}
+
+void irqstat_exclude(uint64_t cycles)
+{
+    irq_frame_t *frame = this_cpu()->irq_frame;
+    if (frame)
+        frame->excluded += cycles;
+}
+
+void irqstat_softirq(int nr, uint64_t cycles)
+{
+    record(&softirq_stats[this_cpu_id()][nr], cycles);
+}
+
+void irqstat_set_name(uint32_t vector, const char *name)
+{
+    if (vector < IRQSTAT_VECTORS)
+        vector_names[vector] = name;
+}
+
+const char *irqstat_name(uint32_t vector)
+{
+    return vector < IRQSTAT_VECTORS ? vector_names[vector] : 0;
+}
+
+void irqstat_get(uint32_t cpu, uint32_t vector, irq_stat_t *stat)
+{
+    *stat = vector_stats[cpu][vector];
+}
+
+void irqstat_get_softirq(uint32_t cpu, int nr, irq_stat_t *stat)
+{
+    *stat = softirq_stats[cpu][nr];
+}
+
+void irqstat_reset(void)
+{
+    memset(vector_stats, 0, sizeof(vector_stats));
+    memset(softirq_stats, 0, sizeof(softirq_stats));
+}
+
+/* --- irqstat Shell Command --- */
+
+/** @brief Upper bounds of the duration buckets, in cycles. */
+static const char *bucket_names[IRQSTAT_BUCKETS] = {
+    "<512", "<1K", "<2K", "<4K", "<8K", "<16K", "<32K", "<64K", "<128K", ">=128K"
+};
+
+/**
+ * @brief Bucket holding the pct-th percentile of a histogram.
+ */
+static const char *percentile(const irq_stat_t *stat, uint64_t pct)
+{
+    uint64_t want = (stat->count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < IRQSTAT_BUCKETS; i++)
+    {
+        seen += stat->hist[i];
+        if (seen >= want)
+            return bucket_names[i];
+    }
+    return bucket_names[IRQSTAT_BUCKETS - 1];
+}
+
+/**
+ * @brief One line of totals after a label of @p label_len characters,
+ * then the per-CPU counts.
+ */
+static void print_stat(int label_len, const irq_stat_t *total, const uint64_t *per_cpu)
+{
+    for (int pad = label_len; pad < 14; pad++)
+        putc(' ');
+    printf("%llu  %llu/%llu  p50 %s  p99 %s\n", total->count,
+           total->cycles / total->count, total->max,
+           percentile(total, 50), percentile(total, 99));
+
+    puts("               ");
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        if (cpu_locals[cpu].online)
+            printf(" cpu%d %llu", cpu, per_cpu[cpu]);
+    }
+    putc('\n');
+}
+
+static void sum_stat(irq_stat_t *total, const irq_stat_t *stat)
+{
+    total->count += stat->count;
+    total->cycles += stat->cycles;
+    if (stat->max > total->max)
+        total->max = stat->max;
+    for (int i = 0; i < IRQSTAT_BUCKETS; i++)
+        total->hist[i] += stat->hist[i];
+}
+
+static void cmd_irqstat(const char *arg)
+{
+    if (strcmp(arg, "reset") == 0)
+    {
+        irqstat_reset();
+        puts("Interrupt statistics reset.\n");
+        return;
+    }
+
+    irq_stat_t total, stat;
+    uint64_t per_cpu[MAX_CPUS];
+
+    puts("\n--- Interrupts (cycles, softirqs excluded) ---\n");
+    puts("  VECTOR        COUNT  AVG/MAX  PERCENTILES\n");
+    for (uint32_t vector = 0; vector < IRQSTAT_VECTORS; vector++)
+    {
+        memset(&total, 0, sizeof(total));
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        {
+            irqstat_get(cpu, vector, &stat);
+            per_cpu[cpu] = stat.count;
+            sum_stat(&total, &stat);
+        }
+        if (!total.count)
+            continue;
+
+        const char *name = irqstat_name(vector);
+        if (!name)
+            name = "?";
+        if (vector == IRQSTAT_OTHER)
+        {
+            printf("  %s", name);
+            print_stat(strlen(name), &total, per_cpu);
+        }
+        else
+        {
+            printf("  0x%X %s", vector, name);
+            print_stat((vector < 0x10 ? 4 : 5) + strlen(name), &total, per_cpu);
+        }
+    }
+
+    puts("  --- Softirqs ---\n");
+    for (int nr = 0; nr < NR_SOFTIRQS; nr++)
+    {
+        memset(&total, 0, sizeof(total));
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+        {
+            irqstat_get_softirq(cpu, nr, &stat);
+            per_cpu[cpu] = stat.count;
+            sum_stat(&total, &stat);
+        }
+        if (!total.count)
+            continue;
+        printf("  %s", softirq_name(nr));
+        print_stat(strlen(softirq_name(nr)), &total, per_cpu);
+    }
+    puts("----------------------------------------------\n");
+}
+
+static shell_command_t irqstat_command = {
+    "irqstat", cmd_irqstat, "Show interrupt counts and handler times (usage: irqstat [reset])"
+};
+
+void irqstat_init(void)
+{
+    shell_register(&irqstat_command);
+}
@@ -0,0 +1,173 @@
+/**
+ * @file pci.c
+ * @brief PCI configuration space access through the legacy 0xCF8/0xCFC ports.
+ *
+ * Configuration mechanism #1: a dword address written to CONFIG_ADDRESS
+ * selects bus, device, function and register, and CONFIG_DATA then reads
+ * or writes that dword. The pair is not atomic, so every access holds
+ * one lock. Narrower accesses use the matching byte lanes of the window.
+ */
+
+#include <valen/pci.h>
+#include <valen/io.h>
+#include <valen/irq.h>
+#include <valen/spinlock.h>
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+#define PCI_CONFIG_ENABLE 0x80000000U
+
+#define PCI_MAX_BUS 256
+#define PCI_MAX_SLOT 32
+#define PCI_MAX_FUNC 8
+#define PCI_HEADER_MULTI 0x80
+
+#define PCI_BAR_IO 0x1
+#define PCI_BAR_TYPE_64 0x4
+#define PCI_BAR_MEM_MASK 0xFFFFFFF0U
+
+/* MSI capability layout */
+#define MSI_CONTROL 2
+#define MSI_ADDRESS_LO 4
+#define MSI_ADDRESS_HI 8
+#define MSI_CONTROL_ENABLE 0x0001
+#define MSI_CONTROL_MME 0x0070
+#define MSI_CONTROL_64BIT 0x0080
+
+static spinlock_t pci_lock = SPINLOCK_INIT_NAMED("pci");
+
+static void pci_select(const pci_dev_t *dev, uint8_t offset)
+{
+    outl(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | ((uint32_t)dev->bus << 16) |
+                                 ((uint32_t)dev->slot << 11) | ((uint32_t)dev->func << 8) |
+                                 (offset & 0xFC));
+}
+
+uint32_t pci_read32(const pci_dev_t *dev, uint8_t offset)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&pci_lock);
+    pci_select(dev, offset);
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spinlock_release_irqrestore(&pci_lock, flags);
+    return value;
+}
+
+uint16_t pci_read16(const pci_dev_t *dev, uint8_t offset)
+{
+    return (uint16_t)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+uint8_t pci_read8(const pci_dev_t *dev, uint8_t offset)
+{
+    return (uint8_t)(pci_read32(dev, offset) >> ((offset & 3) * 8));
+}
+
+void pci_write32(const pci_dev_t *dev, uint8_t offset, uint32_t value)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&pci_lock);
+    pci_select(dev, offset);
+    outl(PCI_CONFIG_DATA, value);
+    spinlock_release_irqrestore(&pci_lock, flags);
+}
+
+void pci_write16(const pci_dev_t *dev, uint8_t offset, uint16_t value)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&pci_lock);
+    pci_select(dev, offset);
+    outw(PCI_CONFIG_DATA + (offset & 2), value);
+    spinlock_release_irqrestore(&pci_lock, flags);
+}
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, int index, pci_dev_t *dev)
+{
+    uint32_t want = ((uint32_t)class_code << 24) | ((uint32_t)subclass << 16) | ((uint32_t)prog_if << 8);
+
+    for (int bus = 0; bus < PCI_MAX_BUS; bus++)
+    {
+        for (int slot = 0; slot < PCI_MAX_SLOT; slot++)
+        {
+            for (int func = 0; func < PCI_MAX_FUNC; func++)
+            {
+                pci_dev_t d = {(uint8_t)bus, (uint8_t)slot, (uint8_t)func, 0, 0};
+                uint32_t id = pci_read32(&d, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF)
+                {
+                    /* Function 0 missing means the whole slot is empty */
+                    if (func == 0)
+                        break;
+                    continue;
+                }
+
+                if ((pci_read32(&d, PCI_CLASS_REVISION) & 0xFFFFFF00U) == want && index-- == 0)
+                {
+                    d.vendor = (uint16_t)id;
+                    d.device = (uint16_t)(id >> 16);
+                    *dev = d;
+                    return 0;
+                }
+
+                if (func == 0 && !(pci_read8(&d, PCI_HEADER_TYPE) & PCI_HEADER_MULTI))
+                    break;
+            }
+        }
+    }
+    return -1;
+}
+
+uint64_t pci_bar_address(const pci_dev_t *dev, int bar)
+{
+    uint8_t offset = PCI_BAR0 + bar * 4;
+    uint32_t lo = pci_read32(dev, offset);
+    if (lo & PCI_BAR_IO)
+        return 0;
+
+    uint64_t addr = lo & PCI_BAR_MEM_MASK;
+    if (lo & PCI_BAR_TYPE_64)
+        addr |= (uint64_t)pci_read32(dev, offset + 4) << 32;
+    return addr;
+}
+
+uint8_t pci_find_capability(const pci_dev_t *dev, uint8_t id)
+{
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+        return 0;
+
+    /* Bounded walk in case a broken device links its list into a loop */
+    uint8_t cap = pci_read8(dev, PCI_CAP_PTR) & 0xFC;
+    for (int i = 0; cap && i < 48; i++)
+    {
+        if (pci_read8(dev, cap) == id)
+            return cap;
+        cap = pci_read8(dev, cap + 1) & 0xFC;
+    }
+    return 0;
+}
+
+int pci_enable_msi(const pci_dev_t *dev, uint32_t cpu, uint8_t vector)
+{
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSI);
+    if (!cap)
+        return -1;
+
+    uint64_t address;
+    uint32_t data;
+    irq_msi_message(cpu, vector, &address, &data);
+
+    uint16_t control = pci_read16(dev, cap + MSI_CONTROL);
+    pci_write32(dev, cap + MSI_ADDRESS_LO, (uint32_t)address);
+    if (control & MSI_CONTROL_64BIT)
+    {
+        pci_write32(dev, cap + MSI_ADDRESS_HI, (uint32_t)(address >> 32));
+        pci_write16(dev, cap + 12, (uint16_t)data);
+    }
+    else
+    {
+        pci_write16(dev, cap + 8, (uint16_t)data);
+    }
+
+    /* One message only, then switch INTx off so the device raises nothing else */
+    control = (control & ~MSI_CONTROL_MME) | MSI_CONTROL_ENABLE;
+    pci_write16(dev, cap + MSI_CONTROL, control);
+    pci_write16(dev, PCI_COMMAND, pci_read16(dev, PCI_COMMAND) | PCI_COMMAND_INTX_OFF);
+    return 0;
+}
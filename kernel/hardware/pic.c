@@ -2,7 +2,7 @@
 #include <valen/io.h>
 #include <valen/spinlock.h>
 
-static spinlock_t pic_lock = SPINLOCK_INIT;
+static spinlock_t pic_lock = SPINLOCK_INIT_NAMED("pic");
 
 /* Helper functions to wait for PIC command completion */
 static void pic_wait_command(uint16_t port)
@@ -21,7 +21,7 @@ static void pic_wait_command(uint16_t port)
  */
 void pic_remap(uint8_t offset1, uint8_t offset2)
 {
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     /* Save current interrupt masks */
     uint8_t mask1 = inb(PIC1_DATA);
@@ -55,7 +55,7 @@ void pic_remap(uint8_t offset1, uint8_t offset2)
     outb(PIC1_DATA, mask1);
     outb(PIC2_DATA, mask2);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
 }
 
 /**
@@ -76,7 +76,7 @@ void pic_init(void)
  */
 void pic_send_eoi(uint8_t irq)
 {
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     if (irq >= 8) {
         /* Send EOI to slave PIC */
@@ -86,7 +86,7 @@ void pic_send_eoi(uint8_t irq)
     /* Always send EOI to master PIC */
     outb(PIC1_COMMAND, PIC_EOI);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
 }
 
 /**
@@ -105,12 +105,12 @@ void pic_irq_enable(uint8_t irq)
         irq -= 8;
     }
     
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     value = inb(port) & ~(1 << irq);
     outb(port, value);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
 }
 
 /**
@@ -129,12 +129,12 @@ void pic_irq_disable(uint8_t irq)
         irq -= 8;
     }
     
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     value = inb(port) | (1 << irq);
     outb(port, value);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
 }
 
 /**
@@ -142,12 +142,12 @@ void pic_irq_disable(uint8_t irq)
  */
 void pic_irq_mask_all(void)
 {
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     outb(PIC1_DATA, 0xFF);
     outb(PIC2_DATA, 0xFF);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
 }
 
 /**
@@ -155,12 +155,12 @@ void pic_irq_mask_all(void)
  */
 void pic_irq_unmask_all(void)
 {
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     outb(PIC1_DATA, 0x00);
     outb(PIC2_DATA, 0x00);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
 }
 
 /**
@@ -169,7 +169,7 @@ void pic_irq_unmask_all(void)
  */
 uint16_t pic_get_irr(void)
 {
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     outb(PIC1_COMMAND, 0x0A);    /* Read IRR command */
     uint16_t irr = inb(PIC1_COMMAND);
@@ -177,7 +177,7 @@ uint16_t pic_get_irr(void)
     outb(PIC2_COMMAND, 0x0A);    /* Read IRR command */
     irr |= (inb(PIC2_COMMAND) << 8);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
     
     return irr;
 }
@@ -188,7 +188,7 @@ uint16_t pic_get_irr(void)
  */
 uint16_t pic_get_isr(void)
 {
-    spinlock_acquire(&pic_lock);
+    uint64_t flags = spinlock_acquire_irqsave(&pic_lock);
     
     outb(PIC1_COMMAND, 0x0B);    /* Read ISR command */
     uint16_t isr = inb(PIC1_COMMAND);
@@ -196,7 +196,7 @@ uint16_t pic_get_isr(void)
     outb(PIC2_COMMAND, 0x0B);    /* Read ISR command */
     isr |= (inb(PIC2_COMMAND) << 8);
     
-    spinlock_release(&pic_lock);
+    spinlock_release_irqrestore(&pic_lock, flags);
     
     return isr;
 }
@@ -0,0 +1,273 @@
+/**
+ * @file smp.c
+ * @brief Application processor startup and per-CPU data.
+ *
+ * The BSP copies the real-mode trampoline below 1MB, then starts each AP
+ * from the MADT with the INIT-SIPI-SIPI sequence, one at a time. Each AP
+ * loads the shared GDT and IDT, points its GS base at its cpu_local_t,
+ * enables its local APIC and settles in its idle loop, waiting for the
+ * scheduler to hand it tasks.
+ */
+
+#include <valen/smp.h>
+#include <valen/percpu.h>
+#include <valen/acpi.h>
+#include <valen/apic.h>
+#include <valen/tsc.h>
+#include <valen/gdt.h>
+#include <valen/idt.h>
+#include <valen/pmm.h>
+#include <valen/page.h>
+#include <valen/paging.h>
+#include <valen/task.h>
+#include <valen/fpu.h>
+#include <valen/cpu.h>
+#include <valen/string.h>
+#include <valen/stdio.h>
+#include <valen/softirq.h>
+#include <valen/klog.h>
+
+#define IA32_GS_BASE_MSR 0xC0000101
+
+/** @brief Must match TRAMPOLINE_BASE in trampoline.s. */
+#define TRAMPOLINE_BASE 0x8000
+
+/** @brief Boot stack of each AP: 4 pages (16KB). */
+#define AP_STACK_PAGES 4
+
+/** @brief How long the BSP waits for an AP to report in. */
+#define AP_START_TIMEOUT_US 100000
+
+/**
+ * @brief Layout of trampoline_params in trampoline.s.
+ */
+typedef struct trampoline_params
+{
+    uint64_t cr3;
+    uint64_t stack;
+    uint64_t entry;
+    uint64_t arg;
+} __attribute__((packed)) trampoline_params_t;
+
+extern char trampoline_start[];
+extern char trampoline_end[];
+extern char trampoline_params[];
+
+cpu_local_t cpu_locals[MAX_CPUS];
+
+static volatile uint32_t cpus_online = 1;
+
+/* Bumped by every shootdown; CPUs flush until their tlb_gen catches up */
+static uint64_t tlb_gen;
+
+void percpu_init(uint32_t cpu)
+{
+    cpu_local_t *local = &cpu_locals[cpu];
+
+    local->self = local;
+    local->id = cpu;
+    wrmsr(IA32_GS_BASE_MSR, (uint64_t)local);
+}
+
+/**
+ * @brief First C code on an AP, called from the trampoline on its boot stack.
+ */
+static void ap_main(uint64_t cpu)
+{
+    gdt_load();
+    idt_load();
+    percpu_init(cpu);
+    tss_init(cpu);
+    paging_init_cpu();
+    lapic_enable();
+    cpu_locals[cpu].apic_id = lapic_id();
+    fpu_init_cpu();
+
+    scheduler_init_cpu();
+
+    cpu_locals[cpu].online = 1;
+    __atomic_add_fetch(&cpus_online, 1, __ATOMIC_SEQ_CST);
+
+    asm volatile("sti");
+    cpu_idle();
+}
+
+/**
+ * @brief Runs INIT-SIPI-SIPI for one AP and waits for it to come online.
+ * @return 0 once the AP is running, -1 on timeout.
+ */
+static int start_ap(uint32_t cpu, uint32_t apic_id)
+{
+    void *stack = pmm_alloc_pages(AP_STACK_PAGES);
+    if (!stack)
+        return -1;
+
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+
+    trampoline_params_t *params = (trampoline_params_t *)KERNEL_PHYS_TO_VIRT(
+        TRAMPOLINE_BASE + (trampoline_params - trampoline_start));
+    params->cr3 = cr3;
+    params->stack = (uint64_t)stack + AP_STACK_PAGES * PAGE_SIZE;
+    params->entry = (uint64_t)ap_main;
+    params->arg = cpu;
+
+    cpu_locals[cpu].apic_id = apic_id;
+
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    tsc_delay_us(10000);
+
+    for (int i = 0; i < 2; i++)
+    {
+        lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+        tsc_delay_us(200);
+    }
+
+    for (uint64_t waited = 0; waited < AP_START_TIMEOUT_US; waited += 100)
+    {
+        if (cpu_locals[cpu].online)
+            return 0;
+        tsc_delay_us(100);
+    }
+
+    /* The AP may still wake up later and use the stack, so it is not freed */
+    return -1;
+}
+
+void smp_init(void)
+{
+    cpu_locals[0].online = 1;
+
+    if (acpi_init() != 0)
+        return;
+
+    const acpi_madt_info_t *madt = acpi_get_madt();
+    lapic_init(madt->lapic_phys);
+    if (!lapic_available())
+        return;
+
+    uint32_t bsp_apic = lapic_id();
+    cpu_locals[0].apic_id = bsp_apic;
+
+    memcpy(KERNEL_PHYS_TO_VIRT(TRAMPOLINE_BASE), trampoline_start, trampoline_end - trampoline_start);
+
+    uint32_t next_cpu = 1;
+    for (uint32_t i = 0; i < madt->cpu_count && next_cpu < MAX_CPUS; i++)
+    {
+        if (madt->cpu_apic_ids[i] == bsp_apic)
+            continue;
+
+        if (start_ap(next_cpu, madt->cpu_apic_ids[i]) == 0)
+            next_cpu++;
+        else
+            klog(KLOG_WARN, "SMP: CPU with APIC ID %u did not start\n", madt->cpu_apic_ids[i]);
+    }
+
+    klog(KLOG_INFO, "SMP: %u CPUs online\n", cpus_online);
+}
+
+uint32_t smp_cpu_count(void)
+{
+    return cpus_online;
+}
+
+void smp_send_resched(uint32_t cpu)
+{
+    if (cpu == this_cpu_id() || !cpu_locals[cpu].online || !lapic_available())
+        return;
+    /* Set before the IPI, so a tick sharing the interrupt keeps the request */
+    cpu_locals[cpu].need_schedule = 1;
+    lapic_send_ipi(cpu_locals[cpu].apic_id, RESCHED_VECTOR);
+}
+
+void smp_send_tick(uint32_t cpu)
+{
+    if (cpu == this_cpu_id() || !cpu_locals[cpu].online || !lapic_available())
+        return;
+    cpu_locals[cpu].tick_pending = 1;
+    lapic_send_ipi(cpu_locals[cpu].apic_id, RESCHED_VECTOR);
+}
+
+/**
+ * @brief Handler for RESCHED_VECTOR. Runs a scheduler tick passed on by
+ * the BSP, or else asks for a switch; either way it switches on return
+ * from the interrupt unless the interrupted task has preemption disabled.
+ */
+void smp_resched_interrupt(void)
+{
+    cpu_local_t *cpu = this_cpu();
+
+    irq_enter();
+    if (cpu->tick_pending)
+    {
+        cpu->tick_pending = 0;
+        scheduler_tick();
+    }
+    else
+    {
+        cpu->need_schedule = 1;
+    }
+    lapic_eoi();
+    irq_exit();
+    preempt_schedule_irq();
+}
+
+/**
+ * @brief Flushes this CPU's TLB if a shootdown has been requested since
+ * its last flush. Called with interrupts disabled.
+ */
+static void tlb_catch_up(void)
+{
+    cpu_local_t *cpu = this_cpu();
+    uint64_t gen = __atomic_load_n(&tlb_gen, __ATOMIC_ACQUIRE);
+
+    if (cpu->tlb_gen != gen)
+    {
+        paging_flush_tlb();
+        __atomic_store_n(&cpu->tlb_gen, gen, __ATOMIC_RELEASE);
+    }
+}
+
+void smp_flush_tlb(void)
+{
+    if (cpus_online == 1 || !lapic_available())
+        return;
+
+    uint64_t flags = irq_save();
+    uint32_t self = this_cpu_id();
+    uint64_t gen = __atomic_add_fetch(&tlb_gen, 1, __ATOMIC_SEQ_CST);
+    uint64_t sent = 0;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+        if (i == self || !cpu_locals[i].online)
+            continue;
+        lapic_send_ipi(cpu_locals[i].apic_id, TLB_FLUSH_VECTOR);
+        sent |= 1ULL << i;
+    }
+    tlb_catch_up();
+
+    /* Another CPU may be doing the same with interrupts off, waiting on
+     * us: answer its request while waiting so neither spins forever */
+    for (uint32_t i = 0; i < MAX_CPUS; i++)
+    {
+        if (!(sent & (1ULL << i)))
+            continue;
+        while (__atomic_load_n(&cpu_locals[i].tlb_gen, __ATOMIC_ACQUIRE) < gen)
+        {
+            tlb_catch_up();
+            cpu_relax();
+        }
+    }
+
+    irq_restore(flags);
+}
+
+/**
+ * @brief Handler for TLB_FLUSH_VECTOR.
+ */
+void smp_tlb_flush_interrupt(void)
+{
+    tlb_catch_up();
+    lapic_eoi();
+}
@@ -6,27 +6,82 @@
 #include <valen/gdt.h>
 #include <valen/pmm.h>
 #include <valen/vmm.h>
+#include <valen/paging.h>
+#include <valen/page.h>
 #include <valen/heap.h>
+#include <valen/slab.h>
 #include <valen/shell.h>
 #include <valen/keyboard.h>
 #include <valen/task.h>
-#include <valen/pit.h>
+#include <valen/timer.h>
+#include <valen/softirq.h>
+#include <valen/uart.h>
+#include <valen/klog.h>
+#include <valen/irq.h>
+#include <valen/fpu.h>
+#include <valen/percpu.h>
+#include <valen/acpi.h>
+#include <valen/tsc.h>
+#include <valen/smp.h>
+#include <valen/bench.h>
+#include <valen/string.h>
+#include <valen/ahci.h>
+#include <valen/block.h>
+#include <valen/irqstat.h>
+#include <valen/prof.h>
+#include <valen/spinlock.h>
  
 int system_ready = 0;
  
-#define KERNEL_VIRT_OFFSET 0xFFFFFFFF80000000ULL
-#define PHYS_TO_VIRT(p) ((void *)((uint64_t)(p) + KERNEL_VIRT_OFFSET))
-#define VIRT_TO_PHYS(v) ((uint64_t)(v) - KERNEL_VIRT_OFFSET)
- 
 extern char _kernel_end[];
+
+#define CMDLINE_MAX 256
+
+/* Copied out of the boot information, which lives in memory the PMM hands out */
+static char cmdline[CMDLINE_MAX];
+
+const char *kernel_cmdline(void)
+{
+    return cmdline;
+}
+
+int kernel_cmdline_has(const char *option)
+{
+    size_t len = strlen(option);
+    const char *p = cmdline;
+
+    while (*p)
+    {
+        while (*p == ' ')
+            p++;
+        const char *word = p;
+        while (*p && *p != ' ')
+            p++;
+        if ((size_t)(p - word) == len && strncmp(word, option, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Headless runs: "bench" on the command line runs every suite at boot */
+static void bench_task_main(void)
+{
+    bench_run("all");
+}
  
 void kmain(unsigned long magic, unsigned long addr)
 {
-    print_clear();
+    string_init();
 
-    idt_init();
+    /* Per-CPU data first: every spinlock, including the console's, uses it */
     gdt_init();
-    
+    percpu_init(0);
+    tss_init(0);
+
+    print_clear();
+    idt_init();
+    uart_init();
+
     if (magic != MULTIBOOT2_BOOTLOADER_MAGIC)
     {
         while (1)
@@ -35,8 +90,9 @@ void kmain(unsigned long magic, unsigned long addr)
 
     uint64_t max_physical_addr = 0;
     struct multiboot_tag_mmap *mmap_tag = NULL;
+    struct multiboot_tag_acpi *acpi_tag = NULL;
 
-    struct multiboot_tag *tag = (struct multiboot_tag *)PHYS_TO_VIRT(addr + 8);
+    struct multiboot_tag *tag = (struct multiboot_tag *)KERNEL_PHYS_TO_VIRT(addr + 8);
     while (tag->type != MULTIBOOT_TAG_TYPE_END)
     {
         if (tag->type == MULTIBOOT_TAG_TYPE_MMAP)
@@ -53,42 +109,93 @@ void kmain(unsigned long magic, unsigned long addr)
                 }
             }
         }
+        else if (tag->type == MULTIBOOT_TAG_TYPE_CMDLINE)
+        {
+            strncpy(cmdline, ((struct multiboot_tag_string *)tag)->string, CMDLINE_MAX - 1);
+            cmdline[CMDLINE_MAX - 1] = '\0';
+        }
+        else if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW ||
+                 (tag->type == MULTIBOOT_TAG_TYPE_ACPI_OLD && !acpi_tag))
+        {
+            /* Prefer the ACPI 2.0 RSDP when the bootloader passes both */
+            acpi_tag = (struct multiboot_tag_acpi *)tag;
+        }
         tag = (struct multiboot_tag *)((uint8_t *)tag + ((tag->size + 7) & ~7));
     }
 
+    if (acpi_tag)
+        acpi_set_rsdp(acpi_tag->rsdp);
+
     if (max_physical_addr == 0)
         max_physical_addr = 0x20000000;
 
     uintptr_t kernel_phys_end = VIRT_TO_PHYS((uintptr_t)_kernel_end);
     uintptr_t bitmap_phys = (kernel_phys_end + 0x1000) & ~0xFFFULL;
+    /* The PMM's used bitmap and its magazine bitmap, 1 bit per page each */
+    uint64_t bitmap_size = (max_physical_addr / 32768) * 2 + 4096;
+
+    /* Map all RAM at DIRECT_MAP_OFFSET, with page tables taken from just past the bitmap */
+    paging_direct_map_begin(bitmap_phys + bitmap_size);
+    if (mmap_tag)
+    {
+        uint32_t entries = (mmap_tag->size - sizeof(struct multiboot_tag_mmap)) / mmap_tag->entry_size;
+        for (uint32_t i = 0; i < entries; i++)
+        {
+            if (mmap_tag->entries[i].type == MULTIBOOT_MEMORY_AVAILABLE)
+                paging_direct_map_add(mmap_tag->entries[i].addr, mmap_tag->entries[i].len);
+        }
+    }
+    else
+    {
+        paging_direct_map_add(0, max_physical_addr);
+    }
+    uintptr_t b_end = paging_direct_map_end();
+
     pmm_init((uintptr_t)PHYS_TO_VIRT(bitmap_phys), max_physical_addr);
 
     if (mmap_tag)
     {
         uint32_t entries = (mmap_tag->size - sizeof(struct multiboot_tag_mmap)) / mmap_tag->entry_size;
-        uint64_t bitmap_size = (max_physical_addr / 32768) + 4096;
-        uintptr_t b_end = bitmap_phys + bitmap_size;
 
         for (uint32_t i = 0; i < entries; i++)
         {
-            if (mmap_tag->entries[i].type == MULTIBOOT_MEMORY_AVAILABLE)
+            if (mmap_tag->entries[i].type != MULTIBOOT_MEMORY_AVAILABLE)
+                continue;
+
+            uint64_t start = mmap_tag->entries[i].addr;
+            uint64_t end = start + mmap_tag->entries[i].len;
+
+            /* Release the region around the PMM bitmap and the early page tables; the PMM keeps the low 2MB reserved */
+            if (start < bitmap_phys && end > start)
+                pmm_free_region(start, (end < bitmap_phys ? end : bitmap_phys) - start);
+            if (end > b_end)
             {
-                for (uint64_t a = mmap_tag->entries[i].addr; a < mmap_tag->entries[i].addr + mmap_tag->entries[i].len; a += 4096)
-                {
-                    if (a < 0x200000 || (a >= bitmap_phys && a < b_end))
-                        continue;
-                    pmm_mark_free(a);
-                }
+                uint64_t from = start > b_end ? start : b_end;
+                pmm_free_region(from, end - from);
             }
         }
     }
  
     vmm_init();
     heap_init();
+    slab_init();
+    fpu_init();
     keyboard_init();
-    pit_init(50);  // 50Hz timer for responsive scheduling
     scheduler_init();
-    
+    tsc_init();
+    smp_init();
+    irq_init();    // Route device IRQs through the I/O APIC when there is one
+    timer_init();  // One-shot deadlines; no periodic tick
+    softirq_init();
+    shell_commands_init(); // Subsystems below register their own commands
+    klog_init();   // Background log output from here on
+    ahci_init();   // SATA disks become block devices
+    bcache_init();
+    irqstat_init();
+    lockstat_init();
+    bench_init();
+    prof_init();
+
     // Create shell task
     task_t *shell_task = task_create(shell_task_main, "shell");
     if (!shell_task) {
@@ -96,6 +203,12 @@ void kmain(unsigned long magic, unsigned long addr)
         while (1) asm volatile("hlt");
     }
 
+    // Interactive: let the shell run ahead of default priority tasks
+    task_set_nice(shell_task, -10);
+
+    if (kernel_cmdline_has("bench") && !task_create(bench_task_main, "bench"))
+        printf("Failed to create bench task!\n");
+
     set_color(COLOR_DARK_GREY);
     puts("Type 'help' to begin.\n");
     set_color(COLOR_GREEN);
@@ -105,11 +218,6 @@ void kmain(unsigned long magic, unsigned long addr)
     /* Enable CPU interrupts */
     asm volatile ("sti");
 
-    // Start the scheduler with the first task
-    schedule();
-    
-    // Kernel should never reach here - tasks run via scheduler
-    while (1) {
-        asm volatile ("hlt");
-    }
-}
\ No newline at end of file
+    // The boot context becomes the BSP's idle task; tasks run via the scheduler
+    cpu_idle();
+}
@@ -0,0 +1,72 @@
+#include <valen/spinlock.h>
+#include <valen/shell.h>
+#include <valen/stdio.h>
+#include <valen/string.h>
+
+#ifdef CONFIG_LOCK_STAT
+#define LOCKSTAT_MAX 32
+
+typedef struct lockstat_list {
+    spinlock_t *locks[LOCKSTAT_MAX];
+    int count;
+} lockstat_list_t;
+
+/* lockstat_for_each() callback: insert by spin time, most first */
+static void collect_lock(spinlock_t *lock, void *arg)
+{
+    lockstat_list_t *list = (lockstat_list_t *)arg;
+    if (list->count == LOCKSTAT_MAX)
+        return;
+
+    int i = list->count++;
+    while (i > 0 && list->locks[i - 1]->stat.spin_cycles < lock->stat.spin_cycles) {
+        list->locks[i] = list->locks[i - 1];
+        i--;
+    }
+    list->locks[i] = lock;
+}
+
+static void cmd_lockstat(const char *arg)
+{
+    if (strcmp(arg, "reset") == 0) {
+        lockstat_reset();
+        puts("Lock statistics reset.\n");
+        return;
+    }
+
+    lockstat_list_t list;
+    list.count = 0;
+    lockstat_for_each(collect_lock, &list);
+
+    puts("\n--- Spinlock Contention (cycles) ---\n");
+    puts("  NAME          ACQUIRED  CONTENDED  SPIN TOTAL/AVG/MAX  HOLDER\n");
+    for (int i = 0; i < list.count; i++) {
+        spinlock_t *lock = list.locks[i];
+        lock_stat_t *stat = &lock->stat;
+        uint64_t avg = stat->contended ? stat->spin_cycles / stat->contended : 0;
+
+        printf("  %s", lock->name);
+        for (int pad = strlen(lock->name); pad < 14; pad++)
+            putc(' ');
+        printf("%llu  %llu  %llu/%llu/%llu  0x%llX\n",
+               stat->acquisitions, stat->contended,
+               stat->spin_cycles, avg, stat->max_spin, (uint64_t)stat->holder);
+    }
+    puts("------------------------------------\n");
+}
+#else
+static void cmd_lockstat(const char *arg)
+{
+    (void)arg;
+    puts("Lock statistics are disabled; enable LOCK_STAT in menuconfig.\n");
+}
+#endif
+
+static shell_command_t lockstat_command = {
+    "lockstat", cmd_lockstat, "Show spinlock contention (usage: lockstat [reset])"
+};
+
+void lockstat_init(void)
+{
+    shell_register(&lockstat_command);
+}
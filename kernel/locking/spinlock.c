@@ -1,52 +1,175 @@
 #include <valen/spinlock.h>
+#include <valen/percpu.h>
+#include <valen/cpu.h>
+
+#ifdef CONFIG_LOCK_STAT
+static spinlock_t *lockstat_list;
+
+/* Push a named lock on the list the first time it is taken */
+static void lockstat_register(spinlock_t *lock)
+{
+    if (!lock->name || __atomic_exchange_n(&lock->stat_listed, 1, __ATOMIC_RELAXED))
+        return;
+
+    spinlock_t *head = __atomic_load_n(&lockstat_list, __ATOMIC_RELAXED);
+    do {
+        lock->stat_next = head;
+    } while (!__atomic_compare_exchange_n(&lockstat_list, &head, lock, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Called with the lock held, so the counters have a single writer */
+static void lockstat_acquired(spinlock_t *lock, uint64_t spin, void *caller)
+{
+    lock_stat_t *stat = &lock->stat;
+
+    if (!lock->stat_listed)
+        lockstat_register(lock);
+
+    stat->acquisitions++;
+    stat->holder = caller;
+    if (spin) {
+        stat->contended++;
+        stat->spin_cycles += spin;
+        if (spin > stat->max_spin)
+            stat->max_spin = spin;
+    }
+}
+
+void lockstat_for_each(void (*fn)(spinlock_t *lock, void *arg), void *arg)
+{
+    spinlock_t *lock = __atomic_load_n(&lockstat_list, __ATOMIC_ACQUIRE);
+    for (; lock; lock = lock->stat_next)
+        fn(lock, arg);
+}
+
+void lockstat_reset(void)
+{
+    spinlock_t *lock = __atomic_load_n(&lockstat_list, __ATOMIC_ACQUIRE);
+    for (; lock; lock = lock->stat_next) {
+        lock->stat.acquisitions = 0;
+        lock->stat.contended = 0;
+        lock->stat.spin_cycles = 0;
+        lock->stat.max_spin = 0;
+    }
+}
+#endif
 
 void spinlock_init(spinlock_t *lock)
+{
+    spinlock_init_named(lock, NULL);
+}
+
+void spinlock_init_named(spinlock_t *lock, const char *name)
 {
     lock->lock = 0;
+#ifdef CONFIG_LOCK_STAT
+    lock->name = name;
+    lock->stat_next = NULL;
+    lock->stat_listed = 0;
+    lock->stat = (lock_stat_t){ 0 };
+#else
+    (void)name;
+#endif
+}
+
+/*
+ * Holding a spinlock disables preemption on the CPU, so a lock holder is
+ * never switched out by the timer while other CPUs spin on the lock.
+ *
+ * Waiters only read the lock word while they wait, so it stays shared in
+ * their caches and the only write each acquire makes is taking a ticket.
+ */
+
+static inline void ticket_lock(spinlock_t *lock, void *caller)
+{
+    preempt_disable();
+
+    uint16_t ticket = 1;
+    asm volatile (
+        "lock xaddw %0, %1"
+        : "+r" (ticket), "+m" (lock->tickets.next)
+        :
+        : "memory", "cc"
+    );
+
+#ifdef CONFIG_LOCK_STAT
+    /* Only a contended acquisition pays for reading the TSC */
+    uint64_t spin = 0;
+    if (lock->tickets.owner != ticket) {
+        uint64_t start = rdtsc();
+        while (lock->tickets.owner != ticket) {
+            asm volatile ("pause" ::: "memory");
+        }
+        spin = rdtsc() - start;
+        if (!spin)
+            spin = 1;
+    }
+    lockstat_acquired(lock, spin, caller);
+#else
+    (void)caller;
+    while (lock->tickets.owner != ticket) {
+        asm volatile ("pause" ::: "memory");
+    }
+#endif
 }
 
 void spinlock_acquire(spinlock_t *lock)
 {
-    while (1) {
-        uint32_t expected = 0;
-        uint32_t desired = 1;
-        
+    ticket_lock(lock, __builtin_return_address(0));
+}
+
+void spinlock_release(spinlock_t *lock)
+{
+    // Only the holder writes owner, so no lock prefix is needed; x86 keeps
+    // the store ordered after the critical section's stores
+    asm volatile (
+        "incw %0"
+        : "+m" (lock->tickets.owner)
+        :
+        : "memory", "cc"
+    );
+
+    preempt_enable();
+}
+
+uint8_t spinlock_try_acquire(spinlock_t *lock)
+{
+    preempt_disable();
+
+    // Free only while owner == next; take a ticket in the same swap
+    uint32_t old = lock->lock;
+    uint32_t expected = old;
+    uint32_t desired = old + (1U << 16);
+
+    if ((old & 0xFFFF) == (old >> 16)) {
         asm volatile (
             "lock cmpxchgl %2, %1"
             : "+a" (expected), "+m" (lock->lock)
             : "r" (desired)
             : "memory", "cc"
         );
-        
-        if (expected == 0) {
-            break;
+        if (expected == old) {
+#ifdef CONFIG_LOCK_STAT
+            lockstat_acquired(lock, 0, __builtin_return_address(0));
+#endif
+            return 1;
         }
-        
-        asm volatile ("pause");
     }
+
+    preempt_enable();
+    return 0;
 }
 
-void spinlock_release(spinlock_t *lock)
+uint64_t spinlock_acquire_irqsave(spinlock_t *lock)
 {
-    asm volatile (
-        "movl $0, %0"
-        : "=m" (lock->lock)
-        :
-        : "memory"
-    );
+    uint64_t flags = irq_save();
+    ticket_lock(lock, __builtin_return_address(0));
+    return flags;
 }
 
-uint8_t spinlock_try_acquire(spinlock_t *lock)
+void spinlock_release_irqrestore(spinlock_t *lock, uint64_t flags)
 {
-    uint32_t expected = 0;
-    uint32_t desired = 1;
-    
-    asm volatile (
-        "lock cmpxchgl %2, %1"
-        : "+a" (expected), "+m" (lock->lock)
-        : "r" (desired)
-        : "memory", "cc"
-    );
-    
-    return (expected == 0);
-}
\ No newline at end of file
+    spinlock_release(lock);
+    irq_restore(flags);
+}
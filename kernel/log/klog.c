@@ -0,0 +1,448 @@
+#include <stdarg.h>
+#include <valen/klog.h>
+#include <valen/percpu.h>
+#include <valen/cpu.h>
+#include <valen/heap.h>
+#include <valen/stdio.h>
+#include <valen/string.h>
+#include <valen/task.h>
+#include <valen/timer.h>
+#include <valen/wait.h>
+#include <valen/shell.h>
+
+/*
+ * Each CPU owns one ring and is its only writer; it writes with
+ * interrupts off, so records never interleave. Readers never block the
+ * writer. When the ring is full the writer drops the oldest records by
+ * moving tail past them before it overwrites them. A reader copies a
+ * record out and then re-checks tail: if tail has moved past the copy's
+ * start, the copy may be torn and the reader starts over at the new
+ * tail. Positions count bytes ever written and are masked on use.
+ */
+
+#define LOG_MAX_ARGS 8
+#define LOG_MAX_STRING 64
+#define LOG_MAX_RECORD 256
+#define LOG_LINE_MAX 256
+
+// Batch records for this long before klogd runs
+#define KLOG_FLUSH_DELAY NSEC_PER_MSEC
+
+// Records at or above this importance also go to the screen
+#define KLOG_CONSOLE_LEVEL KLOG_WARN
+
+typedef struct log_record {
+    uint64_t timestamp;     // timer_now() when logged
+    const char *fmt;
+    uint16_t size;          // Bytes including the header; a multiple of 8
+    uint8_t level;
+    uint8_t nargs;
+    uint32_t cpu;
+    uint64_t args[];        // Then the copied strings; %s args are offsets to them
+} log_record_t;
+
+typedef struct log_ring {
+    uint8_t data[KLOG_RING_SIZE];
+    uint64_t head;          // End of the newest record
+    uint64_t tail;          // Start of the oldest record still intact
+} log_ring_t;
+
+// Where one reader is in every ring, and the next record of each
+typedef struct log_reader {
+    uint64_t pos[MAX_CPUS];
+    int loaded[MAX_CPUS];
+    uint64_t rec[MAX_CPUS][LOG_MAX_RECORD / 8];
+} log_reader_t;
+
+static log_ring_t rings[MAX_CPUS];
+
+static log_reader_t klogd_reader;
+static log_reader_t dump_reader;
+static wait_queue_t klogd_wait = WAIT_QUEUE_INIT;
+static timer_t flush_timer;
+static int flush_armed;     // Set by the klog() that arms flush_timer
+static int klogd_ready;
+
+static void ring_copy_in(log_ring_t *ring, uint64_t pos, const void *src, uint64_t len) {
+    uint64_t off = pos & (KLOG_RING_SIZE - 1);
+    uint64_t first = len < KLOG_RING_SIZE - off ? len : KLOG_RING_SIZE - off;
+    memcpy(&ring->data[off], src, first);
+    memcpy(ring->data, (const uint8_t *)src + first, len - first);
+}
+
+static void ring_copy_out(log_ring_t *ring, uint64_t pos, void *dst, uint64_t len) {
+    uint64_t off = pos & (KLOG_RING_SIZE - 1);
+    uint64_t first = len < KLOG_RING_SIZE - off ? len : KLOG_RING_SIZE - off;
+    memcpy(dst, &ring->data[off], first);
+    memcpy((uint8_t *)dst + first, ring->data, len - first);
+}
+
+/**
+ * @brief Store the arguments @p fmt consumes in @p rec
+ *
+ * @return Size of the record, header included
+ */
+static uint64_t capture_args(log_record_t *rec, const char *fmt, va_list args) {
+    char *strings = (char *)&rec->args[LOG_MAX_ARGS];
+    char *end = (char *)rec + LOG_MAX_RECORD;
+    char *next = strings;
+
+    rec->nargs = 0;
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%' || !p[1]) continue;
+        p++;
+
+        int longs = 0;
+        while (*p == 'l') {
+            longs++;
+            p++;
+        }
+        if (!*p) break;
+        if (*p == '%') continue;
+        if (rec->nargs == LOG_MAX_ARGS) break;
+
+        uint64_t value;
+        switch (*p) {
+            case 'd':
+            case 'i':
+                value = longs ? (uint64_t)va_arg(args, long long) : (uint64_t)(int64_t)va_arg(args, int);
+                break;
+            case 'p':
+                value = (uint64_t)va_arg(args, void *);
+                break;
+            case 's': {
+                const char *s = va_arg(args, const char *);
+                if (!s) s = "(null)";
+                if (next == end) {
+                    // Area full: point at the last terminator, an empty string
+                    value = next - 1 - strings;
+                    break;
+                }
+                value = next - strings;
+                for (int n = 0; *s && n < LOG_MAX_STRING - 1 && next < end - 1; n++) {
+                    *next++ = *s++;
+                }
+                *next++ = '\0';
+                break;
+            }
+            default:
+                value = longs ? va_arg(args, unsigned long long) : va_arg(args, unsigned int);
+                break;
+        }
+        rec->args[rec->nargs++] = value;
+    }
+
+    // Close the gap between the arguments and the strings
+    uint64_t used = next - strings;
+    memmove(&rec->args[rec->nargs], strings, used);
+    return (sizeof(log_record_t) + rec->nargs * sizeof(uint64_t) + used + 7) & ~7ULL;
+}
+
+static void flush_timer_fn(void *data) {
+    (void)data;
+    // Records logged from here on arm the timer again; earlier ones are
+    // read by the klogd we are about to wake
+    __atomic_store_n(&flush_armed, 0, __ATOMIC_RELEASE);
+    wake_up(&klogd_wait);
+}
+
+void klog(int level, const char *fmt, ...) {
+    uint64_t buf[LOG_MAX_RECORD / 8];
+    log_record_t *rec = (log_record_t *)buf;
+
+    va_list args;
+    va_start(args, fmt);
+    uint64_t size = capture_args(rec, fmt, args);
+    va_end(args);
+
+    rec->fmt = fmt;
+    rec->size = size;
+    rec->level = level;
+
+    uint64_t flags = irq_save();
+    log_ring_t *ring = &rings[this_cpu_id()];
+    rec->cpu = this_cpu_id();
+    rec->timestamp = timer_now();
+
+    uint64_t head = ring->head;
+    uint64_t tail = ring->tail;
+    if (head + size - tail > KLOG_RING_SIZE) {
+        while (head + size - tail > KLOG_RING_SIZE) {
+            uint16_t old;
+            ring_copy_out(ring, tail + offsetof(log_record_t, size), &old, sizeof(old));
+            tail += old;
+        }
+        // Readers must see the records go before their bytes change
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    ring_copy_in(ring, head, rec, size);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+    irq_restore(flags);
+
+    // Any CPU may get here; only the one that sets the flag arms the timer
+    if (klogd_ready && !__atomic_exchange_n(&flush_armed, 1, __ATOMIC_ACQUIRE)) {
+        timer_add(&flush_timer, timer_now() + KLOG_FLUSH_DELAY);
+    }
+}
+
+/**
+ * @brief Copy the record at @p pos in @p ring out to @p dst
+ *
+ * Moves @p pos up to the oldest intact record if the writer has passed it.
+ *
+ * @return 1 if a record was copied, 0 if @p pos is at the head
+ */
+static int ring_read(log_ring_t *ring, uint64_t *pos, log_record_t *dst) {
+    for (;;) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (*pos < tail) *pos = tail;
+        if (*pos >= head) return 0;
+
+        ring_copy_out(ring, *pos, dst, sizeof(log_record_t));
+        uint16_t size = dst->size;
+        int valid = size >= sizeof(log_record_t) && size <= LOG_MAX_RECORD && !(size & 7);
+        if (valid) {
+            ring_copy_out(ring, *pos, dst, size);
+        }
+
+        // Overwritten while we copied: the copy may be torn
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) > *pos) continue;
+
+        if (!valid) {
+            *pos = head;    // Never written by klog(); skip what is there
+            return 0;
+        }
+        return 1;
+    }
+}
+
+static void reader_init(log_reader_t *reader) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        reader->pos[i] = 0;     // Before every tail, so it starts at the oldest
+        reader->loaded[i] = 0;
+    }
+}
+
+/**
+ * @brief Next record across all CPUs, in timestamp order
+ *
+ * @return The record, valid until the next call, or NULL if none is left
+ */
+static log_record_t *reader_next(log_reader_t *reader) {
+    int best = -1;
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        log_record_t *rec = (log_record_t *)reader->rec[i];
+        if (!reader->loaded[i]) {
+            reader->loaded[i] = ring_read(&rings[i], &reader->pos[i], rec);
+        }
+        if (reader->loaded[i] &&
+            (best < 0 || rec->timestamp < ((log_record_t *)reader->rec[best])->timestamp)) {
+            best = i;
+        }
+    }
+    if (best < 0) return NULL;
+
+    log_record_t *rec = (log_record_t *)reader->rec[best];
+    reader->loaded[best] = 0;
+    reader->pos[best] += rec->size;
+    return rec;
+}
+
+static int reader_pending(log_reader_t *reader) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (reader->loaded[i] || __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE) > reader->pos[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Bounded output for render()
+typedef struct line_buf {
+    char *data;
+    int len;
+} line_buf_t;
+
+static void line_char(line_buf_t *line, char c) {
+    if (line->len < LOG_LINE_MAX - 2) {
+        line->data[line->len++] = c;
+    }
+}
+
+static void line_uint(line_buf_t *line, uint64_t value, unsigned base, int upper, int min_digits) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char buf[64];
+    int n = 0;
+
+    do {
+        buf[n++] = digits[value % base];
+        value /= base;
+    } while (value);
+    while (n < min_digits) buf[n++] = '0';
+    while (n) line_char(line, buf[--n]);
+}
+
+/**
+ * @brief Format @p rec as one line: "[seconds.micros] message\n"
+ */
+static void render(const log_record_t *rec, char *out) {
+    line_buf_t line = { out, 0 };
+    const char *strings = (const char *)&rec->args[rec->nargs];
+    const char *end = (const char *)rec + rec->size;
+    int argi = 0;
+
+    uint64_t us = rec->timestamp / NSEC_PER_USEC;
+    line_char(&line, '[');
+    uint64_t secs = us / 1000000;
+    for (uint64_t pad = 10000; pad > 1 && secs < pad; pad /= 10) line_char(&line, ' ');
+    line_uint(&line, secs, 10, 0, 1);
+    line_char(&line, '.');
+    line_uint(&line, us % 1000000, 10, 0, 6);
+    line_char(&line, ']');
+    line_char(&line, ' ');
+
+    for (const char *p = rec->fmt; *p; p++) {
+        if (*p != '%' || !p[1]) {
+            line_char(&line, *p);
+            continue;
+        }
+        p++;
+        while (*p == 'l') p++;
+        if (!*p) break;
+        if (*p == '%') {
+            line_char(&line, '%');
+            continue;
+        }
+        if (argi == rec->nargs) continue;
+
+        uint64_t value = rec->args[argi++];
+        switch (*p) {
+            case 'd':
+            case 'i':
+                if ((int64_t)value < 0) {
+                    line_char(&line, '-');
+                    value = -value;
+                }
+                line_uint(&line, value, 10, 0, 1);
+                break;
+            case 'u': line_uint(&line, value, 10, 0, 1); break;
+            case 'x': line_uint(&line, value, 16, 0, 1); break;
+            case 'X': line_uint(&line, value, 16, 1, 1); break;
+            case 'o': line_uint(&line, value, 8, 0, 1); break;
+            case 'b': line_uint(&line, value, 2, 0, 1); break;
+            case 'p':
+                line_char(&line, '0');
+                line_char(&line, 'x');
+                line_uint(&line, value, 16, 0, 1);
+                break;
+            case 'c': line_char(&line, (char)value); break;
+            case 's':
+                for (const char *s = strings + value; s < end && *s; s++) line_char(&line, *s);
+                break;
+            default:
+                line_char(&line, '%');
+                line_char(&line, *p);
+                break;
+        }
+    }
+
+    if (!line.len || out[line.len - 1] != '\n') {
+        out[line.len++] = '\n';
+    }
+    out[line.len] = '\0';
+}
+
+/**
+ * @brief Formats records in the background and writes them to the sinks
+ */
+static void klogd_main(void) {
+    static char line[LOG_LINE_MAX];
+
+    while (1) {
+        wait_event(klogd_wait, reader_pending(&klogd_reader));
+
+        log_record_t *rec;
+        while ((rec = reader_next(&klogd_reader))) {
+            render(rec, line);
+            serial_write(line);
+            if (rec->level <= KLOG_CONSOLE_LEVEL) {
+                puts(line);
+            }
+        }
+    }
+}
+
+static void cmd_dmesg(const char *arg);
+
+static shell_command_t dmesg_command = {
+    "dmesg", cmd_dmesg, "Show the kernel log"
+};
+
+void klog_init(void) {
+    shell_register(&dmesg_command);
+
+    reader_init(&klogd_reader);
+    timer_setup(&flush_timer, flush_timer_fn, NULL);
+
+    task_t *task = task_create(klogd_main, "klogd");
+    if (!task) {
+        printf("klog: cannot start klogd\n");
+        return;
+    }
+    task_set_nice(task, 10);
+    klogd_ready = 1;
+
+    // Whatever was logged during boot
+    wake_up(&klogd_wait);
+}
+
+void klog_dmesg(void) {
+    log_reader_t *reader = malloc(sizeof(log_reader_t));
+    char *line = malloc(LOG_LINE_MAX);
+    if (!reader || !line) {
+        free(reader);
+        free(line);
+        puts("dmesg: out of memory\n");
+        return;
+    }
+
+    reader_init(reader);
+    log_record_t *rec;
+    while ((rec = reader_next(reader))) {
+        render(rec, line);
+        puts(line);
+    }
+
+    free(line);
+    free(reader);
+}
+
+void klog_dump(int count) {
+    static char line[LOG_LINE_MAX];
+
+    // Count first, then print only the newest records
+    int total = 0;
+    reader_init(&dump_reader);
+    while (reader_next(&dump_reader)) total++;
+
+    reader_init(&dump_reader);
+    for (int i = 0; i < total; i++) {
+        log_record_t *rec = reader_next(&dump_reader);
+        if (!rec) break;
+        if (i < total - count) continue;
+
+        render(rec, line);
+        puts(line);
+        serial_write(line);
+    }
+}
+
+static void cmd_dmesg(const char *arg) {
+    (void)arg; // Unused parameter
+    klog_dmesg();
+}
@@ -0,0 +1,47 @@
+#include <stddef.h>
+#include <valen/ksyms.h>
+
+// Generated into obj/ksyms.s at link time. Weak, so the first link,
+// which has no table yet, sees zero.
+extern const ksym_t ksym_table[] __attribute__((weak));
+extern const uint64_t ksym_table_size __attribute__((weak));
+
+extern char _code_start[], _code_end[];
+
+uint64_t ksym_count(void) {
+    return &ksym_table_size ? ksym_table_size : 0;
+}
+
+int ksym_is_text(uint64_t addr) {
+    return addr >= (uint64_t)_code_start && addr < (uint64_t)_code_end;
+}
+
+int64_t ksym_index(uint64_t addr) {
+    uint64_t count = ksym_count();
+    if (!count || !ksym_is_text(addr) || addr < ksym_table[0].addr)
+        return -1;
+
+    // Last entry at or below addr
+    uint64_t lo = 0, hi = count;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (ksym_table[mid].addr <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return (int64_t)lo;
+}
+
+const ksym_t *ksym_get(uint64_t index) {
+    return &ksym_table[index];
+}
+
+const char *ksym_lookup(uint64_t addr, uint64_t *offset) {
+    int64_t index = ksym_index(addr);
+    if (index < 0)
+        return NULL;
+    if (offset)
+        *offset = addr - ksym_table[index].addr;
+    return ksym_table[index].name;
+}
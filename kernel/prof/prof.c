@@ -0,0 +1,395 @@
+#include <valen/prof.h>
+#include <valen/ksyms.h>
+#include <valen/percpu.h>
+#include <valen/cpu.h>
+#include <valen/heap.h>
+#include <valen/page.h>
+#include <valen/pmm.h>
+#include <valen/rcu.h>
+#include <valen/shell.h>
+#include <valen/stdio.h>
+#include <valen/string.h>
+#include <valen/task.h>
+#include <valen/timer.h>
+
+/*
+ * Each CPU owns one ring and is its only writer; it writes from the
+ * clock event interrupt, so samples never interleave. head counts the
+ * samples written and is stored with release order after the sample, so
+ * a reader that loads it with acquire order sees whole samples. The
+ * rings only fill up; prof_start() empties them again.
+ */
+
+#define PROF_PERIOD (NSEC_PER_SEC / PROF_HZ)
+#define PROF_RING_PAGES (PROF_RING_SIZE * sizeof(prof_sample_t) / PAGE_SIZE)
+
+#define PROF_TOP_FUNCS 20
+#define PROF_TOP_TASKS 32
+#define PROF_LINE_MAX 512
+
+typedef struct prof_ring {
+    prof_sample_t *samples;
+    volatile uint32_t head;     // Samples written
+    uint32_t dropped;           // Samples lost to a full ring
+    timer_t timer;              // Paces this CPU's samples
+    uint64_t sampled;           // Deadline of the timer's last sample
+} prof_ring_t;
+
+static prof_ring_t rings[MAX_CPUS];
+static volatile int running;
+
+static void prof_timer_fn(void *data) {
+    timer_t *timer = data;
+    if (!running) return;
+
+    // Keep to the grid, unless we fell behind it
+    uint64_t now = timer_now();
+    uint64_t next = timer->expires + PROF_PERIOD;
+    if (next <= now) next = now + PROF_PERIOD;
+    timer_add(timer, next);
+}
+
+// Runs pinned to one CPU, so the timer lands on that CPU's wheel
+static void prof_arm_main(void) {
+    prof_ring_t *ring = &rings[this_cpu_id()];
+    timer_add(&ring->timer, timer_now() + PROF_PERIOD);
+}
+
+int prof_start(void) {
+    if (running) return 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        prof_ring_t *ring = &rings[cpu];
+        if (!cpu_locals[cpu].online) continue;
+
+        if (!ring->samples) {
+            ring->samples = pmm_alloc_pages(PROF_RING_PAGES);
+            if (!ring->samples) return -1;
+            timer_setup(&ring->timer, prof_timer_fn, &ring->timer);
+        }
+        ring->head = 0;
+        ring->dropped = 0;
+        ring->sampled = 0;
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+    if (!timer_is_percpu()) {
+        // Every timer runs on the BSP, so only the BSP is worth a timer
+        timer_add(&rings[0].timer, timer_now() + PROF_PERIOD);
+        return 0;
+    }
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!cpu_locals[cpu].online) continue;
+        if (!task_create_on(prof_arm_main, "profarm", 1ULL << cpu)) {
+            prof_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void prof_stop(void) {
+    if (!running) return;
+    running = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!rings[cpu].samples) continue;
+        // A callback that saw running set may re-arm while we wait for it
+        timer_cancel(&rings[cpu].timer);
+        timer_cancel(&rings[cpu].timer);
+    }
+}
+
+int prof_running(void) {
+    return running;
+}
+
+/*
+ * Follow the saved frame pointers up the task's stack. Every frame must
+ * lie above the last one and inside the stack, and every return address
+ * must be kernel text, so a frame built by code without frame pointers
+ * ends the walk instead of faulting.
+ */
+static uint32_t walk_frames(task_t *task, task_context_t *regs, uint64_t *stack) {
+    if (!task || !task->stack) return 0;
+
+    uint64_t lo = regs->rsp;
+    uint64_t hi = (uint64_t)task->stack + task->stack_size;
+    uint64_t fp = regs->rbp;
+    uint32_t depth = 0;
+
+    while (depth < PROF_DEPTH && fp >= lo && fp + 16 <= hi && !(fp & 7)) {
+        uint64_t *frame = (uint64_t *)fp;
+        if (!ksym_is_text(frame[1])) break;
+        stack[depth++] = frame[1];
+        if (frame[0] <= fp) break;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+void prof_tick(task_context_t *regs) {
+    if (!running) return;
+
+    cpu_local_t *cpu = this_cpu();
+    prof_ring_t *ring = &rings[cpu->id];
+    if (!ring->samples) return;
+
+    // The clock event also fires for every other timer on this CPU. Only
+    // the interrupt that finds our deadline due takes a sample, once
+    uint64_t expires = ring->timer.expires;
+    if (!ring->timer.pending || expires > timer_now() || expires == ring->sampled) return;
+    ring->sampled = expires;
+
+    uint32_t head = ring->head;
+    if (head == PROF_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+
+    prof_sample_t *sample = &ring->samples[head];
+    task_t *task = cpu->current;
+    sample->rip = regs->rip;
+    sample->pid = task ? task->pid : 0;
+    sample->depth = walk_frames(task, regs, sample->stack);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t ring_count(int cpu) {
+    if (!rings[cpu].samples) return 0;
+    return __atomic_load_n(&rings[cpu].head, __ATOMIC_ACQUIRE);
+}
+
+// Copy the command name of pid, or "?" if it has exited
+static void task_comm(uint32_t pid, char *comm) {
+    rcu_read_lock();
+    task_t *task = find_task_by_pid(pid);
+    if (task) {
+        memcpy(comm, task->comm, sizeof(task->comm));
+        comm[sizeof(task->comm) - 1] = '\0';
+    } else {
+        strcpy(comm, pid ? "?" : "idle");
+    }
+    rcu_read_unlock();
+}
+
+static void pad(uint64_t value, int width) {
+    int digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+    for (; digits < width; digits++) putc(' ');
+}
+
+// Hits and their share of total, right-aligned under the HITS and % headings
+static void print_share(uint64_t hits, uint64_t total) {
+    uint64_t permille = hits * 1000 / total;
+    putc(' ');
+    pad(hits, 7);
+    printf("%llu  ", hits);
+    pad(permille / 10, 3);
+    printf("%llu.%llu%%  ", permille / 10, permille % 10);
+}
+
+typedef struct prof_task_hits {
+    uint32_t pid;
+    uint64_t hits;
+} prof_task_hits_t;
+
+static void print_tasks(uint64_t total) {
+    prof_task_hits_t tasks[PROF_TOP_TASKS];
+    int ntasks = 0;
+    uint64_t other = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint32_t count = ring_count(cpu);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t pid = rings[cpu].samples[i].pid;
+            int t = 0;
+            while (t < ntasks && tasks[t].pid != pid) t++;
+            if (t == ntasks) {
+                if (ntasks == PROF_TOP_TASKS) {
+                    other++;
+                    continue;
+                }
+                tasks[ntasks].pid = pid;
+                tasks[ntasks].hits = 0;
+                ntasks++;
+            }
+            tasks[t].hits++;
+        }
+    }
+
+    puts("\n    HITS       %  PID   TASK\n");
+    for (int n = 0; n < ntasks; n++) {
+        // Busiest remaining task next
+        int best = n;
+        for (int t = n + 1; t < ntasks; t++) {
+            if (tasks[t].hits > tasks[best].hits) best = t;
+        }
+        prof_task_hits_t swap = tasks[n];
+        tasks[n] = tasks[best];
+        tasks[best] = swap;
+
+        char comm[sizeof(((task_t *)0)->comm)];
+        task_comm(tasks[n].pid, comm);
+        print_share(tasks[n].hits, total);
+        printf("%u", tasks[n].pid);
+        pad(tasks[n].pid, 5);
+        printf(" %s\n", comm);
+    }
+    if (other) {
+        print_share(other, total);
+        puts("      (other tasks)\n");
+    }
+}
+
+void prof_dump(void) {
+    uint64_t total = 0, dropped = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += ring_count(cpu);
+        dropped += rings[cpu].dropped;
+    }
+
+    printf("\n--- Profile: %llu samples, %llu dropped ---\n", total, dropped);
+    if (!total) return;
+
+    uint64_t nsyms = ksym_count();
+    uint32_t *hits = NULL;
+    if (nsyms) {
+        hits = malloc(nsyms * sizeof(uint32_t));
+        if (!hits) {
+            puts("prof: out of memory.\n");
+            return;
+        }
+        memset(hits, 0, nsyms * sizeof(uint32_t));
+    }
+
+    uint64_t unknown = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint32_t count = ring_count(cpu);
+        for (uint32_t i = 0; i < count; i++) {
+            int64_t index = ksym_index(rings[cpu].samples[i].rip);
+            if (index < 0 || !hits)
+                unknown++;
+            else
+                hits[index]++;
+        }
+    }
+
+    puts("    HITS       %  FUNCTION\n");
+    for (int n = 0; n < PROF_TOP_FUNCS && hits; n++) {
+        uint64_t best = 0;
+        for (uint64_t i = 1; i < nsyms; i++) {
+            if (hits[i] > hits[best]) best = i;
+        }
+        if (!hits[best]) break;
+
+        print_share(hits[best], total);
+        printf("%s\n", ksym_get(best)->name);
+        hits[best] = 0;
+    }
+    if (unknown) {
+        print_share(unknown, total);
+        puts(nsyms ? "(outside kernel text)\n" : "(no symbol table)\n");
+    }
+    free(hits);
+
+    print_tasks(total);
+}
+
+static int append(char *line, int len, const char *str) {
+    while (*str && len < PROF_LINE_MAX - 1) line[len++] = *str++;
+    line[len] = '\0';
+    return len;
+}
+
+static int append_uint(char *line, int len, uint64_t value) {
+    char digits[21];
+    int n = sizeof(digits) - 1;
+    digits[n] = '\0';
+    do {
+        digits[--n] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    return append(line, len, &digits[n]);
+}
+
+static int append_frame(char *line, int len, uint64_t addr) {
+    len = append(line, len, ";");
+
+    const char *name = ksym_lookup(addr, NULL);
+    if (name) return append(line, len, name);
+
+    char hex[19] = "0x";
+    for (int i = 0; i < 16; i++) {
+        hex[2 + i] = "0123456789abcdef"[(addr >> (60 - 4 * i)) & 0xF];
+    }
+    hex[18] = '\0';
+    return append(line, len, hex);
+}
+
+void prof_stream(void) {
+    char line[PROF_LINE_MAX];
+    char comm[sizeof(((task_t *)0)->comm)];
+    uint32_t comm_pid = ~0u;
+    uint64_t lines = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint32_t count = ring_count(cpu);
+        for (uint32_t i = 0; i < count; i++) {
+            const prof_sample_t *sample = &rings[cpu].samples[i];
+
+            // Samples of one task come in runs, so look each name up once
+            if (sample->pid != comm_pid) {
+                task_comm(sample->pid, comm);
+                comm_pid = sample->pid;
+            }
+
+            int len = append(line, 0, comm);
+            len = append(line, len, "-");
+            len = append_uint(line, len, sample->pid);
+            for (uint32_t d = sample->depth; d > 0; d--) {
+                len = append_frame(line, len, sample->stack[d - 1]);
+            }
+            len = append_frame(line, len, sample->rip);
+            append(line, len, " 1\n");
+
+            serial_write(line);
+            lines++;
+        }
+    }
+    printf("prof: wrote %llu stacks to the serial port.\n", lines);
+}
+
+static void cmd_prof(const char *arg) {
+    if (strcmp(arg, "start") == 0) {
+        if (prof_start() < 0)
+            puts("prof: could not allocate sample buffers.\n");
+        else
+            printf("Profiling at %d Hz.\n", PROF_HZ);
+    } else if (strcmp(arg, "stop") == 0) {
+        prof_stop();
+        puts("Profiling stopped.\n");
+    } else if (strcmp(arg, "dump") == 0) {
+        prof_dump();
+    } else if (strcmp(arg, "raw") == 0) {
+        prof_stream();
+    } else if (*arg == '\0') {
+        puts(prof_running() ? "Profiler running.\n" : "Profiler stopped.\n");
+    } else {
+        puts("Usage: prof start|stop|dump|raw\n");
+    }
+}
+
+static shell_command_t prof_command = {
+    "prof", cmd_prof, "Sample kernel CPU time (usage: prof start|stop|dump|raw)"
+};
+
+void prof_init(void) {
+    shell_register(&prof_command);
+}
@@ -0,0 +1,167 @@
+#include <valen/rcu.h>
+#include <valen/spinlock.h>
+#include <valen/wait.h>
+
+/*
+ * One grace period runs at a time. It starts with a mask of the online
+ * CPUs that are not idle; each CPU clears its bit at its next quiescent
+ * state and the CPU that clears the last bit ends the grace period.
+ * Callbacks queued while one is running wait for the next, which starts
+ * straight away.
+ *
+ * An idle CPU executes no readers, so it is left out of new grace periods
+ * and reports the current one on its way into hlt. Leaving idle is ordered
+ * before any read that follows, so a reader that starts after a grace
+ * period began cannot see what was unlinked before it.
+ */
+typedef struct rcu_list {
+    rcu_head_t *head;
+    rcu_head_t **tail;
+} rcu_list_t;
+
+static spinlock_t rcu_lock = SPINLOCK_INIT_NAMED("rcu");
+static volatile uint64_t gp_mask;   // CPUs yet to pass a quiescent state
+static int gp_active;
+static rcu_list_t next_cbs = { NULL, &next_cbs.head };  // Waiting for a grace period to start
+static rcu_list_t wait_cbs = { NULL, &wait_cbs.head };  // Waiting for the current one to end
+static rcu_list_t done_cbs = { NULL, &done_cbs.head };  // Ready to run
+
+static wait_queue_t sync_wait = WAIT_QUEUE_INIT;
+
+static void list_splice(rcu_list_t *to, rcu_list_t *from) {
+    if (!from->head) return;
+    *to->tail = from->head;
+    to->tail = from->tail;
+    from->head = NULL;
+    from->tail = &from->head;
+}
+
+static void gp_start(void);
+
+// Called with rcu_lock held
+static void gp_end(void) {
+    list_splice(&done_cbs, &wait_cbs);
+    gp_active = 0;
+    if (next_cbs.head) {
+        gp_start();
+    }
+}
+
+// Called with rcu_lock held
+static void gp_start(void) {
+    // Order the callers' unlinking before the idle flags are read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    uint64_t mask = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (cpu_locals[i].online && !cpu_locals[i].rcu_idle) {
+            mask |= 1ULL << i;
+        }
+    }
+
+    list_splice(&wait_cbs, &next_cbs);
+    gp_active = 1;
+    gp_mask = mask;
+    if (!mask) {
+        gp_end();
+    }
+}
+
+// Called with rcu_lock held
+static void report_qs(uint32_t cpu) {
+    uint64_t bit = 1ULL << cpu;
+    if (gp_mask & bit) {
+        gp_mask &= ~bit;
+        if (!gp_mask) {
+            gp_end();
+        }
+    }
+}
+
+static void run_callbacks(void) {
+    if (!done_cbs.head) return;
+
+    uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+    rcu_head_t *head = done_cbs.head;
+    done_cbs.head = NULL;
+    done_cbs.tail = &done_cbs.head;
+    spinlock_release_irqrestore(&rcu_lock, flags);
+
+    while (head) {
+        rcu_head_t *next = head->next;
+        head->func(head);
+        head = next;
+    }
+}
+
+/**
+ * @brief Queue @p func to run on @p head after a grace period
+ */
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head)) {
+    head->next = NULL;
+    head->func = func;
+
+    uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+    *next_cbs.tail = head;
+    next_cbs.tail = &head->next;
+    if (!gp_active) {
+        gp_start();
+    }
+    spinlock_release_irqrestore(&rcu_lock, flags);
+}
+
+typedef struct rcu_sync {
+    rcu_head_t head;
+    volatile int done;
+} rcu_sync_t;
+
+static void sync_done(rcu_head_t *head) {
+    container_of(head, rcu_sync_t, head)->done = 1;
+    // The queue is shared, so waking it never touches the waiter's stack
+    wake_up(&sync_wait);
+}
+
+/**
+ * @brief Wait for every read-side section that started before the call
+ */
+void synchronize_rcu(void) {
+    rcu_sync_t sync = { .done = 0 };
+    call_rcu(&sync.head, sync_done);
+    wait_event(sync_wait, sync.done);
+}
+
+/**
+ * @brief Quiescent state: the calling task holds no locks and no reader
+ * is active on this CPU. Runs callbacks whose grace period has ended.
+ */
+void rcu_note_qs(void) {
+    uint32_t cpu = this_cpu_id();
+
+    if (gp_mask & (1ULL << cpu)) {
+        uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+        report_qs(cpu);
+        spinlock_release_irqrestore(&rcu_lock, flags);
+    }
+    run_callbacks();
+}
+
+/**
+ * @brief The CPU is about to halt: leave it out of grace periods until
+ * rcu_idle_exit(). Called with interrupts disabled.
+ */
+void rcu_idle_enter(void) {
+    cpu_local_t *cpu = this_cpu();
+
+    // Under the lock, so a grace period starting now either sees the flag
+    // or has its bit cleared here
+    uint64_t flags = spinlock_acquire_irqsave(&rcu_lock);
+    cpu->rcu_idle = 1;
+    report_qs(cpu->id);
+    spinlock_release_irqrestore(&rcu_lock, flags);
+
+    run_callbacks();
+}
+
+void rcu_idle_exit(void) {
+    __atomic_store_n(&this_cpu()->rcu_idle, 0, __ATOMIC_SEQ_CST);
+}
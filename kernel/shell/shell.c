@@ -3,15 +3,19 @@
  * @brief Valen Interactive Shell
  * * Provides a command-line interface for system interaction. This module
  * manages a local input buffer, handles character insertion/deletion,
- * and interfaces with VGA driver to provide a flicker-free experience
- * through hardware cursor masking and coordinate math.
+ * and redraws only the part of the line that changed since it was last
+ * drawn, so typing or pasting costs one screen write per burst of keys.
+ * Commands live in a hash table that subsystems register into at init.
  */
 
+#include <valen/shell.h>
 #include <valen/stdio.h>
 #include <valen/string.h>
 #include <valen/io.h>
 #include <valen/pmm.h>
+#include <valen/vmm.h>
 #include <valen/heap.h>
+#include <valen/slab.h>
 #include <valen/task.h>
 #include <valen/spinlock.h>
 #include <valen/color.h>
@@ -25,7 +29,12 @@ static char input_buffer[MAX_BUFFER];
 static int buffer_len = 0;
 static int cursor_idx = 0;
 static int prompt_start_y = 1;
-static spinlock_t shell_lock = SPINLOCK_INIT;
+static spinlock_t shell_lock = SPINLOCK_INIT_NAMED("shell");
+
+/* What the screen shows of the input line */
+static int drawn_len = 0;           /* Characters drawn after the prompt */
+static int drawn_cursor = 0;        /* Index the hardware cursor sits at */
+static int dirty_from = MAX_BUFFER; /* First index changed since, or MAX_BUFFER */
 
 /**
  * @brief Resets shell state and initializes prompt.
@@ -40,6 +49,9 @@ void shell_init()
     memset(input_buffer, 0, MAX_BUFFER);
     buffer_len = 0;
     cursor_idx = 0;
+    drawn_len = 0;
+    drawn_cursor = 0;
+    dirty_from = MAX_BUFFER;
 
     if (get_cursor_y() < 1)
         set_cursor(0, 1);
@@ -51,66 +63,141 @@ void shell_init()
 }
 
 /**
- * @brief Redraws the command line while preventing cursor ghosting.
- * This function masks the hardware cursor during the printing process.
- * It calculates the absolute VGA coordinates based on prompt length
- * and the current buffer index to handle line-wrapping across 80 columns.
+ * @brief Moves the cursor to input index @p idx, wrapping across 80 columns.
+ */
+static void move_to(int idx)
+{
+    int total = PROMPT_LEN + idx;
+    set_cursor(total % width, prompt_start_y + (total / width));
+}
+
+/**
+ * @brief Brings the screen up to date with the input buffer.
+ * Everything from the first changed index on is written in one console
+ * call, followed by blanks over characters the line has lost, so the
+ * hardware cursor moves only once the text is in place. Called with
+ * shell_lock held.
  */
-static void redraw_line()
+static void render_line()
 {
-    /* Calculate final landing spot for hardware cursor after redraw */
-    int final_total = PROMPT_LEN + cursor_idx;
-    int final_x = final_total % width;
-    int final_y = prompt_start_y + (final_total / width);
+    if (dirty_from < MAX_BUFFER)
+    {
+        char out[MAX_BUFFER + 1];
+        int from = dirty_from < buffer_len ? dirty_from : buffer_len;
+        int n = 0;
 
-    /* Temporarily hide cursor to prevent ghosting during character output */
-    hide_hardware_cursor();
+        for (int i = from; i < buffer_len; i++)
+            out[n++] = input_buffer[i];
+        for (int i = buffer_len; i < drawn_len; i++)
+            out[n++] = ' ';
+        out[n] = '\0';
 
-    /* Reset software cursor to start of current input line */
-    set_cursor(PROMPT_LEN, prompt_start_y);
+        if (n)
+        {
+            move_to(from);
+            puts(out);
+            drawn_cursor = -1;
+        }
+        drawn_len = buffer_len;
+        dirty_from = MAX_BUFFER;
+    }
 
-    /* Overwrite current screen line(s) with updated buffer */
-    for (int i = 0; i < buffer_len; i++)
+    if (drawn_cursor != cursor_idx)
     {
-        putc(input_buffer[i]);
+        move_to(cursor_idx);
+        drawn_cursor = cursor_idx;
     }
+}
 
-    /* Print a trailing space to erase characters left over by backspaces */
-    putc(' ');
+static void mark_dirty(int idx)
+{
+    if (idx < dirty_from)
+        dirty_from = idx;
+}
+
+/* --- Command Table --- */
 
-    /* Synchronize VGA cursor registers with final calculated position */
-    set_cursor(final_x, final_y);
+static shell_command_t *command_table[SHELL_HASH_BUCKETS];
+static shell_command_t *command_list;       /* Registration order, for help */
+static shell_command_t **command_tail = &command_list;
+static spinlock_t command_lock = SPINLOCK_INIT_NAMED("shellcmd");
 
-    /* Restore hardware cursor visibility at the final destination */
-    show_hardware_cursor();
+/**
+ * @brief FNV-1a hash of a command name, folded to a bucket.
+ */
+static uint32_t command_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash & (SHELL_HASH_BUCKETS - 1);
+}
+
+/**
+ * @brief Looks a command up without locking. Commands are only ever
+ * added, and each is fully linked before it is published.
+ */
+static shell_command_t *find_command(const char *name)
+{
+    shell_command_t *cmd = __atomic_load_n(&command_table[command_hash(name)], __ATOMIC_ACQUIRE);
+    for (; cmd; cmd = cmd->hash_next)
+    {
+        if (strcmp(cmd->name, name) == 0)
+            return cmd;
+    }
+    return NULL;
+}
+
+int shell_register(shell_command_t *cmd)
+{
+    spinlock_acquire(&command_lock);
+
+    if (find_command(cmd->name))
+    {
+        spinlock_release(&command_lock);
+        return -1;
+    }
+
+    uint32_t bucket = command_hash(cmd->name);
+    cmd->hash_next = command_table[bucket];
+    cmd->list_next = NULL;
+    __atomic_store_n(&command_table[bucket], cmd, __ATOMIC_RELEASE);
+    __atomic_store_n(command_tail, cmd, __ATOMIC_RELEASE);
+    command_tail = &cmd->list_next;
+
+    spinlock_release(&command_lock);
+    return 0;
 }
 
 // Command function prototypes
 static void cmd_clear(const char *arg);
 static void cmd_help(const char *arg);
 static void cmd_mem(const char *arg);
+static void cmd_heapstat(const char *arg);
 static void cmd_tasks(const char *arg);
 static void cmd_kill(const char *arg);
 static void cmd_reboot(const char *arg);
 
-// Command structure
-typedef struct {
-    const char *name;
-    void (*func)(const char *arg);
-    const char *help;
-} command_t;
-
-// Command array
-static const command_t commands[] = {
+// The shell's own commands; subsystems register the rest
+static shell_command_t builtin_commands[] = {
     {"clear", cmd_clear, "Clear the terminal screen"},
     {"help", cmd_help, "Display this help menu"},
     {"mem", cmd_mem, "Show physical memory utilization"},
+    {"heapstat", cmd_heapstat, "Show heap and slab allocator statistics"},
     {"tasks", cmd_tasks, "List running tasks"},
     {"kill", cmd_kill, "Kill a task (usage: kill <pid>)"},
     {"reboot", cmd_reboot, "Restart the system via PS/2"},
-    {NULL, NULL, NULL} // Sentinel
 };
 
+void shell_commands_init(void)
+{
+    for (size_t i = 0; i < sizeof(builtin_commands) / sizeof(builtin_commands[0]); i++)
+        shell_register(&builtin_commands[i]);
+}
+
 /**
  * @brief Parse command and arguments
  */
@@ -137,7 +224,7 @@ static void parse_command(const char *input, char *cmd, char *arg) {
 
 /**
  * @brief Logic for interpreting and executing shell commands.
- * Uses a command table for cleaner dispatch and better maintainability.
+ * Looks the command up in the registration table and runs it.
  */
 void process_command(char *cmd)
 {
@@ -152,12 +239,10 @@ void process_command(char *cmd)
         return;
     }
     
-    // Search for command in table
-    for (int i = 0; commands[i].name != NULL; i++) {
-        if (strcmp(cmd_name, commands[i].name) == 0) {
-            commands[i].func(cmd_arg);
-            return;
-        }
+    shell_command_t *command = find_command(cmd_name);
+    if (command) {
+        command->func(cmd_arg);
+        return;
     }
     
     // Command not found
@@ -174,11 +259,12 @@ static void cmd_clear(const char *arg) {
 static void cmd_help(const char *arg) {
     (void)arg; // Unused parameter
     puts("\n--- Valen Command Interface ---\n");
-    for (int i = 0; commands[i].name != NULL; i++) {
+    shell_command_t *cmd = __atomic_load_n(&command_list, __ATOMIC_ACQUIRE);
+    for (; cmd; cmd = __atomic_load_n(&cmd->list_next, __ATOMIC_ACQUIRE)) {
         puts("  ");
-        puts(commands[i].name);
+        puts(cmd->name);
         puts(" - ");
-        puts(commands[i].help);
+        puts(cmd->help);
         puts("\n");
     }
     puts("----------------------------------\n");
@@ -189,52 +275,98 @@ static void cmd_mem(const char *arg) {
     uint64_t total = pmm_get_total_kb();
     uint64_t used = pmm_get_used_kb();
     uint64_t free = total - used;
+    pmm_pcp_stats_t pcp;
+    pmm_get_pcp_stats(&pcp);
+    pmm_zero_stats_t zero;
+    pmm_get_zero_stats(&zero);
+    vmm_fault_stats_t faults;
+    vmm_get_fault_stats(&faults);
 
     puts("\n--- Physical Memory Mapping ---\n");
     printf("  Total: %llu MB\n", total / 1024);
     printf("  Used:  %llu MB\n", used / 1024);
     printf("  Free:  %llu MB\n", free / 1024);
+    printf("  Page cache: %llu pages (%llu refills, %llu drains)\n",
+           pcp.cached_pages, pcp.refills, pcp.drains);
+    printf("  Zeroed pool: %llu pages (%llu hits, %llu misses)\n",
+           zero.pooled_pages, zero.hits, zero.misses);
+    printf("  Demand paging: %llu faults, %llu reserve misses, %llu pages reserved\n",
+           faults.faults, faults.misses, faults.reserved_pages);
     puts("-------------------------------\n");
 }
 
+static void cmd_heapstat(const char *arg) {
+    (void)arg; // Unused parameter
+    heap_stats_t heap;
+    heap_get_stats(&heap);
+
+    // Average free-list entries inspected per malloc, in tenths
+    uint64_t search = heap.mallocs ? (heap.search_steps * 10) / heap.mallocs : 0;
+
+    puts("\n--- Kernel Heap ---\n");
+    printf("  Live allocations: %llu (%llu large)\n", heap.live_allocs, heap.large_allocs);
+    printf("  In use:   %llu KB of %llu KB reserved (%llu arenas)\n",
+           heap.bytes_in_use / 1024, heap.bytes_reserved / 1024, heap.arenas);
+    printf("  Free:     %llu KB in %llu blocks, largest %llu bytes\n",
+           heap.free_bytes / 1024, heap.free_blocks, heap.largest_free);
+    printf("  Calls:    %llu mallocs, %llu frees, %llu failures\n",
+           heap.mallocs, heap.frees, heap.failures);
+    printf("  Search:   %llu.%llu blocks per malloc\n", search / 10, search % 10);
+
+    kmem_cache_stats_t caches[16];
+    int count = kmem_cache_get_stats(caches, 16);
+
+    puts("\n--- Slab Caches ---\n");
+    puts("  NAME            OBJSIZE  ACTIVE/TOTAL  SLABS\n");
+    for (int i = 0; i < count; i++) {
+        printf("  %s", caches[i].name);
+        for (int pad = strlen(caches[i].name); pad < 16; pad++) putc(' ');
+        printf("%llu  %llu/%llu  %llu x %llu KB\n",
+               caches[i].object_size, caches[i].active, caches[i].total,
+               caches[i].slabs, caches[i].slab_bytes / 1024);
+    }
+    puts("-------------------\n");
+}
+
+/**
+ * @brief task_for_each() callback for the tasks command
+ */
+static void print_task(task_t *task, void *arg) {
+    int *task_count = (int *)arg;
+
+    const char *state_str = "UNKNOWN";
+    switch (task->state) {
+        case TASK_RUNNING: state_str = "RUNNING"; break;
+        case TASK_INTERRUPTIBLE: state_str = "INTERRUPTIBLE"; break;
+        case TASK_UNINTERRUPTIBLE: state_str = "UNINTERRUPTIBLE"; break;
+        case TASK_ZOMBIE: state_str = "ZOMBIE"; break;
+        case TASK_STOPPED: state_str = "STOPPED"; break;
+        case TASK_TRACED: state_str = "TRACED"; break;
+    }
+
+    puts("  PID ");
+    printf("%d", task->pid);
+    puts(": ");
+    puts(task->comm);
+    puts(" (State: ");
+    puts(state_str);
+    printf(", Prio %d, CPU %d)\n", task->prio, task->cpu);
+    (*task_count)++;
+}
+
 static void cmd_tasks(const char *arg) {
     (void)arg; // Unused parameter
     puts("\n--- Running Tasks ---\n");
-    
-    task_t *current = get_current_task();
-    if (!current) {
+
+    // Count and list all tasks on every CPU's runqueue
+    int task_count = 0;
+    task_for_each(print_task, &task_count);
+
+    if (task_count == 0) {
         puts("  No tasks running\n");
-        puts("---------------------\n");
-        return;
+    } else {
+        printf("  Total tasks: %d\n", task_count);
     }
-    
-    // Count and list all tasks
-    int task_count = 0;
-    task_t *task = current;
-    
-    do {
-        const char *state_str = "UNKNOWN";
-        switch (task->state) {
-            case TASK_RUNNING: state_str = "RUNNING"; break;
-            case TASK_INTERRUPTIBLE: state_str = "INTERRUPTIBLE"; break;
-            case TASK_UNINTERRUPTIBLE: state_str = "UNINTERRUPTIBLE"; break;
-            case TASK_ZOMBIE: state_str = "ZOMBIE"; break;
-            case TASK_STOPPED: state_str = "STOPPED"; break;
-            case TASK_TRACED: state_str = "TRACED"; break;
-        }
-        
-        puts("  PID ");
-        printf("%d", task->pid);
-        puts(": ");
-        puts(task->comm);
-        puts(" (State: ");
-        puts(state_str);
-        puts(")\n");
-        task_count++;
-        task = task->next;
-    } while (task != current && task != NULL);
-    
-    printf("  Total tasks: %d\n", task_count);
     puts("---------------------\n");
 }
 
@@ -250,20 +382,10 @@ static void cmd_kill(const char *arg) {
         return;
     }
     
-    int result = kill_task(pid);
-    switch (result) {
-        case 0:
-            printf("Task with PID %d killed successfully.\n", pid);
-            break;
-        case -1:
-            printf("Error: Task with PID %d not found.\n", pid);
-            break;
-        case -2:
-            printf("Error: Cannot kill current shell task (PID %d).\n", pid);
-            break;
-        default:
-            printf("Error: Unknown error killing task %d.\n", pid);
-            break;
+    if (kill_task(pid) == 0) {
+        printf("Task %d will exit at its next safe point.\n", pid);
+    } else {
+        printf("Error: Task with PID %d not found.\n", pid);
     }
 }
 
@@ -275,8 +397,9 @@ static void cmd_reboot(const char *arg) {
 
 /**
  * @brief Handles raw keyboard input characters for the shell.
- * This function is called by the keyboard interrupt handler to process
- * individual keystrokes and manage the input buffer and cursor position.
+ * Called for every key process_pending_key() drains, this only edits the
+ * input buffer and notes the first index that changed; shell_flush()
+ * draws the result once the burst of keys is through.
  */
 void shell_input(signed char c)
 {
@@ -285,6 +408,9 @@ void shell_input(signed char c)
     if (c == '\n')
     {
         input_buffer[buffer_len] = '\0';
+
+        // Show the whole line before the command's output follows it
+        render_line();
         puts("\n");
         
         // Copy command to local buffer before releasing lock
@@ -313,21 +439,15 @@ void shell_input(signed char c)
         }
         buffer_len--;
         cursor_idx--;
-        
-        spinlock_release(&shell_lock);
-        redraw_line();
+        mark_dirty(cursor_idx);
     }
     else if (c == -1 && cursor_idx > 0)  // Left arrow
     {
         cursor_idx--;
-        spinlock_release(&shell_lock);
-        redraw_line();
     }
     else if (c == -2 && cursor_idx < buffer_len)  // Right arrow
     {
         cursor_idx++;
-        spinlock_release(&shell_lock);
-        redraw_line();
     }
     else if (c >= 32 && c <= 126 && buffer_len < MAX_BUFFER - 1)
     {
@@ -337,25 +457,19 @@ void shell_input(signed char c)
             input_buffer[i] = input_buffer[i - 1];
         }
         input_buffer[cursor_idx] = (char)c;
+        mark_dirty(cursor_idx);
         buffer_len++;
         cursor_idx++;
-        
-        // Prevent buffer overflow
-        if (buffer_len >= MAX_BUFFER) {
-            buffer_len = MAX_BUFFER - 1;
-            input_buffer[buffer_len] = '\0';
-        }
-        if (cursor_idx >= MAX_BUFFER) {
-            cursor_idx = MAX_BUFFER - 1;
-        }
-        
-        spinlock_release(&shell_lock);
-        redraw_line();
-    }
-    else
-    {
-        spinlock_release(&shell_lock);
     }
+
+    spinlock_release(&shell_lock);
+}
+
+void shell_flush(void)
+{
+    spinlock_acquire(&shell_lock);
+    render_line();
+    spinlock_release(&shell_lock);
 }
 
 /**
@@ -366,6 +480,10 @@ void shell_task_main(void) {
     shell_init();
     
     while (1) {
+        // Sleep until the keyboard IRQ has input for us, then draw
+        // everything it queued in one go
+        keyboard_wait_key();
         process_pending_key();
+        shell_flush();
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,202 @@
+#include <valen/softirq.h>
+#include <valen/cpu.h>
+#include <valen/task.h>
+#include <valen/wait.h>
+#include <valen/klog.h>
+#include <valen/irqstat.h>
+
+/*
+ * Pending softirqs are a per-CPU bitmask that only its own CPU changes, so
+ * raising one just needs interrupts off. The handlers run with interrupts
+ * enabled; an interrupt that arrives meanwhile only raises its softirq,
+ * and the loop below picks it up before returning.
+ */
+
+// Passes over the pending mask before the rest goes to ksoftirqd
+#define MAX_SOFTIRQ_RESTART 10
+
+#define TASKLET_SCHED 0x1   // Queued on some CPU's list
+#define TASKLET_RUN 0x2     // Running; blocks other CPUs from running it too
+
+static void (*softirq_vec[NR_SOFTIRQS])(void);
+static const char *softirq_names[NR_SOFTIRQS] = { "timer", "tasklet" };
+
+// Per-CPU tasklet lists, touched only by their CPU with interrupts off.
+// Zero-initialized, so tasklets can be scheduled before softirq_init().
+typedef struct tasklet_list {
+    tasklet_t *head;
+    tasklet_t *tail;
+} tasklet_list_t;
+
+static tasklet_list_t tasklets[MAX_CPUS];
+
+static wait_queue_t ksoftirqd_wait[MAX_CPUS];
+
+void open_softirq(int nr, void (*action)(void)) {
+    softirq_vec[nr] = action;
+}
+
+const char *softirq_name(int nr) {
+    return softirq_names[nr];
+}
+
+static void wakeup_softirqd(cpu_local_t *cpu) {
+    if (cpu->ksoftirqd) {
+        wake_up(&ksoftirqd_wait[cpu->id]);
+    }
+}
+
+void raise_softirq(int nr) {
+    uint64_t flags = irq_save();
+    cpu_local_t *cpu = this_cpu();
+
+    cpu->softirq_pending |= 1u << nr;
+
+    // Interrupt context runs it on its way out; nothing else would
+    if (!in_interrupt()) {
+        wakeup_softirqd(cpu);
+    }
+    irq_restore(flags);
+}
+
+/**
+ * @brief Run the pending softirqs of this CPU. Called with interrupts
+ * disabled, which it re-enables only while handlers run.
+ */
+static void do_softirq(void) {
+    cpu_local_t *cpu = this_cpu();
+    int restart = MAX_SOFTIRQ_RESTART;
+
+    cpu->in_softirq = 1;
+    preempt_disable();
+
+    uint32_t pending;
+    while ((pending = cpu->softirq_pending) && restart--) {
+        cpu->softirq_pending = 0;
+        asm volatile("sti");
+
+        while (pending) {
+            int nr = bsf64(pending);
+            pending &= pending - 1;
+            if (softirq_vec[nr]) {
+                uint64_t start = rdtsc();
+                softirq_vec[nr]();
+                irqstat_softirq(nr, rdtsc() - start);
+            }
+        }
+
+        asm volatile("cli");
+    }
+
+    preempt_enable();
+    cpu->in_softirq = 0;
+
+    // Still raised after a full budget: let the scheduler interleave it
+    if (cpu->softirq_pending) {
+        wakeup_softirqd(cpu);
+    }
+}
+
+void irq_exit(void) {
+    cpu_local_t *cpu = this_cpu();
+
+    cpu->irq_count--;
+    if (!cpu->irq_count && !cpu->in_softirq && cpu->softirq_pending) {
+        // Charged to the softirqs, not to the interrupt that raised them
+        uint64_t start = rdtsc();
+        do_softirq();
+        irqstat_exclude(rdtsc() - start);
+    }
+}
+
+void tasklet_init(tasklet_t *t, void (*func)(void *data), void *data) {
+    t->next = NULL;
+    t->state = 0;
+    t->func = func;
+    t->data = data;
+}
+
+static void tasklet_enqueue(tasklet_list_t *list, tasklet_t *t) {
+    t->next = NULL;
+    if (list->head) {
+        list->tail->next = t;
+    } else {
+        list->head = t;
+    }
+    list->tail = t;
+}
+
+void tasklet_schedule(tasklet_t *t) {
+    if (__atomic_fetch_or(&t->state, TASKLET_SCHED, __ATOMIC_ACQ_REL) & TASKLET_SCHED) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    tasklet_enqueue(&tasklets[this_cpu_id()], t);
+    irq_restore(flags);
+
+    raise_softirq(SOFTIRQ_TASKLET);
+}
+
+static void tasklet_action(void) {
+    tasklet_list_t *local = &tasklets[this_cpu_id()];
+
+    asm volatile("cli");
+    tasklet_t *list = local->head;
+    local->head = NULL;
+    asm volatile("sti");
+
+    while (list) {
+        tasklet_t *t = list;
+        list = t->next;
+
+        if (!(__atomic_fetch_or(&t->state, TASKLET_RUN, __ATOMIC_ACQUIRE) & TASKLET_RUN)) {
+            // Cleared first, so the tasklet may schedule itself again
+            __atomic_fetch_and(&t->state, ~TASKLET_SCHED, __ATOMIC_RELAXED);
+            t->func(t->data);
+            __atomic_fetch_and(&t->state, ~TASKLET_RUN, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        // Running on another CPU: try again on the next pass
+        asm volatile("cli");
+        tasklet_enqueue(local, t);
+        this_cpu()->softirq_pending |= 1u << SOFTIRQ_TASKLET;
+        asm volatile("sti");
+    }
+}
+
+/**
+ * @brief Per-CPU task that runs softirqs the interrupt exit path left over
+ */
+static void ksoftirqd_main(void) {
+    cpu_local_t *cpu = this_cpu();
+
+    while (1) {
+        wait_event(ksoftirqd_wait[cpu->id], cpu->softirq_pending);
+
+        uint64_t flags = irq_save();
+        if (!cpu->in_softirq) {
+            do_softirq();
+        }
+        irq_restore(flags);
+    }
+}
+
+void softirq_init(void) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        wait_queue_init(&ksoftirqd_wait[i]);
+    }
+    open_softirq(SOFTIRQ_TASKLET, tasklet_action);
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (!cpu_locals[i].online) continue;
+
+        task_t *task = task_create_on(ksoftirqd_main, "ksoftirqd", 1ULL << i);
+        if (!task) {
+            klog(KLOG_ERR, "softirq: no ksoftirqd for CPU %u\n", i);
+            continue;
+        }
+        cpu_locals[i].ksoftirqd = task;
+    }
+}
@@ -1,106 +1,564 @@
 #include <valen/task.h>
-#include <valen/heap.h>
+#include <valen/slab.h>
+#include <valen/pmm.h>
+#include <valen/vmm.h>
+#include <valen/page.h>
+#include <valen/paging.h>
 #include <valen/stdio.h>
 #include <valen/string.h>
 #include <valen/spinlock.h>
+#include <valen/percpu.h>
+#include <valen/smp.h>
+#include <valen/cpu.h>
+#include <valen/timer.h>
+#include <valen/fpu.h>
+#include <valen/rcu.h>
+#include <valen/klog.h>
+#include <valen/irqstat.h>
 
-// Global task management
-task_t *current_task = NULL;
-static task_t *runqueue = NULL;
-static pid_t next_pid = 1;
-static spinlock_t runqueue_lock = SPINLOCK_INIT;
-static spinlock_t current_task_lock = SPINLOCK_INIT;
-static volatile uint8_t need_schedule = 0;
-static volatile uint8_t tasks_exist = 0;
+/*
+ * Every CPU owns a run queue with its own lock and only ever switches to
+ * tasks on that queue, so the scheduler's fast path never touches another
+ * CPU's queue. A CPU that runs dry steals from the tail of a busy
+ * neighbour's queue instead of halting.
+ *
+ * A run queue holds two priority arrays with one FIFO per priority level
+ * and a bitmap of the non-empty levels, so picking the next task is a bsf
+ * over three words whatever the number of tasks. Tasks that use up their
+ * time slice move to the expired array, which is swapped in once the
+ * active one runs empty; a busy high-priority task therefore cannot starve
+ * lower ones forever. Real-time tasks never expire.
+ */
+#define PRIO_BITMAP_WORDS ((MAX_PRIO + 63) / 64)
+
+typedef struct prio_array {
+    uint32_t nr_active;
+    uint64_t bitmap[PRIO_BITMAP_WORDS];  // Bit n set if queue[n] is non-empty
+    task_t *queue[MAX_PRIO];    // Head of each level's circular FIFO
+} prio_array_t;
+
+typedef struct runqueue {
+    spinlock_t lock;
+    prio_array_t *active;   // Tasks with time slice left
+    prio_array_t *expired;  // Tasks waiting for the next round
+    prio_array_t arrays[2];
+    uint32_t nr_running;
+    timer_t tick;           // Scheduler tick, armed only while a task runs
+} runqueue_t;
+
+static runqueue_t runqueues[MAX_CPUS];
+static task_t idle_tasks[MAX_CPUS];
+
+// Task control blocks come from a slab cache. Kernel stacks are reserved
+// whole, but only their top pages are backed up front; the rest is backed
+// a page at a time as they grow
+#define TASK_STACK_PAGES 8
+#define TASK_STACK_HOT_PAGES 2
+#define TASK_STACK_SIZE (TASK_STACK_PAGES * PAGE_SIZE)
+
+// finish_switch() fills the fault reserve before a task runs, so growing
+// into every unbacked page of its stack must fit in a full reserve
+#if TASK_STACK_PAGES - TASK_STACK_HOT_PAGES > VMM_FAULT_RESERVE_PAGES
+#error "Kernel stacks can fault in more pages than the fault reserve holds"
+#endif
+static kmem_cache_t *task_cache = NULL;
+
+// Timer ticks a nice 0 or real-time task may run before it is preempted
+#define SCHED_SLICE_TICKS 25
 
 // Assembly context switch function
 extern void switch_to(task_context_t *prev, task_context_t *next);
 
+// Every task but the idle ones, including those that are asleep. Readers
+// walk it under RCU; tasklist_lock serializes writers.
+static task_t *task_list;
+static spinlock_t tasklist_lock = SPINLOCK_INIT_NAMED("tasklist");
+
+// PID lookup, separate from every scheduling list so that it finds
+// sleeping tasks too. Also under RCU and tasklist_lock.
+#define PID_HASH_BITS 8
+#define PID_HASH_SIZE (1 << PID_HASH_BITS)
+#define PID_BITMAP_WORDS (PID_MAX / 64)
+
+static task_t *pid_hash[PID_HASH_SIZE];
+static uint64_t pid_bitmap[PID_BITMAP_WORDS];  // Bit n set while PID n is taken
+static pid_t last_pid;
+
+static task_t **pid_bucket(pid_t pid) {
+    // Fibonacci hashing spreads the sequential PIDs over all buckets
+    return &pid_hash[((uint32_t)pid * 2654435761u) >> (32 - PID_HASH_BITS)];
+}
+
 /**
- * @brief Initialize the task scheduler
+ * @brief Take the first free PID after the last one handed out, wrapping
+ * around past PID_MAX. Called with tasklist_lock held.
+ *
+ * @return The PID, or -1 if all are taken
  */
-void scheduler_init(void) {
-    current_task = NULL;
-    runqueue = NULL;
-    next_pid = 1;
-    need_schedule = 0;
-    tasks_exist = 0;
+static pid_t pid_alloc(void) {
+    uint32_t start = (uint32_t)(last_pid + 1) % PID_MAX;
+
+    // Scan from start to the end, then wrap around once to start's word
+    for (uint32_t n = 0; n <= PID_BITMAP_WORDS; n++) {
+        uint32_t w = (start / 64 + n) % PID_BITMAP_WORDS;
+        uint64_t free = ~pid_bitmap[w];
+        if (n == 0) {
+            free &= ~0ULL << (start % 64);
+        }
+        if (w == 0) {
+            free &= ~1ULL;  // PID 0 is never handed out
+        }
+        if (!free) continue;
+
+        pid_t pid = w * 64 + bsf64(free);
+        pid_bitmap[w] |= 1ULL << (pid % 64);
+        last_pid = pid;
+        return pid;
+    }
+    return -1;
+}
+
+static void pid_release(pid_t pid) {
+    uint64_t flags = spinlock_acquire_irqsave(&tasklist_lock);
+    pid_bitmap[pid / 64] &= ~(1ULL << (pid % 64));
+    spinlock_release_irqrestore(&tasklist_lock, flags);
+}
+
+static void task_free(task_t *task) {
+    fpu_release(task);
+    if (task->stack) {
+        vmm_free(task->stack, TASK_STACK_PAGES);
+    }
+    if (task->mm) {
+        paging_space_destroy(task->mm);
+    }
+    kmem_cache_free(task_cache, task);
+}
+
+static void task_free_rcu(rcu_head_t *head) {
+    task_t *task = container_of(head, task_t, rcu);
+
+    // No reader can see the task any more, so its PID is free to reuse
+    pid_release(task->pid);
+    task_free(task);
 }
 
 /**
- * @brief Add task to runqueue
+ * @brief Free a task that is off the task list once no reader can see it
  */
-void add_task_to_runqueue(task_t *task) {
-    spinlock_acquire(&runqueue_lock);
-    
-    if (!runqueue) {
-        runqueue = task;
+static void task_free_deferred(task_t *task) {
+    call_rcu(&task->rcu, task_free_rcu);
+}
+
+/**
+ * @brief Give a task a PID and make it visible on the task list and in the
+ * PID hash
+ *
+ * @return 0 on success, -1 if no PID is free
+ */
+static int tasklist_add(task_t *task) {
+    uint64_t flags = spinlock_acquire_irqsave(&tasklist_lock);
+
+    pid_t pid = pid_alloc();
+    if (pid < 0) {
+        spinlock_release_irqrestore(&tasklist_lock, flags);
+        return -1;
+    }
+    task->pid = pid;
+
+    task_t **bucket = pid_bucket(pid);
+    task->pid_pprev = bucket;
+    task->pid_next = *bucket;
+    if (*bucket) {
+        (*bucket)->pid_pprev = &task->pid_next;
+    }
+    rcu_assign_pointer(*bucket, task);
+
+    task->tasks_prev = NULL;
+    task->tasks_next = task_list;
+    if (task_list) {
+        task_list->tasks_prev = task;
+    }
+    rcu_assign_pointer(task_list, task);
+    spinlock_release_irqrestore(&tasklist_lock, flags);
+    return 0;
+}
+
+/**
+ * @brief Unlink a task from the task list and the PID hash. Its own links
+ * stay intact, so a reader standing on it can still walk on. The PID
+ * stays taken until the task is freed.
+ */
+static void tasklist_del(task_t *task) {
+    uint64_t flags = spinlock_acquire_irqsave(&tasklist_lock);
+    rcu_assign_pointer(*task->pid_pprev, task->pid_next);
+    if (task->pid_next) {
+        task->pid_next->pid_pprev = task->pid_pprev;
+    }
+
+    if (task->tasks_prev) {
+        rcu_assign_pointer(task->tasks_prev->tasks_next, task->tasks_next);
+    } else {
+        rcu_assign_pointer(task_list, task->tasks_next);
+    }
+    if (task->tasks_next) {
+        task->tasks_next->tasks_prev = task->tasks_prev;
+    }
+    spinlock_release_irqrestore(&tasklist_lock, flags);
+}
+
+/**
+ * @brief Time slice of a task in timer ticks: 50 at nice -20, 25 at nice 0
+ * and 1 at nice 19. Real-time tasks get the nice 0 slice.
+ */
+static unsigned int task_timeslice(task_t *task) {
+    if (task->prio < MAX_RT_PRIO) {
+        return SCHED_SLICE_TICKS;
+    }
+
+    unsigned int slice = SCHED_SLICE_TICKS * (MAX_PRIO - task->static_prio) / 20;
+    return slice ? slice : 1;
+}
+
+/**
+ * @brief Append a task to the FIFO of its priority level
+ */
+static void array_enqueue(prio_array_t *array, task_t *task) {
+    task_t **head = &array->queue[task->prio];
+
+    if (!*head) {
+        *head = task;
         task->next = task;
         task->prev = task;
+        array->bitmap[task->prio / 64] |= 1ULL << (task->prio % 64);
     } else {
-        // Insert at head of circular doubly-linked list
-        task->next = runqueue;
-        task->prev = runqueue->prev;
-        runqueue->prev->next = task;
-        runqueue->prev = task;
-        runqueue = task;
+        // Insert at the tail of the circular doubly-linked list
+        task->next = *head;
+        task->prev = (*head)->prev;
+        (*head)->prev->next = task;
+        (*head)->prev = task;
     }
-    
-    tasks_exist = 1;  // Set flag that tasks exist
-    spinlock_release(&runqueue_lock);
+    task->array = array;
+    array->nr_active++;
 }
 
 /**
- * @brief Remove task from runqueue
+ * @brief Unlink a task from the priority array it is queued on
  */
-void remove_task_from_runqueue(task_t *task) {
-    spinlock_acquire(&runqueue_lock);
-    
-    if (!task || !runqueue) {
-        spinlock_release(&runqueue_lock);
-        return;
-    }
-    
+static void array_dequeue(task_t *task) {
+    prio_array_t *array = task->array;
+    task_t **head = &array->queue[task->prio];
+
     if (task->next == task) {
-        // Only task in queue
-        runqueue = NULL;
-        tasks_exist = 0;  // No tasks exist
+        // Only task at this level
+        *head = NULL;
+        array->bitmap[task->prio / 64] &= ~(1ULL << (task->prio % 64));
     } else {
         task->prev->next = task->next;
         task->next->prev = task->prev;
-        if (runqueue == task) {
-            runqueue = task->next;
+        if (*head == task) {
+            *head = task->next;
         }
     }
     task->next = NULL;
     task->prev = NULL;
-    
-    spinlock_release(&runqueue_lock);
+    task->array = NULL;
+    array->nr_active--;
 }
 
 /**
- * @brief Create a new task
+ * @brief Highest priority (lowest value) level with a queued task
  */
-task_t *task_create(void (*func)(void), const char *name) {
-    task_t *task = (task_t*)malloc(sizeof(task_t));
+static int array_first(prio_array_t *array) {
+    for (int i = 0; i < PRIO_BITMAP_WORDS; i++) {
+        if (array->bitmap[i]) {
+            return i * 64 + bsf64(array->bitmap[i]);
+        }
+    }
+    return MAX_PRIO;
+}
+
+/**
+ * @brief Scheduler tick of one CPU
+ *
+ * There is no periodic interrupt: the tick is a kernel timer that keeps
+ * re-arming itself while the CPU runs a task and lapses once it goes idle.
+ * Without a clock event per CPU every tick runs on the BSP, which passes
+ * each AP's tick on to it with an IPI.
+ */
+static void sched_tick(void *data) {
+    runqueue_t *rq = data;
+    uint32_t id = rq - runqueues;
+    cpu_local_t *cpu = &cpu_locals[id];
+
+    if (id == this_cpu_id()) {
+        scheduler_tick();
+        if (cpu->current != cpu->idle) {
+            timer_add(&rq->tick, timer_now() + NSEC_PER_SEC / TIMER_HZ);
+        }
+        return;
+    }
+
+    // The AP checks the tick under its runqueue lock when it leaves idle,
+    // so reading its current task under the same lock cannot miss a restart
+    smp_send_tick(id);
+    uint64_t flags = spinlock_acquire_irqsave(&rq->lock);
+    if (cpu->current != cpu->idle) {
+        timer_add(&rq->tick, timer_now() + NSEC_PER_SEC / TIMER_HZ);
+    }
+    spinlock_release_irqrestore(&rq->lock, flags);
+}
+
+/**
+ * @brief Initialize the task scheduler
+ */
+void scheduler_init(void) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        runqueue_t *rq = &runqueues[i];
+
+        memset(rq, 0, sizeof(runqueue_t));
+        spinlock_init_named(&rq->lock, "runqueue");
+        rq->active = &rq->arrays[0];
+        rq->expired = &rq->arrays[1];
+        timer_setup(&rq->tick, sched_tick, rq);
+    }
+
+    task_cache = kmem_cache_create("task_t", sizeof(task_t), 0, NULL);
+
+    scheduler_init_cpu();
+}
+
+/**
+ * @brief Turn the code running on this CPU into its idle task
+ *
+ * The idle task runs on the CPU's boot stack and is never on a run queue;
+ * the scheduler falls back to it when the queue is empty.
+ */
+void scheduler_init_cpu(void) {
+    cpu_local_t *cpu = this_cpu();
+    task_t *idle = &idle_tasks[cpu->id];
+
+    memset(idle, 0, sizeof(task_t));
+    idle->pid = 0;
+    idle->state = TASK_RUNNING;
+    idle->prio = MAX_PRIO;
+    idle->static_prio = MAX_PRIO;
+    idle->normal_prio = MAX_PRIO;
+    idle->cpu = cpu->id;
+    idle->cpus_allowed = 1ULL << cpu->id;
+    idle->fpu_cpu = -1;
+    idle->flags = TASK_RUNNING_FLAG;
+    strcpy(idle->comm, "idle");
+
+    cpu->idle = idle;
+    cpu->current = idle;
+    cpu->dead = NULL;
+    cpu->migrate = NULL;
+    cpu->need_schedule = 0;
+}
+
+static inline int task_allowed(task_t *task, uint32_t cpu) {
+    return (task->cpus_allowed >> cpu) & 1;
+}
+
+/**
+ * @brief Lock the runqueue a task is on, with interrupts disabled
+ *
+ * Retries if the task is stolen between reading task->cpu and taking the
+ * lock. A task caught between queues is not queued anywhere, which callers
+ * see as task->array == NULL.
+ */
+static runqueue_t *task_rq_lock(task_t *task, uint64_t *flags) {
+    *flags = irq_save();
+
+    for (;;) {
+        int cpu = task->cpu;
+        runqueue_t *rq = &runqueues[cpu];
+
+        spinlock_acquire(&rq->lock);
+        if (task->cpu == cpu) {
+            return rq;
+        }
+        spinlock_release(&rq->lock);
+    }
+}
+
+static void task_rq_unlock(runqueue_t *rq, uint64_t flags) {
+    spinlock_release_irqrestore(&rq->lock, flags);
+}
+
+/**
+ * @brief Non-zero if @p mask contains an online CPU
+ */
+static int online_mask(uint64_t mask) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (cpu_locals[i].online && ((mask >> i) & 1)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Pick the online CPU in the task's affinity mask with the fewest
+ * runnable tasks, preferring the calling CPU on a tie
+ */
+static int select_cpu(task_t *task) {
+    int self = this_cpu_id();
+    int best = task_allowed(task, self) ? self : -1;
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (!cpu_locals[i].online || !task_allowed(task, i)) continue;
+        if (best < 0 || runqueues[i].nr_running < runqueues[best].nr_running) {
+            best = i;
+        }
+    }
+    return best < 0 ? self : best;
+}
+
+/**
+ * @brief Queue a task on the active array. Called with rq->lock held.
+ */
+static void rq_insert(runqueue_t *rq, task_t *task) {
+    array_enqueue(rq->active, task);
+    rq->nr_running++;
+}
+
+/**
+ * @brief Unlink a task from its runqueue. Called with rq->lock held.
+ */
+static void rq_remove(runqueue_t *rq, task_t *task) {
+    if (!task->array) {
+        return;
+    }
+
+    array_dequeue(task);
+    rq->nr_running--;
+}
+
+/**
+ * @brief Wake one idle CPU so it can steal from a queue that has backed up
+ */
+static void kick_idle_cpu(int busy) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (i != busy && cpu_locals[i].online && !runqueues[i].nr_running &&
+            cpu_locals[i].current == cpu_locals[i].idle) {
+            smp_send_resched(i);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Add task to the runqueue of task->cpu
+ */
+void add_task_to_runqueue(task_t *task) {
+    runqueue_t *rq = &runqueues[task->cpu];
+    cpu_local_t *owner = &cpu_locals[task->cpu];
+
+    uint64_t flags = spinlock_acquire_irqsave(&rq->lock);
+    rq_insert(rq, task);
+    uint32_t queued = rq->nr_running;
+
+    // A task that outranks the running one gets the CPU at the next
+    // interrupt return instead of waiting for the slice to end
+    if (task->prio < owner->current->prio) {
+        owner->need_schedule = 1;
+    }
+    spinlock_release_irqrestore(&rq->lock, flags);
+
+    // Wake the owning CPU if it is idling, and a thief if work is waiting
+    smp_send_resched(task->cpu);
+    if (queued > 1) {
+        kick_idle_cpu(task->cpu);
+    }
+}
+
+/**
+ * @brief Remove task from runqueue
+ */
+void remove_task_from_runqueue(task_t *task) {
+    if (!task) {
+        return;
+    }
+
+    uint64_t flags;
+    runqueue_t *rq = task_rq_lock(task, &flags);
+    rq_remove(rq, task);
+    task_rq_unlock(rq, flags);
+}
+
+/**
+ * @brief Runs on the new task after switch_to() and on the previous task
+ * when it is switched back in: drops the run queue lock taken by schedule(),
+ * tops up the fault reserve, frees a task that exited on this CPU and moves
+ * a task whose affinity no longer includes this CPU.
+ */
+static void finish_switch(void) {
+    cpu_local_t *cpu = this_cpu();
+    task_t *dead = cpu->dead;
+    task_t *migrate = cpu->migrate;
+
+    cpu->dead = NULL;
+    cpu->migrate = NULL;
+    spinlock_release(&runqueues[cpu->id].lock);
+
+    // The stack may grow anywhere from here on, even inside PMM code that
+    // holds the locks a refill needs, so fill the reserve first: full, it
+    // covers every page the stack can still fault in. The task before us
+    // started with a full one too, so what it left covers this refill
+    vmm_fault_refill();
+
+    if (dead) {
+        task_free_deferred(dead);
+    }
+    if (migrate) {
+        migrate->cpu = select_cpu(migrate);
+        add_task_to_runqueue(migrate);
+    }
+}
+
+/**
+ * @brief First code a new task runs, entered by switch_to()'s ret
+ */
+static void task_entry(void) {
+    finish_switch();
+    asm volatile("sti");
+
+    task_t *self = this_cpu_current();
+    self->task_func();
+    task_exit(0);
+}
+
+/**
+ * @brief Create a new task that may only run on the CPUs in @p cpus_allowed
+ *
+ * The mask is in place before the task is queued, so it never runs
+ * elsewhere, not even briefly. Returns NULL if the mask holds no online CPU.
+ */
+task_t *task_create_on(void (*func)(void), const char *name, uint64_t cpus_allowed) {
+    if (!online_mask(cpus_allowed)) {
+        return NULL;
+    }
+
+    task_t *task = (task_t*)kmem_cache_alloc(task_cache);
     if (!task) {
         return NULL;
     }
-    
+
     // Initialize task structure
     memset(task, 0, sizeof(task_t));
-    
-    task->pid = next_pid++;
+
     task->state = TASK_RUNNING;
-    task->prio = 120;
-    task->static_prio = 120;
-    task->normal_prio = 120;
+    task->prio = DEFAULT_PRIO;
+    task->static_prio = DEFAULT_PRIO;
+    task->normal_prio = DEFAULT_PRIO;
     task->rt_priority = 0;
+    task->time_slice = task_timeslice(task);
+    task->fpu_cpu = -1;
     task->flags = TASK_RUNNING_FLAG;
     task->task_func = func;
     task->exit_code = 0;
-    task->parent = current_task;
-    
+    task->parent = this_cpu_current();
+
     // Copy command name
     if (name) {
         strncpy(task->comm, name, sizeof(task->comm) - 1);
@@ -108,138 +566,277 @@ task_t *task_create(void (*func)(void), const char *name) {
     } else {
         strcpy(task->comm, "unknown");
     }
-    
-    // Allocate kernel stack
-    task->stack_size = 8192;
-    task->stack = malloc(task->stack_size);
+
+    // The kernel stack sits between guard pages. Only its top pages, which
+    // every task uses, are backed now; faults back the rest
+    task->stack_size = TASK_STACK_SIZE;
+    task->stack = vmm_reserve(TASK_STACK_PAGES);
     if (!task->stack) {
-        free(task);
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+    void *hot = (uint8_t *)task->stack + (TASK_STACK_PAGES - TASK_STACK_HOT_PAGES) * PAGE_SIZE;
+    if (vmm_populate(hot, TASK_STACK_HOT_PAGES) != 0) {
+        vmm_free(task->stack, TASK_STACK_PAGES);
+        kmem_cache_free(task_cache, task);
         return NULL;
     }
-    
+
     // Set up initial stack for new task
     uint64_t *stack_top = (uint64_t*)((uint8_t*)task->stack + task->stack_size);
-    
+
     // Align stack to 16-byte boundary
     stack_top = (uint64_t*)((uint64_t)stack_top & ~0xF);
-    
-    // Push initial values that context switch expects to pop
-    // The context switch will pop: r15, r14, r13, r12, rbx, rbp
-    *--stack_top = 0;  // r15
-    *--stack_top = 0;  // r14  
-    *--stack_top = 0;  // r13
-    *--stack_top = 0;  // r12
-    *--stack_top = 0;  // rbx
+
+    // switch_to() pops r15, r14, r13, r12, rbx, rbp and returns into
+    // task_entry, which then sees the stack alignment of a normal call
+    *--stack_top = 0;                     // Fake return address of task_entry
+    *--stack_top = (uint64_t)task_entry;  // switch_to's return address
     *--stack_top = 0;  // rbp
-    
-    // Set up context structure
+    *--stack_top = 0;  // rbx
+    *--stack_top = 0;  // r12
+    *--stack_top = 0;  // r13
+    *--stack_top = 0;  // r14
+    *--stack_top = 0;  // r15
+
+    // Set up context structure; the general purpose registers stay zero
     task->context.rsp = (uint64_t)stack_top;
-    task->context.rip = (uint64_t)func;
+    task->context.rip = (uint64_t)task_entry;
     task->context.cs = 0x08;
     task->context.ss = 0x10;
     task->context.eflags = 0x202;
-    
-    // Zero out all general purpose registers
-    task->context.r15 = 0;
-    task->context.r14 = 0;
-    task->context.r13 = 0;
-    task->context.r12 = 0;
-    task->context.rbp = 0;
-    task->context.rbx = 0;
-    task->context.r11 = 0;
-    task->context.r10 = 0;
-    task->context.r9 = 0;
-    task->context.r8 = 0;
-    task->context.rax = 0;
-    task->context.rcx = 0;
-    task->context.rdx = 0;
-    task->context.rsi = 0;
-    task->context.rdi = 0;
-    task->context.orig_rax = 0;
-    
-    // Add to runqueue
+
+    if (tasklist_add(task) < 0) {
+        vmm_free(task->stack, TASK_STACK_PAGES);
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+
+    // Add to the least loaded runqueue it may use
+    task->cpus_allowed = cpus_allowed;
+    task->cpu = select_cpu(task);
     add_task_to_runqueue(task);
-    
+
     return task;
 }
 
+/**
+ * @brief Create a new task
+ */
+task_t *task_create(void (*func)(void), const char *name) {
+    return task_create_on(func, name, TASK_CPUS_ALL);
+}
+
 /**
  * @brief Exit current task
  */
 void task_exit(long exit_code) {
-    spinlock_acquire(&current_task_lock);
-    
-    if (!current_task) {
-        spinlock_release(&current_task_lock);
+    task_t *exiting_task = this_cpu_current();
+
+    if (exiting_task->pid == 0) {
         return;
     }
-    
-    printf("Task '%s' (PID %d) exiting with code %ld\n", 
-           current_task->comm, current_task->pid, exit_code);
-    
-    current_task->state = TASK_ZOMBIE;
-    current_task->exit_code = exit_code;
-    
-    // Save current_task pointer before releasing lock
-    task_t *exiting_task = current_task;
-    
-    spinlock_release(&current_task_lock);
-    
-    // Remove from runqueue and schedule next task
+
+    klog(KLOG_INFO, "Task '%s' (PID %d) exiting with code %ld\n",
+         exiting_task->comm, exiting_task->pid, exit_code);
+
+    exiting_task->exit_code = exit_code;
+    tasklist_del(exiting_task);
+    exiting_task->state = TASK_ZOMBIE;
+
+    // Remove from runqueue; schedule() frees the task once off its stack
     remove_task_from_runqueue(exiting_task);
     schedule();
 }
 
+/**
+ * @brief Find a task in @p array that @p self may take, starting from the
+ * lowest priority level and the tail of each FIFO, which would run last
+ */
+static task_t *steal_candidate(prio_array_t *array, task_t *running, uint32_t self) {
+    for (int prio = MAX_PRIO - 1; prio >= 0; prio--) {
+        task_t *head = array->queue[prio];
+        if (!head) continue;
+
+        task_t *task = head->prev;
+        do {
+            if (task != running && task_allowed(task, self)) {
+                return task;
+            }
+            task = task->prev;
+        } while (task != head->prev);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Move one task from the tail of a busy neighbour's runqueue to
+ * this CPU's. Called with interrupts off and no runqueue lock held, so
+ * only one lock is ever taken at a time.
+ * @return 1 if a task was stolen, 0 otherwise.
+ */
+static int steal_task(uint32_t self) {
+    // Start after ourselves so idle CPUs spread over different victims
+    for (uint32_t n = 1; n < MAX_CPUS; n++) {
+        uint32_t victim = (self + n) % MAX_CPUS;
+        runqueue_t *rq = &runqueues[victim];
+
+        // A queue with a single task has nothing to spare
+        if (!cpu_locals[victim].online || rq->nr_running < 2) continue;
+
+        spinlock_acquire(&rq->lock);
+
+        // Expired tasks would wait longest on the victim
+        task_t *running = cpu_locals[victim].current;
+        task_t *task = steal_candidate(rq->expired, running, self);
+        if (!task) {
+            task = steal_candidate(rq->active, running, self);
+        }
+        if (task) {
+            rq_remove(rq, task);
+            task->cpu = self;
+        }
+
+        spinlock_release(&rq->lock);
+
+        if (task) {
+            spinlock_acquire(&runqueues[self].lock);
+            rq_insert(&runqueues[self], task);
+            spinlock_release(&runqueues[self].lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Choose the next task to run. Called with rq->lock held.
+ */
+static task_t *pick_next(runqueue_t *rq, task_t *idle) {
+    // Every active task has used its slice: start the next round
+    if (!rq->active->nr_active) {
+        prio_array_t *array = rq->active;
+        rq->active = rq->expired;
+        rq->expired = array;
+    }
+
+    if (!rq->active->nr_active) {
+        return idle;
+    }
+    return rq->active->queue[array_first(rq->active)];
+}
+
 /**
  * @brief Core scheduler
+ *
+ * A task that has marked itself sleeping leaves its runqueue here, unless
+ * @p preempt is set: a task preempted on its way to sleep stays queued, so
+ * it can still re-check its wait condition when it next runs.
  */
-void schedule(void) {
-    spinlock_acquire(&runqueue_lock);
-    spinlock_acquire(&current_task_lock);
-    
-    if (!runqueue) {
-        spinlock_release(&current_task_lock);
-        spinlock_release(&runqueue_lock);
-        return;
+static void __schedule(int preempt) {
+    uint64_t flags = irq_save();
+    cpu_local_t *cpu = this_cpu();
+    runqueue_t *rq = &runqueues[cpu->id];
+
+    // An interrupt may preempt the idle loop while it halts; whatever runs
+    // next can enter read-side sections
+    if (cpu->rcu_idle) {
+        rcu_idle_exit();
     }
-    
-    task_t *next = NULL;
-    task_t *old_current = current_task;
-    
-    // Find next runnable task
-    if (!current_task) {
-        next = runqueue;
-    } else {
-        next = current_task->next;
-        if (next == current_task) {
-            next = current_task; // Only one task
+
+    // Out of local work: pull some from a busy neighbour before going idle
+    if (!rq->nr_running) {
+        steal_task(cpu->id);
+    }
+
+    spinlock_acquire(&rq->lock);
+    cpu->need_schedule = 0;
+
+    task_t *prev = cpu->current;
+
+    if (prev != cpu->idle && prev->array) {
+        if (prev->state != TASK_RUNNING && !preempt) {
+            // Going to sleep; task_wake() queues it again
+            rq_remove(rq, prev);
+        } else if (!task_allowed(prev, cpu->id)) {
+            // Lost this CPU from its affinity; moved once switched out
+            rq_remove(rq, prev);
+            cpu->migrate = prev;
+        } else if (prev->time_slice == 0) {
+            // Slice used up: real-time tasks rotate within their level,
+            // others wait until every active task has had its turn
+            prev->time_slice = task_timeslice(prev);
+            array_dequeue(prev);
+            array_enqueue(prev->prio < MAX_RT_PRIO ? rq->active : rq->expired, prev);
+        }
+    }
+
+    task_t *next = pick_next(rq, cpu->idle);
+
+    // Leaving idle: start the tick that charges time slices
+    if (next != cpu->idle && !rq->tick.pending) {
+        timer_add(&rq->tick, timer_now() + NSEC_PER_SEC / TIMER_HZ);
+    }
+
+    if (next == prev) {
+        spinlock_release_irqrestore(&rq->lock, flags);
+        if (!preempt_count()) {
+            rcu_note_qs();
         }
+        return;
+    }
+
+    if (prev->state == TASK_ZOMBIE) {
+        cpu->dead = prev;
+    }
+    cpu->current = next;
+    fpu_switch(prev, next);
+    paging_switch(next->mm);   // Tagged with a PCID, so the TLB survives
+
+    // The run queue lock stays held across the switch and is dropped by
+    // whichever task runs next on this CPU
+    switch_to(&prev->context, &next->context);
+
+    finish_switch();
+    irq_restore(flags);
+
+    // Back with no locks held: no RCU reader can be active on this CPU
+    if (!preempt_count()) {
+        rcu_note_qs();
     }
-    
-    if (next && next != current_task) {
-        // Update current_task while holding both locks
-        current_task = next;
-        
-        // Release both locks before context switch
-        spinlock_release(&current_task_lock);
-        spinlock_release(&runqueue_lock);
-        
-        // Perform context switch
-        if (old_current) {
-            switch_to(&old_current->context, &next->context);
+}
+
+void schedule(void) {
+    __schedule(0);
+    task_check_kill();
+}
+
+/**
+ * @brief Idle loop of a CPU; runs whenever its run queue is empty and
+ * there was nothing to steal
+ */
+void cpu_idle(void) {
+    while (1) {
+        schedule();
+
+        // Spend spare cycles zeroing pages ahead of time, one block per
+        // call so a task that becomes runnable is not held up for long
+        vmm_fault_refill();
+        while (!runqueues[this_cpu_id()].nr_running) {
+            if (!pmm_zero_refill()) break;
+        }
+
+        // Check for work with interrupts off so a wakeup IPI cannot slip in
+        // between the check and hlt; sti only takes effect after hlt.
+        // RCU callbacks run on the way in and may queue work themselves
+        asm volatile("cli");
+        rcu_idle_enter();
+        if (!runqueues[this_cpu_id()].nr_running) {
+            asm volatile("sti; hlt");
         } else {
-            // First task - set up stack and jump directly
-            asm volatile (
-                "mov %0, %%rsp\n"
-                "jmp *%1"
-                :
-                : "r" (next->context.rsp), "r" (next->context.rip)
-                : "memory"
-            );
+            asm volatile("sti");
         }
-    } else {
-        spinlock_release(&current_task_lock);
-        spinlock_release(&runqueue_lock);
+        rcu_idle_exit();
     }
 }
 
@@ -247,135 +844,343 @@ void schedule(void) {
  * @brief Timer tick handler for scheduler
  */
 void scheduler_tick(void) {
-    // Don't acquire locks in interrupt context
-    // Just check if tasks exist and set scheduling flag
-    
-    if (!tasks_exist) return;
-    
-    // Simple time slice management
-    static int counter = 0;
-    counter++;
-    
-    // Schedule every 25 ticks (0.5 seconds at 50Hz)
-    if (counter >= 25) {
-        counter = 0;
-        need_schedule = 1;  // Set flag for deferred scheduling
+    // No lock needed: only the running task's slice is touched, and
+    // schedule() reads it with interrupts disabled
+    cpu_local_t *cpu = this_cpu();
+    task_t *curr = cpu->current;
+
+    if (curr == cpu->idle) {
+        if (runqueues[cpu->id].nr_running) {
+            cpu->need_schedule = 1;
+        }
+        return;
+    }
+
+    if (curr->time_slice > 0) {
+        curr->time_slice--;
+    }
+    if (curr->time_slice == 0) {
+        cpu->need_schedule = 1;  // Switch on return from the interrupt
+    }
+}
+
+/**
+ * @brief Preempt the interrupted task once its time slice is up
+ *
+ * Runs at the end of the timer and reschedule interrupts, after the EOI
+ * and with interrupts still disabled. The interrupted registers stay on
+ * the task's stack, and the ISR's iretq resumes them once the task is
+ * switched back in. Tasks holding a spinlock are left alone; they are
+ * preempted on a later tick.
+ */
+void preempt_schedule_irq(void) {
+    cpu_local_t *cpu = this_cpu();
+
+    if (!cpu->need_schedule || preempt_count()) {
+        return;
     }
+    // The handler's time ends here, not when this task next runs
+    irqstat_close();
+    __schedule(1);
+
+    // On the way out of the interrupt with nothing held: a CPU-bound task
+    // that never sleeps is killed here
+    task_check_kill();
+}
+
+/**
+ * @brief Make a sleeping task runnable again
+ *
+ * The task goes back on the runqueue it slept on. Safe to call from
+ * interrupt handlers.
+ *
+ * @return 1 if the task was woken, 0 if it was not sleeping
+ */
+int task_wake(task_t *task) {
+    uint64_t flags;
+    runqueue_t *rq = task_rq_lock(task, &flags);
+
+    if (task->state != TASK_INTERRUPTIBLE && task->state != TASK_UNINTERRUPTIBLE) {
+        task_rq_unlock(rq, flags);
+        return 0;
+    }
+
+    task->state = TASK_RUNNING;
+
+    // Still queued if it was woken before it got as far as schedule()
+    int enqueue = !task->array;
+    if (enqueue) {
+        rq_insert(rq, task);
+        if (task->prio < cpu_locals[task->cpu].current->prio) {
+            cpu_locals[task->cpu].need_schedule = 1;
+        }
+    }
+
+    int cpu = task->cpu;
+    task_rq_unlock(rq, flags);
+
+    if (enqueue) {
+        smp_send_resched(cpu);
+    }
+    return 1;
+}
+
+static void sleep_timeout(void *data) {
+    task_wake((task_t *)data);
+}
+
+/**
+ * @brief Sleep for at least @p us microseconds
+ *
+ * The wakeup is programmed as a one-shot deadline, so it is not rounded
+ * to any tick.
+ */
+void task_usleep(uint64_t us) {
+    task_t *self = this_cpu_current();
+    if (self->pid == 0) {
+        return;
+    }
+
+    timer_t timer;
+    timer_setup(&timer, sleep_timeout, self);
+
+    // Mark sleeping before arming, so an early expiry just cancels the sleep
+    self->state = TASK_INTERRUPTIBLE;
+    self->stack_links++;
+    timer_add(&timer, timer_now() + us * NSEC_PER_USEC);
+    while (self->state != TASK_RUNNING) {
+        schedule();
+    }
+
+    timer_cancel(&timer);
+    self->stack_links--;
+
+    // kill_task() wakes sleepers early; the timer is off the wheel now
+    task_check_kill();
+}
+
+/**
+ * @brief Sleep for at least @p ms milliseconds
+ */
+void task_sleep(uint64_t ms) {
+    task_usleep(ms * 1000);
 }
 
 /**
  * @brief Get current task
  */
 task_t *get_current_task(void) {
-    spinlock_acquire(&current_task_lock);
-    task_t *task = current_task;
-    spinlock_release(&current_task_lock);
-    return task;
+    return this_cpu_current();
 }
 
 /**
  * @brief Get current PID
  */
 pid_t get_current_pid(void) {
-    spinlock_acquire(&current_task_lock);
-    pid_t pid = current_task ? current_task->pid : -1;
-    spinlock_release(&current_task_lock);
-    return pid;
+    task_t *task = this_cpu_current();
+    return task ? task->pid : -1;
 }
 
 /**
  * @brief Yield CPU to next task
  */
 void yield(void) {
-    if (need_schedule) {
-        need_schedule = 0;
+    if (this_cpu()->need_schedule) {
         schedule();
     }
 }
 
 /**
  * @brief Find task by PID
+ *
+ * Call inside rcu_read_lock(): the task may exit at any time, and the
+ * pointer stays valid only until rcu_read_unlock().
  */
 task_t *find_task_by_pid(pid_t pid) {
     if (pid <= 0) return NULL;
-    
-    spinlock_acquire(&runqueue_lock);
-    
-    if (!runqueue) {
-        spinlock_release(&runqueue_lock);
-        return NULL;
-    }
-    
-    task_t *current = runqueue;
-    task_t *found = NULL;
-    
-    do {
-        if (current->pid == pid) {
-            found = current;
-            break;
+
+    task_t *task = rcu_dereference(*pid_bucket(pid));
+    for (; task; task = rcu_dereference(task->pid_next)) {
+        if (task->pid == pid) {
+            return task;
         }
-        current = current->next;
-    } while (current != runqueue);
-    
-    spinlock_release(&runqueue_lock);
-    return found;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Call @p fn for every task, running or asleep
+ *
+ * The walk is an RCU read-side section, so it never blocks the scheduler
+ * and @p fn must not sleep.
+ */
+void task_for_each(void (*fn)(task_t *task, void *arg), void *arg) {
+    rcu_read_lock();
+    for (task_t *task = rcu_dereference(task_list); task; task = rcu_dereference(task->tasks_next)) {
+        fn(task, arg);
+    }
+    rcu_read_unlock();
 }
 
 /**
  * @brief Kill a task by PID
+ *
+ * Only marks the task: another CPU may be running it, and a sleeping or
+ * just woken task may still have wait queue entries and timers linked
+ * from its stack. The task exits itself at its next safe point, see
+ * task_check_kill(), and is woken if asleep so it gets there.
+ *
+ * @return 0 if the task was marked, -1 if there is no such task
  */
 int kill_task(pid_t pid) {
-    if (pid <= 0) return -1;
-    
-    spinlock_acquire(&runqueue_lock);
-    
-    task_t *target = NULL;
-    task_t *current = runqueue;
-    
-    if (runqueue) {
-        do {
-            if (current->pid == pid) {
-                target = current;
-                break;
-            }
-            current = current->next;
-        } while (current != runqueue);
-    }
-    
+    if (pid <= 0 || pid >= PID_MAX) return -1;
+
+    // The read-side section keeps the task's memory around until it is
+    // marked and woken
+    rcu_read_lock();
+    task_t *target = find_task_by_pid(pid);
     if (!target) {
-        spinlock_release(&runqueue_lock);
+        rcu_read_unlock();
         return -1;
     }
-    
-    // Don't allow killing current task
-    if (target == current_task) {
-        spinlock_release(&runqueue_lock);
-        return -2;
-    }
-    
-    // Mark as zombie and remove from runqueue
-    target->state = TASK_ZOMBIE;
-    
-    if (target->next == target) {
-        // Only task in queue
-        runqueue = NULL;
+
+    uint64_t flags;
+    runqueue_t *rq = task_rq_lock(target, &flags);
+    int result = 0;
+
+    if (target->state == TASK_ZOMBIE) {
+        result = -1;    // Already exiting
     } else {
-        target->prev->next = target->next;
-        target->next->prev = target->prev;
-        if (runqueue == target) {
-            runqueue = target->next;
-        }
+        target->kill_pending = 1;
+    }
+
+    task_rq_unlock(rq, flags);
+
+    if (result == 0) {
+        task_wake(target);
+    }
+    rcu_read_unlock();
+    return result;
+}
+
+/**
+ * @brief Non-zero if kill_task() has marked the current task
+ */
+int task_kill_pending(void) {
+    return this_cpu_current()->kill_pending;
+}
+
+/**
+ * @brief Exit if the current task is marked for killing and is at a safe
+ * point: nothing on its stack is linked into a wait queue or timer wheel,
+ * and it holds no spinlock or RCU read lock. Called after every
+ * schedule(), on the way out of a preempting interrupt, and by
+ * wait_event() and task_usleep() once they have unlinked.
+ */
+void task_check_kill(void) {
+    task_t *self = this_cpu_current();
+    if (self->kill_pending && !self->stack_links && !preempt_count()) {
+        task_exit(-1);
+    }
+}
+
+/**
+ * @brief Restrict the CPUs a task may run on
+ *
+ * A queued task that is not allowed on its current CPU is moved at once.
+ * A running task is moved when it is next switched out.
+ *
+ * @return 0 on success, -1 if @p mask contains no online CPU
+ */
+int task_set_affinity(task_t *task, uint64_t mask) {
+    if (!task || !online_mask(mask)) return -1;
+
+    // A task caught between queues ends up on a CPU the new mask may
+    // exclude, and is then moved when it is next switched out
+    uint64_t flags;
+    runqueue_t *rq = task_rq_lock(task, &flags);
+    int cpu = task->cpu;
+
+    task->cpus_allowed = mask;
+
+    int move = 0;
+    int running = task == cpu_locals[cpu].current;
+    if (!task_allowed(task, cpu) && !running && task->array) {
+        rq_remove(rq, task);
+        move = 1;
+    }
+
+    task_rq_unlock(rq, flags);
+
+    if (move) {
+        task->cpu = select_cpu(task);
+        add_task_to_runqueue(task);
+    } else if (running && !task_allowed(task, cpu)) {
+        cpu_locals[cpu].need_schedule = 1;
+        smp_send_resched(cpu);
+    }
+    return 0;
+}
+
+/**
+ * @brief Recompute a task's priority and requeue it at the new level
+ */
+static void task_change_prio(task_t *task, int static_prio, unsigned int rt_priority) {
+    uint64_t flags;
+    runqueue_t *rq = task_rq_lock(task, &flags);
+    prio_array_t *array = task->array;
+
+    // The FIFO is picked by prio, so leave it before prio changes
+    if (array) {
+        array_dequeue(task);
+    }
+
+    task->static_prio = static_prio;
+    task->rt_priority = rt_priority;
+    task->normal_prio = rt_priority ? MAX_RT_PRIO - 1 - (int)rt_priority : static_prio;
+    task->prio = task->normal_prio;
+
+    if (array) {
+        array_enqueue(array, task);
+    }
+
+    // Let the owning CPU re-pick: the task may now outrank the running
+    // one, or be the running one and have dropped below another
+    int cpu = task->cpu;
+    if (array) {
+        cpu_locals[cpu].need_schedule = 1;
+    }
+
+    task_rq_unlock(rq, flags);
+
+    if (array) {
+        smp_send_resched(cpu);
     }
-    target->next = NULL;
-    target->prev = NULL;
-    
-    spinlock_release(&runqueue_lock);
-    
-    // Free the task's resources (safe to do outside lock)
-    if (target->stack) {
-        free(target->stack);
-    }
-    free(target);
-    
+}
+
+/**
+ * @brief Set the nice value (-20 to 19) of a normal task
+ * @return 0 on success, -1 on an invalid task or value
+ */
+int task_set_nice(task_t *task, int nice) {
+    if (!task || task->pid == 0 || nice < -20 || nice > 19) return -1;
+
+    task_change_prio(task, NICE_TO_PRIO(nice), task->rt_priority);
+    return 0;
+}
+
+/**
+ * @brief Make a task real-time with priority 1 (lowest) to 99 (highest),
+ * or a normal task again with 0
+ *
+ * Real-time tasks always run before normal ones and never move to the
+ * expired array, so a busy one starves every normal task on its CPU.
+ *
+ * @return 0 on success, -1 on an invalid task or value
+ */
+int task_set_rt_priority(task_t *task, unsigned int rt_priority) {
+    if (!task || task->pid == 0 || rt_priority >= MAX_RT_PRIO) return -1;
+
+    task_change_prio(task, task->static_prio, rt_priority);
     return 0;
 }
@@ -0,0 +1,78 @@
+#include <valen/wait.h>
+#include <valen/percpu.h>
+#include <valen/cpu.h>
+
+/**
+ * @brief Initialize a wait queue
+ */
+void wait_queue_init(wait_queue_t *wq) {
+    spinlock_init(&wq->lock);
+    wq->head = NULL;
+}
+
+/**
+ * @brief Add the current task to a wait queue and mark it sleeping
+ */
+void prepare_to_wait(wait_queue_t *wq, wait_queue_entry_t *entry) {
+    task_t *self = this_cpu_current();
+
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+    // Only link on the first pass of a wait_event() loop
+    if (!entry->task) {
+        entry->task = self;
+        entry->prev = NULL;
+        entry->next = wq->head;
+        if (wq->head) {
+            wq->head->prev = entry;
+        }
+        wq->head = entry;
+        self->stack_links++;
+    }
+    self->state = TASK_INTERRUPTIBLE;
+
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * @brief Mark the current task running and remove it from a wait queue
+ */
+void finish_wait(wait_queue_t *wq, wait_queue_entry_t *entry) {
+    task_t *self = this_cpu_current();
+    self->state = TASK_RUNNING;
+
+    if (!entry->task) {
+        return;
+    }
+
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        wq->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    }
+    entry->task = NULL;
+    self->stack_links--;
+
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * @brief Wake all tasks on a wait queue
+ *
+ * Waiters stay linked until they call finish_wait(), so a waiter whose
+ * condition is still false simply goes back to sleep.
+ */
+void wake_up(wait_queue_t *wq) {
+    uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+    for (wait_queue_entry_t *entry = wq->head; entry; entry = entry->next) {
+        task_wake(entry->task);
+    }
+
+    spinlock_release_irqrestore(&wq->lock, flags);
+}
@@ -0,0 +1,425 @@
+/**
+ * @file timer.c
+ * @brief Hierarchical timer wheel for kernel timeouts.
+ *
+ * A wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots. A level-0 slot
+ * spans 2^WHEEL_SHIFT ns (about 65us) and each level above is WHEEL_SLOTS
+ * times coarser, so six levels reach about 50 days. A timer is linked into
+ * the finest level whose range covers its expiry, so arming and cancelling
+ * are constant time. Once time reaches the start of an upper-level slot,
+ * its timers cascade down a level. Every timer therefore sits on level 0
+ * before it is due.
+ *
+ * Nothing ticks. After each interrupt the wheel works out its next event,
+ * which is either the earliest level-0 expiry or the next non-empty
+ * cascade, and programs the clock event device for exactly that moment.
+ * With the LAPIC timer in TSC-deadline mode every CPU runs its own wheel;
+ * otherwise PIT channel 0 drives a single wheel on the BSP.
+ *
+ * The clock event interrupt only raises SOFTIRQ_TIMER. The wheel is run
+ * from the softirq with interrupts enabled, so timer callbacks no longer
+ * hold up other interrupts.
+ */
+
+#include <stddef.h>
+#include <valen/timer.h>
+#include <valen/spinlock.h>
+#include <valen/percpu.h>
+#include <valen/apic.h>
+#include <valen/pit.h>
+#include <valen/tsc.h>
+#include <valen/cpu.h>
+#include <valen/softirq.h>
+
+#define WHEEL_LEVELS 6
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/** @brief log2 of the level-0 slot width in nanoseconds. */
+#define WHEEL_SHIFT 16
+
+/** @brief log2 of a level's slot width in level-0 slots. */
+#define LEVEL_SHIFT(level) ((level) * WHEEL_BITS)
+
+#define NO_EVENT UINT64_MAX
+
+typedef struct timer_base
+{
+    spinlock_t lock;
+    uint64_t clk;                       /* Current level-0 slot index; earlier ones have run */
+    uint64_t next_event;                /* Deadline the device is armed for, or NO_EVENT */
+    uint64_t pending_map[WHEEL_LEVELS]; /* Bit n set while slot n of the level is non-empty */
+    timer_t *wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+    timer_t *volatile running;
+    int expiring;                       /* Inside timer_interrupt(), which reprograms on exit */
+    int device_ready;                   /* LAPIC timer of this CPU is in TSC-deadline mode */
+} timer_base_t;
+
+static timer_base_t bases[MAX_CPUS];
+static int percpu_events = 0;
+
+static inline uint64_t ror64(uint64_t value, unsigned int count)
+{
+    count &= 63;
+    return count ? (value >> count) | (value << (64 - count)) : value;
+}
+
+/**
+ * @brief Wheel of the calling CPU. Interrupts must be disabled.
+ */
+static timer_base_t *local_base(void)
+{
+    return &bases[percpu_events ? this_cpu_id() : 0];
+}
+
+static int wheel_empty(timer_base_t *base)
+{
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if (base->pending_map[level])
+            return 0;
+    }
+    return 1;
+}
+
+static void wheel_link(timer_base_t *base, timer_t *timer)
+{
+    uint64_t index = timer->expires >> WHEEL_SHIFT;
+    if (index < base->clk)
+        index = base->clk;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           (index >> LEVEL_SHIFT(level)) - (base->clk >> LEVEL_SHIFT(level)) >= WHEEL_SLOTS)
+        level++;
+
+    /* Past the top level's range: park in its furthest slot and re-sort on cascade */
+    uint64_t pos = index >> LEVEL_SHIFT(level);
+    uint64_t last = (base->clk >> LEVEL_SHIFT(level)) + WHEEL_MASK;
+    if (pos > last)
+        pos = last;
+
+    timer_t **head = &base->wheel[level * WHEEL_SLOTS + (pos & WHEEL_MASK)];
+    timer->slot = level * WHEEL_SLOTS + (pos & WHEEL_MASK);
+    timer->prev = NULL;
+    timer->next = *head;
+    if (*head)
+        (*head)->prev = timer;
+    *head = timer;
+    timer->pending = 1;
+
+    base->pending_map[level] |= 1ULL << (pos & WHEEL_MASK);
+}
+
+static void wheel_unlink(timer_base_t *base, timer_t *timer)
+{
+    timer_t **head = &base->wheel[timer->slot];
+
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *head = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    if (!*head)
+        base->pending_map[timer->slot / WHEEL_SLOTS] &= ~(1ULL << (timer->slot & WHEEL_MASK));
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->pending = 0;
+}
+
+/**
+ * @brief Level-0 index at which the first non-empty slot after the current
+ * one on @p level comes up, or NO_EVENT if the level is empty.
+ */
+static uint64_t level_next(timer_base_t *base, int level)
+{
+    uint64_t map = base->pending_map[level];
+    if (!map)
+        return NO_EVENT;
+
+    /* Bit 0 of the rotated map is the slot after the current one */
+    uint64_t pos = base->clk >> LEVEL_SHIFT(level);
+    uint64_t ahead = bsf64(ror64(map, (pos + 1) & WHEEL_MASK)) + 1;
+    return (pos + ahead) << LEVEL_SHIFT(level);
+}
+
+/**
+ * @brief Time of the wheel's next event in ns, or NO_EVENT if it is empty.
+ */
+static uint64_t wheel_next_expiry(timer_base_t *base)
+{
+    uint64_t next = NO_EVENT;
+
+    /* Level-0 slots follow time order from the current one, so the first
+       non-empty slot holds the earliest expiry */
+    uint64_t map = base->pending_map[0];
+    if (map)
+    {
+        uint64_t slot = (base->clk + bsf64(ror64(map, base->clk & WHEEL_MASK))) & WHEEL_MASK;
+        for (timer_t *timer = base->wheel[slot]; timer; timer = timer->next)
+        {
+            if (timer->expires < next)
+                next = timer->expires;
+        }
+    }
+
+    for (int level = 1; level < WHEEL_LEVELS; level++)
+    {
+        uint64_t index = level_next(base, level);
+        if (index != NO_EVENT && (index << WHEEL_SHIFT) < next)
+            next = index << WHEEL_SHIFT;
+    }
+    return next;
+}
+
+/**
+ * @brief Arms the clock event device if the wheel's next event is earlier
+ * than the deadline it already holds. A stale later deadline just raises
+ * an interrupt with nothing to do.
+ */
+static void wheel_program(timer_base_t *base)
+{
+    uint64_t next = wheel_next_expiry(base);
+    if (next >= base->next_event)
+        return;
+    base->next_event = next;
+
+    if (percpu_events)
+    {
+        if (!base->device_ready)
+        {
+            lapic_timer_init();
+            base->device_ready = 1;
+        }
+
+        /* A deadline of 0 would disarm the timer */
+        uint64_t tsc = tsc_from_ns(next);
+        lapic_timer_set_deadline(tsc ? tsc : 1);
+    }
+    else
+    {
+        uint64_t now = timer_now();
+        pit_oneshot(next > now ? next - now : 0);
+    }
+}
+
+/**
+ * @brief Moves the timers of every upper-level slot starting at the
+ * current index down the wheel.
+ */
+static void wheel_cascade(timer_base_t *base)
+{
+    for (int level = 1; level < WHEEL_LEVELS; level++)
+    {
+        if (base->clk & ((1ULL << LEVEL_SHIFT(level)) - 1))
+            break;
+
+        uint64_t pos = (base->clk >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+        timer_t *timer = base->wheel[level * WHEEL_SLOTS + pos];
+        base->wheel[level * WHEEL_SLOTS + pos] = NULL;
+        base->pending_map[level] &= ~(1ULL << pos);
+
+        while (timer)
+        {
+            timer_t *next = timer->next;
+            wheel_link(base, timer);
+            timer = next;
+        }
+    }
+}
+
+/**
+ * @brief Runs the due timers of the current level-0 slot. Called with the
+ * lock held; @p flags are the interrupt state it was taken with.
+ */
+static void wheel_expire(timer_base_t *base, uint64_t now, uint64_t *flags)
+{
+    timer_t **head = &base->wheel[base->clk & WHEEL_MASK];
+
+    for (;;)
+    {
+        timer_t *timer = *head;
+        while (timer && timer->expires > now)
+            timer = timer->next;
+        if (!timer)
+            break;
+
+        wheel_unlink(base, timer);
+        void (*func)(void *data) = timer->func;
+        void *data = timer->data;
+        base->running = timer;
+
+        /* Callbacks run without the lock so that they may re-arm timers */
+        spinlock_release_irqrestore(&base->lock, *flags);
+        func(data);
+        *flags = spinlock_acquire_irqsave(&base->lock);
+
+        base->running = NULL;
+    }
+}
+
+/**
+ * @brief SOFTIRQ_TIMER handler: runs the due timers of this CPU's wheel
+ * and programs the next deadline.
+ */
+static void timer_softirq(void)
+{
+    uint64_t flags = irq_save();
+    timer_base_t *base = local_base();
+    spinlock_acquire(&base->lock);
+    base->expiring = 1;
+
+    uint64_t now = timer_now();
+    uint64_t target = now >> WHEEL_SHIFT;
+
+    /* Step from event to event rather than slot by slot, so a long idle
+       stretch costs only the cascades that actually hold timers */
+    for (;;)
+    {
+        wheel_expire(base, now, &flags);
+        if (base->clk >= target)
+            break;
+
+        uint64_t next = level_next(base, 0);
+        for (int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            uint64_t index = level_next(base, level);
+            if (index < next)
+                next = index;
+        }
+
+        base->clk = next < target ? next : target;
+        wheel_cascade(base);
+    }
+
+    /* The device has fired, so whatever comes next must be programmed */
+    base->expiring = 0;
+    base->next_event = NO_EVENT;
+    wheel_program(base);
+
+    spinlock_release_irqrestore(&base->lock, flags);
+}
+
+void timer_init(void)
+{
+    uint64_t clk = timer_now() >> WHEEL_SHIFT;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+        spinlock_init_named(&bases[cpu].lock, "timer");
+        bases[cpu].clk = clk;
+        bases[cpu].next_event = NO_EVENT;
+    }
+
+    open_softirq(SOFTIRQ_TIMER, timer_softirq);
+
+    if (lapic_tsc_deadline_supported())
+        percpu_events = 1;
+    else
+        pit_oneshot_init();
+}
+
+int timer_is_percpu(void)
+{
+    return percpu_events;
+}
+
+void timer_setup(timer_t *timer, void (*func)(void *data), void *data)
+{
+    timer->expires = 0;
+    timer->func = func;
+    timer->data = data;
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->pending = 0;
+    timer->cpu = 0;
+    timer->slot = 0;
+}
+
+void timer_add(timer_t *timer, uint64_t expires)
+{
+    uint64_t flags = irq_save();
+
+    timer_base_t *base = local_base();
+    spinlock_acquire(&base->lock);
+
+    /* A pending timer may sit on another CPU's wheel. Only that wheel's lock
+     * covers it, and another CPU may link it anew while we hold neither, so
+     * unlink it there and look again once our lock is back */
+    while (timer->pending && timer->cpu != (uint32_t)(base - bases))
+    {
+        timer_base_t *old = &bases[timer->cpu];
+        spinlock_release(&base->lock);
+        spinlock_acquire(&old->lock);
+        if (timer->pending && &bases[timer->cpu] == old)
+            wheel_unlink(old, timer);
+        spinlock_release(&old->lock);
+        spinlock_acquire(&base->lock);
+    }
+    if (timer->pending)
+        wheel_unlink(base, timer);
+
+    /* An empty wheel left behind while idle can jump straight to now */
+    if (!base->expiring && wheel_empty(base))
+    {
+        uint64_t clk = timer_now() >> WHEEL_SHIFT;
+        if (clk > base->clk)
+            base->clk = clk;
+    }
+
+    timer->expires = expires;
+    timer->cpu = base - bases;
+    wheel_link(base, timer);
+
+    if (!base->expiring)
+        wheel_program(base);
+
+    spinlock_release(&base->lock);
+    irq_restore(flags);
+}
+
+int timer_cancel(timer_t *timer)
+{
+    uint64_t flags = irq_save();
+    timer_base_t *base = &bases[timer->cpu];
+    spinlock_acquire(&base->lock);
+
+    /* timer_add() on another CPU may have moved it to a different wheel */
+    while (&bases[timer->cpu] != base)
+    {
+        spinlock_release(&base->lock);
+        base = &bases[timer->cpu];
+        spinlock_acquire(&base->lock);
+    }
+
+    int was_pending = timer->pending;
+    if (was_pending)
+        wheel_unlink(base, timer);
+
+    /* Wait out a callback running on another CPU so the caller may free the timer */
+    while (base->running == timer)
+    {
+        spinlock_release(&base->lock);
+        irq_restore(flags);
+        cpu_relax();
+        flags = irq_save();
+        spinlock_acquire(&base->lock);
+    }
+
+    spinlock_release(&base->lock);
+    irq_restore(flags);
+    return was_pending;
+}
+
+void timer_interrupt(void)
+{
+    raise_softirq(SOFTIRQ_TIMER);
+}
+
+uint64_t timer_now(void)
+{
+    return tsc_to_ns(rdtsc());
+}
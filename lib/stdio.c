@@ -7,18 +7,170 @@
 #include <valen/io.h>
 #include <valen/spinlock.h>
 #include <valen/color.h>
+#include <valen/string.h>
+#include <valen/cpu.h>
+#include <valen/uart.h>
 
 /* Higher Half Virtual Address for VGA Buffer */
 #define VIRT_ADDR 0xFFFFFFFF800B8000
 
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+
+/* Rows below the status bar, which is never scrolled */
+#define SCROLL_ROWS (VGA_HEIGHT - 1)
+
+/* Characters printf() gathers before writing them out */
+#define OUT_BUF_SIZE 128
+
 static uint16_t *buffer = (uint16_t *)VIRT_ADDR;
 static int cursor_x = 0;
 static int cursor_y = 0;
-const int width = 80;
-const int height = 25;
+const int width = VGA_WIDTH;
+const int height = VGA_HEIGHT;
 static uint8_t terminal_attribute = COLOR_GREEN;
 
-static spinlock_t lock = SPINLOCK_INIT;
+/*
+ * Output goes to a copy of the screen in RAM and reaches VGA memory only
+ * when a call is done: every row written since is copied over in one go,
+ * and the hardware cursor moves only if its position changed. Scrolling
+ * rotates the rows below the status bar instead of moving them, so a
+ * printf() that scrolls many lines still rewrites each row just once.
+ */
+static uint16_t shadow[VGA_WIDTH * VGA_HEIGHT];
+static int scroll_base = 0;         /* Shadow row shown in screen row 1, less one */
+static uint32_t dirty_rows = 0;     /* Bit n set while screen row n differs from VGA memory */
+static int hw_cursor = -1;          /* Position last written to the cursor registers */
+
+/* Guards the screen; taken with interrupts off: fault and interrupt handlers print too */
+static spinlock_t lock = SPINLOCK_INIT_NAMED("console");
+
+/**
+ * @brief Shadow cell shown at column @p x of screen row @p y.
+ */
+static uint16_t *cell(int x, int y)
+{
+    int row = y ? 1 + (y - 1 + scroll_base) % SCROLL_ROWS : 0;
+    return &shadow[row * VGA_WIDTH + x];
+}
+
+static void clear_row(int y)
+{
+    uint16_t blank = (uint16_t)' ' | ((uint16_t)terminal_attribute << 8);
+    uint16_t *row = cell(0, y);
+    for (int x = 0; x < VGA_WIDTH; x++)
+    {
+        row[x] = blank;
+    }
+    dirty_rows |= 1u << y;
+}
+
+/**
+ * @brief Copies the dirty rows to VGA memory and moves the hardware cursor.
+ * Called with the lock held at the end of every output call.
+ */
+static void console_flush(void)
+{
+    for (uint32_t rows = dirty_rows; rows; rows &= rows - 1)
+    {
+        int y = bsf64(rows);
+        memcpy(&buffer[y * VGA_WIDTH], cell(0, y), VGA_WIDTH * sizeof(uint16_t));
+    }
+    dirty_rows = 0;
+
+    if (cursor_y * VGA_WIDTH + cursor_x != hw_cursor)
+    {
+        update_cursor(cursor_x, cursor_y);
+    }
+}
+
+/**
+ * @brief Moves to the next line, scrolling below the status bar at the
+ * bottom. Called with the lock held.
+ */
+static void console_newline(void)
+{
+    cursor_x = 0;
+    if (cursor_y < VGA_HEIGHT - 1)
+    {
+        cursor_y++;
+        return;
+    }
+
+    /* The top row becomes the bottom one; every row now shows another line */
+    scroll_base = (scroll_base + 1) % SCROLL_ROWS;
+    dirty_rows |= ((1u << SCROLL_ROWS) - 1) << 1;
+    clear_row(VGA_HEIGHT - 1);
+}
+
+/**
+ * @brief Puts one character in the shadow buffer. Called with the lock held.
+ */
+static void console_emit(char c)
+{
+    if (c == '\n')
+    {
+        console_newline();
+        return;
+    }
+
+    if (cursor_x >= VGA_WIDTH)
+    {
+        console_newline();
+    }
+
+    uint8_t uc = (uint8_t)c;
+    *cell(cursor_x, cursor_y) = (uint16_t)uc | ((uint16_t)terminal_attribute << 8);
+    dirty_rows |= 1u << cursor_y;
+    cursor_x++;
+}
+
+/**
+ * @brief Writes @p len characters and flushes them to the screen once.
+ */
+static void console_write(const char *s, size_t len)
+{
+    uint64_t flags = spinlock_acquire_irqsave(&lock);
+    for (size_t i = 0; i < len; i++)
+    {
+        console_emit(s[i]);
+    }
+    console_flush();
+    spinlock_release_irqrestore(&lock, flags);
+}
+
+/* Output of one printf() or print_*() call, written out in chunks */
+typedef struct out_buf
+{
+    char data[OUT_BUF_SIZE];
+    size_t len;
+} out_buf_t;
+
+static void out_flush(out_buf_t *out)
+{
+    if (out->len)
+    {
+        console_write(out->data, out->len);
+        out->len = 0;
+    }
+}
+
+static void out_char(out_buf_t *out, char c)
+{
+    if (out->len == OUT_BUF_SIZE)
+    {
+        out_flush(out);
+    }
+    out->data[out->len++] = c;
+}
+
+static void out_str(out_buf_t *out, const char *s)
+{
+    while (*s)
+    {
+        out_char(out, *s++);
+    }
+}
 
 /**
  * @brief Sets the global text color for kprint.
@@ -35,16 +187,12 @@ uint8_t get_color(void)
 
 /**
  * @brief Writes a string to COM1 Serial Port for diagnostics.
- * I/O ports (outb) do not change in the Higher Half.
+ * Queued by the UART driver, which has its own lock, so it neither waits
+ * for the line nor holds up the screen.
  */
 void serial_write(char *s)
 {
-    spinlock_acquire(&lock);
-    while (*s)
-    {
-        outb(0x3f8, *s++);
-    }
-    spinlock_release(&lock);
+    uart_write(s, strlen(s));
 }
 
 /**
@@ -77,6 +225,7 @@ int get_cursor_y() { return cursor_y; }
 void update_cursor(int x, int y)
 {
     uint16_t pos = y * width + x;
+    hw_cursor = pos;
     outb(0x3D4, 0x0F);
     outb(0x3D5, (uint8_t)(pos & 0xFF));
     outb(0x3D4, 0x0E);
@@ -88,11 +237,11 @@ void update_cursor(int x, int y)
  */
 void set_cursor(int x, int y)
 {
-    spinlock_acquire(&lock);
+    uint64_t flags = spinlock_acquire_irqsave(&lock);
     cursor_x = x;
     cursor_y = y;
-    update_cursor(cursor_x, cursor_y);
-    spinlock_release(&lock);
+    console_flush();
+    spinlock_release_irqrestore(&lock, flags);
 }
 
 /**
@@ -111,18 +260,17 @@ void enable_cursor(uint8_t cursor_start, uint8_t cursor_end)
  */
 void print_clear()
 {
-    spinlock_acquire(&lock);
-    uint16_t blank = (uint16_t)' ' | ((uint16_t)terminal_attribute << 8);
-    for (int i = 0; i < width * height; i++)
+    uint64_t flags = spinlock_acquire_irqsave(&lock);
+    for (int y = 0; y < height; y++)
     {
-        buffer[i] = blank;
+        clear_row(y);
     }
 
     cursor_x = 0;
     cursor_y = 1;
-    update_cursor(cursor_x, cursor_y);
+    console_flush();
     enable_cursor(14, 15); // Enable hardware cursor
-    spinlock_release(&lock);
+    spinlock_release_irqrestore(&lock, flags);
 }
 
 /**
@@ -130,42 +278,12 @@ void print_clear()
  */
 void print_newline()
 {
-    spinlock_acquire(&lock);
-    
-    cursor_x = 0;
-    if (cursor_y < height - 1)
-    {
-        cursor_y++;
-    }
-    else
-    {
-        /* Move all rows from row 1 to height-1 UP by one */
-        for (int y = 1; y < height - 1; y++)
-        {
-            for (int x = 0; x < width; x++)
-            {
-                buffer[y * width + x] = buffer[(y + 1) * width + x];
-            }
-        }
-        /* Clear the bottom-most row only */
-        uint16_t blank = (uint16_t)' ' | ((uint16_t)terminal_attribute << 8);
-        for (int x = 0; x < width; x++)
-        {
-            buffer[(height - 1) * width + x] = blank;
-        }
-        cursor_y = height - 1;
-    }
-    update_cursor(cursor_x, cursor_y);
-    
-    spinlock_release(&lock);
+    console_write("\n", 1);
 }
 
 void puts(const char *str)
 {
-    while (*str)
-    {
-        putc(*str++);
-    }
+    console_write(str, strlen(str));
 }
 
 /**
@@ -173,34 +291,26 @@ void puts(const char *str)
  */
 void putc(char c)
 {
-    spinlock_acquire(&lock);
-    
-    if (c == '\n')
-    {
-        spinlock_release(&lock);
-        print_newline();  // print_newline() has its own lock
-        return;
-    }
-
-    if (cursor_x >= width)
-    {
-        spinlock_release(&lock);
-        print_newline();  // print_newline() has its own lock
-        spinlock_acquire(&lock);
-    }
-
-    uint8_t uc = (uint8_t)c;
-    buffer[cursor_y * width + cursor_x] = (uint16_t)uc | ((uint16_t)terminal_attribute << 8);
-
-    cursor_x++;
-    update_cursor(cursor_x, cursor_y);
-    spinlock_release(&lock);
+    console_write(&c, 1);
 }
 
+static void fmt_uint(out_buf_t *out, uint64_t num);
+static void fmt_int(out_buf_t *out, uint64_t n);
+static void fmt_hex(out_buf_t *out, uint64_t n);
+static void fmt_hex_upper(out_buf_t *out, uint64_t num);
+static void fmt_octal(out_buf_t *out, uint64_t num);
+static void fmt_binary(out_buf_t *out, uint64_t num);
+
+/**
+ * @brief Formats into a local buffer, so the screen is updated once per
+ * OUT_BUF_SIZE characters rather than once per character.
+ */
 void printf(const char *format, ...)
 {
     va_list args;
     va_start(args, format);
+    out_buf_t out;
+    out.len = 0;
 
     while (*format)
     {
@@ -211,10 +321,10 @@ void printf(const char *format, ...)
             {
             case 'd':
             case 'i':
-                print_int(va_arg(args, int));
+                fmt_int(&out, va_arg(args, int));
                 break;
             case 'u':
-                print_uint(va_arg(args, unsigned int));
+                fmt_uint(&out, va_arg(args, unsigned int));
                 break;
             case 'l':
                 if (*(format + 1) == 'l')
@@ -223,80 +333,81 @@ void printf(const char *format, ...)
                     if (*(format + 1) == 'u')
                     {
                         format++;
-                        print_uint(va_arg(args, unsigned long long));
+                        fmt_uint(&out, va_arg(args, unsigned long long));
                     }
                     else if (*(format + 1) == 'd' || *(format + 1) == 'i')
                     {
                         format++;
-                        print_int(va_arg(args, long long));
+                        fmt_int(&out, va_arg(args, long long));
                     }
                     else if (*(format + 1) == 'x')
                     {
                         format++;
-                        print_hex(va_arg(args, unsigned long long));
+                        fmt_hex(&out, va_arg(args, unsigned long long));
                     }
                     else if (*(format + 1) == 'X')
                     {
                         format++;
-                        print_hex_upper(va_arg(args, unsigned long long));
+                        fmt_hex_upper(&out, va_arg(args, unsigned long long));
                     }
                     else
                     {
-                        print_hex(va_arg(args, unsigned long));
+                        fmt_hex(&out, va_arg(args, unsigned long));
                     }
                 }
                 else
                 {
-                    print_hex(va_arg(args, unsigned long));
+                    fmt_hex(&out, va_arg(args, unsigned long));
                 }
                 break;
             case 'x':
-                print_hex(va_arg(args, unsigned int));
+                fmt_hex(&out, va_arg(args, unsigned int));
                 break;
             case 'X':
-                print_hex_upper(va_arg(args, unsigned int));
+                fmt_hex_upper(&out, va_arg(args, unsigned int));
                 break;
             case 'o':
-                print_octal(va_arg(args, unsigned int));
+                fmt_octal(&out, va_arg(args, unsigned int));
                 break;
             case 'b':
-                print_binary(va_arg(args, unsigned int));
+                fmt_binary(&out, va_arg(args, unsigned int));
                 break;
             case 'p':
-                putc('0');
-                putc('x');
-                print_hex_upper((uint64_t)va_arg(args, void *));
+                out_char(&out, '0');
+                out_char(&out, 'x');
+                fmt_hex_upper(&out, (uint64_t)va_arg(args, void *));
                 break;
             case 's':
-                puts(va_arg(args, char *));
+                out_str(&out, va_arg(args, char *));
                 break;
             case 'c':
-                putc(va_arg(args, int));
+                out_char(&out, va_arg(args, int));
                 break;
             case '%':
-                putc('%');
+                out_char(&out, '%');
                 break;
             default:
-                putc('%');
-                putc(*format);
+                out_char(&out, '%');
+                out_char(&out, *format);
                 break;
             }
         }
         else
         {
-            putc(*format);
+            out_char(&out, *format);
         }
         format++;
     }
 
     va_end(args);
+    out_flush(&out);
 }
 
-void print_uint(uint64_t num)
+static void fmt_uint(out_buf_t *out, uint64_t num)
 {
     if (num == 0)
     {
-        putc('0');
+        out_char(out, '0');
         return;
     }
 
@@ -312,15 +423,15 @@ void print_uint(uint64_t num)
     // Print in reverse order (most significant digit first)
     while (i > 0)
     {
-        putc(buffer[--i]);
+        out_char(out, buffer[--i]);
     }
 }
 
-void print_int(uint64_t n)
+static void fmt_int(out_buf_t *out, uint64_t n)
 {
     if (n == 0)
     {
-        putc('0');
+        out_char(out, '0');
         return;
     }
     char buf[21];
@@ -331,10 +442,10 @@ void print_int(uint64_t n)
         buf[i--] = (n % 10) + '0';
         n /= 10;
     }
-    puts(&buf[i + 1]);  // Use puts instead of printf to avoid recursion
+    out_str(out, &buf[i + 1]);
 }
 
-void print_hex(uint64_t n)
+static void fmt_hex(out_buf_t *out, uint64_t n)
 {
     char *chars = "0123456789ABCDEF";
     char buf[19];
@@ -344,16 +455,16 @@ void print_hex(uint64_t n)
         buf[i] = chars[n & 0xF];
         n >>= 4;
     }
-    putc('0');
-    putc('x');
-    puts(buf);  // Use puts instead of printf to avoid recursion
+    out_char(out, '0');
+    out_char(out, 'x');
+    out_str(out, buf);
 }
 
-void print_hex_upper(uint64_t num)
+static void fmt_hex_upper(out_buf_t *out, uint64_t num)
 {
     if (num == 0)
     {
-        putc('0');
+        out_char(out, '0');
         return;
     }
 
@@ -370,15 +481,15 @@ void print_hex_upper(uint64_t num)
     // Print in reverse order (most significant digit first)
     while (i > 0)
     {
-        putc(buffer[--i]);
+        out_char(out, buffer[--i]);
     }
 }
 
-void print_octal(uint64_t num)
+static void fmt_octal(out_buf_t *out, uint64_t num)
 {
     if (num == 0)
     {
-        putc('0');
+        out_char(out, '0');
         return;
     }
 
@@ -394,15 +505,15 @@ void print_octal(uint64_t num)
     // Print in reverse order (most significant digit first)
     while (i > 0)
     {
-        putc(buffer[--i]);
+        out_char(out, buffer[--i]);
     }
 }
 
-void print_binary(uint64_t num)
+static void fmt_binary(out_buf_t *out, uint64_t num)
 {
     if (num == 0)
     {
-        putc('0');
+        out_char(out, '0');
         return;
     }
 
@@ -418,11 +529,60 @@ void print_binary(uint64_t num)
     // Print in reverse order (most significant digit first)
     while (i > 0)
     {
-        putc(buffer[--i]);
+        out_char(out, buffer[--i]);
     }
 }
 
 
+void print_uint(uint64_t num)
+{
+    out_buf_t out;
+    out.len = 0;
+    fmt_uint(&out, num);
+    out_flush(&out);
+}
+
+void print_int(uint64_t n)
+{
+    out_buf_t out;
+    out.len = 0;
+    fmt_int(&out, n);
+    out_flush(&out);
+}
+
+void print_hex(uint64_t n)
+{
+    out_buf_t out;
+    out.len = 0;
+    fmt_hex(&out, n);
+    out_flush(&out);
+}
+
+void print_hex_upper(uint64_t num)
+{
+    out_buf_t out;
+    out.len = 0;
+    fmt_hex_upper(&out, num);
+    out_flush(&out);
+}
+
+void print_octal(uint64_t num)
+{
+    out_buf_t out;
+    out.len = 0;
+    fmt_octal(&out, num);
+    out_flush(&out);
+}
+
+void print_binary(uint64_t num)
+{
+    out_buf_t out;
+    out.len = 0;
+    fmt_binary(&out, num);
+    out_flush(&out);
+}
+
+
 void serial_write_hex(uint32_t n)
 {
     char hex[] = "0123456789ABCDEF";
@@ -461,7 +621,7 @@ void show_hardware_cursor()
 
 void print_backspace()
 {
-    spinlock_acquire(&lock);
+    uint64_t flags = spinlock_acquire_irqsave(&lock);
     if (cursor_x > 0)
     {
         cursor_x--;
@@ -471,9 +631,10 @@ void print_backspace()
         cursor_y--;
         cursor_x = width - 1;
     }
-    buffer[cursor_y * width + cursor_x] = (uint16_t)' ' | ((uint16_t)terminal_attribute << 8);
-    update_cursor(cursor_x, cursor_y);
-    spinlock_release(&lock);
+    *cell(cursor_x, cursor_y) = (uint16_t)' ' | ((uint16_t)terminal_attribute << 8);
+    dirty_rows |= 1u << cursor_y;
+    console_flush();
+    spinlock_release_irqrestore(&lock, flags);
 }
 
 /**
@@ -1,8 +1,64 @@
 #include <valen/string.h>
+#include <valen/cpu.h>
 #include <stddef.h>
 
+/*
+ * Below STRING_REP_MIN bytes the fixed startup cost of a rep string
+ * instruction outweighs the copy, so short runs go through 8-byte words.
+ * Longer ones use rep movsb/stosb when the CPU has ERMSB, which makes
+ * them the fastest way to move memory, and rep movsq/stosq otherwise.
+ * SSE is not used: the kernel is built without it and only tasks own
+ * FPU state (see fpu.h).
+ */
+#define STRING_REP_MIN 64
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* CPUID.(EAX=7,ECX=0):EBX bit 9, enhanced rep movsb/stosb */
+#define CPUID_7_EBX_ERMSB (1u << 9)
+
+/* Set by string_init(); word and rep movsq paths until then */
+static int have_ermsb = 0;
+
+void string_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) return;
+
+    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    have_ermsb = (ebx & CPUID_7_EBX_ERMSB) != 0;
+}
+
+/* Unaligned word access; x86 handles it in hardware */
+typedef uint64_t __attribute__((may_alias, aligned(1))) word_t;
+
+static inline uint64_t load64(const void *p) {
+    return *(const word_t *)p;
+}
+
+static inline void store64(void *p, uint64_t v) {
+    *(word_t *)p = v;
+}
+
 void *memset(void *ptr, int value, uint64_t num) {
     uint8_t *p = (uint8_t *)ptr;
+    uint64_t word = (uint8_t)value * ONES;
+
+    if (num >= STRING_REP_MIN) {
+        if (have_ermsb) {
+            asm volatile("rep stosb" : "+D"(p), "+c"(num) : "a"(word) : "memory");
+            return ptr;
+        }
+        uint64_t words = num / 8;
+        asm volatile("rep stosq" : "+D"(p), "+c"(words) : "a"(word) : "memory");
+        num &= 7;
+    }
+
+    for (; num >= 8; num -= 8, p += 8) {
+        store64(p, word);
+    }
     while (num--) {
         *p++ = (uint8_t)value;
     }
@@ -12,18 +68,81 @@ void *memset(void *ptr, int value, uint64_t num) {
 void *memcpy(void *dest, const void *src, uint64_t num) {
     uint8_t *d = (uint8_t *)dest;
     const uint8_t *s = (const uint8_t *)src;
+
+    if (num >= STRING_REP_MIN) {
+        if (have_ermsb) {
+            asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(num) : : "memory");
+            return dest;
+        }
+        uint64_t words = num / 8;
+        asm volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+        num &= 7;
+    }
+
+    for (; num >= 8; num -= 8, d += 8, s += 8) {
+        store64(d, load64(s));
+    }
     while (num--) {
         *d++ = *s++;
     }
     return dest;
 }
 
+void *memmove(void *dest, const void *src, uint64_t num) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    /* A forward copy only reads bytes it has not yet overwritten */
+    if (d <= s || d >= s + num) {
+        return memcpy(dest, src, num);
+    }
+
+    /* Backwards from the end; rep movs is slow with the direction flag set */
+    d += num;
+    s += num;
+    for (; num >= 8; num -= 8) {
+        d -= 8;
+        s -= 8;
+        store64(d, load64(s));
+    }
+    while (num--) {
+        *--d = *--s;
+    }
+    return dest;
+}
+
+int memcmp(const void *ptr1, const void *ptr2, uint64_t num) {
+    const uint8_t *a = (const uint8_t *)ptr1;
+    const uint8_t *b = (const uint8_t *)ptr2;
+
+    /* Skip equal words; the byte loop then finds the first difference */
+    for (; num >= 8 && load64(a) == load64(b); num -= 8, a += 8, b += 8)
+        ;
+    for (; num; num--, a++, b++) {
+        if (*a != *b) {
+            return *a - *b;
+        }
+    }
+    return 0;
+}
+
 int strlen(const char *str) {
-    int len = 0;
-    while (*str++) {
-        len++;
+    const char *p = str;
+
+    /* Aligned words never cross into the next page, so reading past the
+       terminator within one is safe */
+    for (; (uintptr_t)p & 7; p++) {
+        if (!*p) return p - str;
+    }
+    for (;;) {
+        uint64_t word = load64(p);
+        if ((word - ONES) & ~word & HIGHS) break;
+        p += 8;
+    }
+    while (*p) {
+        p++;
     }
-    return len;
+    return p - str;
 }
 
 int strcmp(const char *str1, const char *str2) {
@@ -1,92 +1,276 @@
+/**
+ * @file heap.c
+ * @brief Kernel Heap (Segregated Fit with Boundary Tags).
+ *
+ * Free blocks are kept in power-of-two size classes: class k holds blocks
+ * of [2^k, 2^(k+1)) bytes, and a bitmap records which classes are non-empty.
+ * Every block carries its size in a header and a footer, so free() merges
+ * with both neighbours in constant time. Heap memory grows in arenas taken
+ * from the PMM, and large requests get whole pages of their own.
+ */
+
 #include <valen/heap.h>
 #include <valen/vmm.h>
 #include <valen/pmm.h>
+#include <valen/page.h>
 #include <valen/stdio.h>
 #include <valen/spinlock.h>
+#include <valen/string.h>
 
 #define HEAP_MAGIC 0x12345678
+#define HEAP_LARGE_MAGIC 0x87654321
+
+/** @brief Boundary tag flags, stored in the low bits of the block size. */
+#define TAG_ALLOC 0x1ULL
+#define TAG_PROLOGUE 0x2ULL
+#define TAG_SIZE(tag) ((tag) & ~0xFULL)
+
+#define HEADER_SIZE 16
+#define FOOTER_SIZE 8
+#define MIN_BLOCK 48
+
+/** @brief Pages per heap arena (64KB). */
+#define HEAP_ARENA_PAGES 16
+
+/** @brief Blocks above this size bypass the arenas and map whole pages. */
+#define HEAP_LARGE_THRESHOLD (16 * 1024)
+
+/** @brief Size classes: 2^0 .. 2^63, only the classes above MIN_BLOCK are used. */
+#define HEAP_CLASSES 64
+
+/** @brief Blocks inspected in the exact size class before moving up a class. */
+#define HEAP_CLASS_SCAN 4
 
-typedef struct heap_node
+/**
+ * @brief Block header. The free-list links overlap the payload, so they
+ * only exist while the block is free.
+ */
+typedef struct heap_block
 {
     uint32_t magic;
-    uint64_t size;
-    struct heap_node *next;
-    int free;
-} __attribute__((packed)) heap_node_t;
+    uint32_t reserved;
+    uint64_t tag;
+    struct heap_block *next_free;
+    struct heap_block *prev_free;
+} heap_block_t;
+
+/**
+ * @brief Arena header. @c prologue acts as the footer of a permanently
+ * allocated block in front of the first real block, and the arena ends with
+ * a zero-sized allocated epilogue header, so coalescing never leaves it.
+ */
+typedef struct heap_arena
+{
+    uint64_t pages;
+    uint64_t prologue;
+} heap_arena_t;
+
+static heap_block_t *free_lists[HEAP_CLASSES];
+static uint64_t class_bitmap = 0;
+static int heap_ready = 0;
+static spinlock_t heap_lock = SPINLOCK_INIT_NAMED("heap");
+
+/* Running counters, protected by heap_lock. Free-list figures are computed on demand. */
+static heap_stats_t stats;
+
+static inline uint64_t *block_footer(heap_block_t *block)
+{
+    return (uint64_t *)((uint8_t *)block + TAG_SIZE(block->tag) - FOOTER_SIZE);
+}
+
+static inline void block_set(heap_block_t *block, uint64_t size, uint64_t flags)
+{
+    block->magic = HEAP_MAGIC;
+    block->tag = size | flags;
+    *block_footer(block) = size | flags;
+}
+
+static inline heap_block_t *block_next(heap_block_t *block)
+{
+    return (heap_block_t *)((uint8_t *)block + TAG_SIZE(block->tag));
+}
+
+static inline uint64_t block_prev_tag(heap_block_t *block)
+{
+    return *((uint64_t *)block - 1);
+}
+
+static inline int size_class(uint64_t size)
+{
+    return 63 - __builtin_clzll(size);
+}
 
-static heap_node_t *head = NULL;
-static spinlock_t heap_lock = SPINLOCK_INIT;
+static void free_list_insert(heap_block_t *block)
+{
+    int k = size_class(TAG_SIZE(block->tag));
+
+    block->prev_free = NULL;
+    block->next_free = free_lists[k];
+    if (free_lists[k])
+        free_lists[k]->prev_free = block;
+    free_lists[k] = block;
+    class_bitmap |= (1ULL << k);
+}
+
+static void free_list_remove(heap_block_t *block)
+{
+    int k = size_class(TAG_SIZE(block->tag));
+
+    if (block->prev_free)
+        block->prev_free->next_free = block->next_free;
+    else
+        free_lists[k] = block->next_free;
+    if (block->next_free)
+        block->next_free->prev_free = block->prev_free;
+
+    if (!free_lists[k])
+        class_bitmap &= ~(1ULL << k);
+}
+
+/**
+ * @brief Formats @p bytes of memory at @p base as an arena holding one free block.
+ */
+static void arena_add(void *base, uint64_t bytes, uint64_t pages)
+{
+    heap_arena_t *arena = (heap_arena_t *)base;
+    arena->pages = pages;
+    arena->prologue = TAG_ALLOC | TAG_PROLOGUE;
+
+    stats.arenas++;
+    stats.bytes_reserved += bytes;
+
+    heap_block_t *block = (heap_block_t *)((uint8_t *)base + sizeof(heap_arena_t));
+    block_set(block, bytes - sizeof(heap_arena_t) - HEADER_SIZE, 0);
+
+    heap_block_t *epilogue = block_next(block);
+    epilogue->magic = HEAP_MAGIC;
+    epilogue->tag = TAG_ALLOC;
+
+    free_list_insert(block);
+}
+
+/**
+ * @brief Finds a free block of at least @p size bytes.
+ *
+ * The exact class may hold blocks that are too small, so only its first
+ * few entries are tried. Any block of a higher class is guaranteed to fit,
+ * and the lowest such class comes straight from the bitmap.
+ */
+static heap_block_t *find_block(uint64_t size)
+{
+    int k = size_class(size);
+
+    heap_block_t *block = free_lists[k];
+    for (int i = 0; block && i < HEAP_CLASS_SCAN; i++, block = block->next_free)
+    {
+        stats.search_steps++;
+        if (TAG_SIZE(block->tag) >= size)
+            return block;
+    }
+
+    uint64_t larger = (k + 1 < HEAP_CLASSES) ? class_bitmap & (~0ULL << (k + 1)) : 0;
+    if (!larger)
+        return NULL;
+
+    stats.search_steps++;
+    return free_lists[__builtin_ctzll(larger)];
+}
 
 void heap_init()
 {
-    // Use larger static heap area for kernel memory management
-    // 16KB initial heap should support multiple tasks
+    // Static bootstrap arena, the heap grows from the PMM afterwards
     static char heap_area[16384] __attribute__((aligned(4096)));
 
-    head = (heap_node_t *)heap_area;
-    head->magic = HEAP_MAGIC;
-    head->size = 16384 - sizeof(heap_node_t);
-    head->next = 0;
-    head->free = 1;
+    for (int i = 0; i < HEAP_CLASSES; i++)
+        free_lists[i] = NULL;
+    class_bitmap = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    arena_add(heap_area, sizeof(heap_area), 0);
+    heap_ready = 1;
+}
+
+/**
+ * @brief Serves a large request with pages of its own.
+ */
+static void *malloc_large(uint64_t size)
+{
+    uint64_t pages = (size + HEADER_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    heap_block_t *block = (heap_block_t *)pmm_alloc_pages(pages);
+
+    spinlock_acquire(&heap_lock);
+    stats.mallocs++;
+    if (block)
+    {
+        stats.live_allocs++;
+        stats.large_allocs++;
+        stats.bytes_in_use += pages * PAGE_SIZE;
+        stats.bytes_reserved += pages * PAGE_SIZE;
+    }
+    else
+    {
+        stats.failures++;
+    }
+    spinlock_release(&heap_lock);
+
+    if (!block)
+        return 0;
+
+    block->magic = HEAP_LARGE_MAGIC;
+    block->tag = pages;
+    return (uint8_t *)block + HEADER_SIZE;
 }
 
 void *malloc(uint64_t size)
 {
-    if (size == 0)
+    if (size == 0 || !heap_ready)
         return 0;
-        
+
+    uint64_t need = (size + HEADER_SIZE + FOOTER_SIZE + 15) & ~15ULL;
+    if (need < MIN_BLOCK)
+        need = MIN_BLOCK;
+
+    if (need > HEAP_LARGE_THRESHOLD)
+        return malloc_large(size);
+
     spinlock_acquire(&heap_lock);
-    
-    if (!head) {
-        spinlock_release(&heap_lock);
-        return 0;
-    }
-    
-    size = (size + 7) & ~7;
-    heap_node_t *curr = head;
+    stats.mallocs++;
 
-    while (curr)
+    heap_block_t *block = find_block(need);
+    if (!block)
     {
-        if (curr->free && curr->size >= size)
+        void *base = pmm_alloc_pages(HEAP_ARENA_PAGES);
+        if (!base)
         {
-            if (curr->size > size + sizeof(heap_node_t) + 32)
-            {
-                heap_node_t *new_node = (heap_node_t *)((uint8_t *)curr + sizeof(heap_node_t) + size);
-                new_node->magic = HEAP_MAGIC;
-                new_node->size = curr->size - size - sizeof(heap_node_t);
-                new_node->next = curr->next;
-                new_node->free = 1;
-
-                curr->size = size;
-                curr->next = new_node;
-            }
-            curr->free = 0;
-
+            stats.failures++;
             spinlock_release(&heap_lock);
-            return (void *)((uint8_t *)curr + sizeof(heap_node_t));
+            return 0;
         }
+        arena_add(base, HEAP_ARENA_PAGES * PAGE_SIZE, HEAP_ARENA_PAGES);
+        block = find_block(need);
+    }
 
-        if (!curr->next)
-        {
-            void *new_virt = vmm_alloc(4096, 0x03);
-            if (!new_virt)
-            {
-                spinlock_release(&heap_lock);
-                return 0;
-            }
-
-            heap_node_t *new_node = (heap_node_t *)new_virt;
-            new_node->magic = HEAP_MAGIC;
-            new_node->size = 4096 - sizeof(heap_node_t);
-            new_node->next = 0;
-            new_node->free = 1;
-            curr->next = new_node;
-        }
-        curr = curr->next;
+    free_list_remove(block);
+
+    uint64_t total = TAG_SIZE(block->tag);
+    if (total - need >= MIN_BLOCK)
+    {
+        block_set(block, need, TAG_ALLOC);
+        heap_block_t *rest = block_next(block);
+        block_set(rest, total - need, 0);
+        free_list_insert(rest);
+    }
+    else
+    {
+        block_set(block, total, TAG_ALLOC);
     }
 
+    stats.live_allocs++;
+    stats.bytes_in_use += TAG_SIZE(block->tag);
+
     spinlock_release(&heap_lock);
-    return 0;
+    return (uint8_t *)block + HEADER_SIZE;
 }
 
 void free(void *ptr)
@@ -94,30 +278,89 @@ void free(void *ptr)
     if (!ptr)
         return;
 
+    heap_block_t *block = (heap_block_t *)((uint8_t *)ptr - HEADER_SIZE);
+
+    if (block->magic == HEAP_LARGE_MAGIC)
+    {
+        uint64_t pages = block->tag;
+        block->magic = 0;
+        pmm_free_pages(block, pages);
+
+        spinlock_acquire(&heap_lock);
+        stats.frees++;
+        stats.live_allocs--;
+        stats.large_allocs--;
+        stats.bytes_in_use -= pages * PAGE_SIZE;
+        stats.bytes_reserved -= pages * PAGE_SIZE;
+        spinlock_release(&heap_lock);
+        return;
+    }
+
     spinlock_acquire(&heap_lock);
-    
-    heap_node_t *node = (heap_node_t *)((uint8_t *)ptr - sizeof(heap_node_t));
 
-    if (node->magic != HEAP_MAGIC)
+    /* Reject foreign pointers and double frees */
+    if (block->magic != HEAP_MAGIC || !(block->tag & TAG_ALLOC))
     {
         spinlock_release(&heap_lock);
         return;
     }
 
-    node->free = 1;
+    uint64_t size = TAG_SIZE(block->tag);
+
+    stats.frees++;
+    stats.live_allocs--;
+    stats.bytes_in_use -= size;
+
+    /* Merge with the following block */
+    heap_block_t *next = block_next(block);
+    if (!(next->tag & TAG_ALLOC))
+    {
+        free_list_remove(next);
+        size += TAG_SIZE(next->tag);
+        next->magic = 0;
+    }
 
-    heap_node_t *temp = head;
-    while (temp)
+    /* Merge with the preceding block, found through its footer */
+    uint64_t prev_tag = block_prev_tag(block);
+    if (!(prev_tag & TAG_ALLOC))
     {
-        if (temp->free && temp->next && temp->next->free)
+        heap_block_t *prev = (heap_block_t *)((uint8_t *)block - TAG_SIZE(prev_tag));
+        free_list_remove(prev);
+        size += TAG_SIZE(prev_tag);
+        block->magic = 0;
+        block = prev;
+    }
+
+    block_set(block, size, 0);
+    free_list_insert(block);
+
+    spinlock_release(&heap_lock);
+}
+
+/**
+ * @brief Snapshots the heap counters and walks the free lists for
+ * fragmentation figures.
+ */
+void heap_get_stats(heap_stats_t *out)
+{
+    spinlock_acquire(&heap_lock);
+
+    *out = stats;
+    out->free_blocks = 0;
+    out->free_bytes = 0;
+    out->largest_free = 0;
+
+    for (int k = 0; k < HEAP_CLASSES; k++)
+    {
+        for (heap_block_t *block = free_lists[k]; block; block = block->next_free)
         {
-            temp->size += sizeof(heap_node_t) + temp->next->size;
-            temp->next = temp->next->next;
-            continue;
+            uint64_t size = TAG_SIZE(block->tag);
+            out->free_blocks++;
+            out->free_bytes += size;
+            if (size > out->largest_free)
+                out->largest_free = size;
         }
-                
-        temp = temp->next;
     }
-    
+
     spinlock_release(&heap_lock);
-}
\ No newline at end of file
+}
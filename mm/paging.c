@@ -5,39 +5,113 @@
  * This module handles the creation and manipulation of the 4-level paging
  * hierarchy. All physical addresses are converted to higher-half virtual
  * addresses before access.
+ *
+ * Address spaces other than the kernel's share its upper half by copying
+ * the upper 256 PML4 entries, and are tagged with a PCID when the CPU has
+ * them, so switching between them keeps the TLB. Kernel leaves are global
+ * and survive every switch.
  */
 
 #include <valen/paging.h>
+#include <valen/page.h>
 #include <valen/pmm.h>
 #include <valen/stdio.h>
 #include <valen/spinlock.h>
+#include <valen/cpu.h>
+#include <valen/percpu.h>
+#include <valen/heap.h>
+#include <valen/smp.h>
 
-/** * @brief The offset to shift physical addresses into the higher half.
- * Must match the value in boot.s and linker.ld.
- */
-#define KERNEL_VIRT_OFFSET 0xFFFFFFFF80000000
+/** @brief Pointer to the top-level Page Map Level 4 table. */
+extern uint64_t p4_table[];
 
-/** * @brief Helper to convert a physical address to a virtual one the kernel can use.
+/** * @brief We must use the virtual address of the p4_table.
+ * The linker now provides this as a higher-half address.
  */
-#define PHYS_TO_VIRT(phys) ((void *)((uint64_t)(phys) + KERNEL_VIRT_OFFSET))
+uint64_t *kernel_pml4 = (uint64_t *)p4_table;
 
-/** * @brief Helper to extract the physical address from a page table entry.
- */
-#define ENTRY_TO_PHYS(entry) ((uint64_t)(entry) & ~0xFFF)
+static spinlock_t paging_lock = SPINLOCK_INIT_NAMED("paging");
+
+/** @brief CPUID.80000001h:EDX - 1GB pages supported. */
+#define CPUID_EDX_PDPE1GB (1U << 26)
+/** @brief CPUID.01h:ECX - process-context identifiers supported. */
+#define CPUID_1_ECX_PCID (1U << 17)
+
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
+/** @brief CR3 bit 63: keep the TLB entries tagged with the new PCID. */
+#define CR3_NOFLUSH (1ULL << 63)
+
+/** @brief PAT index bit: bit 7 of a 4KB entry, moved to bit 12 in a 2MB/1GB leaf. */
+#define PTE_PAT (1ULL << 7)
+#define LEAF_PAT_LARGE (1ULL << 12)
+
+/** @brief Entry bits 52-63: software bits, protection key (59-62) and NX (63). */
+#define ENTRY_HIGH_FLAGS 0xFFF0000000000000ULL
+
+/** @brief PCIDs are 12 bits; 0 belongs to the kernel space. */
+#define PCID_COUNT 4096
+
+/** @brief First PML4 slot of the kernel half, shared by every address space. */
+#define PML4_KERNEL_FIRST 256
+
+static int gb_pages_supported = 0;
+static int pcid_supported = 0;
+
+/** @brief The kernel's own address space; kernel threads run in it. */
+static addr_space_t kernel_space = {.pml4 = (uint64_t *)p4_table, .pcid = 0};
+
+/** @brief Bumped whenever a kernel-half PML4 entry is created. */
+static uint64_t kernel_top_gen = 1;
+
+/* PCIDs in use, protected by paging_lock */
+static uint64_t pcid_bitmap[PCID_COUNT / 64] = {1};
 
-/** * @brief Helper to convert virtual to physical address.
+/* Per CPU, PCIDs whose TLB entries there may be stale: the next switch to
+ * them on that CPU flushes instead of keeping them. */
+static uint64_t pcid_stale[MAX_CPUS][PCID_COUNT / 64];
+
+/**
+ * @brief Where page tables are accessed. Until the direct map exists every
+ * table lives in the first 1GB and is reached through the boot window.
  */
-#define VIRT_TO_PHYS(v) ((uint64_t)(v) - KERNEL_VIRT_OFFSET)
+static uint64_t table_offset = KERNEL_VIRT_OFFSET;
 
-/** @brief Pointer to the top-level Page Map Level 4 table. */
-extern uint64_t p4_table[];
+#define TABLE_VIRT(phys) ((uint64_t *)((uint64_t)(phys) + table_offset))
 
-/** * @brief We must use the virtual address of the p4_table.
- * The linker now provides this as a higher-half address.
+/**
+ * @brief Bump allocator for the page tables of the direct map, which is
+ * built before the PMM can hand out frames. 0 once the direct map is done.
  */
-uint64_t *kernel_pml4 = (uint64_t *)p4_table;
+static uint64_t early_next = 0;
 
-static spinlock_t paging_lock = SPINLOCK_INIT;
+/** @brief Early page tables must be reachable through the boot window. */
+#define EARLY_LIMIT 0x40000000ULL
+
+static void detect_features(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001)
+    {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        gb_pages_supported = (edx & CPUID_EDX_PDPE1GB) != 0;
+    }
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    pcid_supported = (ecx & CPUID_1_ECX_PCID) != 0;
+}
+
+/**
+ * @brief Kernel leaves are global, so switching address spaces keeps them.
+ */
+static inline uint64_t leaf_flags(uint64_t virt, uint64_t flags)
+{
+    if ((virt >> 63) && !(flags & PAGE_USER))
+        flags |= PAGE_GLOBAL;
+    return flags;
+}
 
 /**
  * @brief Initializes paging by ensuring the PML4 is loaded into CR3.
@@ -51,10 +125,259 @@ void paging_init()
             ;
     }
 
+    detect_features();
+
     /* CR3 requires a PHYSICAL address. We must subtract the offset. */
-    uint64_t phys_pml4 = (uint64_t)kernel_pml4 - KERNEL_VIRT_OFFSET;
+    uint64_t phys_pml4 = VIRT_TO_PHYS(kernel_pml4);
 
     asm volatile("mov %0, %%cr3" : : "r"(phys_pml4));
+
+    paging_init_cpu();
+}
+
+/**
+ * @brief Enables global pages and, if supported, PCIDs on the calling CPU.
+ * Must run in the kernel space (PCID 0), after percpu_init().
+ */
+void paging_init_cpu(void)
+{
+    uint64_t cr4 = read_cr4() | CR4_PGE;
+    if (pcid_supported)
+        cr4 |= CR4_PCIDE;
+    write_cr4(cr4);
+
+    this_cpu()->active_space = &kernel_space;
+}
+
+/**
+ * @brief Pending TLB invalidations for one batched operation.
+ *
+ * Up to PAGING_FLUSH_THRESHOLD addresses are flushed one by one with invlpg;
+ * beyond that a single CR3 reload is cheaper than the individual flushes.
+ */
+typedef struct tlb_batch
+{
+    uint64_t count;
+    uint64_t pages[PAGING_FLUSH_THRESHOLD];
+} tlb_batch_t;
+
+static inline void tlb_batch_add(tlb_batch_t *batch, uint64_t virt)
+{
+    if (batch->count < PAGING_FLUSH_THRESHOLD)
+        batch->pages[batch->count] = virt;
+    batch->count++;
+}
+
+static void tlb_batch_flush(tlb_batch_t *batch)
+{
+    if (batch->count > PAGING_FLUSH_THRESHOLD)
+    {
+        paging_flush_tlb();
+    }
+    else
+    {
+        for (uint64_t i = 0; i < batch->count; i++)
+            asm volatile("invlpg (%0)" ::"r"(batch->pages[i]) : "memory");
+    }
+    batch->count = 0;
+}
+
+/**
+ * @brief Allocates a zeroed page for a new table, from the early frames
+ * while the direct map is being built and from the zeroed pool after.
+ */
+static uint64_t *table_alloc(void)
+{
+    if (!early_next)
+        return (uint64_t *)pmm_alloc_zeroed(0);
+
+    if (early_next + PAGE_SIZE > EARLY_LIMIT)
+        return NULL;
+
+    uint64_t *table = TABLE_VIRT(early_next);
+    early_next += PAGE_SIZE;
+    for (int i = 0; i < 512; i++)
+        table[i] = 0;
+    return table;
+}
+
+/**
+ * @brief Returns the next-level table behind @p entry, creating it if asked.
+ *
+ * When creating, a large page in the way is split into a table of
+ * @p child_size entries that map the same memory with the same flags,
+ * including NX and the protection key. Splitting down to 4KB moves the
+ * PAT bit from bit 12 of the large leaf to bit 7 of each entry.
+ *
+ * @return NULL if the level is missing (or a large page) and cannot be created.
+ */
+static uint64_t *table_next(uint64_t *entry, uint64_t child_size, int create)
+{
+    if ((*entry & 1) && !(*entry & PAGE_HUGE))
+        return TABLE_VIRT(ENTRY_TO_PHYS(*entry));
+
+    if (!create)
+        return NULL;
+
+    uint64_t *table = table_alloc();
+    if (!table)
+        return NULL;
+
+    if (*entry & 1)
+    {
+        uint64_t base = ENTRY_TO_PHYS(*entry) & ~(child_size * 512 - 1);
+        uint64_t attrs = *entry & ((0xFFF & ~PAGE_HUGE) | ENTRY_HIGH_FLAGS);
+        if (child_size != PAGE_SIZE)
+            attrs |= PAGE_HUGE | (*entry & LEAF_PAT_LARGE);
+        else if (*entry & LEAF_PAT_LARGE)
+            attrs |= PTE_PAT;
+        for (int i = 0; i < 512; i++)
+            table[i] = (base + i * child_size) | attrs;
+    }
+
+    *entry = VIRT_TO_PHYS(table) | 0x07;
+
+    /* Other address spaces copy this slot on their next switch */
+    if (entry >= &kernel_pml4[PML4_KERNEL_FIRST] && entry < &kernel_pml4[512])
+        __atomic_add_fetch(&kernel_top_gen, 1, __ATOMIC_RELEASE);
+    return table;
+}
+
+/**
+ * @brief Walks to the page table covering @p virt. Called with paging_lock held.
+ */
+static uint64_t *pt_lookup_in(uint64_t *pml4, uint64_t virt, int create)
+{
+    uint64_t *pdpt = table_next(&pml4[(virt >> 39) & 0x1FF], PAGE_SIZE_1G, create);
+    if (!pdpt)
+        return NULL;
+
+    uint64_t *pd = table_next(&pdpt[(virt >> 30) & 0x1FF], PAGE_SIZE_2M, create);
+    if (!pd)
+        return NULL;
+
+    return table_next(&pd[(virt >> 21) & 0x1FF], PAGE_SIZE, create);
+}
+
+static uint64_t *pt_lookup(uint64_t virt, int create)
+{
+    return pt_lookup_in(kernel_pml4, virt, create);
+}
+
+/**
+ * @brief Installs one 2MB or 1GB leaf. Called with paging_lock held.
+ *
+ * A page table already in the slot is released if it maps nothing;
+ * otherwise the slot is left alone.
+ *
+ * @return 0 on success, -1 if the slot is in use or a table could not be allocated.
+ */
+static int map_large(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags, tlb_batch_t *batch)
+{
+    uint64_t *pdpt = table_next(&kernel_pml4[(virt >> 39) & 0x1FF], PAGE_SIZE_1G, 1);
+    if (!pdpt)
+        return -1;
+
+    uint64_t *entry = &pdpt[(virt >> 30) & 0x1FF];
+    if (size == PAGE_SIZE_2M)
+    {
+        uint64_t *pd = table_next(entry, PAGE_SIZE_2M, 1);
+        if (!pd)
+            return -1;
+        entry = &pd[(virt >> 21) & 0x1FF];
+    }
+
+    if ((*entry & 1) && !(*entry & PAGE_HUGE))
+    {
+        uint64_t *table = TABLE_VIRT(ENTRY_TO_PHYS(*entry));
+        for (int i = 0; i < 512; i++)
+        {
+            if (table[i] & 1)
+                return -1;
+        }
+        if (!early_next)
+            pmm_free_page(table);
+    }
+
+    if (*entry & 1)
+        tlb_batch_add(batch, virt);
+    *entry = (phys & ~(size - 1)) | leaf_flags(virt, flags) | PAGE_HUGE;
+    return 0;
+}
+
+/**
+ * @brief Largest leaf that fits at this position of a range, or 0 for 4KB.
+ */
+static uint64_t large_step(uint64_t virt, uint64_t phys, uint64_t left)
+{
+    if (gb_pages_supported && !((virt | phys) & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G)
+        return PAGE_SIZE_1G;
+    if (!((virt | phys) & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M)
+        return PAGE_SIZE_2M;
+    return 0;
+}
+
+/**
+ * @brief Clears every leaf in [@p virt, @p virt + @p size), whatever its size,
+ * without creating or splitting tables. Called with paging_lock held to
+ * undo a mapping that ran out of memory part way.
+ */
+static void unmap_leaves(uint64_t virt, uint64_t size, tlb_batch_t *batch)
+{
+    for (uint64_t end = virt + size; virt < end;)
+    {
+        uint64_t step = PAGE_SIZE_1G * 512;
+        uint64_t *entry = NULL;
+
+        uint64_t *pdpt = table_next(&kernel_pml4[(virt >> 39) & 0x1FF], PAGE_SIZE_1G, 0);
+        if (pdpt)
+        {
+            step = PAGE_SIZE_1G;
+            entry = &pdpt[(virt >> 30) & 0x1FF];
+        }
+        if (entry && !(*entry & PAGE_HUGE))
+        {
+            uint64_t *pd = table_next(entry, PAGE_SIZE_2M, 0);
+            entry = pd ? &pd[(virt >> 21) & 0x1FF] : NULL;
+            if (pd)
+                step = PAGE_SIZE_2M;
+        }
+        if (entry && !(*entry & PAGE_HUGE))
+        {
+            uint64_t *pt = table_next(entry, PAGE_SIZE, 0);
+            entry = pt ? &pt[(virt >> 12) & 0x1FF] : NULL;
+            if (pt)
+                step = PAGE_SIZE;
+        }
+
+        if (entry && (*entry & 1))
+        {
+            *entry = 0;
+            tlb_batch_add(batch, virt);
+        }
+        virt = (virt & ~(step - 1)) + step;
+    }
+}
+
+/**
+ * @brief Flushes the whole TLB of this CPU, for every PCID.
+ *
+ * Kernel leaves are global and kernel entries may be cached under any
+ * PCID, so a CR3 reload is not enough; toggling CR4.PGE drops everything.
+ */
+void paging_flush_tlb(void)
+{
+    uint64_t cr4 = read_cr4();
+    if (cr4 & CR4_PGE)
+    {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+        return;
+    }
+
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" ::"r"(cr3) : "memory");
 }
 
 /**
@@ -63,73 +386,509 @@ void paging_init()
  * @param virt The virtual address to map.
  * @param phys The physical address to map to.
  * @param flags The permission flags for the final page entry.
+ * @return 0 on success, -1 if a page table could not be allocated.
  */
-void paging_map(uint64_t virt, uint64_t phys, uint64_t flags)
+int paging_map(uint64_t virt, uint64_t phys, uint64_t flags)
 {
+    return paging_map_pages(virt, &phys, 1, flags);
+}
+
+/**
+ * @brief Maps @p count pages at @p virt to the frames listed in @p phys.
+ *
+ * The page tables are walked once per 2MB region under a single hold of
+ * paging_lock. Only entries that replace a present mapping need a TLB flush,
+ * since non-present entries are never cached.
+ *
+ * @return 0 on success, or -1 if a page table could not be allocated, in
+ *         which case none of the pages is left mapped.
+ */
+int paging_map_pages(uint64_t virt, const uint64_t *phys, uint64_t count, uint64_t flags)
+{
+    tlb_batch_t batch;
+    batch.count = 0;
+    int ret = 0;
+
     spinlock_acquire(&paging_lock);
-    
-    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
-    uint64_t pd_idx = (virt >> 21) & 0x1FF;
-    uint64_t pt_idx = (virt >> 12) & 0x1FF;
-
-    /* 1. PML4 -> PDPT */
-    if (!(kernel_pml4[pml4_idx] & 1))
-    {
-        void *new_virt = pmm_alloc_page();
-        uint64_t new_phys = VIRT_TO_PHYS(new_virt);
-        uint64_t *pdpt = (uint64_t *)new_virt;
-        for (int i = 0; i < 512; i++)
-            pdpt[i] = 0;
 
-        kernel_pml4[pml4_idx] = new_phys | 0x07;
+    uint64_t *pt = NULL;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t page = virt + i * PAGE_SIZE;
+        if (!pt || ((page >> 12) & 0x1FF) == 0)
+            pt = pt_lookup(page, 1);
+        if (!pt)
+        {
+            unmap_leaves(virt, i * PAGE_SIZE, &batch);
+            ret = -1;
+            break;
+        }
+
+        uint64_t *entry = &pt[(page >> 12) & 0x1FF];
+        if (*entry & 1)
+            tlb_batch_add(&batch, page);
+        *entry = (phys[i] & ~0xFFF) | leaf_flags(page, flags);
     }
 
-    uint64_t *pdpt = (uint64_t *)PHYS_TO_VIRT(ENTRY_TO_PHYS(kernel_pml4[pml4_idx]));
+    spinlock_release(&paging_lock);
+    tlb_batch_flush(&batch);
+    return ret;
+}
 
-    /* 2. PDPT -> PD */
-    if (!(pdpt[pdpt_idx] & 1))
+/**
+ * @brief Creates the page tables covering @p count pages at @p virt without
+ * mapping anything, so paging_fill() can later install entries there.
+ * @return 0 on success, -1 if a table could not be allocated.
+ */
+int paging_prepare(uint64_t virt, uint64_t count)
+{
+    int ret = 0;
+
+    spinlock_acquire(&paging_lock);
+    for (uint64_t i = 0; i < count; i++, virt += PAGE_SIZE)
     {
-        void *new_virt = pmm_alloc_page();
-        uint64_t new_phys = VIRT_TO_PHYS(new_virt);
-        uint64_t *pd = (uint64_t *)new_virt;
-        for (int i = 0; i < 512; i++)
-            pd[i] = 0;
+        if ((i == 0 || ((virt >> 12) & 0x1FF) == 0) && !pt_lookup(virt, 1))
+        {
+            ret = -1;
+            break;
+        }
+    }
+    spinlock_release(&paging_lock);
+    return ret;
+}
+
+/**
+ * @brief Maps @p virt to @p phys if it is unmapped, without paging_lock.
+ *
+ * Safe from the page fault handler whatever the interrupted code holds:
+ * the tables must already exist (see paging_prepare()), and tables are
+ * never freed while they map 4KB pages, so the walk only reads. The entry
+ * is claimed with a compare-and-swap, and a non-present entry is never
+ * cached, so no TLB flush is needed.
+ *
+ * @return 0 if mapped, 1 if another CPU mapped it first, -1 without a table.
+ */
+int paging_fill(uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    uint64_t *pt = pt_lookup(virt, 0);
+    if (!pt)
+        return -1;
+
+    uint64_t expected = 0;
+    uint64_t entry = (phys & ~0xFFF) | leaf_flags(virt, flags);
+    if (!__atomic_compare_exchange_n(&pt[(virt >> 12) & 0x1FF], &expected, entry, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return 1;
+    return 0;
+}
+
+/**
+ * @brief Maps a physically contiguous range with one page-table walk per 2MB.
+ *
+ * Wherever @p virt and @p phys are both aligned to 2MB (or 1GB, if the CPU
+ * supports it) and enough of the range is left, a large page is used
+ * instead of a full page table.
+ *
+ * @return 0 on success, or -1 if a page table could not be allocated, in
+ *         which case none of the range is left mapped.
+ */
+int paging_map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags)
+{
+    tlb_batch_t batch;
+    batch.count = 0;
+    int ret = 0;
+
+    spinlock_acquire(&paging_lock);
+
+    uint64_t *pt = NULL;
+    for (uint64_t offset = 0; offset < size;)
+    {
+        uint64_t page = virt + offset;
+        uint64_t step = large_step(page, phys + offset, size - offset);
+        while (step && map_large(page, phys + offset, step, flags, &batch) != 0)
+            step = (step == PAGE_SIZE_1G) ? PAGE_SIZE_2M : 0;
+        if (step)
+        {
+            offset += step;
+            pt = NULL;
+            continue;
+        }
+
+        if (!pt || ((page >> 12) & 0x1FF) == 0)
+            pt = pt_lookup(page, 1);
+        if (!pt)
+        {
+            unmap_leaves(virt, offset, &batch);
+            ret = -1;
+            break;
+        }
 
-        pdpt[pdpt_idx] = new_phys | 0x07;
+        uint64_t *entry = &pt[(page >> 12) & 0x1FF];
+        if (*entry & 1)
+            tlb_batch_add(&batch, page);
+        *entry = ((phys + offset) & ~0xFFF) | leaf_flags(page, flags);
+        offset += PAGE_SIZE;
     }
 
-    uint64_t *pd = (uint64_t *)PHYS_TO_VIRT(ENTRY_TO_PHYS(pdpt[pdpt_idx]));
+    spinlock_release(&paging_lock);
+    tlb_batch_flush(&batch);
+    return ret;
+}
+
+/**
+ * @brief Maps one 2MB or 1GB page.
+ * @param size PAGE_SIZE_2M or PAGE_SIZE_1G. @p virt and @p phys must be aligned to it.
+ * @return 0 on success, -1 on bad arguments, missing CPU support or a slot
+ *         that already holds 4KB mappings.
+ */
+int paging_map_large(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags)
+{
+    if (size != PAGE_SIZE_2M && size != PAGE_SIZE_1G)
+        return -1;
+    if (size == PAGE_SIZE_1G && !gb_pages_supported)
+        return -1;
+    if ((virt | phys) & (size - 1))
+        return -1;
+
+    tlb_batch_t batch;
+    batch.count = 0;
+
+    spinlock_acquire(&paging_lock);
+    int ret = map_large(virt, phys, size, flags, &batch);
+    spinlock_release(&paging_lock);
+
+    tlb_batch_flush(&batch);
+    return ret;
+}
+
+/**
+ * @brief Reports whether the CPU can map 1GB pages.
+ */
+int paging_has_1g_pages(void)
+{
+    return gb_pages_supported;
+}
 
-    /* 3. PD -> PT */
-    if (!(pd[pd_idx] & 1))
+/**
+ * @brief Removes the 4KB mapping of @p virt.
+ * @return The physical address that was mapped, or 0 if none was.
+ */
+uint64_t paging_unmap(uint64_t virt)
+{
+    uint64_t phys = 0;
+    paging_unmap_pages(virt, 1, &phys);
+    return phys;
+}
+
+/**
+ * @brief Removes @p count 4KB mappings starting at @p virt.
+ *
+ * Page tables are left in place so later mappings in the same range can
+ * reuse them. If @p phys is not NULL it receives the frame each page was
+ * mapped to, or 0 for pages that were not mapped.
+ */
+void paging_unmap_pages(uint64_t virt, uint64_t count, uint64_t *phys)
+{
+    tlb_batch_t batch;
+    batch.count = 0;
+
+    spinlock_acquire(&paging_lock);
+
+    uint64_t *pt = NULL;
+    for (uint64_t i = 0; i < count; i++, virt += PAGE_SIZE)
     {
-        void *new_virt = pmm_alloc_page();
-        uint64_t new_phys = VIRT_TO_PHYS(new_virt);
-        uint64_t *pt = (uint64_t *)new_virt;
-        for (int i = 0; i < 512; i++)
-            pt[i] = 0;
+        if (!pt || ((virt >> 12) & 0x1FF) == 0)
+            pt = pt_lookup(virt, 0);
+
+        uint64_t entry = 0;
+        if (pt)
+        {
+            entry = pt[(virt >> 12) & 0x1FF];
+            pt[(virt >> 12) & 0x1FF] = 0;
+        }
+
+        if (entry & 1)
+            tlb_batch_add(&batch, virt);
+        if (phys)
+            phys[i] = (entry & 1) ? ENTRY_TO_PHYS(entry) : 0;
+    }
+
+    spinlock_release(&paging_lock);
+    tlb_batch_flush(&batch);
+}
+
+/**
+ * @brief Starts building the direct map. Page tables are taken one frame at
+ * a time from @p early_phys, which must be free RAM in the first 1GB.
+ */
+void paging_direct_map_begin(uint64_t early_phys)
+{
+    detect_features();
+    early_next = (early_phys + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+/**
+ * @brief Maps the physical range [phys, phys + len) at DIRECT_MAP_OFFSET.
+ */
+void paging_direct_map_add(uint64_t phys, uint64_t len)
+{
+    uint64_t start = phys & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = (phys + len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (end <= start)
+        return;
+
+    paging_map_range(DIRECT_MAP_OFFSET + start, start, end - start, PAGE_PRESENT | PAGE_WRITE);
+}
+
+/**
+ * @brief Finishes the direct map and switches page-table access to it.
+ * @return The first physical address after the early frames used for tables.
+ */
+uint64_t paging_direct_map_end(void)
+{
+    uint64_t end = early_next;
+
+    early_next = 0;
+    table_offset = DIRECT_MAP_OFFSET;
+    return end;
+}
+
+/**
+ * @brief Copies the kernel half of the PML4 into @p space if a kernel-half
+ * slot was created since the last copy. Needs no lock: those slots are only
+ * ever filled in, never cleared.
+ */
+static void sync_kernel_half(addr_space_t *space)
+{
+    uint64_t gen = __atomic_load_n(&kernel_top_gen, __ATOMIC_ACQUIRE);
+    if (space == &kernel_space || space->kernel_gen == gen)
+        return;
+
+    for (int i = PML4_KERNEL_FIRST; i < 512; i++)
+        space->pml4[i] = kernel_pml4[i];
+    space->kernel_gen = gen;
+}
 
-        pd[pd_idx] = new_phys | 0x07;
+/**
+ * @brief Takes a free PCID, or 0 (flush on every switch) if there is none.
+ * Called with paging_lock held.
+ */
+static uint16_t pcid_alloc(void)
+{
+    if (!pcid_supported)
+        return 0;
+
+    for (int i = 0; i < PCID_COUNT / 64; i++)
+    {
+        if (~pcid_bitmap[i])
+        {
+            int bit = bsf64(~pcid_bitmap[i]);
+            pcid_bitmap[i] |= 1ULL << bit;
+            return (uint16_t)(i * 64 + bit);
+        }
     }
+    return 0;
+}
+
+/**
+ * @brief Marks @p pcid stale on every CPU except the caller's if it has
+ * @p space loaded, which invalidates @p virt itself instead.
+ * @return Non-zero if another CPU is running in @p space right now.
+ */
+static int space_invalidate(addr_space_t *space, uint64_t virt)
+{
+    cpu_local_t *self = this_cpu();
+    uint64_t bit = 1ULL << (space->pcid % 64);
+    int remote = 0;
+
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        if (&cpu_locals[i] == self && self->active_space == space)
+            continue;
+        if (space->pcid)
+            __atomic_or_fetch(&pcid_stale[i][space->pcid / 64], bit, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cpu_locals[i].active_space, __ATOMIC_SEQ_CST) == space)
+            remote = 1;
+    }
+
+    if (self->active_space == space)
+        asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+    return remote;
+}
+
+/**
+ * @brief Creates an address space with an empty lower half and the kernel
+ * half shared with every other space.
+ * @return The new space, or NULL if out of memory.
+ */
+addr_space_t *paging_space_create(void)
+{
+    addr_space_t *space = (addr_space_t *)malloc(sizeof(addr_space_t));
+    if (!space)
+        return NULL;
 
-    uint64_t *pt = (uint64_t *)PHYS_TO_VIRT(ENTRY_TO_PHYS(pd[pd_idx]));
+    space->pml4 = (uint64_t *)pmm_alloc_zeroed(0);
+    if (!space->pml4)
+    {
+        free(space);
+        return NULL;
+    }
+    space->kernel_gen = 0;
+    sync_kernel_half(space);
 
-    /* 4. PT -> Physical Page */
-    pt[pt_idx] = (phys & ~0xFFF) | flags;
-    
+    spinlock_acquire(&paging_lock);
+    space->pcid = pcid_alloc();
     spinlock_release(&paging_lock);
-    /* Invalidate TLB */
-    asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+    return space;
 }
 
 /**
- * @brief Maps a range of memory by iterating through pages.
+ * @brief Frees the page tables of @p space's lower half, its PML4 and its
+ * PCID. Frames still mapped there are not freed. No CPU may have it loaded.
  */
-void paging_map_range(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags)
+void paging_space_destroy(addr_space_t *space)
 {
-    for (uint64_t offset = 0; offset < size; offset += 4096)
+    for (int i = 0; i < PML4_KERNEL_FIRST; i++)
     {
-        paging_map(virt + offset, phys + offset, flags);
+        if (!(space->pml4[i] & 1))
+            continue;
+        uint64_t *pdpt = TABLE_VIRT(ENTRY_TO_PHYS(space->pml4[i]));
+
+        for (int j = 0; j < 512; j++)
+        {
+            if (!(pdpt[j] & 1) || (pdpt[j] & PAGE_HUGE))
+                continue;
+            uint64_t *pd = TABLE_VIRT(ENTRY_TO_PHYS(pdpt[j]));
+
+            for (int k = 0; k < 512; k++)
+            {
+                if ((pd[k] & 1) && !(pd[k] & PAGE_HUGE))
+                    pmm_free_page(TABLE_VIRT(ENTRY_TO_PHYS(pd[k])));
+            }
+            pmm_free_page(pd);
+        }
+        pmm_free_page(pdpt);
     }
-}
\ No newline at end of file
+    pmm_free_page(space->pml4);
+
+    if (space->pcid)
+    {
+        /* Whoever gets the PCID next must not see this space's entries */
+        spinlock_acquire(&paging_lock);
+        for (int i = 0; i < MAX_CPUS; i++)
+            pcid_stale[i][space->pcid / 64] |= 1ULL << (space->pcid % 64);
+        pcid_bitmap[space->pcid / 64] &= ~(1ULL << (space->pcid % 64));
+        spinlock_release(&paging_lock);
+    }
+    free(space);
+}
+
+/**
+ * @brief Maps the 4KB page @p virt of @p space's lower half to @p phys.
+ * @return 0 on success, -1 for a kernel-half address or without memory.
+ */
+int paging_space_map(addr_space_t *space, uint64_t virt, uint64_t phys, uint64_t flags)
+{
+    if (virt >> 47)
+        return -1;
+
+    int remote = 0;
+    spinlock_acquire(&paging_lock);
+    uint64_t *pt = pt_lookup_in(space->pml4, virt, 1);
+    if (!pt)
+    {
+        spinlock_release(&paging_lock);
+        return -1;
+    }
+
+    uint64_t *entry = &pt[(virt >> 12) & 0x1FF];
+    int replaced = *entry & 1;
+    *entry = (phys & ~0xFFF) | flags;
+    if (replaced)
+        remote = space_invalidate(space, virt);
+    spinlock_release(&paging_lock);
+
+    if (remote)
+        smp_flush_tlb();
+    return 0;
+}
+
+/**
+ * @brief Removes the mapping of @p virt from @p space's lower half.
+ * @return The physical address that was mapped, or 0 if none was.
+ */
+uint64_t paging_space_unmap(addr_space_t *space, uint64_t virt)
+{
+    if (virt >> 47)
+        return 0;
+
+    uint64_t entry = 0;
+    int remote = 0;
+    spinlock_acquire(&paging_lock);
+    uint64_t *pt = pt_lookup_in(space->pml4, virt, 0);
+    if (pt)
+    {
+        entry = pt[(virt >> 12) & 0x1FF];
+        pt[(virt >> 12) & 0x1FF] = 0;
+    }
+    if (entry & 1)
+        remote = space_invalidate(space, virt);
+    spinlock_release(&paging_lock);
+
+    if (remote)
+        smp_flush_tlb();
+    return (entry & 1) ? ENTRY_TO_PHYS(entry) : 0;
+}
+
+/**
+ * @brief Loads @p space, or the kernel space if NULL, on this CPU.
+ *
+ * With PCIDs the CR3 write sets the no-flush bit, so the TLB entries the
+ * CPU cached the last time it ran in @p space are still there. They are
+ * dropped instead if the space changed mappings meanwhile or the PCID
+ * changed hands. Called with interrupts disabled.
+ */
+void paging_switch(addr_space_t *space)
+{
+    cpu_local_t *cpu = this_cpu();
+    if (!space)
+        space = &kernel_space;
+    if (cpu->active_space == space)
+        return;
+
+    sync_kernel_half(space);
+
+    /* Publish the switch before checking for stale entries, so a CPU that
+     * invalidates meanwhile either sees us here or has set the bit */
+    __atomic_store_n(&cpu->active_space, space, __ATOMIC_SEQ_CST);
+
+    uint64_t cr3 = VIRT_TO_PHYS(space->pml4) | space->pcid;
+    if (space->pcid)
+    {
+        uint64_t bit = 1ULL << (space->pcid % 64);
+        uint64_t stale = __atomic_fetch_and(&pcid_stale[cpu->id][space->pcid / 64], ~bit, __ATOMIC_SEQ_CST);
+        if (!(stale & bit))
+            cr3 |= CR3_NOFLUSH;
+    }
+
+    asm volatile("mov %0, %%cr3" ::"r"(cr3) : "memory");
+}
+
+/**
+ * @brief Called on a kernel-half page fault: copies PML4 slots the kernel
+ * created after the current space last synced.
+ * @return 1 if the access can be retried, 0 if the fault is not this kind.
+ */
+int paging_sync_fault(uint64_t virt)
+{
+    addr_space_t *space = this_cpu()->active_space;
+    if (!(virt >> 63) || !space || space == &kernel_space)
+        return 0;
+
+    int slot = (virt >> 39) & 0x1FF;
+    if ((space->pml4[slot] & 1) || !(kernel_pml4[slot] & 1))
+        return 0;
+
+    sync_kernel_half(space);
+    return 1;
+}
@@ -1,59 +1,536 @@
+/**
+ * @file pmm.c
+ * @brief Physical Memory Manager (Buddy Allocator).
+ *
+ * Free physical memory is kept in power-of-two blocks of 2^order frames,
+ * one free list per order. Allocation splits the smallest block that fits,
+ * freeing merges a block with its buddy for as long as the buddy is free.
+ * The bitmap remains the authoritative used/free state of every frame and
+ * backs the accounting reported by pmm_get_*_kb(). It is kept in 64-bit
+ * words so runs of frames are found with one tzcnt per word.
+ *
+ * Single pages are served from per-CPU magazines that refill from and
+ * drain to the buddy lists in batches, so most pmm_alloc_page() and
+ * pmm_free_page() calls never take pmm_lock. A page in a magazine is
+ * still used in the bitmap, so a second bitmap marks the pages that sit
+ * in one; freeing such a page again is a double free and is ignored.
+ *
+ * Page tables and demand-backed pages come from a pool of pages that idle
+ * CPUs zero ahead of time, so allocating one does not pay for clearing it.
+ */
 
+#include <stddef.h>
 #include <valen/pmm.h>
+#include <valen/page.h>
 #include <valen/paging.h>
 #include <valen/spinlock.h>
+#include <valen/percpu.h>
+#include <valen/cpu.h>
+#include <valen/string.h>
+
+/** @brief Bottom 2MB (Kernel/BIOS/Page Tables) is never handed out. */
+#define PMM_RESERVED_LOW 0x200000ULL
 
-/* The offset used to access physical memory in the higher half */
-#define KERNEL_VIRT_OFFSET 0xFFFFFFFF80000000
-#define PHYS_TO_VIRT(p) ((void *)((uint64_t)(p) + KERNEL_VIRT_OFFSET))
-#define VIRT_TO_PHYS(v) ((uint64_t)(v) - KERNEL_VIRT_OFFSET)
+#define BUDDY_MAGIC 0xB0DD1E5ULL
 
-static uint8_t *bitmap;
-static uint64_t bitmap_size;
+/** @brief Pages a per-CPU magazine can hold (power of two). */
+#define PCP_CAPACITY 64
+/** @brief Pages moved between a magazine and the buddy lists per refill/drain. */
+#define PCP_BATCH 16
+
+/**
+ * @brief Header written at the start of every free block.
+ */
+typedef struct pmm_block
+{
+    uint64_t magic;
+    uint64_t order;
+    struct pmm_block *next;
+    struct pmm_block *prev;
+} pmm_block_t;
+
+static uint64_t *bitmap;
+static uint64_t *cached_bitmap; /* Set while a page sits in a magazine; updated atomically */
+static uint64_t bitmap_words;
 static uint64_t total_pages;
 static uint64_t used_pages;
-static spinlock_t pmm_lock = SPINLOCK_INIT;
+static uint64_t run_hint;
+static pmm_block_t *free_area[PMM_MAX_ORDER + 1];
+static uint64_t free_blocks[PMM_MAX_ORDER + 1];
+static spinlock_t pmm_lock = SPINLOCK_INIT_NAMED("pmm");
+
+/**
+ * @brief Per-CPU magazine of free order-0 pages.
+ *
+ * A ring used as a deque: the hot end (tail + count) receives freed pages
+ * whose cache lines are likely still warm and serves allocations, the cold
+ * end (tail) receives refills from the buddy lists and is drained first.
+ */
+typedef struct pmm_pcp
+{
+    void *pages[PCP_CAPACITY];
+    uint32_t tail;
+    uint32_t count;
+    uint64_t refills;
+    uint64_t drains;
+} pmm_pcp_t;
+
+static pmm_pcp_t pcp[MAX_CPUS];
+
+/** @brief Orders kept pre-zeroed: single pages only. */
+#define ZERO_POOL_ORDERS 1
+/** @brief Idle CPUs stop refilling once free memory drops below this many pages. */
+#define ZERO_POOL_MIN_FREE 1024
+
+/**
+ * @brief Blocks of one order that are already zeroed.
+ *
+ * Linked through their first word, which is cleared again on the way out.
+ */
+typedef struct zero_pool
+{
+    void *head;
+    uint64_t count;
+    uint64_t target; /* Blocks idle CPUs keep ready */
+    uint64_t hits;
+    uint64_t misses; /* Allocations that found the pool empty and cleared inline */
+} zero_pool_t;
+
+static zero_pool_t zero_pools[ZERO_POOL_ORDERS] = {{.target = 64}};
+static spinlock_t zero_lock = SPINLOCK_INIT_NAMED("zeropool");
+
+static inline int frame_used(uint64_t frame)
+{
+    return (bitmap[frame / 64] >> (frame % 64)) & 1;
+}
+
+/**
+ * @brief Marks @p frame as sitting in a magazine.
+ * @return 0, or -1 if it already was.
+ */
+static inline int frame_cache(uint64_t frame)
+{
+    uint64_t bit = 1ULL << (frame % 64);
+    return (__atomic_fetch_or(&cached_bitmap[frame / 64], bit, __ATOMIC_RELAXED) & bit) ? -1 : 0;
+}
+
+static inline void frame_uncache(uint64_t frame)
+{
+    __atomic_fetch_and(&cached_bitmap[frame / 64], ~(1ULL << (frame % 64)), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Mask selecting bits [frame % 64, frame % 64 + count) of one word.
+ */
+static inline uint64_t word_mask(uint64_t frame, uint64_t count)
+{
+    uint64_t mask = (count >= 64) ? ~0ULL : ((1ULL << count) - 1);
+    return mask << (frame % 64);
+}
+
+static void frames_set_used(uint64_t frame, uint64_t count)
+{
+    while (count)
+    {
+        uint64_t n = 64 - (frame % 64);
+        if (n > count)
+            n = count;
+        bitmap[frame / 64] |= word_mask(frame, n);
+        frame += n;
+        count -= n;
+    }
+}
+
+static void frames_set_free(uint64_t frame, uint64_t count)
+{
+    while (count)
+    {
+        uint64_t n = 64 - (frame % 64);
+        if (n > count)
+            n = count;
+        bitmap[frame / 64] &= ~word_mask(frame, n);
+        frame += n;
+        count -= n;
+    }
+}
+
+/**
+ * @brief Finds the first frame in [from, limit) whose state is @p used.
+ * @return The frame, or @p limit if there is none.
+ */
+static uint64_t bitmap_find(uint64_t from, uint64_t limit, int used)
+{
+    while (from < limit)
+    {
+        uint64_t word = bitmap[from / 64];
+        if (!used)
+            word = ~word;
+        word &= ~0ULL << (from % 64);
+
+        if (word)
+        {
+            uint64_t frame = (from & ~63ULL) + __builtin_ctzll(word);
+            return frame < limit ? frame : limit;
+        }
+        from = (from & ~63ULL) + 64;
+    }
+    return limit;
+}
+
+/**
+ * @brief Next-fit search for @p count contiguous free frames in [from, limit).
+ * Runs may cross word boundaries.
+ * @return The first frame of the run, or (uint64_t)-1.
+ */
+static uint64_t bitmap_find_run(uint64_t from, uint64_t limit, uint64_t count)
+{
+    while (from < limit)
+    {
+        uint64_t start = bitmap_find(from, limit, 0);
+        if (start + count > limit)
+            break;
+
+        uint64_t end = bitmap_find(start, start + count, 1);
+        if (end == start + count)
+            return start;
+
+        from = bitmap_find(end, limit, 0);
+    }
+    return (uint64_t)-1;
+}
+
+static inline pmm_block_t *frame_to_block(uint64_t frame)
+{
+    return (pmm_block_t *)PHYS_TO_VIRT(frame * PAGE_SIZE);
+}
+
+static inline uint64_t block_to_frame(pmm_block_t *block)
+{
+    return VIRT_TO_PHYS(block) / PAGE_SIZE;
+}
+
+static void buddy_insert(uint64_t frame, uint64_t order)
+{
+    pmm_block_t *block = frame_to_block(frame);
+
+    block->magic = BUDDY_MAGIC;
+    block->order = order;
+    block->prev = NULL;
+    block->next = free_area[order];
+    if (free_area[order])
+        free_area[order]->prev = block;
+    free_area[order] = block;
+    free_blocks[order]++;
+}
+
+static void buddy_remove(pmm_block_t *block)
+{
+    uint64_t order = block->order;
+
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        free_area[order] = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+
+    block->magic = 0;
+    free_blocks[order]--;
+}
+
+/**
+ * @brief Checks whether a free block of exactly @p order starts at @p frame.
+ *
+ * A clear bit at an order-aligned frame always belongs to the head of a
+ * free block (a larger free block containing it would also contain the
+ * block being merged), so only the head frame has to be inspected.
+ */
+static int buddy_is_free_head(uint64_t frame, uint64_t order)
+{
+    if (frame + (1ULL << order) > total_pages || frame_used(frame))
+        return 0;
+
+    pmm_block_t *block = frame_to_block(frame);
+    return block->magic == BUDDY_MAGIC && block->order == order;
+}
+
+/**
+ * @brief Returns a naturally aligned block to the free lists, merging buddies.
+ */
+static void buddy_free(uint64_t frame, uint64_t order)
+{
+    frames_set_free(frame, 1ULL << order);
+    used_pages -= (1ULL << order);
+
+    while (order < PMM_MAX_ORDER)
+    {
+        uint64_t buddy = frame ^ (1ULL << order);
+        if (!buddy_is_free_head(buddy, order))
+            break;
+
+        buddy_remove(frame_to_block(buddy));
+        frame &= ~(1ULL << order);
+        order++;
+    }
+
+    buddy_insert(frame, order);
+}
+
+/**
+ * @brief Takes a block of @p order off the free lists, splitting larger ones.
+ * @return The first frame of the block, or (uint64_t)-1 when exhausted.
+ */
+static uint64_t buddy_alloc(uint64_t order)
+{
+    uint64_t current = order;
+    while (current <= PMM_MAX_ORDER && !free_area[current])
+        current++;
+
+    if (current > PMM_MAX_ORDER)
+        return (uint64_t)-1;
+
+    pmm_block_t *block = free_area[current];
+    uint64_t frame = block_to_frame(block);
+    buddy_remove(block);
+
+    /* Hand the upper halves back until the block has the requested size */
+    while (current > order)
+    {
+        current--;
+        buddy_insert(frame + (1ULL << current), current);
+    }
+
+    frames_set_used(frame, 1ULL << order);
+    used_pages += (1ULL << order);
+    return frame;
+}
+
+/**
+ * @brief Frees an arbitrary run of used frames as maximal aligned blocks.
+ */
+static void buddy_free_run(uint64_t frame, uint64_t count)
+{
+    uint64_t end = frame + count;
+
+    while (frame < end)
+    {
+        uint64_t order = 0;
+        while (order < PMM_MAX_ORDER &&
+               !(frame & ((1ULL << (order + 1)) - 1)) &&
+               frame + (1ULL << (order + 1)) <= end)
+            order++;
+
+        buddy_free(frame, order);
+        frame += (1ULL << order);
+    }
+}
+
+/**
+ * @brief Removes a single free frame from whichever free block contains it.
+ * The rest of that block is split and returned to the free lists.
+ */
+static void buddy_carve(uint64_t frame)
+{
+    for (uint64_t order = 0; order <= PMM_MAX_ORDER; order++)
+    {
+        uint64_t head = frame & ~((1ULL << order) - 1);
+        if (!buddy_is_free_head(head, order))
+            continue;
+
+        buddy_remove(frame_to_block(head));
+        while (order > 0)
+        {
+            order--;
+            uint64_t half = head + (1ULL << order);
+            if (frame >= half)
+            {
+                buddy_insert(head, order);
+                head = half;
+            }
+            else
+            {
+                buddy_insert(half, order);
+            }
+        }
+
+        frames_set_used(frame, 1);
+        used_pages++;
+        return;
+    }
+}
+
+static uint64_t order_for(uint64_t count)
+{
+    uint64_t order = 0;
+    while ((1ULL << order) < count)
+        order++;
+    return order;
+}
+
+/**
+ * @brief Converts a pointer returned by pmm_alloc_page(s) to a frame number.
+ * Plain physical addresses are accepted as well.
+ */
+static uint64_t addr_to_frame(void *addr)
+{
+    uintptr_t a = (uintptr_t)addr;
+    if (a >= DIRECT_MAP_OFFSET)
+        a = VIRT_TO_PHYS(a);
+    return a / PAGE_SIZE;
+}
+
+static inline void pcp_push_hot(pmm_pcp_t *c, void *page)
+{
+    c->pages[(c->tail + c->count) & (PCP_CAPACITY - 1)] = page;
+    c->count++;
+}
+
+static inline void *pcp_pop_hot(pmm_pcp_t *c)
+{
+    c->count--;
+    return c->pages[(c->tail + c->count) & (PCP_CAPACITY - 1)];
+}
+
+static inline void pcp_push_cold(pmm_pcp_t *c, void *page)
+{
+    c->tail = (c->tail - 1) & (PCP_CAPACITY - 1);
+    c->pages[c->tail] = page;
+    c->count++;
+}
+
+static inline void *pcp_pop_cold(pmm_pcp_t *c)
+{
+    void *page = c->pages[c->tail];
+    c->tail = (c->tail + 1) & (PCP_CAPACITY - 1);
+    c->count--;
+    return page;
+}
+
+/**
+ * @brief Moves up to PCP_BATCH pages from the buddy lists into a magazine.
+ * Called with interrupts disabled on the owning CPU.
+ */
+static void pcp_refill(pmm_pcp_t *c)
+{
+    spinlock_acquire(&pmm_lock);
+    for (int i = 0; i < PCP_BATCH; i++)
+    {
+        uint64_t frame = buddy_alloc(0);
+        if (frame == (uint64_t)-1)
+            break;
+        frame_cache(frame);
+        pcp_push_cold(c, PHYS_TO_VIRT(frame * PAGE_SIZE));
+    }
+    spinlock_release(&pmm_lock);
+    c->refills++;
+}
+
+/**
+ * @brief Returns the PCP_BATCH coldest pages of a magazine to the buddy lists.
+ * Called with interrupts disabled on the owning CPU.
+ */
+static void pcp_drain(pmm_pcp_t *c)
+{
+    spinlock_acquire(&pmm_lock);
+    for (int i = 0; i < PCP_BATCH && c->count > 0; i++)
+    {
+        uint64_t frame = addr_to_frame(pcp_pop_cold(c));
+        frame_uncache(frame);
+        buddy_free(frame, 0);
+    }
+    spinlock_release(&pmm_lock);
+    c->drains++;
+}
+
+/**
+ * @brief Releases every used frame in [start, end), skipping free ones.
+ * Called with pmm_lock held.
+ */
+static void release_used_runs(uint64_t start, uint64_t end)
+{
+    while (start < end)
+    {
+        uint64_t run = bitmap_find(start, end, 1);
+        if (run == end)
+            break;
+
+        uint64_t run_end = bitmap_find(run, end, 0);
+        buddy_free_run(run, run_end - run);
+        start = run_end;
+    }
+}
 
 /**
  * @brief Initializes the PMM bitmap.
- * @param start The VIRTUAL address where the bitmap should be placed.
+ * @param start The VIRTUAL address where the bitmaps should be placed:
+ *        1 bit per page of @p size, twice over.
  * @param size The total size of PHYSICAL RAM in bytes.
  */
 void pmm_init(uintptr_t start, uint64_t size)
 {
-    /* The bitmap pointer is a virtual address in the higher half */
-    bitmap = (uint8_t *)start;
-    total_pages = size / 4096;
-    bitmap_size = (total_pages + 7) / 8;
+    /* The bitmap pointer is a direct map address */
+    bitmap = (uint64_t *)start;
+    total_pages = size / PAGE_SIZE;
+    bitmap_words = (total_pages + 63) / 64;
+    cached_bitmap = bitmap + bitmap_words;
 
-    /* Initially mark everything as USED until kmain calls pmm_mark_free */
+    /* Initially mark everything as USED until kmain releases the free regions */
     used_pages = total_pages;
+    run_hint = PMM_RESERVED_LOW / PAGE_SIZE;
+
+    /* Fill bitmap with all ones (all used) */
+    for (uint64_t i = 0; i < bitmap_words; i++)
+    {
+        bitmap[i] = ~0ULL;
+        cached_bitmap[i] = 0;
+    }
 
-    /* Fill bitmap with 0xFF (all used) */
-    for (uint64_t i = 0; i < bitmap_size; i++)
+    for (int i = 0; i <= PMM_MAX_ORDER; i++)
     {
-        bitmap[i] = 0xFF;
+        free_area[i] = NULL;
+        free_blocks[i] = 0;
+    }
+
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        pcp[i].tail = 0;
+        pcp[i].count = 0;
+        pcp[i].refills = 0;
+        pcp[i].drains = 0;
     }
 }
 
+/**
+ * @brief Releases a PHYSICAL address range into the buddy allocator.
+ * The range is shrunk to whole pages; frames already free and frames in
+ * the reserved low 2MB are skipped.
+ */
+void pmm_free_region(uintptr_t base, uint64_t len)
+{
+    uint64_t start = (base + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end = (base + len) / PAGE_SIZE;
+
+    if (start < PMM_RESERVED_LOW / PAGE_SIZE)
+        start = PMM_RESERVED_LOW / PAGE_SIZE;
+    if (end > total_pages)
+        end = total_pages;
+
+    spinlock_acquire(&pmm_lock);
+    release_used_runs(start, end);
+    spinlock_release(&pmm_lock);
+}
+
 /**
  * @brief Marks a PHYSICAL address as free in the bitmap.
  */
 void pmm_mark_free(uintptr_t addr)
 {
     spinlock_acquire(&pmm_lock);
-    
-    uint64_t block = addr / 4096;
-    if (block < total_pages)
-    {
-        if (bitmap[block / 8] & (1 << (block % 8)))
-        {
-            bitmap[block / 8] &= ~(1 << (block % 8));
-            if (used_pages > 0)
-                used_pages--;
-        }
-    }
-    
+
+    uint64_t block = addr / PAGE_SIZE;
+    if (block < total_pages && addr >= PMM_RESERVED_LOW && frame_used(block))
+        buddy_free(block, 0);
+
     spinlock_release(&pmm_lock);
 }
 
@@ -63,108 +540,337 @@ void pmm_mark_free(uintptr_t addr)
 void pmm_mark_used(uintptr_t addr)
 {
     spinlock_acquire(&pmm_lock);
-    
-    uint64_t block = addr / 4096;
-    if (block < total_pages)
-    {
-        if (!(bitmap[block / 8] & (1 << (block % 8))))
-        {
-            bitmap[block / 8] |= (1 << (block % 8));
-            used_pages++;
-        }
-    }
-    
+
+    uint64_t block = addr / PAGE_SIZE;
+    if (block < total_pages && !frame_used(block))
+        buddy_carve(block);
+
     spinlock_release(&pmm_lock);
 }
 
 /**
- * @brief Finds a free physical frame and returns its PHYSICAL address.
+ * @brief Finds a free physical frame and returns its direct map address.
  */
 void *pmm_alloc_page()
 {
+    uint64_t flags = irq_save();
+    pmm_pcp_t *c = &pcp[this_cpu_id()];
+
+    if (c->count == 0)
+        pcp_refill(c);
+
+    /* Return virtual address that can be used by kernel */
+    void *page = c->count ? pcp_pop_hot(c) : 0;
+    if (page)
+        frame_uncache(addr_to_frame(page));
+    irq_restore(flags);
+    return page;
+}
+
+/**
+ * @brief Claims @p count free frames found by scanning the bitmap.
+ * Used for runs larger than the biggest buddy block and when the buddy
+ * lists are too fragmented. Called with pmm_lock held.
+ */
+static uint64_t alloc_run(uint64_t count)
+{
+    uint64_t floor = PMM_RESERVED_LOW / PAGE_SIZE;
+    uint64_t frame = bitmap_find_run(run_hint, total_pages, count);
+    if (frame == (uint64_t)-1)
+        frame = bitmap_find_run(floor, run_hint + count < total_pages ? run_hint + count : total_pages, count);
+    if (frame == (uint64_t)-1)
+        return frame;
+
+    for (uint64_t i = 0; i < count; i++)
+        buddy_carve(frame + i);
+
+    run_hint = frame + count;
+    return frame;
+}
+
+/**
+ * @brief Allocates multiple contiguous physical pages.
+ *
+ * The request is served from a block of the next power of two and the
+ * unused tail is handed straight back, so exactly @p count frames are used.
+ * Larger or fragmented requests fall back to a bitmap run search.
+ */
+void *pmm_alloc_pages(uint64_t count)
+{
+    if (count == 0)
+        return 0;
+
+    uint64_t order = order_for(count);
+    uint64_t frame = (uint64_t)-1;
+
+    spinlock_acquire(&pmm_lock);
+
+    if (order <= PMM_MAX_ORDER)
+        frame = buddy_alloc(order);
+
+    if (frame != (uint64_t)-1 && count < (1ULL << order))
+        buddy_free_run(frame + count, (1ULL << order) - count);
+    else if (frame == (uint64_t)-1)
+        frame = alloc_run(count);
+
+    spinlock_release(&pmm_lock);
+
+    if (frame == (uint64_t)-1)
+        return 0;
+
+    return PHYS_TO_VIRT(frame * PAGE_SIZE);
+}
+
+/**
+ * @brief Allocates a naturally aligned block of 2^@p order pages.
+ * Unlike pmm_alloc_pages() the result is always aligned to its own size,
+ * which lets callers find the block header by masking an interior address.
+ */
+void *pmm_alloc_block(uint64_t order)
+{
+    if (order > PMM_MAX_ORDER)
+        return 0;
+
     spinlock_acquire(&pmm_lock);
-    
-    for (uint64_t i = 0; i < bitmap_size; i++)
+    uint64_t frame = buddy_alloc(order);
+    spinlock_release(&pmm_lock);
+
+    if (frame == (uint64_t)-1)
+        return 0;
+
+    return PHYS_TO_VIRT(frame * PAGE_SIZE);
+}
+
+/**
+ * @brief Frees @p count contiguous pages obtained from pmm_alloc_pages().
+ */
+void pmm_free_pages(void *addr, uint64_t count)
+{
+    uint64_t frame = addr_to_frame(addr);
+
+    if (frame + count > total_pages)
+        return;
+
+    spinlock_acquire(&pmm_lock);
+
+    /* Skip frames that are already free so a double free cannot corrupt the lists */
+    release_used_runs(frame, frame + count);
+
+    spinlock_release(&pmm_lock);
+}
+
+static void pcp_free(void *addr, int cold)
+{
+    uint64_t frame = addr_to_frame(addr);
+
+    /* Frames the PMM never handed out must not enter a magazine, and a
+     * frame already in one has been freed twice */
+    if (frame >= total_pages || !frame_used(frame) || frame_cache(frame) != 0)
+        return;
+
+    void *page = PHYS_TO_VIRT(frame * PAGE_SIZE);
+    uint64_t flags = irq_save();
+    pmm_pcp_t *c = &pcp[this_cpu_id()];
+
+    if (c->count == PCP_CAPACITY)
+        pcp_drain(c);
+
+    if (cold)
+        pcp_push_cold(c, page);
+    else
+        pcp_push_hot(c, page);
+
+    irq_restore(flags);
+}
+
+/**
+ * @brief Frees a page returned by pmm_alloc_page().
+ * The page is reused first by the next allocation on this CPU.
+ */
+void pmm_free_page(void *addr)
+{
+    pcp_free(addr, 0);
+}
+
+/**
+ * @brief Frees a page whose contents are not in the CPU cache (e.g. after DMA).
+ * The page is queued behind the warm ones and drained back first.
+ */
+void pmm_free_page_cold(void *addr)
+{
+    pcp_free(addr, 1);
+}
+
+/**
+ * @brief Zeroes @p len bytes with non-temporal stores.
+ *
+ * The block is not about to be read, so the stores bypass the cache
+ * instead of evicting whatever the CPU had cached. movnti
+ * works on general purpose registers and needs no FPU state.
+ */
+static void zero_nt(void *addr, uint64_t len)
+{
+    uint64_t *p = (uint64_t *)addr;
+    uint64_t *end = p + len / 8;
+
+    for (; p < end; p += 4)
+    {
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)"
+                     :
+                     : "r"(p), "r"(0ULL)
+                     : "memory");
+    }
+
+    /* Non-temporal stores are weakly ordered: drain them before the block
+     * is published, or another CPU could read stale data through it. */
+    asm volatile("sfence" ::: "memory");
+}
+
+/**
+ * @brief Allocates 2^@p order zeroed pages.
+ *
+ * Served from the pre-zeroed pool when it has a block, otherwise a fresh
+ * block is cleared here. Free with pmm_free_page()/pmm_free_pages().
+ */
+void *pmm_alloc_zeroed(uint64_t order)
+{
+    uint64_t pages = 1ULL << order;
+
+    if (order < ZERO_POOL_ORDERS)
     {
-        if (bitmap[i] != 0xFF)
+        zero_pool_t *pool = &zero_pools[order];
+        uint64_t flags = spinlock_acquire_irqsave(&zero_lock);
+        void **block = (void **)pool->head;
+        if (block)
         {
-            for (int j = 0; j < 8; j++)
-            {
-                if (!(bitmap[i] & (1 << j)))
-                {
-                    uintptr_t addr = (i * 8 + j) * 4096;
-
-                    /* Safety: Never allocate bottom 2MB (Kernel/BIOS/Page Tables) */
-                    /* Note: These are physical address checks */
-                    if (addr < 0x200000)
-                        continue;
-
-                    bitmap[i] |= (1 << j);
-                    used_pages++;
-
-                    spinlock_release(&pmm_lock);
-                    /* Return virtual address that can be used by kernel */
-                    return PHYS_TO_VIRT(addr);
-                }
-            }
+            pool->head = *block;
+            pool->count--;
+            pool->hits++;
+        }
+        else
+        {
+            pool->misses++;
+        }
+        spinlock_release_irqrestore(&zero_lock, flags);
+
+        if (block)
+        {
+            *block = NULL;
+            return block;
         }
     }
-    
-    spinlock_release(&pmm_lock);
-    return 0;
+
+    void *block = pages == 1 ? pmm_alloc_page() : pmm_alloc_pages(pages);
+    if (block)
+        memset(block, 0, pages * PAGE_SIZE);
+    return block;
 }
 
 /**
- * @brief Allocates multiple contiguous physical pages
+ * @brief Zeroes one block for the first pool below its target.
+ * Called from the idle loop, one block at a time so a task that becomes
+ * runnable waits for at most a single block.
+ *
+ * @return 1 if a block was added, 0 if every pool is full or memory is low.
  */
-void *pmm_alloc_pages(uint64_t count)
+int pmm_zero_refill(void)
 {
-    spinlock_acquire(&pmm_lock);
-    
-    // Find enough contiguous free pages
-    for (uint64_t i = 0; i < bitmap_size; i++) {
-        if (bitmap[i] != 0xFF) {
-            // Check if we have enough contiguous pages starting here
-            uint64_t found = 0;
-            for (int j = 0; j < 8 && found < count; j++) {
-                if (!(bitmap[i] & (1 << j))) {
-                    found++;
-                } else {
-                    break;
-                }
-            }
-            
-            if (found >= count) {
-                // Found enough contiguous pages
-                uintptr_t start_addr = (i * 8 + (8 - found)) * 4096;
-                
-                // Mark all pages as used
-                for (uint64_t k = 0; k < count; k++) {
-                    uint64_t page_idx = (start_addr / 4096) + k;
-                    uint64_t byte_idx = page_idx / 8;
-                    uint64_t bit_idx = page_idx % 8;
-                    bitmap[byte_idx] |= (1 << bit_idx);
-                    used_pages++;
-                }
-                
-                spinlock_release(&pmm_lock);
-                return PHYS_TO_VIRT(start_addr);
-            }
+    if (total_pages - used_pages < ZERO_POOL_MIN_FREE)
+        return 0;
+
+    for (uint64_t order = 0; order < ZERO_POOL_ORDERS; order++)
+    {
+        zero_pool_t *pool = &zero_pools[order];
+        if (__atomic_load_n(&pool->count, __ATOMIC_RELAXED) >= pool->target)
+            continue;
+
+        uint64_t pages = 1ULL << order;
+        void **block = (void **)(pages == 1 ? pmm_alloc_page() : pmm_alloc_pages(pages));
+        if (!block)
+            return 0;
+        zero_nt(block, pages * PAGE_SIZE);
+
+        uint64_t flags = spinlock_acquire_irqsave(&zero_lock);
+        if (pool->count >= pool->target)
+        {
+            /* Another idle CPU filled it meanwhile */
+            spinlock_release_irqrestore(&zero_lock, flags);
+            if (pages == 1)
+                pmm_free_page_cold(block);
+            else
+                pmm_free_pages(block, pages);
+            return 0;
         }
+        *block = pool->head;
+        pool->head = block;
+        pool->count++;
+        spinlock_release_irqrestore(&zero_lock, flags);
+        return 1;
     }
-    
-    spinlock_release(&pmm_lock);
     return 0;
 }
 
 /**
- * @brief Frees a page given its PHYSICAL address.
+ * @brief Reports the pre-zeroed pool.
  */
-void pmm_free_page(void *addr)
+void pmm_get_zero_stats(pmm_zero_stats_t *stats)
+{
+    stats->pooled_pages = 0;
+    stats->hits = 0;
+    stats->misses = 0;
+
+    for (uint64_t order = 0; order < ZERO_POOL_ORDERS; order++)
+    {
+        stats->pooled_pages += zero_pools[order].count << order;
+        stats->hits += zero_pools[order].hits;
+        stats->misses += zero_pools[order].misses;
+    }
+}
+
+/**
+ * @brief Sums the per-CPU magazine counters.
+ */
+void pmm_get_pcp_stats(pmm_pcp_stats_t *stats)
+{
+    stats->cached_pages = 0;
+    stats->refills = 0;
+    stats->drains = 0;
+
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        stats->cached_pages += pcp[i].count;
+        stats->refills += pcp[i].refills;
+        stats->drains += pcp[i].drains;
+    }
+}
+
+/**
+ * @brief Pages sitting in per-CPU magazines and the zeroed pool: allocated
+ * from the buddy lists but still free as far as callers are concerned.
+ */
+static uint64_t pcp_cached_pages(void)
+{
+    uint64_t cached = 0;
+    for (int i = 0; i < MAX_CPUS; i++)
+        cached += pcp[i].count;
+    for (uint64_t order = 0; order < ZERO_POOL_ORDERS; order++)
+        cached += zero_pools[order].count << order;
+    return cached;
+}
+
+/**
+ * @brief Number of free blocks currently held at @p order.
+ */
+uint64_t pmm_get_free_blocks(int order)
 {
-    pmm_mark_free((uintptr_t)addr);
+    if (order < 0 || order > PMM_MAX_ORDER)
+        return 0;
+    return free_blocks[order];
 }
 
 uint64_t pmm_get_total_kb() { return total_pages * 4ULL; }
-uint64_t pmm_get_used_kb() { return used_pages * 4ULL; }
-uint64_t pmm_get_free_kb() { return (total_pages > used_pages) ? (total_pages - used_pages) * 4ULL : 0; }
\ No newline at end of file
+uint64_t pmm_get_used_kb() { return (used_pages - pcp_cached_pages()) * 4ULL; }
+uint64_t pmm_get_free_kb() { return (total_pages + pcp_cached_pages() - used_pages) * 4ULL; }
@@ -0,0 +1,377 @@
+/**
+ * @file slab.c
+ * @brief Slab allocator for fixed-size kernel objects.
+ *
+ * Each cache carves naturally aligned blocks of 2^order pages from the PMM
+ * into equally sized objects. The slab header sits at the start of the
+ * block, so the owning slab of any object is found by masking its address.
+ * Free objects are chained through a link word, which makes allocation and
+ * freeing O(1) and keeps fixed-size objects out of the general heap.
+ */
+
+#include <valen/slab.h>
+#include <valen/pmm.h>
+#include <valen/page.h>
+#include <valen/string.h>
+#include <valen/spinlock.h>
+
+#define SLAB_MAGIC 0x51AB51ABU
+
+/** @brief Largest slab block: 2^4 pages (64KB). */
+#define SLAB_MAX_ORDER 4
+
+/** @brief Empty slabs a cache keeps around before returning them to the PMM. */
+#define SLAB_MAX_EMPTY 1
+
+typedef struct slab
+{
+    uint32_t magic;
+    uint32_t inuse;
+    struct kmem_cache *cache;
+    void *freelist;
+    struct slab *next;
+    struct slab *prev;
+} slab_t;
+
+struct kmem_cache
+{
+    char name[16];
+    uint64_t object_size; /* Size requested by the creator */
+    uint64_t size;        /* Stride between objects, including the link word */
+    uint64_t link_offset; /* Where the free-list link lives inside an object */
+    uint64_t offset;      /* Offset of the first object inside a slab */
+    uint32_t order;
+    uint32_t objects;     /* Objects per slab */
+    void (*ctor)(void *);
+
+    slab_t *partial;
+    slab_t *full;
+    slab_t *empty;
+    uint32_t nr_empty;
+
+    uint64_t nr_slabs;
+    uint64_t active;      /* Objects currently allocated */
+    uint64_t allocs;
+    uint64_t grows;       /* Slabs created */
+
+    spinlock_t lock;
+    struct kmem_cache *next;
+};
+
+/** @brief Bootstrap cache that holds every kmem_cache_t descriptor. */
+static struct kmem_cache cache_cache;
+static struct kmem_cache *cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT_NAMED("slab_caches");
+
+static inline uint64_t align_up(uint64_t value, uint64_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline void **obj_link(struct kmem_cache *cache, void *obj)
+{
+    return (void **)((uint8_t *)obj + cache->link_offset);
+}
+
+static void slab_list_add(slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_del(slab_t **list, slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/**
+ * @brief Computes object stride, slab order and objects per slab.
+ * Picks the smallest order that wastes at most 1/8 of the slab.
+ */
+static void cache_layout(struct kmem_cache *cache, uint64_t size, uint64_t align)
+{
+    if (align < 8)
+        align = 8;
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+
+    cache->object_size = size;
+
+    /* A constructed object must survive being freed, so keep the link outside it */
+    if (cache->ctor)
+    {
+        cache->link_offset = align_up(size, sizeof(void *));
+        size = cache->link_offset + sizeof(void *);
+    }
+    else
+    {
+        cache->link_offset = 0;
+    }
+
+    cache->size = align_up(size, align);
+    cache->offset = align_up(sizeof(slab_t), align);
+
+    for (uint32_t order = 0; order <= SLAB_MAX_ORDER; order++)
+    {
+        uint64_t bytes = (uint64_t)PAGE_SIZE << order;
+        if (bytes <= cache->offset)
+            continue;
+
+        uint64_t objects = (bytes - cache->offset) / cache->size;
+        uint64_t waste = bytes - objects * cache->size;
+
+        cache->order = order;
+        cache->objects = objects;
+        if (objects > 0 && waste * 8 <= bytes)
+            break;
+    }
+}
+
+/**
+ * @brief Allocates and formats a new slab. Called with the cache lock held.
+ */
+static slab_t *slab_grow(struct kmem_cache *cache)
+{
+    if (cache->objects == 0)
+        return NULL;
+
+    slab_t *slab = (slab_t *)pmm_alloc_block(cache->order);
+    if (!slab)
+        return NULL;
+
+    cache->nr_slabs++;
+    cache->grows++;
+
+    slab->magic = SLAB_MAGIC;
+    slab->inuse = 0;
+    slab->cache = cache;
+    slab->freelist = NULL;
+
+    /* Thread the free list back to front so objects are handed out in address order */
+    uint8_t *base = (uint8_t *)slab + cache->offset;
+    for (int64_t i = cache->objects - 1; i >= 0; i--)
+    {
+        void *obj = base + i * cache->size;
+        if (cache->ctor)
+            cache->ctor(obj);
+        *obj_link(cache, obj) = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    return slab;
+}
+
+static inline slab_t *obj_to_slab(struct kmem_cache *cache, void *obj)
+{
+    uint64_t bytes = (uint64_t)PAGE_SIZE << cache->order;
+    return (slab_t *)((uintptr_t)obj & ~(bytes - 1));
+}
+
+static void cache_setup(struct kmem_cache *cache, const char *name, uint64_t size, uint64_t align, void (*ctor)(void *))
+{
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name ? name : "unnamed", sizeof(cache->name) - 1);
+    cache->ctor = ctor;
+    spinlock_init(&cache->lock);
+    cache_layout(cache, size, align);
+
+    spinlock_acquire(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spinlock_release(&cache_list_lock);
+}
+
+/**
+ * @brief Initializes the slab allocator.
+ */
+void slab_init(void)
+{
+    cache_list = NULL;
+    cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+}
+
+/**
+ * @brief Creates a cache of fixed-size objects.
+ */
+kmem_cache_t *kmem_cache_create(const char *name, uint64_t size, uint64_t align, void (*ctor)(void *))
+{
+    if (size == 0 || (align & (align - 1)))
+        return NULL;
+
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache)
+        return NULL;
+
+    cache_setup(cache, name, size, align, ctor);
+    if (cache->objects == 0)
+    {
+        kmem_cache_destroy(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/**
+ * @brief Destroys an empty cache.
+ */
+int kmem_cache_destroy(kmem_cache_t *cache)
+{
+    if (!cache || cache == &cache_cache)
+        return -1;
+
+    spinlock_acquire(&cache->lock);
+    if (cache->partial || cache->full)
+    {
+        spinlock_release(&cache->lock);
+        return -1;
+    }
+
+    while (cache->empty)
+    {
+        slab_t *slab = cache->empty;
+        slab_list_del(&cache->empty, slab);
+        slab->magic = 0;
+        cache->nr_slabs--;
+        pmm_free_pages(slab, 1ULL << cache->order);
+    }
+    spinlock_release(&cache->lock);
+
+    spinlock_acquire(&cache_list_lock);
+    struct kmem_cache **link = &cache_list;
+    while (*link && *link != cache)
+        link = &(*link)->next;
+    if (*link)
+        *link = cache->next;
+    spinlock_release(&cache_list_lock);
+
+    kmem_cache_free(&cache_cache, cache);
+    return 0;
+}
+
+/**
+ * @brief Allocates one object: partial slabs first, then empty ones, then a new slab.
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    if (!cache)
+        return NULL;
+
+    spinlock_acquire(&cache->lock);
+
+    slab_t *slab = cache->partial;
+    if (!slab && cache->empty)
+    {
+        slab = cache->empty;
+        slab_list_del(&cache->empty, slab);
+        cache->nr_empty--;
+        slab_list_add(&cache->partial, slab);
+    }
+    if (!slab)
+    {
+        slab = slab_grow(cache);
+        if (!slab)
+        {
+            spinlock_release(&cache->lock);
+            return NULL;
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void *obj = slab->freelist;
+    slab->freelist = *obj_link(cache, obj);
+    slab->inuse++;
+    cache->active++;
+    cache->allocs++;
+
+    if (slab->inuse == cache->objects)
+    {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    spinlock_release(&cache->lock);
+    return obj;
+}
+
+/**
+ * @brief Returns an object to its slab.
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (!cache || !obj)
+        return;
+
+    slab_t *slab = obj_to_slab(cache, obj);
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache)
+        return;
+
+    spinlock_acquire(&cache->lock);
+
+    if (slab->inuse == cache->objects)
+    {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *obj_link(cache, obj) = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->active--;
+
+    if (slab->inuse == 0)
+    {
+        slab_list_del(&cache->partial, slab);
+        if (cache->nr_empty < SLAB_MAX_EMPTY)
+        {
+            slab_list_add(&cache->empty, slab);
+            cache->nr_empty++;
+        }
+        else
+        {
+            slab->magic = 0;
+            cache->nr_slabs--;
+            pmm_free_pages(slab, 1ULL << cache->order);
+        }
+    }
+
+    spinlock_release(&cache->lock);
+}
+
+/**
+ * @brief Copies the counters of up to @p max caches into @p out.
+ * @return The number of entries written.
+ */
+int kmem_cache_get_stats(kmem_cache_stats_t *out, int max)
+{
+    int n = 0;
+
+    spinlock_acquire(&cache_list_lock);
+    for (struct kmem_cache *cache = cache_list; cache && n < max; cache = cache->next, n++)
+    {
+        spinlock_acquire(&cache->lock);
+        strncpy(out[n].name, cache->name, sizeof(out[n].name));
+        out[n].object_size = cache->object_size;
+        out[n].slab_bytes = (uint64_t)PAGE_SIZE << cache->order;
+        out[n].objects_per_slab = cache->objects;
+        out[n].slabs = cache->nr_slabs;
+        out[n].active = cache->active;
+        out[n].total = cache->nr_slabs * cache->objects;
+        out[n].allocs = cache->allocs;
+        out[n].grows = cache->grows;
+        spinlock_release(&cache->lock);
+    }
+    spinlock_release(&cache_list_lock);
+
+    return n;
+}
@@ -1,20 +1,68 @@
 /**
  * @file vmm.c
  * @brief Virtual Memory Manager (VMM) Implementation (Higher Half).
+ *
+ * Kernel virtual space in [VMM_BASE, VMM_END) is tracked by a bitmap with
+ * one bit per page. vmm_alloc() reserves a range next-fit and backs it with
+ * individual frames; vmm_free() unmaps the range, returns the frames to the
+ * PMM and makes the addresses available again.
+ *
+ * Ranges reserved with vmm_reserve() are backed on first touch instead:
+ * the page fault handler maps a zeroed frame from a per-CPU reserve and
+ * takes no lock. Guard pages on both sides stay unmapped and turn overruns
+ * into fatal faults. vmm_populate() backs such a range up front.
  */
 
 #include <valen/vmm.h>
 #include <valen/paging.h>
+#include <valen/page.h>
 #include <valen/pmm.h>
 #include <valen/stdio.h>
 #include <valen/spinlock.h>
+#include <valen/percpu.h>
+#include <valen/smp.h>
 
-#define KERNEL_VIRT_OFFSET 0xFFFFFFFF80000000ULL
+/** @brief Kernel window handed out by vmm_alloc(). */
+#define VMM_BASE 0xFFFFFFFFC0000000ULL
+#define VMM_END 0xFFFFFFFFFF000000ULL
+#define VMM_PAGES ((VMM_END - VMM_BASE) / PAGE_SIZE)
 
-#define PHYS_TO_VIRT(phys) ((void *)((uint64_t)(phys) + KERNEL_VIRT_OFFSET))
-#define ENTRY_TO_PHYS(entry) ((uint64_t)(entry) & ~0xFFF)
+/** @brief Frames collected on the stack per batched paging call. */
+#define VMM_BATCH 64
 
-static spinlock_t vmm_lock = SPINLOCK_INIT;
+/** @brief Unmapped pages left after each allocation to catch overruns. */
+#define VMM_GUARD_PAGES 1
+
+/** @brief The only mapping demand-backed pages get. */
+#define LAZY_FLAGS (PAGE_PRESENT | PAGE_WRITE)
+
+/**
+ * @brief Frames the page fault handler takes without locking.
+ *
+ * Only its own CPU touches it. The handler can run at any point of
+ * vmm_fault_refill(), so refills publish a frame with a compare-and-swap
+ * on @c count instead of disabling interrupts, which would not stop a fault.
+ */
+typedef struct fault_reserve
+{
+    void *pages[VMM_FAULT_RESERVE_PAGES];
+    uint32_t count;
+    uint64_t faults; /* Pages backed on first touch */
+    uint64_t misses; /* Faults that found the reserve empty */
+} fault_reserve_t;
+
+static spinlock_t vmm_lock = SPINLOCK_INIT_NAMED("vmm");
+
+/* One bit per page of the window, 1 = reserved. Protected by vmm_lock. */
+static uint64_t va_bitmap[VMM_PAGES / 64];
+static uint64_t va_hint = 0;
+
+/* One bit per page, 1 = backed on first touch. Set under vmm_lock, read by
+ * the page fault handler without it. */
+static uint64_t lazy_bitmap[VMM_PAGES / 64];
+static uint64_t lazy_pages;
+
+static fault_reserve_t fault_reserves[MAX_CPUS];
 
 
 void vmm_init()
@@ -25,55 +73,418 @@ void vmm_init()
 /**
  * @brief Maps a virtual address to a physical address.
  */
-void vmm_map(uintptr_t virt, uintptr_t phys, uint64_t flags)
+int vmm_map(uintptr_t virt, uintptr_t phys, uint64_t flags)
 {
-    paging_map(virt, phys, flags);
-    /* Invalidate TLB for the specific virtual address */
-    asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    return paging_map(virt, phys, flags);
 }
 
 /**
  * @brief Maps a contiguous range of memory.
  */
-void vmm_map_range(uintptr_t virt, uintptr_t phys, uint64_t size, uint64_t flags)
+int vmm_map_range(uintptr_t virt, uintptr_t phys, uint64_t size, uint64_t flags)
+{
+    return paging_map_range(virt, phys, size, flags);
+}
+
+/**
+ * @brief Finds the first page at or after @p from whose bit equals @p used.
+ * @return The page index, or @p limit if there is none.
+ */
+static uint64_t va_find(uint64_t from, uint64_t limit, int used)
 {
-    for (uint64_t i = 0; i < size; i += 4096)
+    while (from < limit)
     {
-        paging_map(virt + i, phys + i, flags);
-        asm volatile("invlpg (%0)" : : "r"(virt + i) : "memory");
+        uint64_t word = va_bitmap[from / 64];
+        if (!used)
+            word = ~word;
+        word &= ~0ULL << (from % 64);
+
+        if (word)
+        {
+            uint64_t page = (from & ~63ULL) + __builtin_ctzll(word);
+            return page < limit ? page : limit;
+        }
+        from = (from & ~63ULL) + 64;
+    }
+    return limit;
+}
+
+/**
+ * @brief Searches [from, limit) for @p count contiguous free pages.
+ * @return The first page of the range, or (uint64_t)-1.
+ */
+static uint64_t va_find_range(uint64_t from, uint64_t limit, uint64_t count)
+{
+    while (from < limit)
+    {
+        uint64_t start = va_find(from, limit, 0);
+        if (start + count > limit)
+            break;
+
+        uint64_t end = va_find(start, start + count, 1);
+        if (end == start + count)
+            return start;
+
+        from = va_find(end, limit, 0);
+    }
+    return (uint64_t)-1;
+}
+
+static void bitmap_set(uint64_t *bitmap, uint64_t page, uint64_t count, int used)
+{
+    while (count)
+    {
+        uint64_t n = 64 - (page % 64);
+        if (n > count)
+            n = count;
+        uint64_t mask = ((n >= 64) ? ~0ULL : ((1ULL << n) - 1)) << (page % 64);
+        if (used)
+            __atomic_or_fetch(&bitmap[page / 64], mask, __ATOMIC_RELEASE);
+        else
+            __atomic_and_fetch(&bitmap[page / 64], ~mask, __ATOMIC_RELEASE);
+        page += n;
+        count -= n;
+    }
+}
+
+static int page_is_lazy(uint64_t page)
+{
+    return (__atomic_load_n(&lazy_bitmap[page / 64], __ATOMIC_ACQUIRE) >> (page % 64)) & 1;
+}
+
+/**
+ * @brief Reserves @p count pages of kernel virtual space, next-fit from the last allocation.
+ * Called with vmm_lock held.
+ */
+static uintptr_t va_reserve(uint64_t count)
+{
+    uint64_t page = va_find_range(va_hint, VMM_PAGES, count);
+    if (page == (uint64_t)-1 && va_hint)
+        page = va_find_range(0, VMM_PAGES, count);
+    if (page == (uint64_t)-1)
+        return 0;
+
+    bitmap_set(va_bitmap, page, count, 1);
+    va_hint = page + count;
+    if (va_hint >= VMM_PAGES)
+        va_hint = 0;
+
+    return VMM_BASE + page * PAGE_SIZE;
+}
+
+/**
+ * @brief Makes @p count pages at @p virt available to va_reserve() again.
+ */
+static void va_release(uintptr_t virt, uint64_t count)
+{
+    spinlock_acquire(&vmm_lock);
+    bitmap_set(va_bitmap, (virt - VMM_BASE) / PAGE_SIZE, count, 0);
+    spinlock_release(&vmm_lock);
+}
+
+/**
+ * @brief Unmaps @p count pages at @p virt and returns their frames to the PMM.
+ * Other CPUs drop their stale translations before a frame is reused.
+ */
+static void va_unmap(uintptr_t virt, uint64_t count)
+{
+    uint64_t frames[VMM_BATCH];
+
+    while (count)
+    {
+        uint64_t n = count < VMM_BATCH ? count : VMM_BATCH;
+        paging_unmap_pages(virt, n, frames);
+        smp_flush_tlb();
+        for (uint64_t i = 0; i < n; i++)
+        {
+            if (frames[i])
+                pmm_free_page((void *)frames[i]);
+        }
+        virt += n * PAGE_SIZE;
+        count -= n;
     }
 }
 
 /**
  * @brief Allocates virtual pages and maps them to physical frames.
+ *
+ * Each page gets its own frame, so the backing memory does not need to be
+ * physically contiguous. An unmapped guard page follows every allocation.
+ * Every page is backed on return; use vmm_reserve() to back on first touch.
  */
 void *vmm_alloc(uint64_t pages, uint64_t flags)
 {
+    if (pages == 0 || pages >= VMM_PAGES)
+        return 0;
+
     spinlock_acquire(&vmm_lock);
-    
-    // Allocate contiguous physical pages first
-    void *phys_pages = pmm_alloc_pages(pages);
-    if (!phys_pages) {
+    uintptr_t start = va_reserve(pages + VMM_GUARD_PAGES);
+    spinlock_release(&vmm_lock);
+
+    if (!start)
+        return 0;
+
+    uint64_t frames[VMM_BATCH];
+
+    for (uint64_t done = 0; done < pages;)
+    {
+        uint64_t n = pages - done < VMM_BATCH ? pages - done : VMM_BATCH;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            void *frame = pmm_alloc_page();
+            if (!frame)
+            {
+                while (i--)
+                    pmm_free_page((void *)frames[i]);
+                va_unmap(start, done);
+                va_release(start, pages + VMM_GUARD_PAGES);
+                return 0;
+            }
+            frames[i] = VIRT_TO_PHYS(frame);
+        }
+
+        if (paging_map_pages(start + done * PAGE_SIZE, frames, n, flags) != 0)
+        {
+            for (uint64_t i = 0; i < n; i++)
+                pmm_free_page((void *)frames[i]);
+            va_unmap(start, done);
+            va_release(start, pages + VMM_GUARD_PAGES);
+            return 0;
+        }
+        done += n;
+    }
+
+    return (void *)start;
+}
+
+/**
+ * @brief Releases a range returned by vmm_alloc().
+ */
+void vmm_free(void *addr, uint64_t pages)
+{
+    uintptr_t virt = (uintptr_t)addr;
+    if (virt < VMM_BASE || virt >= VMM_END || (virt & (PAGE_SIZE - 1)))
+        return;
+
+    uint64_t page = (virt - VMM_BASE) / PAGE_SIZE;
+    uint64_t count = pages + VMM_GUARD_PAGES;
+    if (count > VMM_PAGES - page)
+        count = VMM_PAGES - page;
+
+    if (page_is_lazy(page) && page >= VMM_GUARD_PAGES)
+    {
+        /* Stop backing the range before taking its frames away */
+        spinlock_acquire(&vmm_lock);
+        bitmap_set(lazy_bitmap, page, pages < count ? pages : count, 0);
+        lazy_pages -= pages < count ? pages : count;
         spinlock_release(&vmm_lock);
+
+        va_unmap(virt, pages < count ? pages : count);
+        va_release(virt - VMM_GUARD_PAGES * PAGE_SIZE, count + VMM_GUARD_PAGES);
+        return;
+    }
+
+    va_unmap(virt, pages < count ? pages : count);
+    va_release(virt, count);
+}
+
+/**
+ * @brief Reserves @p pages of kernel virtual space to be backed on first
+ * touch, with an unmapped guard page below and above.
+ *
+ * Memory is readable and writable and reads as zero. Free with vmm_free().
+ * Faults only draw on this CPU's reserve of VMM_FAULT_RESERVE_PAGES frames, so
+ * touching more pages than that before vmm_fault_refill() runs again is
+ * fatal. Use vmm_populate() for memory that must never fault.
+ */
+void *vmm_reserve(uint64_t pages)
+{
+    if (pages == 0 || pages + 2 * VMM_GUARD_PAGES >= VMM_PAGES)
+        return 0;
+
+    spinlock_acquire(&vmm_lock);
+    uintptr_t start = va_reserve(pages + 2 * VMM_GUARD_PAGES);
+    spinlock_release(&vmm_lock);
+
+    if (!start)
         return 0;
+
+    uintptr_t virt = start + VMM_GUARD_PAGES * PAGE_SIZE;
+    if (paging_prepare(virt, pages) != 0)
+    {
+        va_release(start, pages + 2 * VMM_GUARD_PAGES);
+        return 0;
+    }
+
+    spinlock_acquire(&vmm_lock);
+    bitmap_set(lazy_bitmap, (virt - VMM_BASE) / PAGE_SIZE, pages, 1);
+    lazy_pages += pages;
+    spinlock_release(&vmm_lock);
+
+    vmm_fault_refill();
+    return (void *)virt;
+}
+
+/**
+ * @brief Backs every page of @p pages at @p addr, part of a vmm_reserve()
+ * range, so touching them never faults. Called from task context.
+ * @return 0 on success, -1 if frames ran out. Pages backed so far stay
+ * mapped and go back with vmm_free().
+ */
+int vmm_populate(void *addr, uint64_t pages)
+{
+    uintptr_t virt = (uintptr_t)addr;
+
+    for (uint64_t i = 0; i < pages; i++, virt += PAGE_SIZE)
+    {
+        void *frame = pmm_alloc_zeroed(0);
+        if (!frame)
+            return -1;
+
+        int ret = paging_fill(virt, VIRT_TO_PHYS(frame), LAZY_FLAGS);
+        if (ret != 0)
+        {
+            /* Already backed by a fault */
+            pmm_free_page(frame);
+            if (ret < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Tops up this CPU's fault reserve with zeroed frames.
+ * Called from task context, the idle loop and finish_switch() on every
+ * task switch, never from the fault handler.
+ */
+void vmm_fault_refill(void)
+{
+    preempt_disable();
+    fault_reserve_t *reserve = &fault_reserves[this_cpu_id()];
+
+    while (__atomic_load_n(&reserve->count, __ATOMIC_RELAXED) < VMM_FAULT_RESERVE_PAGES)
+    {
+        void *page = pmm_alloc_zeroed(0);
+        if (!page)
+            break;
+
+        /* A fault in between may take a frame; retry on the slot it frees */
+        uint32_t count = __atomic_load_n(&reserve->count, __ATOMIC_RELAXED);
+        while (count < VMM_FAULT_RESERVE_PAGES)
+        {
+            reserve->pages[count] = page;
+            if (__atomic_compare_exchange_n(&reserve->count, &count, count + 1, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            {
+                page = 0;
+                break;
+            }
+        }
+        if (page)
+            pmm_free_page(page);
+    }
+
+    preempt_enable();
+}
+
+/**
+ * @brief Backs a demand-backed page after a not-present fault on it.
+ * Called from the page fault handler with interrupts disabled. Takes no
+ * lock: the faulting code may hold any, including the PMM's.
+ * @return 0 if the faulting access can be retried, VMM_FAULT_NO_RESERVE if
+ * this CPU's reserve is empty, -1 if the fault is fatal otherwise.
+ */
+int vmm_handle_fault(uintptr_t addr, uint64_t error_code)
+{
+    /* Present pages only fault on protection violations */
+    if (error_code & 1)
+        return -1;
+    if (addr < VMM_BASE || addr >= VMM_END)
+        return -1;
+
+    uint64_t page = (addr - VMM_BASE) / PAGE_SIZE;
+    if (!page_is_lazy(page))
+        return -1;
+
+    fault_reserve_t *reserve = &fault_reserves[this_cpu_id()];
+    if (!reserve->count)
+    {
+        /* Refilling here could spin on a lock the faulting code holds */
+        reserve->misses++;
+        return VMM_FAULT_NO_RESERVE;
+    }
+    void *frame = reserve->pages[reserve->count - 1];
+    reserve->count--;
+
+    uintptr_t virt = addr & ~(uintptr_t)(PAGE_SIZE - 1);
+    int ret = paging_fill(virt, VIRT_TO_PHYS(frame), LAZY_FLAGS);
+    if (ret != 0)
+    {
+        /* Mapped by another CPU meanwhile: the access will now succeed */
+        if (reserve->count < VMM_FAULT_RESERVE_PAGES)
+            reserve->pages[reserve->count++] = frame;
+        else
+            pmm_free_page(frame);
+        return ret < 0 ? -1 : 0;
     }
-    
-    // Find a free virtual address range
-    // For now, use a simple allocator starting from a base address
-    static uintptr_t next_virt_addr = 0xFFFFFFFFC0000000;
-    uintptr_t start_addr = next_virt_addr;
-    
-    // Map each page
-    for (uint64_t i = 0; i < pages; i++) {
-        uintptr_t virt = next_virt_addr + (i * 4096);
-        uintptr_t phys = (uintptr_t)phys_pages + (i * 4096);
-        paging_map(virt, phys, flags);
-        asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+
+    reserve->faults++;
+    return 0;
+}
+
+/**
+ * @brief Reports whether @p addr is a guard page around a vmm_reserve() range.
+ */
+int vmm_is_guard_page(uintptr_t addr)
+{
+    if (addr < VMM_BASE || addr >= VMM_END)
+        return 0;
+
+    uint64_t page = (addr - VMM_BASE) / PAGE_SIZE;
+    int range_after = page + 1 < VMM_PAGES && page_is_lazy(page + 1);
+    int range_before = page > 0 && page_is_lazy(page - 1);
+    return !page_is_lazy(page) && (range_after || range_before);
+}
+
+/**
+ * @brief Sums the demand paging counters.
+ */
+void vmm_get_fault_stats(vmm_fault_stats_t *stats)
+{
+    stats->faults = 0;
+    stats->misses = 0;
+    stats->reserved_pages = lazy_pages;
+
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        stats->faults += fault_reserves[i].faults;
+        stats->misses += fault_reserves[i].misses;
     }
-    
-    next_virt_addr += pages * 4096;
+}
+
+/**
+ * @brief Maps a device's physical registers into the kernel window, uncached.
+ * @return The virtual address of @p phys, or NULL if no space is left.
+ */
+void *vmm_map_mmio(uintptr_t phys, uint64_t size)
+{
+    uintptr_t base = phys & ~(uintptr_t)(PAGE_SIZE - 1);
+    uint64_t pages = (phys + size - base + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    spinlock_acquire(&vmm_lock);
+    uintptr_t virt = va_reserve(pages + VMM_GUARD_PAGES);
     spinlock_release(&vmm_lock);
-    return (void *)start_addr;
+
+    if (!virt)
+        return 0;
+
+    if (paging_map_range(virt, base, pages * PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE | PAGE_PCD | PAGE_PWT) != 0)
+    {
+        va_release(virt, pages + VMM_GUARD_PAGES);
+        return 0;
+    }
+    return (void *)(virt + (phys - base));
 }
 
 /**
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Writes the text symbols of a linked kernel as a nasm source: a table of
+# (address, name) pairs sorted by address, read by kernel/prof/ksyms.c.
+# Usage: ksyms.sh <kernel ELF> [nm]
+
+NM=${2:-nm}
+
+$NM -n "$1" | awk '
+BEGIN { n = 0; last = "" }
+$2 ~ /^[tT]$/ && $3 !~ /^_code_(start|end)$/ {
+    # Keep the first name of symbols that share an address
+    if (n && $1 "" == last) next
+    last = $1
+    addr[n] = $1
+    name[n] = $3
+    n++
+}
+END {
+    print "[bits 64]"
+    print "section .rodata"
+    print "global ksym_table"
+    print "global ksym_table_size"
+    print "align 8"
+    print "ksym_table_size: dq " n
+    print "ksym_table:"
+    for (i = 0; i < n; i++)
+        printf "    dq 0x%s, ksym_name_%d\n", addr[i], i
+    for (i = 0; i < n; i++)
+        printf "ksym_name_%d: db \"%s\", 0\n", i, name[i]
+}'
@@ -2,18 +2,34 @@
 #include <valen/stdio.h>
 #include <valen/panic.h>
 #include <valen/color.h>
+#include <valen/klog.h>
+#include <valen/uart.h>
+#include <valen/vmm.h>
+#include <valen/paging.h>
+
+/* Log records shown below the fault report; the rest of the screen holds it */
+#define PANIC_LOG_LINES 12
 
 /**
- * @brief Panic-level Page Fault Handler.
+ * @brief Page Fault Handler, run on the CPU's IST stack.
+ *
+ * Returns after backing a page of a vmm_reserve() range, so the access is
+ * retried. Any other fault is fatal.
  */
 void page_fault_handler(uint64_t error_code)
 {
-    print_clear();
-    set_color(COLOR_LIGHT_RED);
-    
     uint64_t fault_addr;
     asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
 
+    if (paging_sync_fault(fault_addr))
+        return;
+    int ret = vmm_handle_fault(fault_addr, error_code);
+    if (ret == 0)
+        return;
+
+    print_clear();
+    set_color(COLOR_LIGHT_RED);
+
     printf("\n--- FATAL PAGE FAULT ---\n");
     printf("Address: ");
     print_hex(fault_addr);
@@ -36,7 +52,17 @@ void page_fault_handler(uint64_t error_code)
     else
         printf(" [Kernel Mode]");
 
+    if (vmm_is_guard_page(fault_addr))
+        printf("\nGuard page hit: stack or buffer overflow");
+    if (ret == VMM_FAULT_NO_RESERVE)
+        printf("\nDemand-paged memory touched with this CPU's fault reserve empty");
+
+    /* The screen was cleared above; show what led up to the fault */
+    printf("\n\nRecent kernel log:\n");
+    klog_dump(PANIC_LOG_LINES);
+
     printf("\nSystem Halted.");
+    uart_flush();
     while (1)
         asm volatile("hlt");
 }
\ No newline at end of file